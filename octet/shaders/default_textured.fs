@@ -8,6 +8,9 @@ uniform vec4 lighting[17];
 uniform int num_lights;
 uniform sampler2D diffuse_sampler;
 
+// one if the image is stored top down (eg. DDS)
+uniform float diffuse_sampler_flip;
+
 // inputs
 varying vec3 normal_;
 varying vec3 camera_pos_;
@@ -16,7 +19,8 @@ varying vec4 color_;
 varying vec3 model_pos_;
 
 void main() {
-  vec4 diffuse = texture2D(diffuse_sampler, uv_);
+  vec2 uv = vec2(uv_.x, uv_.y + diffuse_sampler_flip * (1.0 - 2.0 * uv_.y));
+  vec4 diffuse = texture2D(diffuse_sampler, uv);
   vec3 nnormal = normalize(normal_);
   vec3 npos = camera_pos_;
   vec3 diffuse_light = lighting[0].xyz;
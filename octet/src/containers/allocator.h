@@ -52,7 +52,8 @@ namespace octet { namespace containers {
   class allocator {
     // singleton state, a bit like an old-world global variable
     struct state_t {
-      size_t num_bytes;
+      // atomic so that worker threads can allocate
+      std::atomic<size_t> num_bytes;
     };
 
     static state_t &state() {
@@ -20,12 +20,15 @@ namespace octet {
     void app_init() {
       app_scene =  new visual_scene();
 
+      // keep the imported duck and its finished texture between runs
+      cooked_cache::get().set_directory(app_utils::get_path("assets/cooked_cache"));
+      texture_cache::get().set_directory(app_utils::get_path("assets/texture_cache"));
+
       resource_dict dict;
-      if (!loader.load_xml("assets/duck_triangulate.dae")) {
+      if (!loader.load_cooked("assets/duck_triangulate.dae", dict)) {
         // failed to load file
         return;
       }
-      loader.get_resources(dict);
 
       dynarray<resource*> meshes;
       dict.find_all(meshes, atom_mesh);
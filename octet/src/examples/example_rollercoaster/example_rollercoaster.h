@@ -24,12 +24,13 @@ namespace octet {
       cam->translate(vec3(0, 20, 4));
       cam->rotate(-90, vec3(1, 0, 0));
 
-      if (!loader.load_xml("assets/rollercoaster.dae")) {
+      // keep the imported scene between runs
+      cooked_cache::get().set_directory(app_utils::get_path("assets/cooked_cache"));
+      resource_dict dict;
+      if (!loader.load_cooked("assets/rollercoaster.dae", dict)) {
         printf("failed to load file!\n");
         exit(1);
       }
-      resource_dict dict;
-      loader.get_resources(dict);
 
       // note that this call will dump the code below to log.txt
       dict.dump_assets(log(""));
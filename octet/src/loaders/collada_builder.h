@@ -6,7 +6,8 @@
 //
 // load a COLLADA file.
 //
-// This class uses "tiny xml" a handy little XML reader
+// This class uses the xml_pull_parser to read the file and keeps the structure in a "tiny xml" DOM.
+// Large number arrays are parsed straight from the file and kept outside the DOM.
 //
 // Do not read this until you have a good understanding of C++ coding, it will melt your mind.
 // It is, however, one of the smallest COLLADA readers in the Universe of its kind.
@@ -32,16 +33,106 @@ namespace octet { namespace loaders {
     dictionary<TiXmlElement *, allocator> ids;
     dynarray<float> temp_floats;
 
-    // find all the ids in an xml file
-    void find_ids(TiXmlElement *parent) {
-      for (TiXmlElement *elem = parent->FirstChildElement(); elem; elem = elem->NextSiblingElement()) {
-        const char *attrib = elem->Attribute("id");
-        if (attrib) {
-          //printf("%s %s\n", elem->Value(), attrib);
-          ids[attrib] = elem;
+    // number arrays such as <float_array> and <p> by element.
+    hash_map<void *, dynarray<float> *> float_arrays;
+    hash_map<void *, dynarray<int> *> int_arrays;
+
+    void reset_arrays() {
+      for (unsigned i = 0; i != float_arrays.size(); ++i) {
+        if (float_arrays.get_key(i)) delete float_arrays.get_value(i);
+      }
+      for (unsigned i = 0; i != int_arrays.size(); ++i) {
+        if (int_arrays.get_key(i)) delete int_arrays.get_value(i);
+      }
+      float_arrays.clear();
+      int_arrays.clear();
+    }
+
+    // parse "1.2 3.4 43.12" from the file, stopping at anything that is not a number.
+    static void parse_floats(dynarray<float> &values, const char *begin, const char *end) {
+      const uint8_t *src = (const uint8_t *)begin, *src_max = (const uint8_t *)end;
+      for (;;) {
+        while (src != src_max && *src <= ' ') ++src;
+        float value;
+        if (src == src_max || !obj_loader::parse_float(src, src_max, value)) break;
+        values.push_back(value);
+      }
+    }
+
+    // parse "1 3 9 12 34" from the file, stopping at anything that is not a number.
+    static void parse_ints(dynarray<int> &values, const char *begin, const char *end) {
+      const char *src = begin;
+      for (;;) {
+        while (src != end && *src <= ' ') ++src;
+        if (src == end) break;
+        bool negative = *src == '-';
+        src += negative || *src == '+';
+        if (src == end || *src < '0' || *src > '9') break;
+        int value = 0;
+        while (src != end && *src >= '0' && *src <= '9') value = value * 10 + (*src++ - '0');
+        values.push_back(negative ? -value : value);
+      }
+    }
+
+    // make an element from a start tag
+    TiXmlElement *new_element(xml_pull_parser &parser) {
+      string tmp;
+      tmp.set(parser.get_name().begin, parser.get_name().size());
+      TiXmlElement *elem = new TiXmlElement(tmp);
+
+      string value;
+      for (unsigned i = 0; i != parser.get_num_attributes(); ++i) {
+        xml_pull_parser::range name = parser.get_attribute_name(i);
+        tmp.set(name.begin, name.size());
+        xml_pull_parser::decode(value, parser.get_attribute_value(i));
+        elem->SetAttribute(tmp, value);
+        if (name == "id") {
+          ids[value] = elem;
         }
-        find_ids(elem);
       }
+      return elem;
+    }
+
+    // get the numbers of an element such as <float_array> as floats.
+    // Elements that were not parsed while loading are parsed on first use.
+    const dynarray<float> &get_float_array(TiXmlElement *elem) {
+      static const dynarray<float> empty;
+      if (!elem) return empty;
+
+      dynarray<float> *&values = float_arrays[elem];
+      if (!values) {
+        values = new dynarray<float>();
+        atofv(*values, elem->GetText());
+      }
+      return *values;
+    }
+
+    // get the numbers of an element such as <p> as ints.
+    const dynarray<int> &get_int_array(TiXmlElement *elem) {
+      static const dynarray<int> empty;
+      if (!elem) return empty;
+
+      dynarray<int> *&values = int_arrays[elem];
+      if (!values) {
+        values = new dynarray<int>();
+        atoiv(*values, elem->GetText());
+      }
+      return *values;
+    }
+
+    // copy the numbers of an element such as <float_array>
+    void get_floats(dynarray<float> &values, TiXmlElement *elem) {
+      const dynarray<float> &src = get_float_array(elem);
+      values.resize(src.size());
+      if (src.size()) memcpy(values.data(), src.data(), src.size() * sizeof(float));
+    }
+
+    // add the numbers of an element such as <p> to an array
+    void add_ints(dynarray<int> &values, TiXmlElement *elem) {
+      const dynarray<int> &src = get_int_array(elem);
+      unsigned size = values.size();
+      values.resize(size + src.size());
+      if (src.size()) memcpy(values.data() + size, src.data(), src.size() * sizeof(int));
     }
 
     TiXmlElement *find_id(const char *source) {
@@ -297,10 +388,8 @@ namespace octet { namespace loaders {
         state.s->add_attribute(attr, size, GL_FLOAT, state.attr_offset * 4);
         state.attr_offset += size;
       } else if (state.pass == 2) {
-        dynarray<float> accessor_floats;
-        if (!strcmp(accessor_source_elem->Value(), "float_array")) {
-          atofv(accessor_floats, accessor_source_elem->GetText());
-        }
+        static const dynarray<float> no_floats;
+        const dynarray<float> &accessor_floats = !strcmp(accessor_source_elem->Value(), "float_array") ? get_float_array(accessor_source_elem) : no_floats;
 
         // attribute building pass
         for (unsigned i = 0; i != num_vertices; ++i) {
@@ -337,8 +426,7 @@ namespace octet { namespace loaders {
             state.skinst->raw_indices[i] = src_idx;
           }
         } else if (!strcmp(semantic, "WEIGHT")) {
-          dynarray<float> accessor_floats;
-          atofv(accessor_floats, accessor_source_elem->GetText());
+          const dynarray<float> &accessor_floats = get_float_array(accessor_source_elem);
           assert(state.skinst->raw_weights.size() >= num_vertices);
           for (unsigned i = 0; i != num_vertices; ++i) {
             unsigned index = state.p[i * state.input_stride + state.input_offset];
@@ -685,7 +773,7 @@ namespace octet { namespace loaders {
               }
             } else if (!strcmp(semantic, "INV_BIND_MATRIX")) {
               TiXmlElement *float_array = child(find_id(source_id), "float_array");
-              atofv(skinst.inv_bind_matrices, text(float_array));
+              get_floats(skinst.inv_bind_matrices, float_array);
             }
             input = sibling(input, "input");
           }
@@ -790,10 +878,10 @@ namespace octet { namespace loaders {
               const char *source_id = attr(input, "source");
               if (!strcmp(semantic, "INPUT")) {
                 TiXmlElement *float_array = child(find_id(source_id), "float_array");
-                atofv(times, text(float_array));
+                get_floats(times, float_array);
               } else if (!strcmp(semantic, "OUTPUT")) {
                 TiXmlElement *float_array = child(find_id(source_id), "float_array");
-                atofv(values, text(float_array));
+                get_floats(values, float_array);
               } else if (!strcmp(semantic, "INTERPOLATION")) {
                 /*TiXmlElement *name_array = child(find_id(source_id), "Name_array");
                 if (name_array) {
@@ -979,7 +1067,7 @@ namespace octet { namespace loaders {
       parse_input_state state;
       state.s = mesh;
       while (pelem) {
-        atoiv(state.p, pelem->GetText());
+        add_ints(state.p, pelem);
         pelem = sibling(pelem, "p");
       }
       state.input_stride = get_input_stride(mesh_child);
@@ -1071,7 +1159,7 @@ namespace octet { namespace loaders {
       if (vcount_elem) {
         // polygons
         dynarray<int> vcount;
-        atoiv(vcount, vcount_elem->GetText());
+        add_ints(vcount, vcount_elem);
         num_indices = convert_polygons_to_triangles(state, vcount);
       } else {
         // just plain triangles
@@ -1111,7 +1199,7 @@ namespace octet { namespace loaders {
         printf("warning: no vcount element in skin\n");
       }
 
-      atoiv(skin->vcount, vcount_elem->GetText());
+      add_ints(skin->vcount, vcount_elem);
 
       int num_vertices = 0;
       int num_vcs = skin->vcount.size();
@@ -1125,7 +1213,7 @@ namespace octet { namespace loaders {
       parse_input_state state;
       state.s = NULL;
       while (pelem) {
-        atoiv(state.p, pelem->GetText());
+        add_ints(state.p, pelem);
         pelem = sibling(pelem, "p");
       }
       state.input_stride = get_input_stride(mesh_child);
@@ -1213,18 +1301,94 @@ namespace octet { namespace loaders {
     collada_builder() {
     }
 
+    ~collada_builder() {
+      reset_arrays();
+    }
+
     // public function to load a collada file
+    // The file is mapped and read with a pull parser. Number arrays are parsed in place
+    // and only the structural elements are added to the DOM.
     bool load_xml(const char *url) {
       doc_path = url;
       doc_path.truncate(doc_path.filename_pos());
-      const char *path = app_utils::get_path(url);
-      char buf[256];
-      getcwd(buf, sizeof(buf));
-      doc.LoadFile(path);
+      doc.Clear();
+      ids.reset();
+      reset_arrays();
+
+      // map the file if we can, otherwise read it.
+      dynarray<uint8_t> buffer;
+      const uint8_t *data = 0;
+      size_t size = 0;
+      string path = app_utils::get_path(url);
+      file_map *map = 0;
+      if (strncmp(url, "zip://", 6) && strncmp(url, "http://", 7)) {
+        map = new file_map(path);
+        data = map->get_data();
+        size = (size_t)map->get_size();
+      }
+      if (!data) {
+        app_utils::get_url(buffer, url);
+        data = buffer.data();
+        size = buffer.size();
+      }
+
+      xml_pull_parser parser(data, size);
+      TiXmlNode *parent = &doc;
+      dynarray<float> *floats = 0;
+      dynarray<int> *ints = 0;
+      string text;
+      bool ok = true;
+      for (bool done = false; !done; ) {
+        switch (parser.next()) {
+          case xml_pull_parser::token_begin: {
+            TiXmlElement *elem = new_element(parser);
+            parent->LinkEndChild(elem);
+            parent = elem;
+
+            xml_pull_parser::range name = parser.get_name();
+            xml_pull_parser::range count = parser.get_attribute("count");
+            if (name == "float_array") {
+              floats = float_arrays[elem] = new dynarray<float>();
+              if (count.size()) floats->reserve((unsigned)atoi(count.begin));
+            } else if (name == "int_array" || name == "p" || name == "v" || name == "vcount") {
+              ints = int_arrays[elem] = new dynarray<int>();
+              if (count.size()) ints->reserve((unsigned)atoi(count.begin));
+            }
+          } break;
+          case xml_pull_parser::token_end: {
+            parent = parent->Parent();
+            floats = 0;
+            ints = 0;
+          } break;
+          case xml_pull_parser::token_text: {
+            xml_pull_parser::range txt = parser.get_text();
+            if (floats) {
+              parse_floats(*floats, txt.begin, txt.end);
+            } else if (ints) {
+              parse_ints(*ints, txt.begin, txt.end);
+            } else if (parent != &doc && !parser.is_space_text()) {
+              // tiny xml condenses white space, which we rely on for Name_array.
+              xml_pull_parser::decode(text, txt, !parser.is_cdata(), true);
+              TiXmlText *node = new TiXmlText(text);
+              node->SetCDATA(parser.is_cdata());
+              parent->LinkEndChild(node);
+            }
+          } break;
+          case xml_pull_parser::token_error: {
+            printf("error: %s at offset %d in %s\n", parser.get_error(), (int)parser.get_offset(data), path.c_str());
+            ok = false;
+            done = true;
+          } break;
+          case xml_pull_parser::token_eof: {
+            done = true;
+          } break;
+        }
+      }
+      delete map;
 
       TiXmlElement *top = doc.RootElement();
-      if (!top) {
-        printf("file %s not found\n", path);
+      if (!ok || !top) {
+        printf("file %s not found\n", path.c_str());
         return false;
       }
 
@@ -1233,7 +1397,6 @@ namespace octet { namespace loaders {
         return false;
       }
 
-      find_ids(top);
       return true;
     }
 
@@ -1287,5 +1450,21 @@ namespace octet { namespace loaders {
       // animations refer to all other objects
       add_animations(dict);
     }
+
+    /// Load a collada file and add its resources to the collection.
+    /// The XML is only parsed if there is no up to date cooked_cache file for url.
+    bool load_cooked(const char *url, resource_dict &dict) {
+      ref<resource_dict> cooked = cooked_cache::get().load(url);
+      if (!cooked) {
+        if (!load_xml(url)) {
+          return false;
+        }
+        cooked = new resource_dict();
+        get_resources(*cooked);
+        cooked_cache::get().save(*cooked, url);
+      }
+      dict.add_resources(*cooked);
+      return true;
+    }
   };
 }}
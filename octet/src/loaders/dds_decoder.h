@@ -10,6 +10,15 @@
 
 namespace octet { namespace loaders {
   /// Class for loading DDS texture files
+  ///
+  /// DDS files hold finished, block compressed mip chains (BC1-5) that GL can use as they are,
+  /// so images map the file and upload the levels straight from the map using get_layout().
+  ///
+  /// The rows of a DDS file run from the top down, the opposite way to GL. Images flip the levels
+  /// with flip_level() as they upload them, unless every shader that samples them flips the texture
+  /// coordinates instead (see image::allow_flip_in_shader).
+  ///
+  /// When GL cannot use a block format, decode_level() expands it to RGBA.
   class dds_decoder {
     // http://en.wikipedia.org/wiki/DirectDraw_Surface
     // http://www.mindcontrol.org/~hplus/graphics/dds-info/
@@ -17,6 +26,7 @@ namespace octet { namespace loaders {
 
     enum {
       dds_magic = 0x20534444,
+      header_size = 128,
 
       // flags,
       ddsd_caps = 0x00000001,
@@ -53,6 +63,8 @@ namespace octet { namespace loaders {
       COMPRESSED_RGBA_S3TC_DXT1_EXT = 0x83F1,
       COMPRESSED_RGBA_S3TC_DXT3_EXT = 0x83F2,
       COMPRESSED_RGBA_S3TC_DXT5_EXT = 0x83F3,
+      COMPRESSED_RED_RGTC1 = 0x8DBB,
+      COMPRESSED_RG_RGTC2 = 0x8DBD,
     };
 
     struct dds_header {
@@ -91,229 +103,320 @@ namespace octet { namespace loaders {
 
     // read a pair of bytes as a little-endian value
     // this will work on the PS3 and other big-endian machines
-    int le2( uint8_t val[2] )
-    {
+    static unsigned le2(const uint8_t val[2]) {
       return val[0] + val[1] * 0x100;
     }
 
     // read four bytes as a little-endian value
     // this will work on the PS3 and other big-endian machines
-    int le4( uint8_t val[4] )
-    {
+    static unsigned le4(const uint8_t val[4]) {
       return val[0] + val[1] * 0x100 + val[2] * 0x10000 + val[3] * 0x1000000;
     }
 
-    // rrrrrggggggbbbbb
-    // rrrrrggggggbbbbb
-    // 0011223344556677
-    // 8899aabbccddeeff
-    void hack_dxt1(uint8_t *dest, const uint8_t *src, unsigned stride, bool always_use_four_colours) {
-      uint16_t color0 = src[0] + src[1] * 256;
-      uint16_t color1 = src[2] + src[3] * 256;
-      src += 4;
-
-      uint8_t r0 = ( ( ( color0 >> 11 ) & 0x1f ) * (0xffff / 0x1f)) >> 8;
-      uint8_t g0 = ( ( ( color0 >> 6 ) & 0x3f ) * (0xffff / 0x3f)) >> 8;
-      uint8_t b0 = ( ( ( color0 >> 0 ) & 0x1f ) * (0xffff / 0x1f)) >> 8;
-      uint8_t r1 = ( ( ( color1 >> 11 ) & 0x1f ) * (0xffff / 0x1f)) >> 8;
-      uint8_t g1 = ( ( ( color1 >> 6 ) & 0x3f ) * (0xffff / 0x3f)) >> 8;
-      uint8_t b1 = ( ( ( color1 >> 0 ) & 0x1f ) * (0xffff / 0x1f)) >> 8;
-
-      // if it were not for the patent, some other code would go here
-      dest[0] = ( r0 + r1 ) >> 1;
-      dest[1] = ( g0 + g1 ) >> 1;
-      dest[2] = ( b0 + b1 ) >> 1;
-      dest[3] = 0xff;
+    static uint32_t pack(unsigned r, unsigned g, unsigned b, unsigned a) {
+      return (uint32_t)(r | g << 8 | b << 16 | a << 24);
     }
 
-    // quantised alpha
-    void hack_dxt3(uint8_t *dest, const uint8_t *src, unsigned stride) {
-      dest[3] = ( src[0] + src[1] ) >> 1;
+    static unsigned expand5(unsigned v) {
+      return (v << 3) | (v >> 2);
     }
 
-    // interpolated alpha
-    void hack_dxt5(uint8_t *dest, const uint8_t *src, unsigned stride) {
-      dest[3] = ( src[0] + src[1] ) >> 1;
+    static unsigned expand6(unsigned v) {
+      return (v << 2) | (v >> 4);
     }
 
-    // see http://www.opengl.org/registry/specs/EXT/texture_compression_s3tc.txt
-    // a s3tc dirty hack.
-    void hack_s3(uint8_t *image, unsigned dxt, unsigned width, unsigned height, const uint8_t *src, const uint8_t *src_max) {
-      unsigned max_bytes = (width) * (height) * 8;
-      if (dxt != 1) max_bytes *= 2;
-      //if (src_max - src > max_bytes) return; // oops
-
-      for (unsigned y = 0; y != height; ++y) {
-        uint8_t *dest = (uint8_t *)( image + y * (width * 4) );
-        for (unsigned x = 0; x != width; ++x) {
-          if (dxt == 1) {
-            hack_dxt1(dest, src+8, width * 4, false);
-            src += 8;
-          } else if (dxt <= 3) {
-            hack_dxt1(dest, src+8, width * 4, true);
-            hack_dxt3(dest, src, width * 4);
-            src += 16;
+    // the four RGBA colours of a colour block.
+    // DXT1 blocks with c0 <= c1 have three colours and black, which is transparent in RGBA DXT1.
+    static void make_colour_palette(uint32_t *palette, const uint8_t *block, bool four_colours, unsigned black_alpha) {
+      unsigned c0 = le2(block), c1 = le2(block + 2);
+      unsigned r0 = expand5(c0 >> 11), g0 = expand6(c0 >> 5 & 0x3f), b0 = expand5(c0 & 0x1f);
+      unsigned r1 = expand5(c1 >> 11), g1 = expand6(c1 >> 5 & 0x3f), b1 = expand5(c1 & 0x1f);
+      palette[0] = pack(r0, g0, b0, 255);
+      palette[1] = pack(r1, g1, b1, 255);
+      if (four_colours || c0 > c1) {
+        palette[2] = pack((2*r0 + r1) / 3, (2*g0 + g1) / 3, (2*b0 + b1) / 3, 255);
+        palette[3] = pack((r0 + 2*r1) / 3, (g0 + 2*g1) / 3, (b0 + 2*b1) / 3, 255);
+      } else {
+        palette[2] = pack((r0 + r1) / 2, (g0 + g1) / 2, (b0 + b1) / 2, 255);
+        palette[3] = pack(0, 0, 0, black_alpha);
+      }
+    }
+
+    // the sixteen values of an interpolated alpha block (BC3 alpha, BC4 and BC5 channels).
+    static void decode_alpha(uint8_t *values, const uint8_t *block) {
+      unsigned a0 = block[0], a1 = block[1];
+      uint8_t palette[8] = { (uint8_t)a0, (uint8_t)a1 };
+      if (a0 > a1) {
+        for (unsigned i = 1; i != 7; ++i) {
+          palette[i+1] = (uint8_t)(((7 - i) * a0 + i * a1 + 3) / 7);
+        }
+      } else {
+        for (unsigned i = 1; i != 5; ++i) {
+          palette[i+1] = (uint8_t)(((5 - i) * a0 + i * a1 + 2) / 5);
+        }
+        palette[6] = 0;
+        palette[7] = 255;
+      }
+      // sixteen three bit indices
+      uint64_t bits = le2(block + 2) | (uint64_t)le4(block + 4) << 16;
+      for (unsigned i = 0; i != 16; ++i) {
+        values[i] = palette[bits & 7];
+        bits >>= 3;
+      }
+    }
+
+    // decode one block to 16 RGBA pixels in rows of stride bytes.
+    static void decode_block(uint8_t *dest, unsigned stride, const uint8_t *src, unsigned format) {
+      uint32_t palette[4];
+      uint8_t alpha[16], green[16];
+      bool has_colour = format != COMPRESSED_RED_RGTC1 && format != COMPRESSED_RG_RGTC2;
+      const uint8_t *colour = format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT ? src : src + 8;
+      if (has_colour) {
+        bool dxt1 = colour == src;
+        make_colour_palette(palette, colour, !dxt1, format == COMPRESSED_RGBA_S3TC_DXT1_EXT ? 0 : 255);
+      }
+
+      // the alpha or red and green values
+      if (format == COMPRESSED_RGBA_S3TC_DXT3_EXT) {
+        for (unsigned i = 0; i != 8; ++i) {
+          alpha[i*2+0] = (uint8_t)((src[i] & 0x0f) * 17);
+          alpha[i*2+1] = (uint8_t)((src[i] >> 4) * 17);
+        }
+      } else if (!has_colour || format == COMPRESSED_RGBA_S3TC_DXT5_EXT) {
+        decode_alpha(alpha, src);
+        if (format == COMPRESSED_RG_RGTC2) {
+          decode_alpha(green, src + 8);
+        }
+      }
+
+      #if OCTET_SSE
+        // each pixel selects its colour with masks made from its two index bits.
+        __m128i zero = _mm_setzero_si128();
+        for (unsigned j = 0; j != 4; ++j) {
+          __m128i pixels;
+          if (has_colour) {
+            __m128i p0 = _mm_set1_epi32((int)palette[0]), p1 = _mm_set1_epi32((int)palette[1]);
+            __m128i p2 = _mm_set1_epi32((int)palette[2]), p3 = _mm_set1_epi32((int)palette[3]);
+            __m128i bits = _mm_set1_epi32((int)le4(colour + 4));
+            unsigned shift = j * 8;
+            __m128i bit0 = _mm_cmpeq_epi32(_mm_and_si128(bits, _mm_setr_epi32(1 << shift, 4 << shift, 16 << shift, 64 << shift)), zero);
+            __m128i bit1 = _mm_cmpeq_epi32(_mm_and_si128(bits, _mm_setr_epi32(2 << shift, 8 << shift, 32 << shift, (int)(128u << shift))), zero);
+            __m128i lo = _mm_or_si128(_mm_and_si128(bit0, p0), _mm_andnot_si128(bit0, p1));
+            __m128i hi = _mm_or_si128(_mm_and_si128(bit0, p2), _mm_andnot_si128(bit0, p3));
+            pixels = _mm_or_si128(_mm_and_si128(bit1, lo), _mm_andnot_si128(bit1, hi));
           } else {
-            hack_dxt1(dest, src+8, width * 4, true);
-            hack_dxt5(dest, src, width * 4);
-            src += 16;
+            // red and green from the alpha blocks, blue zero, alpha opaque
+            __m128i r = _mm_cvtsi32_si128((int)le4(alpha + j * 4));
+            __m128i g = format == COMPRESSED_RG_RGTC2 ? _mm_cvtsi32_si128((int)le4(green + j * 4)) : zero;
+            pixels = _mm_unpacklo_epi16(_mm_unpacklo_epi8(r, g), _mm_set1_epi16((short)0xff00));
+          }
+          if (format == COMPRESSED_RGBA_S3TC_DXT3_EXT || format == COMPRESSED_RGBA_S3TC_DXT5_EXT) {
+            __m128i a = _mm_cvtsi32_si128((int)le4(alpha + j * 4));
+            a = _mm_slli_epi32(_mm_unpacklo_epi16(_mm_unpacklo_epi8(a, zero), zero), 24);
+            pixels = _mm_or_si128(_mm_and_si128(pixels, _mm_set1_epi32(0x00ffffff)), a);
+          }
+          _mm_storeu_si128((__m128i*)(dest + j * stride), pixels);
+        }
+      #else
+        uint32_t mask = has_colour ? le4(colour + 4) : 0;
+        for (unsigned i = 0; i != 16; ++i) {
+          uint8_t *p = dest + (i >> 2) * stride + (i & 3) * 4;
+          if (has_colour) {
+            uint32_t c = palette[mask >> (i * 2) & 3];
+            p[0] = (uint8_t)c;
+            p[1] = (uint8_t)(c >> 8);
+            p[2] = (uint8_t)(c >> 16);
+            p[3] = (uint8_t)(c >> 24);
+          } else {
+            p[0] = alpha[i];
+            p[1] = format == COMPRESSED_RG_RGTC2 ? green[i] : 0;
+            p[2] = 0;
+            p[3] = 0xff;
+          }
+          if (format == COMPRESSED_RGBA_S3TC_DXT3_EXT || format == COMPRESSED_RGBA_S3TC_DXT5_EXT) {
+            p[3] = alpha[i];
           }
-          dest += 4;
         }
+      #endif
+    }
+
+    // reverse the first rows rows of pixels in a block. Colour blocks have a byte of indices per row.
+    static void flip_colour_block(uint8_t *dest, const uint8_t *src, unsigned rows) {
+      memcpy(dest, src, 8);
+      for (unsigned j = 0; j != rows; ++j) {
+        dest[4 + j] = src[4 + rows - 1 - j];
       }
     }
 
-    static void swap(uint32_t &a, uint32_t &b) {
-      uint32_t t = a; a =  b; b = t;
+    // DXT3 alpha has two bytes per row.
+    static void flip_explicit_alpha_block(uint8_t *dest, const uint8_t *src, unsigned rows) {
+      memcpy(dest, src, 8);
+      for (unsigned j = 0; j != rows; ++j) {
+        dest[j * 2 + 0] = src[(rows - 1 - j) * 2 + 0];
+        dest[j * 2 + 1] = src[(rows - 1 - j) * 2 + 1];
+      }
     }
 
-    static void swap(uint8_t &a, uint8_t &b) {
-      uint8_t t = a; a =  b; b = t;
+    // interpolated alpha has twelve bits of indices per row.
+    static void flip_alpha_block(uint8_t *dest, const uint8_t *src, unsigned rows) {
+      uint64_t bits = le2(src + 2) | (uint64_t)le4(src + 4) << 16;
+      uint64_t result = bits;
+      for (unsigned j = 0; j != rows; ++j) {
+        uint64_t row = (bits >> ((rows - 1 - j) * 12)) & 0xfff;
+        result = (result & ~((uint64_t)0xfff << (j * 12))) | row << (j * 12);
+      }
+      dest[0] = src[0];
+      dest[1] = src[1];
+      for (unsigned i = 0; i != 6; ++i) {
+        dest[2 + i] = (uint8_t)(result >> (i * 8));
+      }
     }
 
-    static void swap3(uint8_t *p1, uint8_t *p2) {
-      // 00011122 23334445 55666777
-      // 44455566 67770001 11222333
-      unsigned s1 = p1[0] + p1[1] * 0x100 + p1[2] * 0x10000;
-      unsigned s2 = p2[0] + p2[1] * 0x100 + p2[2] * 0x10000;
-      s1 = ( s1 >> 12 ) | ( s1 << 12 );
-      s2 = ( s2 >> 12 ) | ( s2 << 12 );
-      p1[0] = (s2 >> 0) & 0xff;
-      p1[1] = (s2 >> 8) & 0xff;
-      p1[2] = (s2 >> 16) & 0xff;
-      p2[0] = (s1 >> 0) & 0xff;
-      p2[1] = (s1 >> 8) & 0xff;
-      p2[2] = (s1 >> 16) & 0xff;
+    static void flip_block(uint8_t *dest, const uint8_t *src, unsigned format, unsigned rows) {
+      switch (format) {
+        case COMPRESSED_RGB_S3TC_DXT1_EXT:
+        case COMPRESSED_RGBA_S3TC_DXT1_EXT: flip_colour_block(dest, src, rows); break;
+        case COMPRESSED_RGBA_S3TC_DXT3_EXT: flip_explicit_alpha_block(dest, src, rows); flip_colour_block(dest + 8, src + 8, rows); break;
+        case COMPRESSED_RGBA_S3TC_DXT5_EXT: flip_alpha_block(dest, src, rows); flip_colour_block(dest + 8, src + 8, rows); break;
+        case COMPRESSED_RED_RGTC1: flip_alpha_block(dest, src, rows); break;
+        case COMPRESSED_RG_RGTC2: flip_alpha_block(dest, src, rows); flip_alpha_block(dest + 8, src + 8, rows); break;
+      }
     }
 
-    void flip_dxt1(dynarray<uint8_t> &image, unsigned width, unsigned height) {
-      unsigned offset = 0;
-      while (width >= 4 && height >= 4) {
-        unsigned xmax = width < 4 ? 1 : width/4;
-        unsigned ymax = height < 4 ? 1 : height/4;
-        if (offset + xmax * ymax * 8 > image.size()) break; 
-        for (unsigned y = 0; y < height/8; y++) {
-          uint8_t *p1 = &image[offset + (y * xmax) * 8];
-          uint8_t *p2 = &image[offset + ((ymax - y - 1) * xmax) * 8];
-          for (unsigned x = 0; x < width/4; x++) {
-            swap((uint32_t&)p1[0], (uint32_t&)p2[0]);
-            swap(p1[4], p2[7]);
-            swap(p1[5], p2[6]);
-            swap(p1[6], p2[5]);
-            swap(p1[7], p2[4]);
-            p1 += 8;
-            p2 += 8;
-          }
-        }
-        width >>= 1;
-        height >>= 1;
-        offset += xmax * ymax * 8;
+  public:
+    /// Where the mip levels are in a DDS file.
+    struct layout {
+      unsigned format;
+      unsigned width;
+      unsigned height;
+      unsigned mip_levels;
+      size_t offset;   /// of the first level from the start of the file
+      size_t size;     /// of all the levels
+    };
+
+    /// Bytes in each 4x4 block of a compressed format.
+    static unsigned get_block_bytes(unsigned format) {
+      return format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT || format == COMPRESSED_RED_RGTC1 ? 8 : 16;
+    }
+
+    /// Bytes in one level of a compressed format.
+    static size_t get_level_size(unsigned width, unsigned height, unsigned format) {
+      return (size_t)((width + 3) / 4) * ((height + 3) / 4) * get_block_bytes(format);
+    }
+
+    /// Read the header of a DDS file. Returns false if it is not a 2D BC1-5 texture.
+    /// Only the levels that are all there are counted.
+    static bool get_layout(layout &result, const uint8_t *src, const uint8_t *src_max) {
+      if (src_max - src < header_size) return false;
+      const dds_header *header = (const dds_header*)src;
+      if (le4(header->magic) != dds_magic) return false;
+      if (!(le4(header->pf.flags) & ddpf_fourcc)) return false;
+      if (le4(header->caps.caps2) & (ddscaps2_cubemap | ddscaps2_volume)) return false;
+
+      const uint8_t *fourcc = header->pf.fourcc;
+      unsigned format = 0;
+      if (!memcmp(fourcc, "DXT1", 4)) {
+        format = COMPRESSED_RGB_S3TC_DXT1_EXT;
+      } else if (!memcmp(fourcc, "DXT2", 4) || !memcmp(fourcc, "DXT3", 4)) {
+        format = COMPRESSED_RGBA_S3TC_DXT3_EXT;
+      } else if (!memcmp(fourcc, "DXT4", 4) || !memcmp(fourcc, "DXT5", 4)) {
+        format = COMPRESSED_RGBA_S3TC_DXT5_EXT;
+      } else if (!memcmp(fourcc, "ATI1", 4) || !memcmp(fourcc, "BC4U", 4)) {
+        format = COMPRESSED_RED_RGTC1;
+      } else if (!memcmp(fourcc, "ATI2", 4) || !memcmp(fourcc, "BC5U", 4)) {
+        format = COMPRESSED_RG_RGTC2;
+      } else {
+        return false;
       }
+
+      unsigned width = le4(header->width), height = le4(header->height);
+      if (width == 0 || height == 0 || width > 0xffff || height > 0xffff) return false;
+
+      unsigned max_levels = le4(header->flags) & ddsd_mipmapcount ? le4(header->mipmap_count) : 1;
+      if (max_levels == 0) max_levels = 1;
+
+      size_t available = (size_t)(src_max - src) - header_size;
+      size_t size = 0;
+      unsigned levels = 0, w = width, h = height;
+      while (levels != max_levels) {
+        size_t level_size = get_level_size(w, h, format);
+        if (size + level_size > available) break;
+        size += level_size;
+        levels++;
+        if (w == 1 && h == 1) break;
+        w = w > 1 ? w >> 1 : 1;
+        h = h > 1 ? h >> 1 : 1;
+      }
+      if (levels == 0) return false;
+
+      result.format = format;
+      result.width = width;
+      result.height = height;
+      result.mip_levels = levels;
+      result.offset = header_size;
+      result.size = size;
+      return true;
     }
 
-    void flip_dxt3(dynarray<uint8_t> &image, unsigned width, unsigned height) {
-      unsigned offset = 0;
-      while (width >= 4 && height >= 4) {
-        unsigned xmax = width < 4 ? 1 : width/4;
-        unsigned ymax = height < 4 ? 1 : height/4;
-        if (offset + xmax * ymax * 16 > image.size()) break; 
-        for (unsigned y = 0; y < height/8; y++) {
-          uint8_t *p1 = &image[offset + (y * xmax) * 16];
-          uint8_t *p2 = &image[offset + ((ymax - y - 1) * xmax) * 16];
-          for (unsigned x = 0; x < width/4; x++) {
-            swap(p1[0], p2[6]);
-            swap(p1[1], p2[7]);
-            swap(p1[2], p2[4]);
-            swap(p1[3], p2[5]);
-            swap(p1[4], p2[2]);
-            swap(p1[5], p2[3]);
-            swap(p1[6], p2[0]);
-            swap(p1[7], p2[1]);
-            p1 += 8;
-            p2 += 8;
-            swap((uint32_t&)p1[0], (uint32_t&)p2[0]);
-            swap(p1[4], p2[7]);
-            swap(p1[5], p2[6]);
-            swap(p1[6], p2[5]);
-            swap(p1[7], p2[4]);
-            p1 += 8;
-            p2 += 8;
+    /// Expand a level of a BC1-5 format to RGBA bytes, for GL implementations that cannot use the format.
+    /// Rows of blocks are decoded in parallel. The rows stay in file order.
+    static void decode_level(uint8_t *dest, const uint8_t *src, unsigned width, unsigned height, unsigned format) {
+      unsigned blocks_x = (width + 3) / 4, blocks_y = (height + 3) / 4;
+      unsigned block_bytes = get_block_bytes(format);
+      platform::thread_pool::get().parallel_for(0, blocks_y, [&](unsigned by) {
+        const uint8_t *block = src + by * blocks_x * block_bytes;
+        unsigned rows = height - by * 4 < 4 ? height - by * 4 : 4;
+        for (unsigned bx = 0; bx != blocks_x; ++bx, block += block_bytes) {
+          uint8_t *out = dest + (by * 4 * width + bx * 4) * 4;
+          unsigned cols = width - bx * 4 < 4 ? width - bx * 4 : 4;
+          if (rows == 4 && cols == 4) {
+            decode_block(out, width * 4, block, format);
+          } else {
+            // blocks on the right and bottom edges may hang over the image
+            uint8_t rgba[64];
+            decode_block(rgba, 16, block, format);
+            for (unsigned j = 0; j != rows; ++j) {
+              memcpy(out + j * width * 4, rgba + j * 16, cols * 4);
+            }
           }
         }
-        width >>= 1;
-        height >>= 1;
-        offset += xmax * ymax * 16;
-      }
+      });
     }
 
-    void flip_dxt5(dynarray<uint8_t> &image, unsigned width, unsigned height) {
-      unsigned offset = 0;
-      while (width >= 4 && height >= 4) {
-        unsigned xmax = width < 4 ? 1 : width/4;
-        unsigned ymax = height < 4 ? 1 : height/4;
-        if (offset + xmax * ymax * 16 > image.size()) break; 
-        for (unsigned y = 0; y < height/8; y++) {
-          uint8_t *p1 = &image[offset + (y * xmax) * 16];
-          uint8_t *p2 = &image[offset + ((ymax - y - 1) * xmax) * 16];
-          for (unsigned x = 0; x < width/4; x++) {
-            // swap alphas
-            swap(p1[0], p2[0]);
-            swap(p1[1], p2[1]);
-            // swap 3 bit indices
-            swap3(p1+2, p2+5);
-            swap3(p1+5, p2+2);
-            p1 += 8;
-            p2 += 8;
-            swap((uint32_t&)p1[0], (uint32_t&)p2[0]);
-            swap(p1[4], p2[7]);
-            swap(p1[5], p2[6]);
-            swap(p1[6], p2[5]);
-            swap(p1[7], p2[4]);
-            p1 += 8;
-            p2 += 8;
-          }
+    /// True if flip_level() can turn a level of this height upside down.
+    /// Levels taller than a block must be whole blocks high, or the rows would not line up.
+    static bool can_flip_level(unsigned height) {
+      return height <= 4 || height % 4 == 0;
+    }
+
+    /// Copy a level upside down, so that its rows run from the bottom up as GL expects.
+    /// Moves whole blocks and reverses the rows inside each block without decoding them.
+    static void flip_level(uint8_t *dest, const uint8_t *src, unsigned width, unsigned height, unsigned format) {
+      unsigned blocks_x = (width + 3) / 4, blocks_y = (height + 3) / 4;
+      unsigned block_bytes = get_block_bytes(format);
+      unsigned rows = height < 4 ? height : 4;
+      for (unsigned by = 0; by != blocks_y; ++by) {
+        const uint8_t *block = src + by * blocks_x * block_bytes;
+        uint8_t *out = dest + (blocks_y - 1 - by) * blocks_x * block_bytes;
+        for (unsigned bx = 0; bx != blocks_x; ++bx, block += block_bytes, out += block_bytes) {
+          flip_block(out, block, format, rows);
         }
-        width >>= 1;
-        height >>= 1;
-        offset += xmax * ymax * 16;
       }
     }
-  public:
-    // get an opengl texture from a file in memory
+
+    /// Copy the levels of a DDS file. Prefer get_layout(), which lets you use the file in place.
     void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width, uint16_t &height, const uint8_t *src, const uint8_t *src_max) {
-      // convert the data
-      dds_header *header = (dds_header*)src;
-
-      if (le4(header->magic) != dds_magic) return;
-
-      unsigned pf_flags = le4(header->pf.flags);
-
-      if (pf_flags & ddpf_fourcc) {
-        uint8_t *fourcc = header->pf.fourcc;
-        if (fourcc[0] == 'D' && fourcc[1] == 'X' && fourcc[2] == 'T') {
-          width = le4(header->width);
-          height = le4(header->height);
-
-          format =
-            fourcc[3] == '1' ? COMPRESSED_RGB_S3TC_DXT1_EXT :
-            fourcc[3] == '3' ? COMPRESSED_RGBA_S3TC_DXT3_EXT :
-            fourcc[3] == '5' ? COMPRESSED_RGBA_S3TC_DXT5_EXT :
-            0
-          ;
-          unsigned size = (unsigned)(src_max - src - 128);
-          image.resize(size);
-          memcpy(&image[0], src + 128, size);
-
-          // dds textures are upside down, flip them!
-          switch (format) {
-            case COMPRESSED_RGB_S3TC_DXT1_EXT: flip_dxt1(image, width, height); break;
-            case COMPRESSED_RGBA_S3TC_DXT3_EXT: flip_dxt3(image, width, height); break;
-            case COMPRESSED_RGBA_S3TC_DXT5_EXT: flip_dxt5(image, width, height); break;
-          }
-          return;
-        }
+      layout info;
+      if (!get_layout(info, src, src_max)) {
+        printf("warning: DDS decoder only supports 2D BC1-5 textures\n");
+        return;
       }
-      printf("warning: DDS decoder only supports DXTn\n");
+
+      width = (uint16_t)info.width;
+      height = (uint16_t)info.height;
+      format = (uint16_t)info.format;
+      image.resize((unsigned)info.size);
+      memcpy(image.data(), src + info.offset, info.size);
     }
   };
 }}
@@ -0,0 +1,618 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+//
+// DXT (BC1-BC5) texture compressor
+//
+// See http://www.opengl.org/registry/specs/EXT/texture_compression_s3tc.txt
+// and http://www.opengl.org/registry/specs/ARB/texture_compression_rgtc.txt
+//
+namespace octet { namespace loaders {
+  /// Block compressor for BC1 (DXT1), BC3 (DXT5), BC4 and BC5 textures.
+  ///
+  /// Colour blocks are fitted along the principal axis of the block colours and the
+  /// end points are then refined by least squares. Blocks of one colour use tables of the
+  /// best end points. Alpha, BC4 and BC5 blocks try both the eight and six value modes.
+  /// Palette matching uses SSE when OCTET_SSE is set and rows of blocks are compressed in parallel.
+  ///
+  /// Images whose sizes are not multiples of four repeat their edge pixels.
+  ///
+  /// Example
+  ///
+  ///     dxt_encoder encoder(dxt_encoder::bc3);
+  ///     dynarray<uint8_t> blocks(dxt_encoder::get_level_size(width, height, dxt_encoder::bc3));
+  ///     encoder.encode_level(blocks.data(), pixels, width, height, 4);
+  ///
+  class dxt_encoder {
+  public:
+    /// Block formats. The values are the GL internal formats.
+    enum format_type {
+      bc1 = 0x83F0,   /// COMPRESSED_RGB_S3TC_DXT1_EXT, RGB in 8 bytes per block.
+      bc3 = 0x83F3,   /// COMPRESSED_RGBA_S3TC_DXT5_EXT, RGBA in 16 bytes per block.
+      bc4 = 0x8DBB,   /// COMPRESSED_RED_RGTC1, red in 8 bytes per block.
+      bc5 = 0x8DBD,   /// COMPRESSED_RG_RGTC2, red and green (eg. normal map x and y) in 16 bytes per block.
+    };
+
+  private:
+    format_type format;
+
+    // least squares refinement of the end points
+    bool refine;
+
+    // Best 5 and 6 bit end points for a block of one colour.
+    // Index 2 decodes to (2 * a + b) / 3, which gets closer than the end points alone.
+    struct single_colour_tables {
+      uint8_t match5[256][2];
+      uint8_t match6[256][2];
+
+      static void make(uint8_t (*match)[2], unsigned bits) {
+        unsigned size = 1 << bits;
+        for (int value = 0; value != 256; ++value) {
+          int best = 1 << 30;
+          for (unsigned a = 0; a != size; ++a) {
+            for (unsigned b = 0; b != size; ++b) {
+              int ea = bits == 5 ? expand5(a) : expand6(a);
+              int eb = bits == 5 ? expand5(b) : expand6(b);
+              int error = (2 * ea + eb) / 3 - value;
+              error = error < 0 ? -error : error;
+              // prefer close end points, which decode the same everywhere.
+              int spread = ea > eb ? ea - eb : eb - ea;
+              if (error * 256 + spread < best) {
+                best = error * 256 + spread;
+                match[value][0] = (uint8_t)a;
+                match[value][1] = (uint8_t)b;
+              }
+            }
+          }
+        }
+      }
+
+      single_colour_tables() {
+        make(match5, 5);
+        make(match6, 6);
+      }
+    };
+
+    static const single_colour_tables &get_tables() {
+      static const single_colour_tables tables;
+      return tables;
+    }
+
+    static int expand5(unsigned v) {
+      return (v << 3) | (v >> 2);
+    }
+
+    static int expand6(unsigned v) {
+      return (v << 2) | (v >> 4);
+    }
+
+    static unsigned quantise(float v, unsigned max) {
+      v = v < 0 ? 0 : v > 255 ? 255 : v;
+      return (unsigned)(v * max * (1.0f/255) + 0.5f);
+    }
+
+    static uint16_t pack565(float r, float g, float b) {
+      return (uint16_t)(quantise(r, 31) << 11 | quantise(g, 63) << 5 | quantise(b, 31));
+    }
+
+    // the four colours decoded from a pair of end points.
+    static void make_palette(int (*palette)[3], uint16_t c0, uint16_t c1) {
+      int e0[3] = { expand5(c0 >> 11), expand6(c0 >> 5 & 0x3f), expand5(c0 & 0x1f) };
+      int e1[3] = { expand5(c1 >> 11), expand6(c1 >> 5 & 0x3f), expand5(c1 & 0x1f) };
+      for (unsigned c = 0; c != 3; ++c) {
+        palette[0][c] = e0[c];
+        palette[1][c] = e1[c];
+        palette[2][c] = (2 * e0[c] + e1[c]) / 3;
+        palette[3][c] = (e0[c] + 2 * e1[c]) / 3;
+      }
+    }
+
+    // choose the nearest palette colour for each pixel.
+    // returns the total squared error and the two bit indices in mask.
+    static unsigned match_colours(uint32_t &mask, const uint8_t *rgba, uint16_t c0, uint16_t c1) {
+      int palette[4][3];
+      make_palette(palette, c0, c1);
+
+      #if OCTET_SSE
+        // four pixels at a time, the distances are exact in floats.
+        __m128 best_index[4], best_dist[4];
+        for (unsigned j = 0; j != 4; ++j) {
+          const uint8_t *p = rgba + j * 16;
+          __m128 r = _mm_setr_ps(p[0], p[4], p[8], p[12]);
+          __m128 g = _mm_setr_ps(p[1], p[5], p[9], p[13]);
+          __m128 b = _mm_setr_ps(p[2], p[6], p[10], p[14]);
+          for (unsigned k = 0; k != 4; ++k) {
+            __m128 dr = _mm_sub_ps(r, _mm_set1_ps((float)palette[k][0]));
+            __m128 dg = _mm_sub_ps(g, _mm_set1_ps((float)palette[k][1]));
+            __m128 db = _mm_sub_ps(b, _mm_set1_ps((float)palette[k][2]));
+            __m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)), _mm_mul_ps(db, db));
+            __m128 index = _mm_set1_ps((float)k);
+            if (k == 0) {
+              best_dist[j] = dist;
+              best_index[j] = index;
+            } else {
+              __m128 closer = _mm_cmplt_ps(dist, best_dist[j]);
+              best_dist[j] = _mm_min_ps(dist, best_dist[j]);
+              best_index[j] = _mm_or_ps(_mm_and_ps(closer, index), _mm_andnot_ps(closer, best_index[j]));
+            }
+          }
+        }
+        float dists[16], indices[16];
+        for (unsigned j = 0; j != 4; ++j) {
+          _mm_storeu_ps(dists + j * 4, best_dist[j]);
+          _mm_storeu_ps(indices + j * 4, best_index[j]);
+        }
+        unsigned error = 0;
+        mask = 0;
+        for (unsigned i = 0; i != 16; ++i) {
+          error += (unsigned)dists[i];
+          mask |= (uint32_t)indices[i] << (i * 2);
+        }
+        return error;
+      #else
+        unsigned error = 0;
+        mask = 0;
+        for (unsigned i = 0; i != 16; ++i) {
+          const uint8_t *p = rgba + i * 4;
+          unsigned best = ~0u, best_k = 0;
+          for (unsigned k = 0; k != 4; ++k) {
+            int dr = p[0] - palette[k][0], dg = p[1] - palette[k][1], db = p[2] - palette[k][2];
+            unsigned dist = (unsigned)(dr * dr + dg * dg + db * db);
+            if (dist < best) {
+              best = dist;
+              best_k = k;
+            }
+          }
+          error += best;
+          mask |= best_k << (i * 2);
+        }
+        return error;
+      #endif
+    }
+
+    // best end points in the least squares sense for a given set of indices.
+    // returns false if all the pixels have the same weights.
+    static bool refine_end_points(uint16_t &c0, uint16_t &c1, const uint8_t *rgba, uint32_t mask) {
+      // weights of the end points for each index, times three
+      static const int w0[4] = { 3, 0, 2, 1 };
+      static const int w1[4] = { 0, 3, 1, 2 };
+      int aa = 0, bb = 0, ab = 0;
+      int at[3] = { 0, 0, 0 }, bt[3] = { 0, 0, 0 };
+      for (unsigned i = 0; i != 16; ++i) {
+        unsigned k = mask >> (i * 2) & 3;
+        int a = w0[k], b = w1[k];
+        aa += a * a;
+        bb += b * b;
+        ab += a * b;
+        for (unsigned c = 0; c != 3; ++c) {
+          at[c] += a * rgba[i * 4 + c];
+          bt[c] += b * rgba[i * 4 + c];
+        }
+      }
+      int det = aa * bb - ab * ab;
+      if (det == 0) return false;
+
+      float scale = 3.0f / det;
+      float e0[3], e1[3];
+      for (unsigned c = 0; c != 3; ++c) {
+        e0[c] = (at[c] * bb - bt[c] * ab) * scale;
+        e1[c] = (bt[c] * aa - at[c] * ab) * scale;
+      }
+      c0 = pack565(e0[0], e0[1], e0[2]);
+      c1 = pack565(e1[0], e1[1], e1[2]);
+      return true;
+    }
+
+    static void write_colour_block(uint8_t *dest, uint16_t c0, uint16_t c1, uint32_t mask, bool four_colours) {
+      // c0 > c1 selects four colours in BC1. Swapping the end points swaps 0 with 1 and 2 with 3.
+      if (four_colours && c0 < c1) {
+        uint16_t t = c0; c0 = c1; c1 = t;
+        mask ^= 0x55555555;
+      }
+      if (c0 == c1) mask = 0;
+      dest[0] = (uint8_t)c0;
+      dest[1] = (uint8_t)(c0 >> 8);
+      dest[2] = (uint8_t)c1;
+      dest[3] = (uint8_t)(c1 >> 8);
+      dest[4] = (uint8_t)mask;
+      dest[5] = (uint8_t)(mask >> 8);
+      dest[6] = (uint8_t)(mask >> 16);
+      dest[7] = (uint8_t)(mask >> 24);
+    }
+
+    // the eight values decoded from a pair of alpha end points.
+    static void make_alpha_palette(int *palette, int a0, int a1) {
+      palette[0] = a0;
+      palette[1] = a1;
+      if (a0 > a1) {
+        for (int i = 1; i != 7; ++i) {
+          palette[i+1] = ((7 - i) * a0 + i * a1 + 3) / 7;
+        }
+      } else {
+        for (int i = 1; i != 5; ++i) {
+          palette[i+1] = ((5 - i) * a0 + i * a1 + 2) / 5;
+        }
+        palette[6] = 0;
+        palette[7] = 255;
+      }
+    }
+
+    static unsigned match_alpha(uint8_t *indices, const uint8_t *values, int a0, int a1) {
+      int palette[8];
+      make_alpha_palette(palette, a0, a1);
+      unsigned error = 0;
+      if (a0 > a1) {
+        // the eight values are evenly spaced, so only the nearest step and its neighbours
+        // can be closest after rounding.
+        static const uint8_t order[8] = { 0, 2, 3, 4, 5, 6, 7, 1 };
+        int scale = (7 << 16) / (a0 - a1);
+        for (unsigned i = 0; i != 16; ++i) {
+          int v = values[i];
+          int c = v > a0 ? a0 : v < a1 ? a1 : v;
+          int t = ((a0 - c) * scale + 0x8000) >> 16;
+          t = t > 7 ? 7 : t;
+          int t_min = t > 0 ? t - 1 : 0, t_max = t < 7 ? t + 1 : 7;
+          unsigned best = ~0u;
+          for (int j = t_min; j <= t_max; ++j) {
+            int d = v - palette[order[j]];
+            if ((unsigned)(d * d) < best) {
+              best = (unsigned)(d * d);
+              indices[i] = order[j];
+            }
+          }
+          error += best;
+        }
+        return error;
+      }
+
+      for (unsigned i = 0; i != 16; ++i) {
+        unsigned best = ~0u;
+        for (unsigned k = 0; k != 8; ++k) {
+          int d = values[i] - palette[k];
+          if ((unsigned)(d * d) < best) {
+            best = (unsigned)(d * d);
+            indices[i] = (uint8_t)k;
+          }
+        }
+        error += best;
+      }
+      return error;
+    }
+
+    // least squares end points for the eight value mode.
+    static bool refine_alpha(int &a0, int &a1, const uint8_t *values, const uint8_t *indices) {
+      int aa = 0, bb = 0, ab = 0, at = 0, bt = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        unsigned k = indices[i];
+        // weights of the end points, times seven
+        int b = k == 0 ? 0 : k == 1 ? 7 : k - 1;
+        int a = 7 - b;
+        aa += a * a;
+        bb += b * b;
+        ab += a * b;
+        at += a * values[i];
+        bt += b * values[i];
+      }
+      int det = aa * bb - ab * ab;
+      if (det == 0) return false;
+      float scale = 7.0f / det;
+      float e0 = (at * bb - bt * ab) * scale;
+      float e1 = (bt * aa - at * ab) * scale;
+      a0 = (int)quantise(e0, 255);
+      a1 = (int)quantise(e1, 255);
+      return a0 != a1;
+    }
+
+    // BC4 block, which is also the alpha of BC3. stride is the distance between values.
+    static void encode_alpha_block(uint8_t *dest, const uint8_t *src, unsigned stride, bool refine) {
+      uint8_t values[16];
+      int min = 255, max = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        int v = values[i] = src[i * stride];
+        min = v < min ? v : min;
+        max = v > max ? v : max;
+      }
+
+      uint8_t best_indices[16];
+      int best_a0 = max, best_a1 = min;
+      memset(best_indices, 0, sizeof(best_indices));
+      if (min != max) {
+        // eight values between the extremes
+        unsigned best = match_alpha(best_indices, values, max, min);
+        for (unsigned iter = 0; refine && iter != 2; ++iter) {
+          int a0 = best_a0, a1 = best_a1;
+          if (!refine_alpha(a0, a1, values, best_indices)) break;
+          if (a0 < a1) {
+            int t = a0; a0 = a1; a1 = t;
+          }
+          uint8_t indices[16];
+          unsigned error = match_alpha(indices, values, a0, a1);
+          if (error >= best) break;
+          best = error;
+          best_a0 = a0;
+          best_a1 = a1;
+          memcpy(best_indices, indices, sizeof(indices));
+        }
+
+        // six values between the extremes that are not 0 or 255, which are exact.
+        if (best && (min == 0 || max == 255)) {
+          int lo = 255, hi = 0;
+          for (unsigned i = 0; i != 16; ++i) {
+            int v = values[i];
+            if (v != 0 && v != 255) {
+              lo = v < lo ? v : lo;
+              hi = v > hi ? v : hi;
+            }
+          }
+          if (lo > hi) lo = hi = 0;
+          uint8_t indices[16];
+          unsigned error = match_alpha(indices, values, lo, hi);
+          if (error < best) {
+            best_a0 = lo;
+            best_a1 = hi;
+            memcpy(best_indices, indices, sizeof(indices));
+          }
+        }
+      }
+
+      dest[0] = (uint8_t)best_a0;
+      dest[1] = (uint8_t)best_a1;
+      uint64_t bits = 0;
+      for (unsigned i = 0; i != 16; ++i) {
+        bits |= (uint64_t)best_indices[i] << (i * 3);
+      }
+      for (unsigned i = 0; i != 6; ++i) {
+        dest[i+2] = (uint8_t)(bits >> (i * 8));
+      }
+    }
+
+    // BC1 block, which is also the colour of BC3. rgba is 16 pixels.
+    static void encode_colour_block(uint8_t *dest, const uint8_t *rgba, bool refine, bool four_colours) {
+      bool solid = true;
+      int mean[3] = { 0, 0, 0 };
+      for (unsigned i = 0; i != 16; ++i) {
+        for (unsigned c = 0; c != 3; ++c) {
+          mean[c] += rgba[i * 4 + c];
+          solid = solid && rgba[i * 4 + c] == rgba[c];
+        }
+      }
+
+      if (solid) {
+        const single_colour_tables &t = get_tables();
+        uint16_t c0 = (uint16_t)(t.match5[rgba[0]][0] << 11 | t.match6[rgba[1]][0] << 5 | t.match5[rgba[2]][0]);
+        uint16_t c1 = (uint16_t)(t.match5[rgba[0]][1] << 11 | t.match6[rgba[1]][1] << 5 | t.match5[rgba[2]][1]);
+        write_colour_block(dest, c0, c1, 0xaaaaaaaa, four_colours);
+        return;
+      }
+
+      // covariance of the colours
+      float m[3] = { mean[0] * (1.0f/16), mean[1] * (1.0f/16), mean[2] * (1.0f/16) };
+      float cov[6] = { 0, 0, 0, 0, 0, 0 };
+      for (unsigned i = 0; i != 16; ++i) {
+        float r = rgba[i * 4 + 0] - m[0], g = rgba[i * 4 + 1] - m[1], b = rgba[i * 4 + 2] - m[2];
+        cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+        cov[3] += g * g; cov[4] += g * b;
+        cov[5] += b * b;
+      }
+
+      // power method for the principal axis, starting with the diagonal.
+      float axis[3] = { cov[0], cov[3], cov[5] };
+      for (unsigned iter = 0; iter != 4; ++iter) {
+        float x = axis[0] * cov[0] + axis[1] * cov[1] + axis[2] * cov[2];
+        float y = axis[0] * cov[1] + axis[1] * cov[3] + axis[2] * cov[4];
+        float z = axis[0] * cov[2] + axis[1] * cov[4] + axis[2] * cov[5];
+        float len = fabsf(x) > fabsf(y) ? fabsf(x) : fabsf(y);
+        len = fabsf(z) > len ? fabsf(z) : len;
+        if (len < 1e-6f) break;
+        axis[0] = x / len; axis[1] = y / len; axis[2] = z / len;
+      }
+
+      // the end points are the pixels at each end of the axis.
+      unsigned imin = 0, imax = 0;
+      float pmin = 1e30f, pmax = -1e30f;
+      for (unsigned i = 0; i != 16; ++i) {
+        const uint8_t *p = rgba + i * 4;
+        float proj = p[0] * axis[0] + p[1] * axis[1] + p[2] * axis[2];
+        if (proj < pmin) { pmin = proj; imin = i; }
+        if (proj > pmax) { pmax = proj; imax = i; }
+      }
+      const uint8_t *hi = rgba + imax * 4, *lo = rgba + imin * 4;
+      uint16_t c0 = pack565(hi[0], hi[1], hi[2]);
+      uint16_t c1 = pack565(lo[0], lo[1], lo[2]);
+      uint32_t mask;
+      unsigned error = match_colours(mask, rgba, c0, c1);
+
+      for (unsigned iter = 0; refine && iter != 2 && error; ++iter) {
+        uint16_t n0 = c0, n1 = c1;
+        if (!refine_end_points(n0, n1, rgba, mask) || (n0 == c0 && n1 == c1)) break;
+        uint32_t new_mask;
+        unsigned new_error = match_colours(new_mask, rgba, n0, n1);
+        if (new_error >= error) break;
+        c0 = n0;
+        c1 = n1;
+        mask = new_mask;
+        error = new_error;
+      }
+
+      write_colour_block(dest, c0, c1, mask, four_colours);
+    }
+
+    void encode_block(uint8_t *dest, const uint8_t *rgba) const {
+      switch (format) {
+        case bc1: {
+          encode_colour_block(dest, rgba, refine, true);
+        } break;
+        case bc3: {
+          encode_alpha_block(dest, rgba + 3, 4, refine);
+          encode_colour_block(dest + 8, rgba, refine, true);
+        } break;
+        case bc4: {
+          encode_alpha_block(dest, rgba, 4, refine);
+        } break;
+        case bc5: {
+          encode_alpha_block(dest, rgba, 4, refine);
+          encode_alpha_block(dest + 8, rgba + 1, 4, refine);
+        } break;
+      }
+    }
+
+  public:
+    /// Make an encoder for a format. Without refinement encoding is about twice as fast.
+    dxt_encoder(format_type format = bc1, bool refine = true) : format(format), refine(refine) {
+    }
+
+    /// Bytes in each 4x4 block.
+    static unsigned get_block_bytes(unsigned format) {
+      return format == bc1 || format == bc4 ? 8 : 16;
+    }
+
+    /// Bytes in a compressed image of this size.
+    static size_t get_level_size(unsigned width, unsigned height, unsigned format) {
+      return (size_t)((width + 3) / 4) * ((height + 3) / 4) * get_block_bytes(format);
+    }
+
+    /// Compress an image of num_comps (1-4) bytes per pixel. Rows of blocks are done in parallel.
+    /// Missing channels read as zero, except alpha which reads as 255.
+    void encode_level(uint8_t *dest, const uint8_t *src, unsigned width, unsigned height, unsigned num_comps) const {
+      unsigned blocks_x = (width + 3) / 4, blocks_y = (height + 3) / 4;
+      unsigned block_bytes = get_block_bytes(format);
+      platform::thread_pool::get().parallel_for(0, blocks_y, [&](unsigned by) {
+        uint8_t rgba[64];
+        uint8_t *out = dest + by * blocks_x * block_bytes;
+        for (unsigned bx = 0; bx != blocks_x; ++bx, out += block_bytes) {
+          for (unsigned j = 0; j != 4; ++j) {
+            unsigned y = by * 4 + j < height ? by * 4 + j : height - 1;
+            for (unsigned i = 0; i != 4; ++i) {
+              unsigned x = bx * 4 + i < width ? bx * 4 + i : width - 1;
+              const uint8_t *p = src + (y * width + x) * num_comps;
+              uint8_t *q = rgba + (j * 4 + i) * 4;
+              q[0] = p[0];
+              q[1] = num_comps >= 2 ? p[1] : 0;
+              q[2] = num_comps >= 3 ? p[2] : 0;
+              q[3] = num_comps == 4 ? p[3] : 0xff;
+            }
+          }
+          encode_block(out, rgba);
+        }
+      });
+    }
+
+    /// Compress a mip chain whose level sizes are max(1, size/2), appending the blocks to result.
+    void encode_chain(dynarray<uint8_t> &result, const uint8_t *src, unsigned width, unsigned height, unsigned num_comps, unsigned levels) const {
+      size_t size = 0;
+      unsigned w = width, h = height;
+      for (unsigned level = 0; level != levels; ++level) {
+        size += get_level_size(w, h, format);
+        w = w > 1 ? w >> 1 : 1;
+        h = h > 1 ? h >> 1 : 1;
+      }
+
+      size_t offset = result.size();
+      result.resize((unsigned)(offset + size));
+      uint8_t *dest = result.data() + offset;
+      for (unsigned level = 0; level != levels; ++level) {
+        encode_level(dest, src, width, height, num_comps);
+        dest += get_level_size(width, height, format);
+        src += width * height * num_comps;
+        width = width > 1 ? width >> 1 : 1;
+        height = height > 1 ? height >> 1 : 1;
+      }
+    }
+
+    /// Decode one block to 16 RGBA pixels, for tests and tools.
+    static void decode_block(uint8_t *rgba, const uint8_t *src, unsigned format) {
+      if (format == bc1 || format == bc3) {
+        const uint8_t *colour = format == bc3 ? src + 8 : src;
+        uint16_t c0 = (uint16_t)(colour[0] | colour[1] << 8);
+        uint16_t c1 = (uint16_t)(colour[2] | colour[3] << 8);
+        uint32_t mask = colour[4] | colour[5] << 8 | colour[6] << 16 | (uint32_t)colour[7] << 24;
+        int palette[4][3];
+        make_palette(palette, c0, c1);
+        if (format == bc1 && c0 <= c1) {
+          for (unsigned c = 0; c != 3; ++c) {
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+            palette[3][c] = 0;
+          }
+        }
+        for (unsigned i = 0; i != 16; ++i) {
+          unsigned k = mask >> (i * 2) & 3;
+          rgba[i*4+0] = (uint8_t)palette[k][0];
+          rgba[i*4+1] = (uint8_t)palette[k][1];
+          rgba[i*4+2] = (uint8_t)palette[k][2];
+          rgba[i*4+3] = format == bc1 && c0 <= c1 && k == 3 ? 0 : 0xff;
+        }
+      } else {
+        for (unsigned i = 0; i != 16; ++i) {
+          rgba[i*4+0] = rgba[i*4+1] = rgba[i*4+2] = 0;
+          rgba[i*4+3] = 0xff;
+        }
+      }
+
+      // alpha, red or red and green
+      unsigned num_alpha = format == bc5 ? 2 : format == bc1 ? 0 : 1;
+      for (unsigned n = 0; n != num_alpha; ++n) {
+        const uint8_t *block = src + n * 8;
+        int palette[8];
+        make_alpha_palette(palette, block[0], block[1]);
+        uint64_t bits = 0;
+        for (unsigned i = 0; i != 6; ++i) {
+          bits |= (uint64_t)block[i+2] << (i * 8);
+        }
+        unsigned channel = format == bc3 ? 3 : n;
+        for (unsigned i = 0; i != 16; ++i) {
+          rgba[i*4+channel] = (uint8_t)palette[bits >> (i * 3) & 7];
+        }
+      }
+    }
+  };
+
+  #if OCTET_UNIT_TEST
+    class dxt_encoder_unit_test {
+    public:
+      dxt_encoder_unit_test() {
+        // a smooth image with an odd size stays close in every format.
+        unsigned width = 37, height = 21;
+        dynarray<uint8_t> pixels(width * height * 4);
+        for (unsigned y = 0; y != height; ++y) {
+          for (unsigned x = 0; x != width; ++x) {
+            uint8_t *p = pixels.data() + (y * width + x) * 4;
+            p[0] = (uint8_t)(x * 6);
+            p[1] = (uint8_t)(y * 12);
+            p[2] = (uint8_t)(200 - x * 2 - y);
+            p[3] = (uint8_t)(x * 3 + y * 5);
+          }
+        }
+
+        static const dxt_encoder::format_type formats[] = { dxt_encoder::bc1, dxt_encoder::bc3, dxt_encoder::bc4, dxt_encoder::bc5 };
+        for (unsigned f = 0; f != 4; ++f) {
+          dxt_encoder encoder(formats[f]);
+          dynarray<uint8_t> blocks(dxt_encoder::get_level_size(width, height, formats[f]));
+          encoder.encode_level(blocks.data(), pixels.data(), width, height, 4);
+
+          unsigned block_bytes = dxt_encoder::get_block_bytes(formats[f]);
+          unsigned channels = formats[f] == dxt_encoder::bc4 ? 1 : formats[f] == dxt_encoder::bc5 ? 2 : 4;
+          int max_error = 0;
+          for (unsigned by = 0; by != height / 4; ++by) {
+            for (unsigned bx = 0; bx != width / 4; ++bx) {
+              uint8_t rgba[64];
+              dxt_encoder::decode_block(rgba, blocks.data() + (by * ((width + 3) / 4) + bx) * block_bytes, formats[f]);
+              for (unsigned i = 0; i != 16; ++i) {
+                const uint8_t *p = pixels.data() + ((by * 4 + i / 4) * width + bx * 4 + i % 4) * 4;
+                for (unsigned c = 0; c != channels; ++c) {
+                  if (formats[f] == dxt_encoder::bc1 && c == 3) continue;
+                  int error = rgba[i*4+c] - p[c];
+                  max_error = error > max_error ? error : -error > max_error ? -error : max_error;
+                }
+              }
+            }
+          }
+          assert(max_error < 16);
+        }
+      }
+    };
+    static dxt_encoder_unit_test dxt_encoder_unit_test;
+  #endif
+}}
@@ -8,10 +8,28 @@
 // jpeg file decoder - tiny and fast
 //
 // See http://en.wikipedia.org/wiki/JPEG
-// 
+//
 namespace octet { namespace loaders {
+  /// Baseline and progressive JPEG decoder.
+  ///
+  /// Huffman codes are decoded with a lookahead table, blocks use an integer IDCT
+  /// (SSE2 when OCTET_SSE is set) and colour conversion is done a row at a time with
+  /// 4:2:0 and 4:2:2 chroma upsampling in the same pass.
+  /// Images with restart markers are decoded one restart interval per thread.
+  ///
+  /// Progressive images are decoded one scan at a time into coefficient buffers
+  /// and transformed in parallel at the end.
+  /// get_preview() makes a 1/8 size image from the first scans only.
   class jpeg_decoder {
-    enum { debug = 0 };
+    enum {
+      debug = 0,
+
+      // huffman codes up to this length are decoded with one table lookup.
+      fast_bits = 9,
+
+      // most blocks in an MCU (4:2:0 has four Y blocks, one Cb and one Cr)
+      max_mcu_blocks = 10,
+    };
 
     // image dimensions
     unsigned precision;
@@ -21,6 +39,13 @@ namespace octet { namespace loaders {
 
     // What kind of image
     unsigned sof_code;
+    bool progressive;
+
+    // bit mask of the components whose DC terms have been sent in a progressive image
+    unsigned dc_components;
+
+    // number of MCUs between restart markers or zero
+    unsigned restart_interval;
 
     // progressive parameters
     unsigned spectral_start;
@@ -32,22 +57,57 @@ namespace octet { namespace loaders {
     unsigned num_mcu_blocks;
     unsigned num_components_in_scan;
 
-    // skip a number of bits in the file.
-    // there is a special case where every 0xff byte is followed by 0x00
-    static void skip_bits(unsigned bits, unsigned &acc, const uint8_t *&src, int &shift) {
-      shift -= bits;
-      while (shift < 0) {
-        // grab more bytes
-        uint8_t byte = *src++;
-        acc = acc * 256 + byte;
-        if (byte == 0xff) {
-          // in JPEG, an 0xff byte is followed by a zero
-          // do not advance past any other 0xff marker
-          src += src[0] == 0x00 ? 1 : -1;
-        }
-        shift += 8;
+    // size of the MCU in pixels and the number of MCUs across and down the image.
+    unsigned mcu_width;
+    unsigned mcu_height;
+    unsigned mcus_x;
+    unsigned mcus_y;
+
+    // read bits from the entropy coded data, most significant bit first.
+    // in JPEG, an 0xff byte is followed by a zero which we skip.
+    // At a marker we stop and read zeros.
+    struct bit_reader {
+      const uint8_t *src;
+      const uint8_t *src_max;
+      uint64_t bits;
+      int num_bits;
+
+      void init(const uint8_t *src_, const uint8_t *src_max_) {
+        src = src_;
+        src_max = src_max_;
+        bits = 0;
+        num_bits = 0;
       }
-    }
+
+      // make sure there are at least 32 bits in the buffer
+      void refill() {
+        if (num_bits >= 32) return;
+        do {
+          unsigned byte = 0;
+          if (src < src_max) {
+            byte = *src;
+            if (byte != 0xff) {
+              src++;
+            } else if (src + 1 < src_max && src[1] == 0x00) {
+              src += 2;
+            } else {
+              // marker: do not advance
+              byte = 0;
+            }
+          }
+          bits |= (uint64_t)byte << (56 - num_bits);
+          num_bits += 8;
+        } while (num_bits <= 56);
+      }
+
+      // get 1..16 bits
+      unsigned get(unsigned n) {
+        unsigned value = (unsigned)(bits >> (64 - n));
+        bits <<= n;
+        num_bits -= n;
+        return value;
+      }
+    };
 
     // this is a component usually Y (brightness), Cb (blueness) and Cr (redness)
     // from the file.
@@ -58,8 +118,23 @@ namespace octet { namespace loaders {
       uint8_t hsamp;
       uint8_t vsamp;
       uint8_t quantisation_table;
+
+      // 1 if the component is half the resolution of the image in x or y
+      uint8_t hshift;
+      uint8_t vshift;
+
+      // number of blocks that cover the component, used by scans with only this component.
+      uint16_t blocks_x;
+      uint16_t blocks_y;
+
+      // blocks in a row of the coefficient buffer, which is a whole number of MCUs.
+      uint16_t block_stride;
     } components[4];
 
+    // for progressive images, the coefficients of every block of each component.
+    // the blocks are in natural order and are not dequantised.
+    dynarray<int16_t> coefficients[4];
+
     // this is a component that is used for a particluar "scan"
     // of the image data. With progressive files there may be more than
     // one scan.
@@ -67,15 +142,12 @@ namespace octet { namespace loaders {
       uint8_t comp;
       uint8_t ac_table;
       uint8_t dc_table;
-      unsigned width_in_blocks;
-      unsigned height_in_blocks;
-      int last_dc;
     } scan_components[4];
 
-    // quantisation table. We multiply the dc and ac coefficients by these numbers.
+    // quantisation table in zig-zag order. We multiply the dc and ac coefficients by these numbers.
     // this is the lossy part of the compression
     struct quant_table {
-      float table[64];
+      uint16_t table[64];
     } quant_tables[4];
 
     // A huffman table maps variable length codes to lengths and values.
@@ -83,26 +155,60 @@ namespace octet { namespace loaders {
     // where each code is distinct from the previous one, even if it has more bits.
     // (ie. 100(0) and 100(1) are less than 1010).
     struct huffman_table {
-      unsigned min_len;
-      uint8_t huffval[257];
-      uint16_t maxcodes[17];
-      uint16_t offset[17];
+      // (length << 8) | value for codes of up to fast_bits, indexed by the next fast_bits bits.
+      uint16_t fast[1 << fast_bits];
+      uint8_t huffval[256];
+
+      // for longer codes: the largest code of each length and the offset from a code to its value.
+      int maxcode[17];
+      int delta[17];
+
+      bool build(const uint8_t *num_codes, const uint8_t *values, unsigned count) {
+        memcpy(huffval, values, count);
+        memset(fast, 0, sizeof(fast));
+        unsigned code = 0;
+        unsigned k = 0;
+        for (unsigned len = 1; len <= 16; ++len) {
+          unsigned n = num_codes[len-1];
+          // too many codes of this length for a prefix code: the table is damaged.
+          // checking first keeps the fast table fills below inside fast[].
+          if (code + n > (1u << len) || k + n > count) return false;
+          delta[len] = (int)k - (int)code;
+          for (unsigned i = 0; i != n; ++i, ++code, ++k) {
+            if (len <= fast_bits) {
+              unsigned first = code << (fast_bits - len);
+              for (unsigned j = 0; j != 1u << (fast_bits - len); ++j) {
+                fast[first + j] = (uint16_t)(len << 8 | values[k]);
+              }
+            }
+          }
+          maxcode[len] = n ? (int)code - 1 : -1;
+          code *= 2;
+        }
+        return true;
+      }
 
       // decode a variable length huffman code
-      // we grab the next 16 bits and look in the maxcodes table to see how many
-      // bits the code has. After that, we strip the right hand bits and
-      // look up the code in a table.
-      unsigned decode(unsigned &acc, const uint8_t *&src, int &shift) {
-        unsigned i = min_len;
-        unsigned short acc16 = acc >> shift;
-
-        // find the shortest code that this could be
-        for (; acc16 > maxcodes[i]; ++i) {
+      // short codes use the lookahead table, longer ones check each length in turn.
+      unsigned decode(bit_reader &in) const {
+        unsigned entry = fast[in.bits >> (64 - fast_bits)];
+        if (entry) {
+          in.get(entry >> 8);
+          return entry & 0xff;
         }
 
-        unsigned code = ( acc16 >> (15-i) ) - offset[i];
-        skip_bits(i + 1, acc, src, shift);
-        return huffval[code];
+        unsigned code16 = (unsigned)(in.bits >> 48);
+        for (unsigned len = fast_bits + 1; len <= 16; ++len) {
+          int code = (int)(code16 >> (16 - len));
+          if (code <= maxcode[len]) {
+            in.get(len);
+            return huffval[(code + delta[len]) & 0xff];
+          }
+        }
+
+        // bad code: skip it and return end of block.
+        in.get(16);
+        return 0;
       }
     } huffman_tables[2][4];
 
@@ -110,14 +216,16 @@ namespace octet { namespace loaders {
     // (Minimal coding unit). The image is tiled by MCUs
     // which have components.
     struct mcu_block {
-      huffman_table *dc_table;
-      huffman_table *ac_table;
-      quant_table *quant;
-      scan_component *scan_comp;
-    } mcu_blocks[8];
+      const huffman_table *dc_table;
+      const huffman_table *ac_table;
+      const quant_table *quant;
+      uint8_t scan_comp;
+      uint8_t comp;
 
-    float dct_coeffs[8*64];
-    float ycrcb_values[8*64];
+      // position of the block in the component's part of the MCU
+      uint8_t x;
+      uint8_t y;
+    } mcu_blocks[max_mcu_blocks];
 
     unsigned u2(const uint8_t *src) {
       return src[0] * 256 + src[1];
@@ -125,8 +233,8 @@ namespace octet { namespace loaders {
 
     // dct coefficients are stored in zig-zag order because the top
     // left is far more common.
-    uint8_t zig_zag(unsigned i) {
-      static const uint8_t zig_zag_[64] = {
+    static const uint8_t *zig_zag() {
+      static const uint8_t zig_zag_[64+16] = {
         0, 1, 8, 16, 9, 2, 3, 10,
         17, 24, 32, 25, 18, 11, 4, 5,
         12, 19, 26, 33, 40, 48, 41, 34,
@@ -135,242 +243,743 @@ namespace octet { namespace loaders {
         29, 22, 15, 23, 30, 37, 44, 51,
         58, 59, 52, 45, 38, 31, 39, 46,
         53, 60, 61, 54, 47, 55, 62, 63,
+        // bad run lengths write here
+        63, 63, 63, 63, 63, 63, 63, 63,
+        63, 63, 63, 63, 63, 63, 63, 63,
       };
-      return i < 63 ? zig_zag_[i] : 63;
+      return zig_zag_;
     }
 
     // negative numbers need to be twiddled as all numbers coming in are positive.
-    static int extend(unsigned bits, unsigned &acc, const uint8_t *&src, int &shift) {
-      uint16_t acc16 = acc >> shift;
-      unsigned v = acc16 >> (16 - bits);
-      return v < ( 1u << ( bits-1 ) ) ? (int)v + ( -1 << bits ) + 1 : (int)v;
+    static int extend(unsigned value, unsigned bits) {
+      return value < ( 1u << ( bits-1 ) ) ? (int)value - (1 << bits) + 1 : (int)value;
     }
 
     // decode one block of an MCU which may contain many blocks
     // The Y component may have four blocks, for example, and only one each of Cr, Cb
-    void decode_mcu_block(unsigned block_num, unsigned &acc, const uint8_t *&src, int &shift, float *outptr) {
-      mcu_block &block = mcu_blocks[block_num];
-
-      unsigned value = block.dc_table->decode(acc, src, shift);
+    // The coefficients are dequantised into natural order.
+    // Returns false if the block only has a DC term.
+    static bool decode_mcu_block(const mcu_block &block, bit_reader &in, int &last_dc, int16_t *coeffs) {
+      const uint8_t *zz = zig_zag();
+      const uint16_t *quant = block.quant->table;
+      memset(coeffs, 0, 64 * sizeof(int16_t));
 
-      int dc = 0;
+      in.refill();
+      unsigned value = block.dc_table->decode(in);
       if (value) {
-        dc = extend(value, acc, src, shift);
-        skip_bits(value, acc, src, shift);
-        //if (debug) printf("dc=%d\n", dc);
+        value = value > 16 ? 16 : value;
+        last_dc += extend(in.get(value), value);
       }
-      int abs_dc = block.scan_comp->last_dc += dc;
-      outptr[0] = abs_dc * block.quant->table[0];
+      coeffs[0] = (int16_t)(last_dc * quant[0]);
 
-      for (int ac_coef = 1; ac_coef < 64; ++ac_coef) {
-        unsigned value = block.ac_table->decode(acc, src, shift);
+      bool has_ac = false;
+      for (unsigned ac_coef = 1; ac_coef < 64; ) {
+        in.refill();
+        unsigned value = block.ac_table->decode(in);
         unsigned skip = value >> 4;
         value &= 0x0f;
-        ac_coef += skip;
 
         if (value) {
-          int ac = extend(value, acc, src, shift);
-          skip_bits(value, acc, src, shift);
-          //if (debug) printf("ac=%d,%d coef=%d zig_zag=%d\n", skip, ac, ac_coef, zig_zag(ac_coef));
-          outptr[zig_zag(ac_coef)] = (float)ac * block.quant->table[ac_coef];
-        } else if (skip != 15) {
+          ac_coef += skip;
+          coeffs[zz[ac_coef]] = (int16_t)(extend(in.get(value), value) * quant[ac_coef & 63]);
+          ac_coef++;
+          has_ac = true;
+        } else if (skip == 15) {
+          ac_coef += 16;
+        } else {
           break;
         }
       }
+
       if (debug) {
         for (int j = 0; j != 8; ++j) {
           for (int i = 0; i != 8; ++i) {
-            printf("%3.0f ", outptr[i+j*8]);
+            printf("%4d ", coeffs[i+j*8]);
           }
           printf("\n");
         }
       }
+      return has_ac;
+    }
+
+    // Progressive scans send either the DC terms or a band of AC terms (spectral selection)
+    // and may send the top bits first and the rest one bit per scan (successive approximation).
+    // See ITU T.81 G.1.2 for the details.
+
+    // the first DC scan sends differences as in baseline, later ones send one more bit.
+    void decode_dc_block(const mcu_block &block, bit_reader &in, int &last_dc, int16_t *coeffs) const {
+      in.refill();
+      if (successive_high == 0) {
+        unsigned value = block.dc_table->decode(in);
+        if (value) {
+          value = value > 16 ? 16 : value;
+          last_dc += extend(in.get(value), value);
+        }
+        coeffs[0] = (int16_t)(last_dc * (1 << successive_low));
+      } else if (in.get(1)) {
+        coeffs[0] |= (int16_t)(1 << successive_low);
+      }
+    }
+
+    // the first AC scan of a band. Runs of blocks with nothing in the band share an end of band code.
+    void decode_ac_first(const mcu_block &block, bit_reader &in, unsigned &eob_run, int16_t *coeffs) const {
+      if (eob_run) {
+        eob_run--;
+        return;
+      }
+
+      const uint8_t *zz = zig_zag();
+      for (unsigned k = spectral_start; k <= spectral_end; ) {
+        in.refill();
+        unsigned value = block.ac_table->decode(in);
+        unsigned skip = value >> 4;
+        value &= 0x0f;
+
+        if (value) {
+          k += skip;
+          coeffs[zz[k]] = (int16_t)(extend(in.get(value), value) * (1 << successive_low));
+          k++;
+        } else if (skip == 15) {
+          k += 16;
+        } else {
+          // this block and the next eob_run blocks end here.
+          eob_run = (1u << skip) - 1;
+          if (skip) eob_run += in.get(skip);
+          break;
+        }
+      }
+    }
+
+    // add one bit to a coefficient that is already non-zero.
+    static void refine_coefficient(bit_reader &in, int16_t &coeff, int bit) {
+      in.refill();
+      if (in.get(1) && (coeff & bit) == 0) {
+        coeff = (int16_t)(coeff >= 0 ? coeff + bit : coeff - bit);
+      }
+    }
+
+    // later AC scans send a bit for each non-zero coefficient and the
+    // coefficients that become non-zero as runs of zeros as in the first scan.
+    void decode_ac_refine(const mcu_block &block, bit_reader &in, unsigned &eob_run, int16_t *coeffs) const {
+      const uint8_t *zz = zig_zag();
+      int bit = 1 << successive_low;
+      unsigned k = spectral_start;
+
+      if (eob_run == 0) {
+        for (; k <= spectral_end; ++k) {
+          in.refill();
+          unsigned value = block.ac_table->decode(in);
+          int skip = (int)(value >> 4);
+          int new_coeff = 0;
+          if (value & 0x0f) {
+            new_coeff = in.get(1) ? bit : -bit;
+          } else if (skip != 15) {
+            eob_run = 1u << skip;
+            if (skip) eob_run += in.get(skip);
+            break;
+          }
+
+          // skip zeros, refining the non-zero coefficients on the way.
+          for (; k <= spectral_end; ++k) {
+            int16_t &coeff = coeffs[zz[k]];
+            if (coeff) {
+              refine_coefficient(in, coeff, bit);
+            } else if (--skip < 0) {
+              break;
+            }
+          }
+
+          if (new_coeff) {
+            coeffs[zz[k]] = (int16_t)new_coeff;
+          }
+        }
+      }
+
+      if (eob_run) {
+        // the rest of the band only has refinement bits.
+        for (; k <= spectral_end; ++k) {
+          int16_t &coeff = coeffs[zz[k]];
+          if (coeff) {
+            refine_coefficient(in, coeff, bit);
+          }
+        }
+        eob_run--;
+      }
+    }
+
+    // fixed point constants for the IDCT, 12 bits of fraction.
+    static int fix(float x) {
+      return (int)(x * 4096 + 0.5f);
     }
 
-    // one dimensional inverse DCT.
+    // one dimensional inverse DCT (Loeffler, Ligtenberg and Moschytz).
     // c0 is the DC term and c1..c7 increase in frequency
-    // example: c0 = 128, c1..c7 = 0 -> 128, 128, 128, 128, 128, 128, 128, 128
-    // todo: improve this!
-    OCTET_HOT void idct(float &c0, float &c1, float &c2, float &c3, float &c4, float &c5, float &c6, float &c7) {
-      float c2c6_1 = (c2 + c6) * 0.541196100f;
-      float c2c6_2 = c2c6_1 + c6 * -1.847759065f;
-      float c2c6_3 = c2c6_1 + c2 * 0.765366865f;
-    
-      float c0c4_1 = c0 + c4;
-      float c0c4_2 = c0 - c4;
-    
-      float ceven_1 = c0c4_1 + c2c6_3;
-      float ceven_2 = c0c4_1 - c2c6_3;
-      float ceven_3 = c0c4_2 + c2c6_2;
-      float ceven_4 = c0c4_2 - c2c6_2;
-    
-      float c1c7 = c7 + c1;
-      float c3c5 = c5 + c3;
-      float c7c3 = c7 + c3;
-      float c5c1 = c5 + c1;
-      float codd_0 = (c7c3 + c5c1) * 1.175875602f;
-    
-      float codd_4 = c7 * 0.298631336f;
-      float codd_3 = c5 * 2.053119869f;
-      float codd_2 = c3 * 3.072711026f;
-      float codd_1 = c1 * 1.501321110f;
-      c1c7 = c1c7 * -0.899976223f;
-      c3c5 = c3c5 * -2.562915447f;
-      c7c3 = c7c3 * -1.961570560f;
-      c5c1 = c5c1 * -0.390180644f;
-    
-      c7c3 += codd_0;
-      c5c1 += codd_0;
-    
-      codd_4 += c1c7 + c7c3;
-      codd_3 += c3c5 + c5c1;
-      codd_2 += c3c5 + c7c3;
-      codd_1 += c1c7 + c5c1;
-    
-      c0 = ceven_1 + codd_1;
-      c7 = ceven_1 - codd_1;
-      c1 = ceven_3 + codd_2;
-      c6 = ceven_3 - codd_2;
-      c2 = ceven_4 + codd_3;
-      c5 = ceven_4 - codd_3;
-      c3 = ceven_2 + codd_4;
-      c4 = ceven_2 - codd_4;
-    }
-
-    // Two dimensional inverse DCT
-    // we can do the rows and columns separately.
-    // Optimisations include spotting blank rows and columns, but this
-    // is just a reference design.
-    void inverse_dct(float *inptr) {
-      // do rows
+    // The results are scaled by 4096 and come out as the even part x0..x3 and odd part o0..o3
+    // which are combined as x0+o3, x1+o2, x2+o1, x3+o0, x3-o0, x2-o1, x1-o2, x0-o3
+    static OCTET_HOT void idct_1d(int *x, int *o, int c0, int c1, int c2, int c3, int c4, int c5, int c6, int c7) {
+      int c2c6 = (c2 + c6) * fix(0.541196100f);
+      int ceven_2 = c2c6 + c6 * fix(-1.847759065f);
+      int ceven_3 = c2c6 + c2 * fix(0.765366865f);
+
+      int c0c4_1 = (c0 + c4) * 4096;
+      int c0c4_2 = (c0 - c4) * 4096;
+
+      x[0] = c0c4_1 + ceven_3;
+      x[3] = c0c4_1 - ceven_3;
+      x[1] = c0c4_2 + ceven_2;
+      x[2] = c0c4_2 - ceven_2;
+
+      int c7c3 = c7 + c3;
+      int c5c1 = c5 + c1;
+      int c7c1 = c7 + c1;
+      int c5c3 = c5 + c3;
+      int codd_0 = (c7c3 + c5c1) * fix(1.175875602f);
+
+      c7c1 = codd_0 + c7c1 * fix(-0.899976223f);
+      c5c3 = codd_0 + c5c3 * fix(-2.562915447f);
+      c7c3 = c7c3 * fix(-1.961570560f);
+      c5c1 = c5c1 * fix(-0.390180644f);
+
+      o[0] = c7 * fix(0.298631336f) + c7c1 + c7c3;
+      o[1] = c5 * fix(2.053119869f) + c5c3 + c5c1;
+      o[2] = c3 * fix(3.072711026f) + c5c3 + c7c3;
+      o[3] = c1 * fix(1.501321110f) + c7c1 + c5c1;
+    }
+
+    // clamp to 0..255
+    static uint8_t clamp(int v) {
+      return (unsigned)v > 255 ? (v < 0 ? 0 : 255) : (uint8_t)v;
+    }
+
+    // the first pass is kept to 16 bits as in the SSE version
+    static int saturate16(int v) {
+      return v < -32768 ? -32768 : v > 32767 ? 32767 : v;
+    }
+
+    // Two dimensional inverse DCT with the result in 0..255
+    // we can do the columns and rows separately.
+    // columns with only a DC term are common and are done separately.
+    static void inverse_dct_scalar(uint8_t *outptr, int stride, const int16_t *inptr) {
+      int tmp[64];
+      int x[4], o[4];
+
+      // do columns, keeping two extra bits of precision
       for (unsigned i = 0; i != 8; ++i) {
-        idct(inptr[8*0+i], inptr[8*1+i], inptr[8*2+i], inptr[8*3+i], inptr[8*4+i], inptr[8*5+i], inptr[8*6+i], inptr[8*7+i]);
+        const int16_t *c = inptr + i;
+        int *t = tmp + i;
+        if (!(c[8] | c[16] | c[24] | c[32] | c[40] | c[48] | c[56])) {
+          int dc = saturate16(c[0] * 4);
+          t[0] = t[8] = t[16] = t[24] = t[32] = t[40] = t[48] = t[56] = dc;
+        } else {
+          idct_1d(x, o, c[0], c[8], c[16], c[24], c[32], c[40], c[48], c[56]);
+          for (unsigned j = 0; j != 4; ++j) x[j] += 512;
+          t[0*8] = saturate16((x[0] + o[3]) >> 10);
+          t[7*8] = saturate16((x[0] - o[3]) >> 10);
+          t[1*8] = saturate16((x[1] + o[2]) >> 10);
+          t[6*8] = saturate16((x[1] - o[2]) >> 10);
+          t[2*8] = saturate16((x[2] + o[1]) >> 10);
+          t[5*8] = saturate16((x[2] - o[1]) >> 10);
+          t[3*8] = saturate16((x[3] + o[0]) >> 10);
+          t[4*8] = saturate16((x[3] - o[0]) >> 10);
+        }
       }
 
-      // do columns
+      // do rows. The scale is now 4096 * 4 * 8 (from the two passes)
+      // and we add 128 to make the result unsigned.
       for (unsigned i = 0; i != 8; ++i) {
-        idct(inptr[8*i+0], inptr[8*i+1], inptr[8*i+2], inptr[8*i+3], inptr[8*i+4], inptr[8*i+5], inptr[8*i+6], inptr[8*i+7]);
+        const int *t = tmp + i * 8;
+        idct_1d(x, o, t[0], t[1], t[2], t[3], t[4], t[5], t[6], t[7]);
+        for (unsigned j = 0; j != 4; ++j) x[j] += 65536 + (128 << 17);
+        uint8_t *out = outptr + i * stride;
+        out[0] = clamp((x[0] + o[3]) >> 17);
+        out[7] = clamp((x[0] - o[3]) >> 17);
+        out[1] = clamp((x[1] + o[2]) >> 17);
+        out[6] = clamp((x[1] - o[2]) >> 17);
+        out[2] = clamp((x[2] + o[1]) >> 17);
+        out[5] = clamp((x[2] - o[1]) >> 17);
+        out[3] = clamp((x[3] + o[0]) >> 17);
+        out[4] = clamp((x[3] - o[0]) >> 17);
       }
+    }
 
-      if (debug) {
-        for (int j = 0; j != 8; ++j) {
-          for (int i = 0; i != 8; ++i) {
-            printf("%f ", inptr[i+j*8]);
-          }
-          printf("\n");
+    #if OCTET_SSE
+      // eight 32 bit values as two registers
+      struct sse_wide {
+        __m128i lo, hi;
+      };
+
+      // x * c0 + y * c1 for each of the eight 16 bit lanes of x and y.
+      static sse_wide sse_madd(__m128i x, __m128i y, int c0, int c1) {
+        __m128i c = _mm_set1_epi32((c1 << 16) | (c0 & 0xffff));
+        sse_wide r = { _mm_madd_epi16(_mm_unpacklo_epi16(x, y), c), _mm_madd_epi16(_mm_unpackhi_epi16(x, y), c) };
+        return r;
+      }
+
+      static sse_wide sse_add(sse_wide a, sse_wide b) {
+        sse_wide r = { _mm_add_epi32(a.lo, b.lo), _mm_add_epi32(a.hi, b.hi) };
+        return r;
+      }
+
+      static sse_wide sse_sub(sse_wide a, sse_wide b) {
+        sse_wide r = { _mm_sub_epi32(a.lo, b.lo), _mm_sub_epi32(a.hi, b.hi) };
+        return r;
+      }
+
+      template <int shift> static __m128i sse_round(sse_wide a, __m128i bias) {
+        return _mm_packs_epi32(
+          _mm_srai_epi32(_mm_add_epi32(a.lo, bias), shift),
+          _mm_srai_epi32(_mm_add_epi32(a.hi, bias), shift)
+        );
+      }
+
+      // idct_1d on eight columns at once, the same arithmetic with the products paired for madd.
+      template <int shift> static void sse_idct_1d(__m128i *r, __m128i bias) {
+        int k0 = fix(0.541196100f);
+        sse_wide ceven_2 = sse_madd(r[2], r[6], k0, k0 + fix(-1.847759065f));
+        sse_wide ceven_3 = sse_madd(r[2], r[6], k0 + fix(0.765366865f), k0);
+        sse_wide c0c4_1 = sse_madd(r[0], r[4], 4096, 4096);
+        sse_wide c0c4_2 = sse_madd(r[0], r[4], 4096, -4096);
+
+        sse_wide x0 = sse_add(c0c4_1, ceven_3);
+        sse_wide x3 = sse_sub(c0c4_1, ceven_3);
+        sse_wide x1 = sse_add(c0c4_2, ceven_2);
+        sse_wide x2 = sse_sub(c0c4_2, ceven_2);
+
+        int k1 = fix(1.175875602f);
+        int k7c1 = fix(-0.899976223f);
+        int k5c3 = fix(-2.562915447f);
+        __m128i c7c3 = _mm_add_epi16(r[7], r[3]);
+        __m128i c5c1 = _mm_add_epi16(r[5], r[1]);
+        sse_wide y0 = sse_madd(c7c3, c5c1, k1 + fix(-1.961570560f), k1);
+        sse_wide y1 = sse_madd(c7c3, c5c1, k1, k1 + fix(-0.390180644f));
+        sse_wide o0 = sse_add(sse_madd(r[7], r[1], fix(0.298631336f) + k7c1, k7c1), y0);
+        sse_wide o3 = sse_add(sse_madd(r[7], r[1], k7c1, fix(1.501321110f) + k7c1), y1);
+        sse_wide o1 = sse_add(sse_madd(r[5], r[3], fix(2.053119869f) + k5c3, k5c3), y1);
+        sse_wide o2 = sse_add(sse_madd(r[5], r[3], k5c3, fix(3.072711026f) + k5c3), y0);
+
+        r[0] = sse_round<shift>(sse_add(x0, o3), bias);
+        r[7] = sse_round<shift>(sse_sub(x0, o3), bias);
+        r[1] = sse_round<shift>(sse_add(x1, o2), bias);
+        r[6] = sse_round<shift>(sse_sub(x1, o2), bias);
+        r[2] = sse_round<shift>(sse_add(x2, o1), bias);
+        r[5] = sse_round<shift>(sse_sub(x2, o1), bias);
+        r[3] = sse_round<shift>(sse_add(x3, o0), bias);
+        r[4] = sse_round<shift>(sse_sub(x3, o0), bias);
+      }
+
+      static void sse_transpose(__m128i *r) {
+        __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]), a1 = _mm_unpackhi_epi16(r[0], r[1]);
+        __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]), a3 = _mm_unpackhi_epi16(r[2], r[3]);
+        __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]), a5 = _mm_unpackhi_epi16(r[4], r[5]);
+        __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]), a7 = _mm_unpackhi_epi16(r[6], r[7]);
+        __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+        __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+        __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+        __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+        r[0] = _mm_unpacklo_epi64(b0, b4); r[1] = _mm_unpackhi_epi64(b0, b4);
+        r[2] = _mm_unpacklo_epi64(b1, b5); r[3] = _mm_unpackhi_epi64(b1, b5);
+        r[4] = _mm_unpacklo_epi64(b2, b6); r[5] = _mm_unpackhi_epi64(b2, b6);
+        r[6] = _mm_unpacklo_epi64(b3, b7); r[7] = _mm_unpackhi_epi64(b3, b7);
+      }
+    #endif
+
+    // the value of every pixel of a block with only a (dequantised) DC term.
+    static uint8_t dc_pixel(int dc) {
+      return clamp((saturate16(dc * 4) * 4096 + 65536 + (128 << 17)) >> 17);
+    }
+
+    // a block with only a DC term is flat. This gives the same result as the full IDCT.
+    static void inverse_dct_dc(uint8_t *outptr, int stride, const int16_t *inptr) {
+      uint8_t value = dc_pixel(inptr[0]);
+      for (unsigned i = 0; i != 8; ++i) {
+        memset(outptr + i * stride, value, 8);
+      }
+    }
+
+    static void inverse_dct(uint8_t *outptr, int stride, const int16_t *inptr) {
+      #if OCTET_SSE
+        __m128i r[8];
+        for (unsigned i = 0; i != 8; ++i) {
+          r[i] = _mm_loadu_si128((const __m128i*)(inptr + i * 8));
+        }
+        sse_idct_1d<10>(r, _mm_set1_epi32(512));
+        sse_transpose(r);
+        sse_idct_1d<17>(r, _mm_set1_epi32(65536 + (128 << 17)));
+        sse_transpose(r);
+        for (unsigned i = 0; i != 8; i += 2) {
+          __m128i pixels = _mm_packus_epi16(r[i], r[i+1]);
+          _mm_storel_epi64((__m128i*)(outptr + i * stride), pixels);
+          _mm_storel_epi64((__m128i*)(outptr + (i + 1) * stride), _mm_unpackhi_epi64(pixels, pixels));
+        }
+      #else
+        inverse_dct_scalar(outptr, stride, inptr);
+      #endif
+    }
+
+    // convert from YCbCr to RGBA
+    // See http://en.wikipedia.org/wiki/YCbCr
+    // We use 16 bit fixed point: y is scaled by 16 and the chroma products by 16/65536
+    // so that the scalar and SSE versions give the same result.
+    // The tables hold the chroma terms for each value of Cb and Cr.
+    struct color_tables {
+      int16_t cr_r[256];
+      int16_t cb_g[256];
+      int16_t cr_g[256];
+      int16_t cb_b[256];
+
+      // clamp[v + clamp_offset] is v clamped to 0..255
+      enum { clamp_offset = 384 };
+      uint8_t clamp[1024];
+
+      color_tables() {
+        for (int i = 0; i != 256; ++i) {
+          int c8 = (i - 128) * 128;
+          // (y * 16 + 8 + t) >> 4 is y + ((t + 8) >> 4)
+          cr_r[i] = (int16_t)((((c8 * 11485) >> 16) + 8) >> 4);
+          cb_g[i] = (int16_t)((c8 * 2819) >> 16);
+          cr_g[i] = (int16_t)((c8 * 5850) >> 16);
+          cb_b[i] = (int16_t)((((c8 * 14516) >> 16) + 8) >> 4);
+        }
+        for (int i = 0; i != 1024; ++i) {
+          clamp[i] = jpeg_decoder::clamp(i - clamp_offset);
         }
       }
+    };
+
+    static const color_tables &get_color_tables() {
+      static const color_tables tables;
+      return tables;
     }
 
-    // clamp to 0..255 range without using branches.
-    // fabsf is usually implemented in hardware (with fast math options)
-    OCTET_HOT uint8_t clamp(float v) {
-      // v + fabsf(v) = 2v when v > 0
-      // v + fabsf(v) = 0  when v < 0
-      float clamp0 = v + fabsf(v);
+    static void color_convert_pixel(uint8_t *outptr, int y, int cb, int cr, const color_tables &t) {
+      const uint8_t *clamp = t.clamp + color_tables::clamp_offset;
+      outptr[0] = clamp[y + t.cr_r[cr]];
+      outptr[1] = clamp[y + ((8 - t.cb_g[cb] - t.cr_g[cr]) >> 4)];
+      outptr[2] = clamp[y + t.cb_b[cb]];
+      outptr[3] = 0xff;
+    }
 
-      // v - fabsf(v-n) = n when v > n
-      // v - fabsf(v-n) = 2v - n when v < n
-      return (uint8_t)( ( clamp0 - fabsf( clamp0 - (255.999f * 2) ) ) * 0.25f + 128 );
+    // convert a row of pixels. If hshift is 1, each chroma sample covers two pixels.
+    static void color_convert_row(uint8_t *outptr, const uint8_t *y, const uint8_t *cb, const uint8_t *cr, unsigned count, unsigned hshift) {
+      unsigned i = 0;
+      #if OCTET_SSE
+        __m128i zero = _mm_setzero_si128();
+        __m128i c128 = _mm_set1_epi16(128);
+        __m128i c8 = _mm_set1_epi16(8);
+        __m128i alpha = _mm_set1_epi8((char)0xff);
+        for (; i + 8 <= count; i += 8) {
+          __m128i cb8, cr8;
+          if (hshift) {
+            int cb4, cr4;
+            memcpy(&cb4, cb + i/2, 4);
+            memcpy(&cr4, cr + i/2, 4);
+            cb8 = _mm_cvtsi32_si128(cb4);
+            cr8 = _mm_cvtsi32_si128(cr4);
+            cb8 = _mm_unpacklo_epi8(cb8, cb8);
+            cr8 = _mm_unpacklo_epi8(cr8, cr8);
+          } else {
+            cb8 = _mm_loadl_epi64((const __m128i*)(cb + i));
+            cr8 = _mm_loadl_epi64((const __m128i*)(cr + i));
+          }
+          __m128i y16 = _mm_add_epi16(_mm_slli_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(y + i)), zero), 4), c8);
+          cb8 = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(cb8, zero), c128), 7);
+          cr8 = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(cr8, zero), c128), 7);
+          __m128i r = _mm_add_epi16(y16, _mm_mulhi_epi16(cr8, _mm_set1_epi16(11485)));
+          __m128i g = _mm_sub_epi16(_mm_sub_epi16(y16, _mm_mulhi_epi16(cb8, _mm_set1_epi16(2819))), _mm_mulhi_epi16(cr8, _mm_set1_epi16(5850)));
+          __m128i b = _mm_add_epi16(y16, _mm_mulhi_epi16(cb8, _mm_set1_epi16(14516)));
+          r = _mm_srai_epi16(r, 4);
+          g = _mm_srai_epi16(g, 4);
+          b = _mm_srai_epi16(b, 4);
+          __m128i rg = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), _mm_packus_epi16(g, g));
+          __m128i ba = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), alpha);
+          _mm_storeu_si128((__m128i*)(outptr + i * 4), _mm_unpacklo_epi16(rg, ba));
+          _mm_storeu_si128((__m128i*)(outptr + i * 4 + 16), _mm_unpackhi_epi16(rg, ba));
+        }
+      #endif
+      const color_tables &tables = get_color_tables();
+      for (; i != count; ++i) {
+        color_convert_pixel(outptr + i * 4, y[i], cb[i >> hshift], cr[i >> hshift], tables);
+      }
     }
 
     // convert from Y to RGB
-    // The 0.125 scaling factor is because the DCT data has a scale of 8
-    void color_convert_444_greyscale(uint8_t *outptr, int stride, float *inptr) {
-      for (unsigned j = 0; j != 8; ++j) {
-        for (unsigned i = 0; i != 8; ++i) {
-          float y = inptr[0];
-          inptr++;
-          outptr[0] = clamp(128 + y * 0.125f);
-          outptr[1] = clamp(128 + y * 0.125f);
-          outptr[2] = clamp(128 + y * 0.125f);
-          outptr[3] = 0xff;
-          outptr += 4;
+    static void color_convert_row_greyscale(uint8_t *outptr, const uint8_t *y, unsigned count) {
+      for (unsigned i = 0; i != count; ++i) {
+        outptr[0] = outptr[1] = outptr[2] = y[i];
+        outptr[3] = 0xff;
+        outptr += 4;
+      }
+    }
+
+    // the decoded pixels of each component of one MCU, up to 2x2 blocks each.
+    struct mcu_pixels {
+      uint8_t planes[4][16*16];
+    };
+
+    int get_plane_stride(unsigned comp) const {
+      return components[comp].hsamp * 8;
+    }
+
+    // write an MCU to the image, which is stored bottom row first.
+    // MCUs on the right and bottom edges are clipped.
+    void color_convert_mcu(uint8_t *image_base, unsigned mcu_x, unsigned mcu_y, const mcu_pixels &pixels) const {
+      unsigned x0 = mcu_x * mcu_width;
+      unsigned y0 = mcu_y * mcu_height;
+      unsigned count = width - x0 < mcu_width ? width - x0 : mcu_width;
+      unsigned rows = height - y0 < mcu_height ? height - y0 : mcu_height;
+      size_t stride = width * 4;
+      uint8_t tmp[16*4];
+
+      for (unsigned j = 0; j != rows; ++j) {
+        uint8_t *outptr = image_base + (height - 1 - y0 - j) * stride + x0 * 4;
+        uint8_t *dest = count == mcu_width ? outptr : tmp;
+        const uint8_t *y = pixels.planes[0] + j * get_plane_stride(0);
+        if (num_components == 1) {
+          color_convert_row_greyscale(dest, y, mcu_width);
+        } else {
+          const component &c = components[1];
+          const uint8_t *cb = pixels.planes[1] + (j >> c.vshift) * get_plane_stride(1);
+          const uint8_t *cr = pixels.planes[2] + (j >> c.vshift) * get_plane_stride(2);
+          color_convert_row(dest, y, cb, cr, mcu_width, c.hshift);
+        }
+        if (dest != outptr) {
+          memcpy(outptr, tmp, count * 4);
         }
-        outptr += stride - 32;
       }
     }
 
-    // convert from YCrCb to RGB
-    // See http://en.wikipedia.org/wiki/YCbCr
-    // The 0.125 scaling factor is because the DCT data has a scale of 8
-    void color_convert_444(uint8_t *outptr, int stride, float *inptr) {
-      for (unsigned j = 0; j != 8; ++j) {
-        for (unsigned i = 0; i != 8; ++i) {
-          float y = inptr[0];
-          float cb = inptr[64];
-          float cr = inptr[128];
-          inptr++;
-          outptr[0] = clamp(128 + y * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += 4;
+    // decode MCUs [mcu_begin, mcu_end) from one restart interval.
+    void decode_interval(const uint8_t *src, const uint8_t *src_max, unsigned mcu_begin, unsigned mcu_end, uint8_t *image_base) const {
+      bit_reader in;
+      in.init(src, src_max);
+      int last_dc[4] = { 0, 0, 0, 0 };
+      mcu_pixels pixels;
+      #if OCTET_SSE
+        __m128i aligned_coeffs[8];
+        int16_t *coeffs = (int16_t*)aligned_coeffs;
+      #else
+        int16_t coeffs[64];
+      #endif
+
+      for (unsigned mcu = mcu_begin; mcu != mcu_end; ++mcu) {
+        for (unsigned b = 0; b != num_mcu_blocks; ++b) {
+          const mcu_block &block = mcu_blocks[b];
+          bool has_ac = decode_mcu_block(block, in, last_dc[block.scan_comp], coeffs);
+          int stride = get_plane_stride(block.comp);
+          uint8_t *outptr = pixels.planes[block.comp] + block.y * 8 * stride + block.x * 8;
+          if (has_ac) {
+            inverse_dct(outptr, stride, coeffs);
+          } else {
+            inverse_dct_dc(outptr, stride, coeffs);
+          }
         }
-        outptr += stride - 32;
+        color_convert_mcu(image_base, mcu % mcus_x, mcu / mcus_x, pixels);
       }
     }
 
-    // convert from YCrCb to RGB
-    // See http://en.wikipedia.org/wiki/YCbCr
-    // The 0.125 scaling factor is because the DCT data has a scale of 8
-    void color_convert_411(uint8_t *outptr, int stride, float *inptr) {
-      for (unsigned j = 0; j != 8; ++j) {
-        for (unsigned i = 0; i != 8; ++i) {
-          float y0 = inptr[0x00];
-          float y1 = inptr[0x40];
-          float y2 = inptr[0x80];
-          float y3 = inptr[0xc0];
-          float cb = inptr[0x100];
-          float cr = inptr[0x140];
-          inptr++;
-          outptr[0] = clamp(128 + y0 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y0 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y0 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += 4;
-          outptr[0] = clamp(128 + y1 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y1 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y1 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += stride - 4;
-          outptr[0] = clamp(128 + y2 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y2 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y2 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
+    // decode units [unit_begin, unit_end) of a progressive scan into the coefficient buffers.
+    // A unit is an MCU if the scan has several components and a single block if it has one.
+    void decode_progressive_interval(const uint8_t *src, const uint8_t *src_max, unsigned unit_begin, unsigned unit_end) {
+      bit_reader in;
+      in.init(src, src_max);
+      int last_dc[4] = { 0, 0, 0, 0 };
+      unsigned eob_run = 0;
+
+      for (unsigned unit = unit_begin; unit != unit_end; ++unit) {
+        for (unsigned b = 0; b != num_mcu_blocks; ++b) {
+          const mcu_block &block = mcu_blocks[b];
+          const component &c = components[block.comp];
+          unsigned bx, by;
+          if (num_components_in_scan == 1) {
+            bx = unit % c.blocks_x;
+            by = unit / c.blocks_x;
+          } else {
+            bx = unit % mcus_x * c.hsamp + block.x;
+            by = unit / mcus_x * c.vsamp + block.y;
+          }
+          int16_t *coeffs = coefficients[block.comp].data() + (by * c.block_stride + bx) * 64;
+
+          if (spectral_start == 0) {
+            decode_dc_block(block, in, last_dc[block.scan_comp], coeffs);
+          } else if (successive_high == 0) {
+            decode_ac_first(block, in, eob_run, coeffs);
+          } else {
+            decode_ac_refine(block, in, eob_run, coeffs);
+          }
+        }
+      }
+    }
+
+    // after the last scan of a progressive image, dequantise and transform the blocks
+    // and convert them to RGB. Each row of MCUs is done on a different thread.
+    void finish_progressive(uint8_t *image_base) const {
+      // quantisation tables in natural order for each component.
+      const uint8_t *zz = zig_zag();
+      uint16_t quant[4][64];
+      for (unsigned comp = 0; comp != num_components; ++comp) {
+        const quant_table &q = quant_tables[components[comp].quantisation_table];
+        for (unsigned k = 0; k != 64; ++k) {
+          quant[comp][zz[k]] = q.table[k];
+        }
+      }
+
+      platform::thread_pool::get().parallel_for(0, mcus_y, [&](unsigned mcu_y) {
+        mcu_pixels pixels;
+        #if OCTET_SSE
+          __m128i aligned_coeffs[8];
+          int16_t *coeffs = (int16_t*)aligned_coeffs;
+        #else
+          int16_t coeffs[64];
+        #endif
+
+        for (unsigned mcu_x = 0; mcu_x != mcus_x; ++mcu_x) {
+          for (unsigned comp = 0; comp != num_components; ++comp) {
+            const component &c = components[comp];
+            int stride = get_plane_stride(comp);
+            for (unsigned y = 0; y != c.vsamp; ++y) {
+              for (unsigned x = 0; x != c.hsamp; ++x) {
+                unsigned bx = mcu_x * c.hsamp + x;
+                unsigned by = mcu_y * c.vsamp + y;
+                const int16_t *src = coefficients[comp].data() + (by * c.block_stride + bx) * 64;
+                int ac = 0;
+                coeffs[0] = (int16_t)(src[0] * quant[comp][0]);
+                for (unsigned i = 1; i != 64; ++i) {
+                  ac |= src[i];
+                  coeffs[i] = (int16_t)(src[i] * quant[comp][i]);
+                }
+
+                uint8_t *outptr = pixels.planes[comp] + y * 8 * stride + x * 8;
+                if (ac) {
+                  inverse_dct(outptr, stride, coeffs);
+                } else {
+                  inverse_dct_dc(outptr, stride, coeffs);
+                }
+              }
+            }
+          }
+          color_convert_mcu(image_base, mcu_x, mcu_y, pixels);
+        }
+      });
+    }
+
+    // make an image with one pixel for each 8x8 block from the DC terms of a progressive image.
+    void make_preview(uint8_t *image_base) const {
+      const color_tables &tables = get_color_tables();
+      unsigned preview_width = components[0].blocks_x;
+      unsigned preview_height = components[0].blocks_y;
+      uint8_t value[3] = { 0x80, 0x80, 0x80 };
+
+      for (unsigned y = 0; y != preview_height; ++y) {
+        uint8_t *outptr = image_base + (preview_height - 1 - y) * preview_width * 4;
+        for (unsigned x = 0; x != preview_width; ++x) {
+          for (unsigned comp = 0; comp != num_components; ++comp) {
+            const component &c = components[comp];
+            unsigned bx = x >> c.hshift;
+            unsigned by = y >> c.vshift;
+            int dc = coefficients[comp].data()[(by * c.block_stride + bx) * 64];
+            value[comp] = dc_pixel(dc * quant_tables[c.quantisation_table].table[0]);
+          }
+          if (num_components == 1) {
+            outptr[0] = outptr[1] = outptr[2] = value[0];
+            outptr[3] = 0xff;
+          } else {
+            color_convert_pixel(outptr, value[0], value[1], value[2], tables);
+          }
           outptr += 4;
-          outptr[0] = clamp(128 + y3 * 0.125f + cr * (1.402f * 0.125f));
-          outptr[1] = clamp(128 + y3 * 0.125f - cb * (0.34414f * 0.125f) - cr * (0.71414f * 0.125f));
-          outptr[2] = clamp(128 + y3 * 0.125f + cb * (1.772f * 0.125f));
-          outptr[3] = 0xff;
-          outptr += -stride + 4;
         }
-        outptr += stride*2 - 64;
       }
     }
 
+    // add an RGBA image to the end of the buffer.
+    static uint8_t *add_image(dynarray<uint8_t> &image, uint16_t &format, unsigned image_width, unsigned image_height) {
+      size_t base = image.size();
+      image.resize(base + (size_t)image_width * image_height * 4);
+      format = 0x1908; // GL_RGBA
+      return image.data() + base;
+    }
+
+    // find the start of each restart interval and the marker at the end of the scan.
+    static const uint8_t *find_intervals(const uint8_t *src, const uint8_t *src_max, dynarray<const uint8_t *> &starts) {
+      starts.push_back(src);
+      while (src + 1 < src_max) {
+        const uint8_t *ff = (const uint8_t *)memchr(src, 0xff, src_max - 1 - src);
+        if (!ff) break;
+        uint8_t marker = ff[1];
+        if (marker == 0x00 || marker == 0xff) {
+          // stuffed zero or fill byte
+          src = ff + 1;
+        } else if (marker >= 0xd0 && marker <= 0xd7) {
+          src = ff + 2;
+          starts.push_back(src);
+        } else {
+          return ff;
+        }
+      }
+      return src_max;
+    }
+
+    // decode the image data after a start of scan header.
+    // Baseline images are written to the image, progressive ones to the coefficient buffers.
+    // returns the end of the scan.
+    const uint8_t *decode_scan(const uint8_t *src, const uint8_t *src_max, dynarray<uint8_t> &image, uint16_t &format) {
+      dynarray<const uint8_t *> starts;
+      const uint8_t *scan_end = find_intervals(src, src_max, starts);
+
+      uint8_t *image_base = progressive ? 0 : add_image(image, format, width, height);
+
+      // progressive scans of one component have one block per MCU.
+      const component &c = components[mcu_blocks[0].comp];
+      bool single = progressive && num_components_in_scan == 1;
+      unsigned num_mcus = single ? c.blocks_x * c.blocks_y : mcus_x * mcus_y;
+      unsigned interval = restart_interval ? restart_interval : num_mcus;
+      unsigned num_intervals = (num_mcus + interval - 1) / interval;
+      if (num_intervals > starts.size()) {
+        printf("warning: JPEG has %d restart intervals, expected %d\n", (int)starts.size(), num_intervals);
+        num_intervals = starts.size();
+      }
+
+      // intervals write to different MCUs of the image, so they can be done in parallel.
+      platform::thread_pool::get().parallel_for(0, num_intervals, [&](unsigned i) {
+        const uint8_t *end = i + 1 < starts.size() ? starts[i+1] - 2 : scan_end;
+        unsigned mcu_end = (i + 1) * interval < num_mcus ? (i + 1) * interval : num_mcus;
+        if (progressive) {
+          decode_progressive_interval(starts[i], end, i * interval, mcu_end);
+        } else {
+          decode_interval(starts[i], end, i * interval, mcu_end, image_base);
+        }
+      });
+
+      return scan_end;
+    }
+
     // JPEG files are split up into chunks starting with 0xff
-    unsigned decode_chunk(const uint8_t *src, dynarray<uint8_t> &image, uint16_t &format) {
+    unsigned decode_chunk(const uint8_t *src, const uint8_t *src_max, dynarray<uint8_t> &image, uint16_t &format) {
       if (debug) printf("decode_chunk %02x\n", src[1]);
 
       unsigned length = 2;
+      if (src[1] != 0xd8 && src[1] != 0xd9 && src[1] != 0xff) {
+        if (src + 4 > src_max) return 0;
+        length = u2(src + 2) + 2;
+        if (length > (size_t)(src_max - src)) return 0;
+      }
 
       switch (src[1]) {
         // different kinds of image (SOF0-7)
         case 0xc0: case 0xc1: case 0xc2: case 0xc3: case 0xc5: case 0xc6: case 0xc7: {
           sof_code = src[1];
-          length = u2(src + 2) + 2;
           precision = src[4];
           height = u2(src + 5);
           width = u2(src + 7);
           num_components = src[9];
 
-          if (src[1] != 0xc0) {
-            printf("warning: only baseline JPEG is supported - disable progressive\n");
+          if (src[1] != 0xc0 && src[1] != 0xc1 && src[1] != 0xc2) {
+            printf("warning: only baseline and progressive JPEG are supported\n");
             return 0;
           }
+          progressive = src[1] == 0xc2;
+          dc_components = 0;
 
-          if (precision != 8 || width == 0 || height == 0 || num_components > 4) {
+          if (precision != 8 || width == 0 || height == 0 || num_components > 4 || length < 10 + num_components * 3) {
             printf("warning: precision=%d width=%d height=%d num_components=%d\n", precision, width, height, num_components);
             return 0;
           }
@@ -383,22 +992,65 @@ namespace octet { namespace loaders {
             return 0;
           }
 
+          unsigned max_hsamp = 1;
+          unsigned max_vsamp = 1;
           for (unsigned i = 0; i != num_components; ++i) {
             component &c = components[i];
             c.id = src[10 + i*3 + 0];
             c.hsamp = src[10 + i*3 + 1] >> 4;
             c.vsamp = src[10 + i*3 + 1] & 15;
             c.quantisation_table = src[10 + i*3 + 2] & 3;
+            if (num_components == 1) {
+              // a single component image is always one block per MCU
+              c.hsamp = c.vsamp = 1;
+            }
+            if (c.hsamp < 1 || c.hsamp > 2 || c.vsamp < 1 || c.vsamp > 2) {
+              printf("warning: unsupported JPEG sampling %dx%d\n", c.hsamp, c.vsamp);
+              return 0;
+            }
+            max_hsamp = c.hsamp > max_hsamp ? c.hsamp : max_hsamp;
+            max_vsamp = c.vsamp > max_vsamp ? c.vsamp : max_vsamp;
             if (debug) printf("id=%d h=%d v=%d q=%d\n", c.id, c.hsamp, c.vsamp, c.quantisation_table);
           }
-          
+
+          for (unsigned i = 0; i != num_components; ++i) {
+            component &c = components[i];
+            c.hshift = c.hsamp != max_hsamp;
+            c.vshift = c.vsamp != max_vsamp;
+          }
+
+          // we support Y at full resolution and Cb, Cr at the same resolution as each other.
+          if (components[0].hshift || components[0].vshift || (num_components == 3 && (
+            components[1].hsamp != components[2].hsamp || components[1].vsamp != components[2].vsamp
+          ))) {
+            printf("warning: unsupported JPEG sampling\n");
+            return 0;
+          }
+
+          mcu_width = max_hsamp * 8;
+          mcu_height = max_vsamp * 8;
+          mcus_x = (width + mcu_width - 1) / mcu_width;
+          mcus_y = (height + mcu_height - 1) / mcu_height;
+
+          for (unsigned i = 0; i != num_components; ++i) {
+            component &c = components[i];
+            unsigned comp_width = (width * c.hsamp + max_hsamp - 1) / max_hsamp;
+            unsigned comp_height = (height * c.vsamp + max_vsamp - 1) / max_vsamp;
+            c.blocks_x = (uint16_t)((comp_width + 7) / 8);
+            c.blocks_y = (uint16_t)((comp_height + 7) / 8);
+            c.block_stride = (uint16_t)(mcus_x * c.hsamp);
+            if (progressive) {
+              size_t size = (size_t)c.block_stride * mcus_y * c.vsamp * 64;
+              coefficients[i].resize(size);
+              memset(coefficients[i].data(), 0, size * sizeof(int16_t));
+            }
+          }
         } break;
 
         // huffman tables
         case 0xc4: {
-          length = u2(src + 2) + 2;
-          src += 4;
           const uint8_t *src_max = src + length;
+          src += 4;
           while (src + 17 <= src_max) {
             unsigned index = src[0];
             unsigned is_ac = (index >> 4) & 1;
@@ -411,30 +1063,8 @@ namespace octet { namespace loaders {
             }
             src += 17;
             if (src + count > src_max || count > 256) return 0;
-            memcpy(h.huffval, src, count);
+            if (!h.build(num_codes, src, count)) return 0;
             src += count;
-
-            unsigned dest = 0;
-            unsigned code = 0;
-            h.min_len = 0;
-            bool done_min_len = false;
-            for (unsigned len = 1; len < 17; ++len) {
-              h.offset[len-1] = code - dest;
-              if (!done_min_len && num_codes[len-1]) {
-                h.min_len = len - 1;
-                done_min_len = true;
-              }
-              for (unsigned i = 0; i != num_codes[len-1]; ++i) {
-                if (debug) printf("code=%04x len=%d\n", ( ( code + i ) << (16 - len) ), len );
-              }
-              dest += num_codes[len-1];
-              code = code + num_codes[len-1];
-              h.maxcodes[len-1] = ( code << (16 - len) ) - 1;
-              code *= 2;
-              if (debug) printf("h.maxcodes[%d] = %04x\n", len-1, h.maxcodes[len-1]);
-            }
-            h.maxcodes[16] = 0xffff;
-            
             if (debug) printf("DHT %d\n", index);
           }
         } break;
@@ -442,6 +1072,7 @@ namespace octet { namespace loaders {
         // start
         case 0xd8: {
           if (debug) printf("SOI\n");
+          restart_interval = 0;
         } break;
 
         // end
@@ -449,21 +1080,33 @@ namespace octet { namespace loaders {
           if (debug) printf("EOI\n");
         } break;
 
+        // restart interval
+        case 0xdd: {
+          restart_interval = u2(src + 4);
+          if (debug) printf("DRI %d\n", restart_interval);
+        } break;
+
         // image data
         case 0xda: {
           const uint8_t *src0 = src;
-          length = u2(src + 2) + 2;
+          if (!width) return 0;
           src += 4;
           num_components_in_scan = *src++;
-          unsigned max_hsamp = 1;
-          unsigned max_vsamp = 1;
           num_mcu_blocks = 0;
-          const uint8_t *src_max = src + length;
+          if (length < 8 + num_components_in_scan * 2) return 0;
+          bool scan_ok = progressive ?
+            num_components_in_scan != 0 && num_components_in_scan <= num_components :
+            num_components_in_scan == num_components
+          ;
+          if (!scan_ok) {
+            printf("warning: only interleaved baseline JPEG is supported\n");
+            return 0;
+          }
           for (unsigned i = 0; i != num_components_in_scan; ++i) {
             scan_component &sc = scan_components[i];
             unsigned id = *src++;
-            sc.ac_table = *src & 0x0f;
-            sc.dc_table = *src++ >> 4;
+            sc.ac_table = *src & 0x03;
+            sc.dc_table = (*src++ >> 4) & 0x03;
             unsigned comp = 0;
             while (comp < num_components) {
               if (components[comp].id == id) break;
@@ -471,102 +1114,69 @@ namespace octet { namespace loaders {
             }
             if (comp >= num_components) return 0;
             component &c = components[comp];
-            max_hsamp = c.hsamp > max_hsamp ? c.hsamp : max_hsamp;
-            max_vsamp = c.vsamp > max_vsamp ? c.vsamp : max_vsamp;
             sc.comp = comp;
             if (debug) printf("SOS comp=%d ac=%d dc=%d\n", comp, sc.ac_table, sc.dc_table);
-            unsigned samps = c.hsamp * c.vsamp;
 
-            if (num_mcu_blocks + samps > sizeof(mcu_blocks)/sizeof(mcu_blocks[0])) {
+            if (num_mcu_blocks + c.hsamp * c.vsamp > max_mcu_blocks) {
               printf("too many mcu blocks\n");
               return 0;
             }
 
-            for (unsigned j = 0; j != samps; ++j) {
-              mcu_block &m = mcu_blocks[num_mcu_blocks++];
-              m.dc_table = &huffman_tables[0][sc.dc_table];
-              m.ac_table = &huffman_tables[1][sc.ac_table];
-              m.quant = &quant_tables[c.quantisation_table];
-              m.scan_comp = &sc;
+            // a scan of one component has one block per MCU
+            unsigned vsamp = num_components_in_scan == 1 ? 1 : c.vsamp;
+            unsigned hsamp = num_components_in_scan == 1 ? 1 : c.hsamp;
+            for (unsigned y = 0; y != vsamp; ++y) {
+              for (unsigned x = 0; x != hsamp; ++x) {
+                mcu_block &m = mcu_blocks[num_mcu_blocks++];
+                m.dc_table = &huffman_tables[0][sc.dc_table];
+                m.ac_table = &huffman_tables[1][sc.ac_table];
+                m.quant = &quant_tables[c.quantisation_table];
+                m.scan_comp = i;
+                m.comp = comp;
+                m.x = x;
+                m.y = y;
+              }
             }
-
-            sc.last_dc = 0;
-          }
-
-          // at present, we only support YCrCb in 4:4:4
-          if (num_mcu_blocks != 1 && num_mcu_blocks != 3 && num_mcu_blocks != 6) {
-            printf("only 4:4:4 and 4:1:1 greyscale and ycrcb supported (%d mcu blocks)\n", num_mcu_blocks);
-            return 0;
           }
 
           spectral_start = *src++;
           spectral_end = *src++;
           successive_high = src[0] >> 4;
           successive_low = *src++ & 0x0f;
-          if (src > src_max) return 0;
 
-          for (unsigned i = 0; i != num_components_in_scan; ++i) {
-            scan_component &sc = scan_components[i];
-            component &c = components[sc.comp];
-            sc.width_in_blocks = width * c.hsamp / max_hsamp;
-            sc.height_in_blocks = height * c.hsamp / max_hsamp;
+          if (progressive) {
+            // DC and AC terms are in separate scans and only DC scans can have several components.
+            if (
+              spectral_start > spectral_end || spectral_end > 63 || successive_low > 13 ||
+              (spectral_start == 0 ? spectral_end != 0 : num_components_in_scan != 1)
+            ) {
+              printf("warning: bad progressive JPEG scan\n");
+              return 0;
+            }
+            if (debug) printf("Ss=%d Se=%d Ah=%d Al=%d\n", spectral_start, spectral_end, successive_high, successive_low);
           }
 
-          width = (width + max_hsamp * 8 - 1) & ~(max_hsamp * 8 - 1);
-          height = (height + max_vsamp * 8 - 1) & ~(max_vsamp * 8 - 1);
-
-          unsigned xmax = ( width + max_hsamp * 8 - 1 ) / (max_hsamp * 8);
-          unsigned ymax = ( height + max_vsamp * 8 - 1 ) / (max_vsamp * 8);
-
-          unsigned acc = 0;
-          int shift = 0;
-          skip_bits(16, acc, src, shift);
-          
-          int stride = width * 4;
-
-          unsigned size = width * height * 4;
-          size_t base = image.size();
-          image.resize(base + size);
-          format = 0x1908; // GL_RGBA
-
-          uint8_t *image_base = image.data() + base;
-
-          for (unsigned y = 0; y != ymax; ++y) {
-            for (unsigned x = 0; x != xmax; ++x) {
-              float *coeffs = dct_coeffs;
-              memset(coeffs, 0, 64 * num_mcu_blocks * sizeof(float));
-              for (unsigned b = 0; b < num_mcu_blocks; ++b) {
-                decode_mcu_block(b, acc, src, shift, coeffs);
-                inverse_dct(coeffs);
-                coeffs += 64;
-              }
-              if (num_mcu_blocks == 1) {
-                // assume 4:4:4 Greyscale
-                color_convert_444_greyscale(&image_base[((height - 1 - y * 8) * stride) + (x * 8 * 4)], -stride, dct_coeffs);
-              } else if (num_mcu_blocks == 3) {
-                // assume 4:4:4 YCbCr
-                color_convert_444(&image_base[((height - 1 - y * 8) * stride) + (x * 8 * 4)], -stride, dct_coeffs);
-              } else if (num_mcu_blocks == 6) {
-                // assume 4:1:1 YCbCr
-                color_convert_411(&image_base[((height - 1 - y * 16) * stride) + (x * 16 * 4)], -stride, dct_coeffs);
-              }
+          const uint8_t *scan_end = decode_scan(src, src_max, image, format);
+          length = (unsigned)(scan_end - src0);
+
+          if (progressive && spectral_start == 0 && successive_high == 0) {
+            for (unsigned i = 0; i != num_components_in_scan; ++i) {
+              dc_components |= 1 << scan_components[i].comp;
             }
           }
-          skip_bits(shift, acc, src, shift);
-          length = (unsigned)(src - src0);
         } break;
 
         // quantisation tables (the lossy bit)
         case 0xdb: {
-          length = u2(src + 2) + 2;
           const uint8_t *src_max = src + length;
           src += 4;
           while (src < src_max) {
             unsigned prec = (src[0] >> 4) & 1;
             unsigned n = src[0] & 0x0f;
             src++;
+            if (src + 64 * (prec + 1) > src_max) return 0;
             for (unsigned i = 0; i != 64; ++i) {
-              quant_tables[n&3].table[i] = (float)( prec ? u2(src) : *src );
+              quant_tables[n&3].table[i] = (uint16_t)( prec ? u2(src) : *src );
               src += prec + 1;
             }
             if (debug) printf("DQT %d %d\n", prec, n);
@@ -575,37 +1185,84 @@ namespace octet { namespace loaders {
 
         // JFIF stubset of JPEG
         case 0xe0: {
-          length = u2(src + 2) + 2;
           if (debug) printf("M_APP0 (JFIF)\n");
         } break;
 
+        // fill byte before a marker
+        case 0xff: {
+          length = 1;
+        } break;
+
         // unknown chunk
         default: {
-          if (src[2] != 0xff) length = u2(src + 2) + 2;
           if (debug) printf("unknown\n");
         } break;
       }
       return length;
     }
-  public:
-    // get an opengl texture from a file in memory
-    void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width_, uint16_t &height_, const uint8_t *src, const uint8_t *src_max) {
-      while (src < src_max) {
+    // decode the chunks of a file up to the end of the image.
+    // if preview is set, stop after the first scans of a progressive image when all the DC terms are known.
+    bool decode_chunks(dynarray<uint8_t> &image, uint16_t &format, const uint8_t *src, const uint8_t *src_max, bool preview) {
+      while (src + 1 < src_max) {
         if (src[0] != 0xff) {
           printf("warning: bad JPEG file\n");
-          return;
+          return false;
         }
-        unsigned length = decode_chunk(src, image, format);
+        if (preview && src[1] == 0xda && !progressive) {
+          return false;
+        }
+        unsigned length = decode_chunk(src, src_max, image, format);
         if (!length) {
+          // a progressive file that stops part of the way through still has an image.
+          bool truncated = src + 4 > src_max || u2(src + 2) + 2u > (size_t)(src_max - src);
+          if (progressive && width && truncated) break;
           printf("warning: bad JPEG file @ chunk %02x\n", src[1]);
-          return;
+          return false;
         }
+        if (src[1] == 0xd9) break;
+        if (preview && width && dc_components == (1u << num_components) - 1) break;
         src += length;
       }
+      return !preview || (progressive && width);
+    }
+
+  public:
+    jpeg_decoder() {
+      width = height = 0;
+      restart_interval = 0;
+      progressive = false;
+      dc_components = 0;
+      memset(huffman_tables, 0, sizeof(huffman_tables));
+      memset(quant_tables, 0, sizeof(quant_tables));
+    }
+
+    // get an opengl texture from a file in memory
+    // The image is RGBA with the bottom row first.
+    void get_image(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width_, uint16_t &height_, const uint8_t *src, const uint8_t *src_max) {
+      if (!decode_chunks(image, format, src, src_max, false)) {
+        return;
+      }
+
+      // a progressive file may be truncated, so we use the scans that we have.
+      if (progressive && width) {
+        finish_progressive(add_image(image, format, width, height));
+      }
       width_ = width;
       height_ = height;
       num_components = 3;
     }
+
+    /// Get a low resolution image from the start of a progressive file, 1/8 of the size.
+    /// This only needs the first scans, so it can be shown while the rest of the file loads or decodes.
+    /// Returns false if the file is baseline or does not have all the DC terms.
+    bool get_preview(dynarray<uint8_t> &image, uint16_t &format, uint16_t &width_, uint16_t &height_, const uint8_t *src, const uint8_t *src_max) {
+      if (!decode_chunks(image, format, src, src_max, true) || dc_components != (1u << num_components) - 1) {
+        return false;
+      }
+      make_preview(add_image(image, format, components[0].blocks_x, components[0].blocks_y));
+      width_ = components[0].blocks_x;
+      height_ = components[0].blocks_y;
+      return true;
+    }
   };
 }}
-
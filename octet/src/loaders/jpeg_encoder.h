@@ -8,72 +8,826 @@
 // jpeg file encoder - tiny and fast
 //
 // See http://en.wikipedia.org/wiki/JPEG
-// 
+//
 namespace octet { namespace loaders {
+  /// Baseline JPEG encoder for screenshots, thumbnails and baked textures.
+  ///
+  /// Blocks are transformed with an integer forward DCT (SSE2 when OCTET_SSE is set)
+  /// and the Huffman tables are made for each image from the symbol counts.
+  /// Each row of MCUs is a restart interval, so rows are encoded on different threads
+  /// and jpeg_decoder can decode them in parallel too.
+  ///
+  /// Example
+  ///
+  ///     dynarray<uint8_t> jpeg;
+  ///     jpeg_encoder encoder(85);
+  ///     encoder.encode(jpeg, width, height, width * 4, pixels);
+  ///
   class jpeg_encoder {
-  public:
-    jpeg_encoder() {
+    enum {
+      debug = 0,
+
+      // rows of MCUs per restart interval, which must be no more than 65535 MCUs.
+      rows_per_interval = 1,
+    };
+
+    unsigned quality;
+    bool subsample;
+
+    unsigned width;
+    unsigned height;
+    unsigned mcu_width;
+    unsigned mcu_height;
+    unsigned mcus_x;
+    unsigned mcus_y;
+
+    // blocks in an MCU: four Y, Cb and Cr for 4:2:0 and one each for 4:4:4
+    unsigned num_mcu_blocks;
+
+    // 0 for Y and 1 for Cb and Cr
+    uint8_t block_table[6];
+
+    // quantisation tables in zig-zag order as written to the file
+    uint8_t quant[2][64];
+
+    // (1 << 20) / divisor for each coefficient in zig-zag order.
+    // The divisor includes the factor of eight from the DCT.
+    uint32_t reciprocal[2][64];
+
+    // quantised coefficients of every block in zig-zag order.
+    dynarray<int16_t> coefficients;
+
+    // symbol counts for the dc and ac tables of Y and CbCr.
+    struct symbol_counts {
+      uint32_t dc[2][256];
+      uint32_t ac[2][256];
+    };
+
+    // huffman codes for each symbol
+    struct huffman_code {
+      uint16_t code[256];
+      uint8_t size[256];
+    };
+
+    // a huffman table as stored in the file: the number of codes of each length and the symbols.
+    struct huffman_table {
+      uint8_t bits[17];
+      uint8_t values[256];
+      unsigned num_values;
+    };
+
+    huffman_table dc_tables[2];
+    huffman_table ac_tables[2];
+    huffman_code dc_codes[2];
+    huffman_code ac_codes[2];
+
+    // dct coefficients are stored in zig-zag order because the top
+    // left is far more common.
+    static const uint8_t *zig_zag() {
+      static const uint8_t zig_zag_[64] = {
+        0, 1, 8, 16, 9, 2, 3, 10,
+        17, 24, 32, 25, 18, 11, 4, 5,
+        12, 19, 26, 33, 40, 48, 41, 34,
+        27, 20, 13, 6, 7, 14, 21, 28,
+        35, 42, 49, 56, 57, 50, 43, 36,
+        29, 22, 15, 23, 30, 37, 44, 51,
+        58, 59, 52, 45, 38, 31, 39, 46,
+        53, 60, 61, 54, 47, 55, 62, 63,
+      };
+      return zig_zag_;
     }
 
-    bool encode(dynarray<uint8_t> data, uint32_t width, uint32_t height, int stride, const uint8_t *src) {
-      /*if ((height & 7) != 0 || (width & 7) != 0) {
-        return false;
+    // the example tables from the JPEG standard (Annex K) in natural order.
+    static const uint8_t *base_quant(unsigned table) {
+      static const uint8_t base_quant_[2][64] = {
+        {
+          16, 11, 10, 16, 24, 40, 51, 61,
+          12, 12, 14, 19, 26, 58, 60, 55,
+          14, 13, 16, 24, 40, 57, 69, 56,
+          14, 17, 22, 29, 51, 87, 80, 62,
+          18, 22, 37, 56, 68, 109, 103, 77,
+          24, 35, 55, 64, 81, 104, 113, 92,
+          49, 64, 78, 87, 103, 121, 120, 101,
+          72, 92, 95, 98, 112, 100, 103, 99,
+        }, {
+          17, 18, 24, 47, 99, 99, 99, 99,
+          18, 21, 26, 66, 99, 99, 99, 99,
+          24, 26, 56, 99, 99, 99, 99, 99,
+          47, 66, 99, 99, 99, 99, 99, 99,
+          99, 99, 99, 99, 99, 99, 99, 99,
+          99, 99, 99, 99, 99, 99, 99, 99,
+          99, 99, 99, 99, 99, 99, 99, 99,
+          99, 99, 99, 99, 99, 99, 99, 99,
+        }
+      };
+      return base_quant_[table];
+    }
+
+    // scale the example tables as libjpeg does: quality 50 is the table itself.
+    void make_quant_tables() {
+      unsigned q = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+      unsigned scale = q < 50 ? 5000 / q : 200 - q * 2;
+      const uint8_t *zz = zig_zag();
+      for (unsigned t = 0; t != 2; ++t) {
+        for (unsigned k = 0; k != 64; ++k) {
+          unsigned value = (base_quant(t)[zz[k]] * scale + 50) / 100;
+          value = value < 1 ? 1 : value > 255 ? 255 : value;
+          quant[t][k] = (uint8_t)value;
+          reciprocal[t][k] = ((1 << 20) + value * 4) / (value * 8);
+        }
+      }
+    }
+
+    // number of bits needed for a value up to 2047, the "size" category of JPEG.
+    struct bit_size_table {
+      uint8_t sizes[2048];
+
+      bit_size_table() {
+        sizes[0] = 0;
+        for (unsigned i = 1; i != 2048; ++i) {
+          sizes[i] = sizes[i >> 1] + 1;
+        }
+      }
+    };
+
+    static unsigned bit_size(unsigned value) {
+      static const bit_size_table table;
+      return table.sizes[value];
+    }
+
+    // fixed point constants for the DCT, 13 bits of fraction.
+    static int fix(float x) {
+      return (int)(x * 8192 + 0.5f);
+    }
+
+    // one dimensional forward DCT (Loeffler, Ligtenberg and Moschytz as in the IJG jfdctint.c).
+    // d0..d7 are the samples and the results are scaled by 8192.
+    // out[0] is the DC term and out[1]..out[7] increase in frequency.
+    static OCTET_HOT void fdct_1d(int *out, int d0, int d1, int d2, int d3, int d4, int d5, int d6, int d7) {
+      int tmp0 = d0 + d7, tmp7 = d0 - d7;
+      int tmp1 = d1 + d6, tmp6 = d1 - d6;
+      int tmp2 = d2 + d5, tmp5 = d2 - d5;
+      int tmp3 = d3 + d4, tmp4 = d3 - d4;
+
+      int tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+      int tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+
+      out[0] = (tmp10 + tmp11) * 8192;
+      out[4] = (tmp10 - tmp11) * 8192;
+      int z1 = (tmp12 + tmp13) * fix(0.541196100f);
+      out[2] = z1 + tmp13 * fix(0.765366865f);
+      out[6] = z1 + tmp12 * fix(-1.847759065f);
+
+      int z5 = (tmp4 + tmp5 + tmp6 + tmp7) * fix(1.175875602f);
+      int z1o = (tmp4 + tmp7) * fix(-0.899976223f);
+      int z2o = (tmp5 + tmp6) * fix(-2.562915447f);
+      int z3o = (tmp4 + tmp6) * fix(-1.961570560f) + z5;
+      int z4o = (tmp5 + tmp7) * fix(-0.390180644f) + z5;
+
+      out[7] = tmp4 * fix(0.298631336f) + z1o + z3o;
+      out[5] = tmp5 * fix(2.053119869f) + z2o + z4o;
+      out[3] = tmp6 * fix(3.072711026f) + z2o + z3o;
+      out[1] = tmp7 * fix(1.501321110f) + z1o + z4o;
+    }
+
+    // Two dimensional forward DCT of samples in -128..127.
+    // The columns are done first with two extra bits of precision, then the rows.
+    // The result is in natural order and is eight times the size of the usual DCT.
+    static void forward_dct_scalar(int16_t *coeffs, const int16_t *samples) {
+      int tmp[64];
+      int out[8];
+      for (unsigned i = 0; i != 8; ++i) {
+        const int16_t *s = samples + i;
+        fdct_1d(out, s[0], s[8], s[16], s[24], s[32], s[40], s[48], s[56]);
+        for (unsigned j = 0; j != 8; ++j) {
+          tmp[j * 8 + i] = (out[j] + (1 << 10)) >> 11;
+        }
+      }
+
+      for (unsigned i = 0; i != 8; ++i) {
+        const int *t = tmp + i * 8;
+        fdct_1d(out, t[0], t[1], t[2], t[3], t[4], t[5], t[6], t[7]);
+        for (unsigned j = 0; j != 8; ++j) {
+          coeffs[i * 8 + j] = (int16_t)((out[j] + (1 << 14)) >> 15);
+        }
+      }
+    }
+
+    #if OCTET_SSE
+      // eight 32 bit values as two registers
+      struct sse_wide {
+        __m128i lo, hi;
+      };
+
+      // x * c0 + y * c1 for each of the eight 16 bit lanes of x and y.
+      static sse_wide sse_madd(__m128i x, __m128i y, int c0, int c1) {
+        __m128i c = _mm_set1_epi32((c1 << 16) | (c0 & 0xffff));
+        sse_wide r = { _mm_madd_epi16(_mm_unpacklo_epi16(x, y), c), _mm_madd_epi16(_mm_unpackhi_epi16(x, y), c) };
+        return r;
+      }
+
+      static sse_wide sse_add(sse_wide a, sse_wide b) {
+        sse_wide r = { _mm_add_epi32(a.lo, b.lo), _mm_add_epi32(a.hi, b.hi) };
+        return r;
+      }
+
+      template <int shift> static __m128i sse_round(sse_wide a) {
+        __m128i bias = _mm_set1_epi32(1 << (shift - 1));
+        return _mm_packs_epi32(
+          _mm_srai_epi32(_mm_add_epi32(a.lo, bias), shift),
+          _mm_srai_epi32(_mm_add_epi32(a.hi, bias), shift)
+        );
+      }
+
+      // fdct_1d on eight columns at once, the same arithmetic with the products paired for madd.
+      template <int shift> static void sse_fdct_1d(__m128i *r) {
+        __m128i tmp0 = _mm_add_epi16(r[0], r[7]), tmp7 = _mm_sub_epi16(r[0], r[7]);
+        __m128i tmp1 = _mm_add_epi16(r[1], r[6]), tmp6 = _mm_sub_epi16(r[1], r[6]);
+        __m128i tmp2 = _mm_add_epi16(r[2], r[5]), tmp5 = _mm_sub_epi16(r[2], r[5]);
+        __m128i tmp3 = _mm_add_epi16(r[3], r[4]), tmp4 = _mm_sub_epi16(r[3], r[4]);
+
+        __m128i tmp10 = _mm_add_epi16(tmp0, tmp3), tmp13 = _mm_sub_epi16(tmp0, tmp3);
+        __m128i tmp11 = _mm_add_epi16(tmp1, tmp2), tmp12 = _mm_sub_epi16(tmp1, tmp2);
+
+        int k0 = fix(0.541196100f);
+        r[0] = sse_round<shift>(sse_madd(tmp10, tmp11, 8192, 8192));
+        r[4] = sse_round<shift>(sse_madd(tmp10, tmp11, 8192, -8192));
+        r[2] = sse_round<shift>(sse_madd(tmp13, tmp12, k0 + fix(0.765366865f), k0));
+        r[6] = sse_round<shift>(sse_madd(tmp13, tmp12, k0, k0 + fix(-1.847759065f)));
+
+        int k1 = fix(1.175875602f);
+        int k14 = fix(-0.899976223f);
+        int k23 = fix(-2.562915447f);
+        __m128i z3 = _mm_add_epi16(tmp4, tmp6);
+        __m128i z4 = _mm_add_epi16(tmp5, tmp7);
+        sse_wide z3o = sse_madd(z3, z4, k1 + fix(-1.961570560f), k1);
+        sse_wide z4o = sse_madd(z3, z4, k1, k1 + fix(-0.390180644f));
+        r[7] = sse_round<shift>(sse_add(sse_madd(tmp4, tmp7, fix(0.298631336f) + k14, k14), z3o));
+        r[1] = sse_round<shift>(sse_add(sse_madd(tmp4, tmp7, k14, fix(1.501321110f) + k14), z4o));
+        r[5] = sse_round<shift>(sse_add(sse_madd(tmp5, tmp6, fix(2.053119869f) + k23, k23), z4o));
+        r[3] = sse_round<shift>(sse_add(sse_madd(tmp5, tmp6, k23, fix(3.072711026f) + k23), z3o));
+      }
+
+      static void sse_transpose(__m128i *r) {
+        __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]), a1 = _mm_unpackhi_epi16(r[0], r[1]);
+        __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]), a3 = _mm_unpackhi_epi16(r[2], r[3]);
+        __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]), a5 = _mm_unpackhi_epi16(r[4], r[5]);
+        __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]), a7 = _mm_unpackhi_epi16(r[6], r[7]);
+        __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+        __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+        __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+        __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+        r[0] = _mm_unpacklo_epi64(b0, b4); r[1] = _mm_unpackhi_epi64(b0, b4);
+        r[2] = _mm_unpacklo_epi64(b1, b5); r[3] = _mm_unpackhi_epi64(b1, b5);
+        r[4] = _mm_unpacklo_epi64(b2, b6); r[5] = _mm_unpackhi_epi64(b2, b6);
+        r[6] = _mm_unpacklo_epi64(b3, b7); r[7] = _mm_unpackhi_epi64(b3, b7);
+      }
+    #endif
+
+    static void forward_dct(int16_t *coeffs, const int16_t *samples) {
+      #if OCTET_SSE
+        __m128i r[8];
+        for (unsigned i = 0; i != 8; ++i) {
+          r[i] = _mm_loadu_si128((const __m128i*)(samples + i * 8));
+        }
+        sse_fdct_1d<11>(r);
+        sse_transpose(r);
+        sse_fdct_1d<15>(r);
+        sse_transpose(r);
+        for (unsigned i = 0; i != 8; ++i) {
+          _mm_storeu_si128((__m128i*)(coeffs + i * 8), r[i]);
+        }
+      #else
+        forward_dct_scalar(coeffs, samples);
+      #endif
+    }
+
+    // divide by the quantisation table with rounding and store in zig-zag order.
+    void quantise(int16_t *dest, const int16_t *coeffs, unsigned table) const {
+      const uint8_t *zz = zig_zag();
+      const uint32_t *recip = reciprocal[table];
+      for (unsigned k = 0; k != 64; ++k) {
+        int c = coeffs[zz[k]];
+        unsigned a = (unsigned)(c < 0 ? -c : c);
+        int q = (int)((a * recip[k] + (1 << 19)) >> 20);
+        // baseline JPEG has up to 11 bits for DC differences and 10 for the rest.
+        q = q > 1023 ? 1023 : q;
+        dest[k] = (int16_t)(c < 0 ? -q : q);
+      }
+    }
+
+    // convert an MCU of RGBA pixels to Y, Cb and Cr blocks in -128..127 and transform them.
+    // Pixels off the right and bottom edges repeat the last row and column.
+    void forward_mcu(int16_t *dest, const uint8_t *src, int stride, unsigned mcu_x, unsigned mcu_y) const {
+      uint8_t rgba[16*16*4];
+      int16_t samples[6][64];
+      #if OCTET_SSE
+        __m128i aligned_coeffs[8];
+        int16_t *coeffs = (int16_t*)aligned_coeffs;
+      #else
+        int16_t coeffs[64];
+      #endif
+
+      unsigned x0 = mcu_x * mcu_width;
+      unsigned y0 = mcu_y * mcu_height;
+      for (unsigned j = 0; j != mcu_height; ++j) {
+        unsigned y = y0 + j < height ? y0 + j : height - 1;
+        const uint8_t *row = src + (ptrdiff_t)(height - 1 - y) * stride;
+        uint8_t *out = rgba + j * mcu_width * 4;
+        if (x0 + mcu_width <= width) {
+          memcpy(out, row + x0 * 4, mcu_width * 4);
+        } else {
+          for (unsigned i = 0; i != mcu_width; ++i) {
+            unsigned x = x0 + i < width ? x0 + i : width - 1;
+            memcpy(out + i * 4, row + x * 4, 4);
+          }
+        }
+      }
+
+      // See http://en.wikipedia.org/wiki/YCbCr
+      // Y in 16 bit fixed point, one 8x8 block at a time.
+      unsigned num_y_blocks = subsample ? 4 : 1;
+      for (unsigned b = 0; b != num_y_blocks; ++b) {
+        int16_t *dest = samples[b];
+        for (unsigned j = 0; j != 8; ++j) {
+          const uint8_t *p = rgba + (((b >> 1) * 8 + j) * mcu_width + (b & 1) * 8) * 4;
+          for (unsigned i = 0; i != 8; ++i, p += 4) {
+            *dest++ = (int16_t)(((19595 * p[0] + 38470 * p[1] + 7471 * p[2] + 32768) >> 16) - 128);
+          }
+        }
+      }
+
+      // Cb and Cr from the sum of 2x2 pixels if subsampled.
+      int16_t *cb = samples[num_y_blocks];
+      int16_t *cr = samples[num_y_blocks + 1];
+      if (subsample) {
+        for (unsigned j = 0; j != 8; ++j) {
+          const uint8_t *p = rgba + j * 2 * 16 * 4;
+          for (unsigned i = 0; i != 8; ++i, p += 8) {
+            int r = p[0] + p[4] + p[64] + p[68];
+            int g = p[1] + p[5] + p[65] + p[69];
+            int b = p[2] + p[6] + p[66] + p[70];
+            *cb++ = (int16_t)((-11056 * r - 21712 * g + 32768 * b + (1 << 17)) >> 18);
+            *cr++ = (int16_t)((32768 * r - 27440 * g - 5328 * b + (1 << 17)) >> 18);
+          }
+        }
+      } else {
+        const uint8_t *p = rgba;
+        for (unsigned i = 0; i != 64; ++i, p += 4) {
+          *cb++ = (int16_t)((-11056 * p[0] - 21712 * p[1] + 32768 * p[2] + (1 << 15)) >> 16);
+          *cr++ = (int16_t)((32768 * p[0] - 27440 * p[1] - 5328 * p[2] + (1 << 15)) >> 16);
+        }
+      }
+
+      for (unsigned b = 0; b != num_mcu_blocks; ++b) {
+        forward_dct(coeffs, samples[b]);
+        quantise(dest + b * 64, coeffs, block_table[b]);
+      }
+    }
+
+    // counts symbols for the huffman tables.
+    struct symbol_counter {
+      symbol_counts &counts;
+
+      symbol_counter(symbol_counts &counts_) : counts(counts_) {
+      }
+
+      void put_dc(unsigned table, unsigned symbol) {
+        counts.dc[table][symbol]++;
+      }
+
+      void put_ac(unsigned table, unsigned symbol) {
+        counts.ac[table][symbol]++;
+      }
+
+      void reserve_block() {
+      }
+
+      void put_bits(unsigned value, unsigned size) {
+      }
+    };
+
+    // writes codes to a buffer, most significant bit first with 0xff bytes followed by a zero.
+    struct bit_writer {
+      const jpeg_encoder &encoder;
+      dynarray<uint8_t> &bytes;
+      size_t pos;
+      uint64_t bits;
+      unsigned num_bits;
+
+      bit_writer(const jpeg_encoder &encoder_, dynarray<uint8_t> &bytes_) : encoder(encoder_), bytes(bytes_) {
+        pos = 0;
+        bits = 0;
+        num_bits = 0;
+      }
+
+      // a block is at most 64 codes of 27 bits, which may double in size with stuffed zeros.
+      void reserve_block() {
+        if (pos + 512 > bytes.size()) {
+          bytes.resize(bytes.size() * 2 + 1024);
+        }
+      }
+
+      void put_bits(unsigned value, unsigned size) {
+        bits = (bits << size) | (value & ((1u << size) - 1));
+        num_bits += size;
+        if (num_bits >= 32) {
+          uint8_t *dest = bytes.data();
+          do {
+            num_bits -= 8;
+            uint8_t byte = (uint8_t)(bits >> num_bits);
+            dest[pos++] = byte;
+            if (byte == 0xff) dest[pos++] = 0;
+          } while (num_bits >= 8);
+        }
+      }
+
+      void put_dc(unsigned table, unsigned symbol) {
+        const huffman_code &h = encoder.dc_codes[table];
+        put_bits(h.code[symbol], h.size[symbol]);
+      }
+
+      void put_ac(unsigned table, unsigned symbol) {
+        const huffman_code &h = encoder.ac_codes[table];
+        put_bits(h.code[symbol], h.size[symbol]);
+      }
+
+      // pad the last byte with ones and write the remaining bytes.
+      void flush() {
+        reserve_block();
+        unsigned pad = (8 - num_bits % 8) % 8;
+        bits = (bits << pad) | ((1u << pad) - 1);
+        num_bits += pad;
+        uint8_t *dest = bytes.data();
+        while (num_bits) {
+          num_bits -= 8;
+          uint8_t byte = (uint8_t)(bits >> num_bits);
+          dest[pos++] = byte;
+          if (byte == 0xff) dest[pos++] = 0;
+        }
+        bytes.resize(pos);
+      }
+    };
+
+    // code one block of quantised coefficients in zig-zag order.
+    // This is used both to count symbols and to write the codes.
+    template <class sink_t> static void encode_block(sink_t &sink, const int16_t *zz, int &last_dc, unsigned table) {
+      int diff = zz[0] - last_dc;
+      last_dc = zz[0];
+      unsigned size = bit_size((unsigned)(diff < 0 ? -diff : diff));
+      sink.put_dc(table, size);
+      if (size) {
+        sink.put_bits((unsigned)(diff < 0 ? diff - 1 : diff), size);
       }
 
-      // guess
-      data.reserve(width * height / 2);
+      unsigned run = 0;
+      for (unsigned k = 1; k != 64; ++k) {
+        int value = zz[k];
+        if (!value) {
+          run++;
+          continue;
+        }
+        for (; run > 15; run -= 16) {
+          sink.put_ac(table, 0xf0);
+        }
+        unsigned size = bit_size((unsigned)(value < 0 ? -value : value));
+        sink.put_ac(table, run << 4 | size);
+        sink.put_bits((unsigned)(value < 0 ? value - 1 : value), size);
+        run = 0;
+      }
+      if (run) {
+        // end of block
+        sink.put_ac(table, 0x00);
+      }
+    }
+
+    // code the MCUs of a restart interval.
+    template <class sink_t> void encode_interval(sink_t &sink, unsigned mcu_begin, unsigned mcu_end) const {
+      int last_dc[2][2] = { { 0, 0 }, { 0, 0 } };
+      for (unsigned mcu = mcu_begin; mcu != mcu_end; ++mcu) {
+        const int16_t *blocks = coefficients.data() + (size_t)mcu * num_mcu_blocks * 64;
+        for (unsigned b = 0; b != num_mcu_blocks; ++b) {
+          sink.reserve_block();
+          // Y, Cb and Cr each have a DC predictor; Cr is the last block.
+          unsigned table = block_table[b];
+          int &dc = table == 0 ? last_dc[0][0] : b + 1 == num_mcu_blocks ? last_dc[1][1] : last_dc[1][0];
+          encode_block(sink, blocks + b * 64, dc, table);
+        }
+      }
+    }
+
+    // make an optimal table of code lengths up to 16 bits for the symbol counts (ITU T.81 K.2)
+    // as in the IJG jpeg_gen_optimal_table.
+    static void make_optimal_table(huffman_table &table, const uint32_t *counts) {
+      // symbol 256 is reserved so that no code is all ones.
+      uint32_t freq[257];
+      int code_size[257];
+      int others[257];
+      for (unsigned i = 0; i != 257; ++i) {
+        freq[i] = i == 256 ? 1 : counts[i];
+        code_size[i] = 0;
+        others[i] = -1;
+      }
+
+      // join the two least frequent trees until there is only one.
+      for (;;) {
+        int c1 = -1, c2 = -1;
+        uint32_t v1 = ~0u, v2 = ~0u;
+        for (int i = 0; i != 257; ++i) {
+          if (freq[i] && freq[i] <= v1) {
+            v1 = freq[i];
+            c1 = i;
+          }
+        }
+        for (int i = 0; i != 257; ++i) {
+          if (freq[i] && freq[i] <= v2 && i != c1) {
+            v2 = freq[i];
+            c2 = i;
+          }
+        }
+        if (c2 < 0) break;
+
+        freq[c1] += freq[c2];
+        freq[c2] = 0;
 
-      static const uint8_t hdr[] = {
+        code_size[c1]++;
+        while (others[c1] >= 0) {
+          c1 = others[c1];
+          code_size[c1]++;
+        }
+        others[c1] = c2;
+        code_size[c2]++;
+        while (others[c2] >= 0) {
+          c2 = others[c2];
+          code_size[c2]++;
+        }
+      }
+
+      unsigned bits[258];
+      memset(bits, 0, sizeof(bits));
+      for (unsigned i = 0; i != 257; ++i) {
+        bits[code_size[i]]++;
+      }
+
+      // move codes longer than 16 bits up the tree.
+      for (unsigned i = 257; i > 16; --i) {
+        while (bits[i] > 0) {
+          unsigned j = i - 2;
+          while (bits[j] == 0) j--;
+          bits[i] -= 2;
+          bits[i-1]++;
+          bits[j+1] += 2;
+          bits[j]--;
+        }
+      }
+
+      // remove the reserved symbol from the longest codes.
+      unsigned longest = 16;
+      while (longest && bits[longest] == 0) longest--;
+      if (longest) bits[longest]--;
+
+      table.bits[0] = 0;
+      for (unsigned i = 1; i <= 16; ++i) {
+        table.bits[i] = (uint8_t)bits[i];
+      }
+
+      // symbols in order of length.
+      table.num_values = 0;
+      for (int len = 1; len <= 256; ++len) {
+        for (unsigned i = 0; i != 256; ++i) {
+          if (code_size[i] == len) {
+            table.values[table.num_values++] = (uint8_t)i;
+          }
+        }
+      }
+    }
+
+    // canonical codes from the lengths.
+    static void make_codes(huffman_code &codes, const huffman_table &table) {
+      memset(&codes, 0, sizeof(codes));
+      unsigned code = 0;
+      unsigned k = 0;
+      for (unsigned len = 1; len <= 16; ++len) {
+        for (unsigned i = 0; i != table.bits[len]; ++i, ++k) {
+          codes.code[table.values[k]] = (uint16_t)code++;
+          codes.size[table.values[k]] = (uint8_t)len;
+        }
+        code *= 2;
+      }
+    }
+
+    static void put_u2(dynarray<uint8_t> &data, unsigned value) {
+      data.push_back((uint8_t)(value >> 8));
+      data.push_back((uint8_t)value);
+    }
+
+    static void put_marker(dynarray<uint8_t> &data, unsigned marker, unsigned length) {
+      data.push_back(0xff);
+      data.push_back((uint8_t)marker);
+      put_u2(data, length);
+    }
+
+    static void put_huffman_table(dynarray<uint8_t> &data, unsigned index, const huffman_table &table) {
+      put_marker(data, 0xc4, 2 + 17 + table.num_values);
+      data.push_back((uint8_t)index);
+      for (unsigned i = 1; i <= 16; ++i) {
+        data.push_back(table.bits[i]);
+      }
+      for (unsigned i = 0; i != table.num_values; ++i) {
+        data.push_back(table.values[i]);
+      }
+    }
+
+    // everything up to the entropy coded data.
+    void write_header(dynarray<uint8_t> &data, unsigned restart_interval) const {
+      static const uint8_t jfif[] = {
         0xff, 0xd8, // SOI
         0xff, 0xe0, 0x00, 0x10, // APP0
-          'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x01, 0x00, 0x48, 0x00, 0x48, 0x00, 0x00,
-
-        0xff, 0xdb, 0x00, 0x43, // DQT
-          0x00,
-          0x03, 0x02, 0x02, 0x03, 0x02, 0x02, 0x03, 0x03,
-          0x03, 0x03, 0x04, 0x03, 0x03, 0x04, 0x05, 0x08,
-          0x05, 0x05, 0x04, 0x04, 0x05, 0x0a, 0x07, 0x07,
-          0x06, 0x08, 0x0c, 0x0a, 0x0c, 0x0c, 0x0b, 0x0a,
-          0x0b, 0x0b, 0x0d, 0x0e, 0x12, 0x10, 0x0d, 0x0e,
-          0x11, 0x0e, 0x0b, 0x0b, 0x10, 0x16, 0x10, 0x11,
-          0x13, 0x14, 0x15, 0x15, 0x15, 0x0c, 0x0f, 0x17,
-          0x18, 0x16, 0x14, 0x18, 0x12, 0x14, 0x15, 0x14,
-        0xff, 0xdb, 0x00, 0x43, // DQT
-          0x01,
-          0x03, 0x04, 0x04, 0x05, 0x04, 0x05, 0x09, 0x05,
-          0x05, 0x09, 0x14, 0x0d, 0x0b, 0x0d, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-          0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14, 0x14,
-        0xff, 0xc0, 0x00, 0x11, // SOF0
-          0x08, 0x02, 0x00, 0x02, 0x00, 0x03, 0x01, 0x11, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01,
-        0xff, 0xc4, 0x00, 0x1e, // DHT
-          0x00, 0x01, 0x00, 0x03, 0x00, 0x02, 0x03, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-          0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x06, 0x05, 0x07, 0x09, 0x08, 0x0a,
-        0xff, 0xc4, 0x00, 0x55, // DHT
-          0x10, 0x00, 0x02, 0x00, 0x03, 0x04, 0x05, 0x08, 0x06, 0x06, 0x04, 0x0b, 0x05, 0x07, 0x05, 0x00,
-          0x00, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x61, 0x07,
-          0x14, 0x53, 0x71, 0x81, 0x92, 0xb1, 0xf0, 0x08, 0x13, 0x34, 0x72, 0x91, 0xa1, 0x09, 0x22, 0x32,
-          0x42, 0xc1, 0xd1, 0x23, 0x52, 0xe1, 0xf1, 0x15, 0x16, 0x17, 0x36, 0x43, 0x62, 0x73, 0x82, 0x94,
-          0xb2, 0xd2, 0x24, 0x55, 0x63, 0xa3, 0xc2, 0x18, 0x33, 0x35, 0x64, 0x74, 0x93, 0xa2, 0x25, 0x44,
-          0x45, 0x54, 0x83,
-        0xff, 0xc4, 0x00, 0x1d, // DHT
-          0x01, 0x01, 0x01, 0x01, 0x00, 0x02, 0x03, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-          0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
-        0xff, 0xc4, 0x00, 0x43, // DHT
-          0x11, 0x01, 0x00, 0x01, 0x02, 0x03, 0x05, 0x02, 0x0b, 0x06, 0x04, 0x05, 0x04, 0x03, 0x01, 0x00,
-          0x00, 0x00, 0x01, 0x02, 0x11, 0x03, 0x04, 0x31, 0x05, 0x12, 0x21, 0x32, 0x51, 0x06, 0x41, 0x07,
-          0x13, 0x14, 0x22, 0x61, 0x71, 0x81, 0x91, 0xa1, 0xb1, 0xd1, 0x15, 0x34, 0x42, 0x53, 0x72, 0xf0,
-          0x52, 0x62, 0xc1, 0xe1, 0x23, 0x82, 0x92, 0xa2, 0xc2, 0x24, 0x43, 0xb2, 0xd2, 0x33, 0x63, 0x73,
-          0x93,
-        0xff, 0xda, 0x00, 0x0c, // SOS
-          0x03, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x3f, 0x00, 0xfd, 0x7f, 
-      };*/
-      return 0;
+          'J', 'F', 'I', 'F', 0x00, 0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00,
+      };
+      for (unsigned i = 0; i != sizeof(jfif); ++i) {
+        data.push_back(jfif[i]);
+      }
+
+      for (unsigned t = 0; t != 2; ++t) {
+        put_marker(data, 0xdb, 2 + 65);
+        data.push_back((uint8_t)t);
+        for (unsigned k = 0; k != 64; ++k) {
+          data.push_back(quant[t][k]);
+        }
+      }
+
+      // SOF0: Y is 2x2 for 4:2:0
+      put_marker(data, 0xc0, 2 + 6 + 3 * 3);
+      data.push_back(8);
+      put_u2(data, height);
+      put_u2(data, width);
+      data.push_back(3);
+      for (unsigned c = 0; c != 3; ++c) {
+        data.push_back((uint8_t)(c + 1));
+        data.push_back(c == 0 && subsample ? 0x22 : 0x11);
+        data.push_back(c == 0 ? 0 : 1);
+      }
+
+      for (unsigned t = 0; t != 2; ++t) {
+        put_huffman_table(data, 0x00 + t, dc_tables[t]);
+        put_huffman_table(data, 0x10 + t, ac_tables[t]);
+      }
+
+      put_marker(data, 0xdd, 4);
+      put_u2(data, restart_interval);
+
+      // SOS: one interleaved scan of all the coefficients
+      put_marker(data, 0xda, 2 + 1 + 3 * 2 + 3);
+      data.push_back(3);
+      for (unsigned c = 0; c != 3; ++c) {
+        data.push_back((uint8_t)(c + 1));
+        data.push_back(c == 0 ? 0x00 : 0x11);
+      }
+      data.push_back(0);
+      data.push_back(63);
+      data.push_back(0);
+    }
+
+  public:
+    /// Make an encoder. Quality is 1..100 as in most tools.
+    /// If subsample is true, colour is stored at half resolution (4:2:0), which is smaller.
+    jpeg_encoder(unsigned quality_ = 90, bool subsample_ = true) {
+      quality = quality_;
+      subsample = subsample_;
+      width = height = 0;
+    }
+
+    /// Encode an RGBA image and add the JPEG file to the end of data.
+    /// The rows are bottom first as for glReadPixels and jpeg_decoder, stride is the number of bytes from one row to the next.
+    /// Alpha is ignored.
+    bool encode(dynarray<uint8_t> &data, uint32_t width_, uint32_t height_, int stride, const uint8_t *src) {
+      if (width_ == 0 || height_ == 0 || width_ > 0xffff || height_ > 0xffff || !src) {
+        return false;
+      }
+
+      width = width_;
+      height = height_;
+      mcu_width = mcu_height = subsample ? 16 : 8;
+      mcus_x = (width + mcu_width - 1) / mcu_width;
+      mcus_y = (height + mcu_height - 1) / mcu_height;
+      num_mcu_blocks = subsample ? 6 : 3;
+      for (unsigned b = 0; b != num_mcu_blocks; ++b) {
+        block_table[b] = b + 2 < num_mcu_blocks ? 0 : 1;
+      }
+      make_quant_tables();
+
+      unsigned interval_rows = rows_per_interval;
+      unsigned restart_interval = mcus_x * interval_rows;
+      unsigned num_intervals = (mcus_y + interval_rows - 1) / interval_rows;
+      unsigned num_mcus = mcus_x * mcus_y;
+
+      // transform and count the symbols of each interval.
+      coefficients.resize((size_t)num_mcus * num_mcu_blocks * 64);
+      dynarray<symbol_counts> counts(num_intervals);
+      platform::thread_pool::get().parallel_for(0, num_intervals, [&](unsigned i) {
+        unsigned mcu_begin = i * restart_interval;
+        unsigned mcu_end = mcu_begin + restart_interval < num_mcus ? mcu_begin + restart_interval : num_mcus;
+        for (unsigned mcu = mcu_begin; mcu != mcu_end; ++mcu) {
+          int16_t *dest = coefficients.data() + (size_t)mcu * num_mcu_blocks * 64;
+          forward_mcu(dest, src, stride, mcu % mcus_x, mcu / mcus_x);
+        }
+
+        memset(&counts[i], 0, sizeof(symbol_counts));
+        symbol_counter counter(counts[i]);
+        encode_interval(counter, mcu_begin, mcu_end);
+      });
+
+      symbol_counts total;
+      memset(&total, 0, sizeof(total));
+      for (unsigned i = 0; i != num_intervals; ++i) {
+        for (unsigned t = 0; t != 2; ++t) {
+          for (unsigned s = 0; s != 256; ++s) {
+            total.dc[t][s] += counts[i].dc[t][s];
+            total.ac[t][s] += counts[i].ac[t][s];
+          }
+        }
+      }
+
+      for (unsigned t = 0; t != 2; ++t) {
+        make_optimal_table(dc_tables[t], total.dc[t]);
+        make_optimal_table(ac_tables[t], total.ac[t]);
+        make_codes(dc_codes[t], dc_tables[t]);
+        make_codes(ac_codes[t], ac_tables[t]);
+      }
+
+      // write the codes for each interval.
+      dynarray<dynarray<uint8_t> > intervals(num_intervals);
+      platform::thread_pool::get().parallel_for(0, num_intervals, [&](unsigned i) {
+        unsigned mcu_begin = i * restart_interval;
+        unsigned mcu_end = mcu_begin + restart_interval < num_mcus ? mcu_begin + restart_interval : num_mcus;
+        bit_writer writer(*this, intervals[i]);
+        encode_interval(writer, mcu_begin, mcu_end);
+        writer.flush();
+      });
+
+      write_header(data, restart_interval);
+      size_t total_size = data.size() + 2;
+      for (unsigned i = 0; i != num_intervals; ++i) {
+        total_size += intervals[i].size() + 2;
+      }
+      data.reserve((unsigned)total_size);
+      for (unsigned i = 0; i != num_intervals; ++i) {
+        size_t pos = data.size();
+        data.resize(pos + intervals[i].size());
+        memcpy(data.data() + pos, intervals[i].data(), intervals[i].size());
+        if (i + 1 != num_intervals) {
+          data.push_back(0xff);
+          data.push_back((uint8_t)(0xd0 + (i & 7)));
+        }
+      }
+      data.push_back(0xff);
+      data.push_back(0xd9);
+
+      if (debug) printf("jpeg_encoder: %dx%d q=%d %d bytes\n", width, height, quality, (int)data.size());
+      coefficients.reset();
+      return true;
     }
   };
-}}
 
+  #if OCTET_UNIT_TEST
+    class jpeg_encoder_unit_test {
+    public:
+      jpeg_encoder_unit_test() {
+        // a smooth image with an odd size survives a round trip through the decoder.
+        unsigned width = 61, height = 37;
+        dynarray<uint8_t> pixels(width * height * 4);
+        for (unsigned y = 0; y != height; ++y) {
+          for (unsigned x = 0; x != width; ++x) {
+            uint8_t *p = pixels.data() + (y * width + x) * 4;
+            p[0] = (uint8_t)(x * 4);
+            p[1] = (uint8_t)(y * 6);
+            p[2] = (uint8_t)(128 + x - y);
+            p[3] = 0xff;
+          }
+        }
+
+        for (unsigned subsample = 0; subsample != 2; ++subsample) {
+          dynarray<uint8_t> jpeg;
+          jpeg_encoder encoder(95, subsample != 0);
+          bool encoded = encoder.encode(jpeg, width, height, width * 4, pixels.data());
+          assert(encoded);
+
+          dynarray<uint8_t> image;
+          uint16_t format = 0, image_width = 0, image_height = 0;
+          jpeg_decoder decoder;
+          decoder.get_image(image, format, image_width, image_height, jpeg.data(), jpeg.data() + jpeg.size());
+          assert(image_width == width && image_height == height);
+
+          int max_error = 0;
+          for (unsigned i = 0; i != image.size(); ++i) {
+            int error = image[i] - pixels[i];
+            max_error = error > max_error ? error : -error > max_error ? -error : max_error;
+          }
+          assert(max_error < 16);
+        }
+      }
+    };
+    static jpeg_encoder_unit_test jpeg_encoder_unit_test;
+  #endif
+}}
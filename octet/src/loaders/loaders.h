@@ -33,6 +33,8 @@
   #include "../loaders/jpeg_encoder.h"
   #include "../loaders/tga_decoder.h"
   #include "../loaders/dds_decoder.h"
+  #include "../loaders/dxt_encoder.h"
   #include "../loaders/nifti_decoder.h"
+  #include "../loaders/xml_pull_parser.h"
 
 #endif
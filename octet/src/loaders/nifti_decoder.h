@@ -7,7 +7,10 @@
 //
 namespace octet { namespace loaders {
   /// NIFTI NMR data decoder. ie. 3d textures.
-  /// This loader only handles very simple NIFTI files.
+  /// This loader handles single file (.nii) little-endian volumes with one value per voxel, and RGB and RGBA volumes.
+  ///
+  /// get_image() gives the first frame as an 8 bit texture. For large or 4D volumes, use get_layout() and
+  /// convert() on a mapped file; nifti_volume does this a brick at a time.
   class nifti_decoder {
     unsigned vox_offset;
     unsigned layer_stride;
@@ -67,40 +70,230 @@ namespace octet { namespace loaders {
       char    magic[4] ;      /// MUST be "ni1\0" or "n+1\0".
     };
 
+    static uint8_t to_byte(float v) {
+      // NaN goes to zero. Round to nearest even like the SSE conversion.
+      return v >= 255.0f ? 255 : v > 0.0f ? (uint8_t)lrintf(v) : 0;
+    }
+
   public:
-    /// get data for a texture in memory.
-    void get_image(dynarray<uint8_t> &bytes, uint16_t &format, uint16_t &width, uint16_t &height, uint16_t &depth, uint32_t &frames, const uint8_t *src, const uint8_t *src_max) {
-      // convert the data
-      nifti_header header = *(nifti_header*)src;
-    
-      width = 0;
-      height = 0;
-      format = 0;
+    /// NIFTI datatype codes.
+    enum datatype_type {
+      dt_uint8 = 2,
+      dt_int16 = 4,
+      dt_int32 = 8,
+      dt_float32 = 16,
+      dt_rgb24 = 128,
+      dt_int8 = 256,
+      dt_uint16 = 512,
+      dt_rgba32 = 2304,
+    };
+
+    /// Size and data of a volume.
+    struct layout {
+      unsigned width;
+      unsigned height;
+      unsigned depth;
+      unsigned frames;
+      unsigned datatype;
+      unsigned bytes_per_voxel;
+      size_t vox_offset;  /// of the first voxel from the start of the file
+      float slope;        /// real value = stored value * slope + inter
+      float inter;
+      float cal_min;      /// display range of real values; empty if cal_max <= cal_min
+      float cal_max;
+    };
+
+    /// Read the header of a .nii file. Returns false if we cannot use it or the file is too short.
+    static bool get_layout(layout &result, const uint8_t *src, const uint8_t *src_max) {
+      if (src_max - src < (ptrdiff_t)sizeof(nifti_header)) return false;
+      nifti_header header;
+      memcpy(&header, src, sizeof(header));
 
-      if (header.dim[0] != 4) {
+      if (header.sizeof_hdr != 348) {
+        log("warning: NIFTI file is big-endian or damaged\n");
+        return false;
+      }
+
+      if (memcmp(header.magic, "n+1", 4)) {
+        log("warning: NIFTI header and data must be in one .nii file\n");
+        return false;
+      }
+
+      if (header.dim[0] < 3 || header.dim[0] > 7 || header.dim[1] <= 0 || header.dim[2] <= 0 || header.dim[3] <= 0) {
         log("warning: NIFTI image type not supported (dim[0] = %d)\n", header.dim[0]);
-        return;
+        return false;
       }
 
-      width = header.dim[1];
-      height = header.dim[2];
-      depth = header.dim[3];
-      frames = 1; //header.dim[4];
-      vox_offset = (int)header.vox_offset;
-      layer_stride = width * height * header.bitpix / 8;
-      frame_stride = layer_stride * depth;
-      unsigned size = frame_stride * frames;
+      unsigned bytes_per_voxel = 0;
+      switch (header.datatype) {
+        case dt_uint8: case dt_int8: bytes_per_voxel = 1; break;
+        case dt_int16: case dt_uint16: bytes_per_voxel = 2; break;
+        case dt_rgb24: bytes_per_voxel = 3; break;
+        case dt_int32: case dt_float32: case dt_rgba32: bytes_per_voxel = 4; break;
+        default:
+          log("warning: NIFTI datatype %d not supported\n", header.datatype);
+          return false;
+      }
 
-      if ((int)header.vox_offset + (int)size > src_max - src) {
+      result.width = header.dim[1];
+      result.height = header.dim[2];
+      result.depth = header.dim[3];
+      result.frames = header.dim[0] >= 4 && header.dim[4] > 1 ? header.dim[4] : 1;
+      result.datatype = header.datatype;
+      result.bytes_per_voxel = bytes_per_voxel;
+      // vox_offset is a float, and converting one that is too big or infinite to size_t is undefined.
+      size_t file_size = (size_t)(src_max - src);
+      if (header.vox_offset >= 348 && !(header.vox_offset <= (float)file_size)) {
+        log("warning: NIFTI voxel offset is past the end of the file\n");
+        return false;
+      }
+      result.vox_offset = header.vox_offset >= 348 ? (size_t)header.vox_offset : 352;
+      result.slope = header.scl_slope != 0 && header.scl_slope == header.scl_slope ? header.scl_slope : 1.0f;
+      result.inter = header.scl_slope != 0 && header.scl_inter == header.scl_inter ? header.scl_inter : 0.0f;
+      result.cal_min = header.cal_min;
+      result.cal_max = header.cal_max;
+
+      uint64_t size = (uint64_t)result.width * result.height * result.depth * result.frames * bytes_per_voxel;
+      if (result.vox_offset > file_size || size > (uint64_t)(file_size - result.vox_offset)) {
         log("warning: NIFTI image too small\n");
+        return false;
+      }
+      return true;
+    }
+
+    /// Convert count single channel voxels of a datatype to bytes: clamp(value * scale + offset, 0, 255).
+    /// Fold the file's slope and inter and the display window into scale and offset.
+    /// 8 and 16 bit integers and floats are done eight at a time with OCTET_SSE.
+    static void convert(uint8_t *dest, const uint8_t *src, size_t count, unsigned datatype, float scale, float offset) {
+      size_t i = 0;
+      #if OCTET_SSE
+        if (datatype == dt_uint8 || datatype == dt_int16 || datatype == dt_uint16 || datatype == dt_float32) {
+          __m128 s = _mm_set1_ps(scale), o = _mm_set1_ps(offset);
+          __m128i zero = _mm_setzero_si128();
+          for (; i + 8 <= count; i += 8) {
+            __m128i lo, hi;
+            __m128 flo, fhi;
+            if (datatype == dt_float32) {
+              flo = _mm_loadu_ps((const float*)(src + i * 4));
+              fhi = _mm_loadu_ps((const float*)(src + i * 4 + 16));
+            } else {
+              if (datatype == dt_uint8) {
+                __m128i x = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src + i)), zero);
+                lo = _mm_unpacklo_epi16(x, zero);
+                hi = _mm_unpackhi_epi16(x, zero);
+              } else if (datatype == dt_uint16) {
+                __m128i x = _mm_loadu_si128((const __m128i*)(src + i * 2));
+                lo = _mm_unpacklo_epi16(x, zero);
+                hi = _mm_unpackhi_epi16(x, zero);
+              } else {
+                // sign extend
+                __m128i x = _mm_loadu_si128((const __m128i*)(src + i * 2));
+                lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+                hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+              }
+              flo = _mm_cvtepi32_ps(lo);
+              fhi = _mm_cvtepi32_ps(hi);
+            }
+            flo = _mm_add_ps(_mm_mul_ps(flo, s), o);
+            fhi = _mm_add_ps(_mm_mul_ps(fhi, s), o);
+            // clamp in floats so that the integer packs cannot wrap; max_ps turns NaN into zero.
+            flo = _mm_min_ps(_mm_max_ps(flo, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+            fhi = _mm_min_ps(_mm_max_ps(fhi, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+            __m128i words = _mm_packs_epi32(_mm_cvtps_epi32(flo), _mm_cvtps_epi32(fhi));
+            _mm_storel_epi64((__m128i*)(dest + i), _mm_packus_epi16(words, words));
+          }
+        }
+      #endif
+
+      for (; i != count; ++i) {
+        float v;
+        switch (datatype) {
+          case dt_uint8: v = (float)src[i]; break;
+          case dt_int8: v = (float)(int8_t)src[i]; break;
+          case dt_int16: { int16_t x; memcpy(&x, src + i * 2, 2); v = (float)x; } break;
+          case dt_uint16: { uint16_t x; memcpy(&x, src + i * 2, 2); v = (float)x; } break;
+          case dt_int32: { int32_t x; memcpy(&x, src + i * 4, 4); v = (float)x; } break;
+          case dt_float32: memcpy(&v, src + i * 4, 4); break;
+          default: v = 0; break;
+        }
+        dest[i] = to_byte(v * scale + offset);
+      }
+    }
+
+    /// Get the display range of real values for a volume: cal_min and cal_max if the file has them,
+    /// otherwise the range of the first frame.
+    static void get_window(float &lo, float &hi, const layout &info, const uint8_t *file) {
+      if (info.cal_max > info.cal_min) {
+        lo = info.cal_min;
+        hi = info.cal_max;
         return;
       }
 
-      format = header.bitpix == 24 ? 0x1907 : 0x1908; // GL_RGB / GL_RGBA
+      const uint8_t *src = file + info.vox_offset;
+      size_t count = (size_t)info.width * info.height * info.depth;
+      float vmin = 0, vmax = 0;
+      for (size_t i = 0; i != count; ++i) {
+        float v;
+        switch (info.datatype) {
+          case dt_uint8: v = (float)src[i]; break;
+          case dt_int8: v = (float)(int8_t)src[i]; break;
+          case dt_int16: { int16_t x; memcpy(&x, src + i * 2, 2); v = (float)x; } break;
+          case dt_uint16: { uint16_t x; memcpy(&x, src + i * 2, 2); v = (float)x; } break;
+          case dt_int32: { int32_t x; memcpy(&x, src + i * 4, 4); v = (float)x; } break;
+          case dt_float32: memcpy(&v, src + i * 4, 4); if (v != v) continue; break;
+          default: v = 0; break;
+        }
+        if (i == 0 || v < vmin) vmin = v;
+        if (i == 0 || v > vmax) vmax = v;
+      }
+      lo = vmin * info.slope + info.inter;
+      hi = vmax * info.slope + info.inter;
+      if (lo > hi) {
+        float t = lo; lo = hi; hi = t;
+      }
+    }
+
+    /// Scale and offset for convert() that map the real values lo..hi to 0..255.
+    static void get_conversion(float &scale, float &offset, const layout &info, float lo, float hi) {
+      float range = hi > lo ? hi - lo : 1.0f;
+      scale = info.slope * 255.0f / range;
+      offset = (info.inter - lo) * 255.0f / range;
+    }
+
+    /// get data for a texture in memory.
+    /// One value per voxel becomes an 8 bit LUMINANCE texture scaled to the display range.
+    void get_image(dynarray<uint8_t> &bytes, uint16_t &format, uint16_t &width, uint16_t &height, uint16_t &depth, uint32_t &frames, const uint8_t *src, const uint8_t *src_max) {
+      width = 0;
+      height = 0;
+      format = 0;
+
+      layout info;
+      if (!get_layout(info, src, src_max)) {
+        return;
+      }
+
+      width = (uint16_t)info.width;
+      height = (uint16_t)info.height;
+      depth = (uint16_t)info.depth;
+      frames = info.frames;
+      vox_offset = (unsigned)info.vox_offset;
+      layer_stride = info.width * info.height * info.bytes_per_voxel;
+      frame_stride = layer_stride * info.depth;
 
       // get one frame (of 3D data)
-      bytes.resize(frame_stride);
-      memcpy(&bytes[0], src + vox_offset, frame_stride);
+      size_t voxels = (size_t)info.width * info.height * info.depth;
+      if (info.datatype == dt_rgb24 || info.datatype == dt_rgba32) {
+        format = info.datatype == dt_rgb24 ? 0x1907 : 0x1908; // GL_RGB / GL_RGBA
+        bytes.resize(frame_stride);
+        memcpy(&bytes[0], src + vox_offset, frame_stride);
+      } else {
+        float lo, hi, scale, offset;
+        get_window(lo, hi, info, src);
+        get_conversion(scale, offset, info, lo, hi);
+        format = 0x1909; // GL_LUMINANCE
+        bytes.resize((unsigned)voxels);
+        convert(&bytes[0], src + vox_offset, voxels, info.datatype, scale, offset);
+      }
     }
 
     /// get the offset of a specific layer in a specific frame.
@@ -108,4 +301,28 @@ namespace octet { namespace loaders {
       return vox_offset + layer * layer_stride + frame * frame_stride;
     }
   };
+
+  #if OCTET_UNIT_TEST
+    class nifti_decoder_unit_test {
+    public:
+      nifti_decoder_unit_test() {
+        // the SSE loop and the scalar tail must agree, so use an odd count.
+        static const int16_t values[11] = { -1000, -1, 0, 1, 100, 127, 128, 254, 255, 256, 32767 };
+        uint8_t result[11];
+        nifti_decoder::convert(result, (const uint8_t*)values, 11, nifti_decoder::dt_int16, 1.0f, 0.0f);
+        static const uint8_t expected[11] = { 0, 0, 0, 1, 100, 127, 128, 254, 255, 255, 255 };
+        for (unsigned i = 0; i != 11; ++i) {
+          assert(result[i] == expected[i]);
+        }
+
+        static const float floats[9] = { 0.0f, 0.25f, 0.5f, 1.0f, 2.0f, -1.0f, 0.75f, 0.125f, 1e30f };
+        nifti_decoder::convert(result, (const uint8_t*)floats, 9, nifti_decoder::dt_float32, 255.0f, 0.0f);
+        static const uint8_t expected_f[9] = { 0, 64, 128, 255, 255, 0, 191, 32, 255 };
+        for (unsigned i = 0; i != 9; ++i) {
+          assert(result[i] == expected_f[i]);
+        }
+      }
+    };
+    static nifti_decoder_unit_test nifti_decoder_unit_test;
+  #endif
 }}
@@ -8,245 +8,767 @@
 //
 namespace octet { namespace loaders {
   /// Class for loading OBJ files.
+  ///
+  /// The file is mapped into memory, split into chunks at line ends and the chunks are
+  /// parsed on the thread pool. Corners with the same position, uv and normal are welded
+  /// into one vertex buffer that is shared by all the meshes.
+  /// There is one mesh for each object ("o") and material ("usemtl") used together.
+  /// Materials come from the "mtllib" files or from the dictionary if they are already there.
+  ///
+  /// Example
+  ///
+  ///     obj_loader loader;
+  ///     loader.load("assets/bunny.obj", dict, app_scene);
+  ///
   class obj_loader {
+    enum {
+      chunk_size = 1 << 22,
+      bucket_bits = 8,
+      num_buckets = 1 << bucket_bits,
+      block_size = 1 << 16,
+      none = 0x7fffffff,
+    };
+
+    // a name in the file
+    struct name_ref {
+      const uint8_t *str;
+      unsigned len;
+    };
+
+    // a change of object or material starting at a triangle
+    struct state_change {
+      uint32_t tri;
+      uint32_t is_material;
+      name_ref name;
+    };
+
+    // a run of triangles that go in the same mesh
+    struct run {
+      uint32_t tri;
+      uint32_t num_tris;
+      uint32_t group;
+      uint32_t offset;
+    };
+
+    // a piece of the file that is parsed on its own.
+    struct chunk {
+      const uint8_t *begin;
+      const uint8_t *end;
+
+      dynarray<vec3p> positions;
+      dynarray<vec3p> normals;
+      dynarray<vec2p> uvs;
+
+      // position, uv and normal index for each triangle corner
+      dynarray<int32_t> corners;
+
+      // corner indices that count back from the vertices before them.
+      // these need the number of vertices in earlier chunks adding.
+      dynarray<uint32_t> relative;
+
+      dynarray<state_change> changes;
+      dynarray<name_ref> libraries;
+      dynarray<run> runs;
+
+      unsigned pos_base;
+      unsigned uv_base;
+      unsigned normal_base;
+      unsigned tri_base;
+      bool error;
+
+      // scratch for a face
+      dynarray<int32_t> face;
+      dynarray<uint8_t> face_relative;
+    };
+
+    // a mesh made from an object and material pair
+    struct group {
+      uint32_t object;
+      uint32_t material;
+      uint32_t num_tris;
+      uint32_t offset;
+    };
+
+    // return the end of the line starting at src, or end.
+    static const uint8_t *find_line_end(const uint8_t *src, const uint8_t *end) {
+      #if OCTET_SSE
+        __m128i newline = _mm_set1_epi8('\n');
+        for (; src + 16 <= end; src += 16) {
+          int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)src), newline));
+          if (mask) {
+            while (!(mask & 1)) { mask >>= 1; src++; }
+            return src;
+          }
+        }
+      #endif
+      const void *res = memchr(src, '\n', end - src);
+      return res ? (const uint8_t*)res : end;
+    }
+
+    static bool is_space(uint8_t chr) {
+      return chr == ' ' || chr == '\t' || chr == '\r';
+    }
+
+    static bool is_digit(uint8_t chr) {
+      return chr >= '0' && chr <= '9';
+    }
+
+    static const uint8_t *skip_space(const uint8_t *src, const uint8_t *end) {
+      while (src != end && is_space(*src)) ++src;
+      return src;
+    }
+
+    static name_ref get_name(const uint8_t *src, const uint8_t *end) {
+      src = skip_space(src, end);
+      while (end != src && is_space(end[-1])) --end;
+      name_ref res = { src, (unsigned)(end - src) };
+      return res;
+    }
+
   public:
-    obj_loader() {
+    /// Parse a float. Returns false if there is no number at src.
+    /// Up to 19 significant digits with small exponents are converted exactly in doubles.
+    /// Other numbers fall back to strtod.
+    static bool parse_float(const uint8_t *&src, const uint8_t *end, float &result) {
+      static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+      };
+
+      const uint8_t *start = src, *p = src;
+      bool negative = false;
+      if (p != end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+      uint64_t mantissa = 0;
+      int digits = 0, exponent = 0;
+      bool any = false, truncated = false;
+      for (; p != end && is_digit(*p); ++p) {
+        any = true;
+        if (digits < 19) {
+          mantissa = mantissa * 10 + (*p - '0');
+          digits += mantissa != 0;
+        } else {
+          exponent++;
+          truncated = true;
+        }
+      }
+      if (p != end && *p == '.') {
+        for (++p; p != end && is_digit(*p); ++p) {
+          any = true;
+          if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+            exponent--;
+          } else {
+            truncated = true;
+          }
+        }
+      }
+      if (!any) return false;
+
+      if (p != end && (*p == 'e' || *p == 'E')) {
+        const uint8_t *e = p + 1;
+        bool eneg = false;
+        if (e != end && (*e == '-' || *e == '+')) eneg = *e++ == '-';
+        if (e != end && is_digit(*e)) {
+          int value = 0;
+          for (; e != end && is_digit(*e); ++e) {
+            if (value < 100000) value = value * 10 + (*e - '0');
+          }
+          exponent += eneg ? -value : value;
+          p = e;
+        }
+      }
+      src = p;
+
+      if (!truncated && mantissa < (1ull << 53) && exponent >= -22 && exponent <= 22) {
+        double value = (double)mantissa;
+        value = exponent < 0 ? value / powers[-exponent] : value * powers[exponent];
+        result = (float)(negative ? -value : value);
+      } else {
+        char tmp[64];
+        size_t len = std::min((size_t)(p - start), sizeof(tmp) - 1);
+        memcpy(tmp, start, len);
+        tmp[len] = 0;
+        result = (float)strtod(tmp, 0);
+      }
+      return true;
     }
 
-    /// Load an OBJ file
-    /// http://en.wikipedia.org/wiki/Wavefront_.obj_file
-    bool load(const char *url, resource_dict &dict, visual_scene *scene) {
-      dynarray<uint8_t> file;
-      app_utils::get_url(file, url);
-      if (file.size() == 0) return false;
+  private:
+    // parse up to num floats from a line, filling the rest with zero.
+    static void parse_floats(float *values, unsigned num, const uint8_t *src, const uint8_t *end) {
+      unsigned i = 0;
+      for (; i != num; ++i) {
+        src = skip_space(src, end);
+        if (!parse_float(src, end, values[i])) break;
+      }
+      for (; i != num; ++i) {
+        values[i] = 0;
+      }
+    }
 
-      const uint8_t *eof = file.data() + file.size();
-      this->dict = &dict;
-      material_index = 0;
-      
-      for (const uint8_t *src = file.data(); src != eof; ) {
-        while (*src == ' ' && src != eof) ++src;
-        const uint8_t *begin = src;
-        while (*src != '\n' && *src != '\r' && src != eof) ++src;
-        const uint8_t *end = src;
-        src += src != eof && *src == '\r';
-        src += src != eof && *src == '\n';
-        if (begin != end ) switch (begin[0]) {
-          case '#': {
-            fwrite(begin, 1, end-begin, stdout);
-          } break;
-          case 'o': {
-            flush();
-            fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') obj_name.assign((const char*)begin + 2, (const char*)end);
-            node = new scene_node(mat4t(), atom_);
-          } break;
-          case 'g': {
-            fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') group_name.assign((const char*)begin + 2, (const char*)end);
-          } break;
+    // parse a face like "f 1/2/3 4/5/6 7/8/9" or "f 1//3 -1//-1 ..." and add triangles as a fan.
+    static void parse_face(chunk &c, const uint8_t *src, const uint8_t *end) {
+      c.face.resize(0);
+      c.face_relative.resize(0);
+      unsigned counts[3] = { c.positions.size(), c.uvs.size(), c.normals.size() };
+      for (;;) {
+        src = skip_space(src, end);
+        if (src == end) break;
+        for (unsigned k = 0; k != 3; ++k) {
+          int32_t value = none;
+          uint8_t relative = 0;
+          if (src != end && (*src == '-' || is_digit(*src))) {
+            bool negative = *src == '-';
+            src += negative;
+            int64_t index = 0;
+            for (; src != end && is_digit(*src); ++src) {
+              if (index < none) index = index * 10 + (*src - '0');
+            }
+            if (negative) {
+              value = (int32_t)(counts[k] - std::min(index, (int64_t)none));
+              relative = 1;
+            } else if (index != 0 && index <= none) {
+              value = (int32_t)(index - 1);
+            }
+          }
+          c.face.push_back(value);
+          c.face_relative.push_back(relative);
+          if (k != 2 && src != end && *src == '/') {
+            src++;
+            continue;
+          }
+          for (++k; k != 3; ++k) {
+            c.face.push_back(none);
+            c.face_relative.push_back(0);
+          }
+          break;
+        }
+        // skip anything we don't understand
+        while (src != end && !is_space(*src)) ++src;
+      }
+
+      unsigned num_corners = c.face.size() / 3;
+      for (unsigned i = 1; i + 1 < num_corners; ++i) {
+        unsigned corner[3] = { 0, i, i + 1 };
+        for (unsigned j = 0; j != 3; ++j) {
+          for (unsigned k = 0; k != 3; ++k) {
+            unsigned idx = corner[j] * 3 + k;
+            if (c.face_relative[idx]) c.relative.push_back(c.corners.size());
+            c.corners.push_back(c.face[idx]);
+          }
+        }
+      }
+    }
+
+    // parse all the lines in a chunk.
+    static void parse_chunk(chunk &c) {
+      c.error = false;
+      float values[3];
+      for (const uint8_t *src = c.begin; src < c.end; ) {
+        const uint8_t *end = find_line_end(src, c.end);
+        const uint8_t *begin = skip_space(src, end);
+        src = end + 1;
+        if (end - begin < 2) continue;
+        switch (begin[0]) {
           case 'v': {
-            //fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') {
-              atofv(values, begin+2, end);
-              if (values.size() == 3) {
-                src_vertices.push_back(vec3p(values[0], values[1], values[2]));
-              }
-            } else if (begin[1] == 't' && begin[2] == ' ') {
-              atofv(values, begin+3, end);
-              if (values.size() == 2) {
-                src_uvs.push_back(vec2p(values[0], values[1]));
-              }
-            } else if (begin[1] == 'n' && begin[2] == ' ') {
-              atofv(values, begin+3, end);
-              if (values.size() == 3) {
-                src_normals.push_back(vec3p(values[0], values[1], values[2]));
-              }
+            if (is_space(begin[1])) {
+              parse_floats(values, 3, begin + 2, end);
+              c.positions.push_back(vec3p(values[0], values[1], values[2]));
+            } else if (begin[1] == 't') {
+              parse_floats(values, 2, begin + 2, end);
+              c.uvs.push_back(vec2p(values[0], values[1]));
+            } else if (begin[1] == 'n') {
+              parse_floats(values, 3, begin + 2, end);
+              c.normals.push_back(vec3p(values[0], values[1], values[2]));
             }
           } break;
           case 'f': {
-            //fwrite(begin, 1, end-begin, stdout);
-            if (begin[1] == ' ') {
-              unsigned slashes = 0;
-              mesh::vertex v[6];
-              atoiv(ivalues, slashes, begin + 2, end);
-              size_t num_values = ivalues.size() - slashes;
-              size_t num_comps = ivalues.size() / num_values;
-              size_t num_idx = ivalues.size() / num_comps;
-              if (num_idx > 4 || num_comps > 3) {
-                printf("warning: bad obj file face\n");
-                return false;
-              }
-              mesh::vertex vtx[4];
-              memset(vtx, 0, sizeof(vtx));
-              if (num_comps >= 1) {
-                size_t d = 0;
-                for (size_t i = 0; i < ivalues.size(); i += num_comps) {
-                  int iv = ivalues[i];
-                  vtx[d++].pos = src_vertices[iv < 0 ? src_vertices.size() + iv : iv];
-                }
-              }
-              if (num_comps >= 2) {
-                size_t d = 0;
-                for (size_t i = 1; i < ivalues.size(); i += num_comps) {
-                  int iv = ivalues[i];
-                  vtx[d++].uv = src_uvs[iv < 0 ? src_uvs.size() + iv : iv];
-                }
-              }
-              if (num_comps >= 3) {
-                size_t d = 0;
-                for (size_t i = 2; i < ivalues.size(); i += num_comps) {
-                  int iv = ivalues[i];
-                  vtx[d++].normal = src_normals[iv < 0 ? src_normals.size() + iv : iv];
-                }
-              }
-
-              face f;
-              f.vtx[0] = vtx[0];
-              f.vtx[1] = vtx[1];
-              f.vtx[2] = vtx[2];
-              f.material_index = material_index;
-              faces.push_back(f);
-              if (num_idx == 4) {
-                f.vtx[0] = vtx[0];
-                f.vtx[1] = vtx[2];
-                f.vtx[2] = vtx[3];
-                f.material_index = material_index;
-                faces.push_back(f);
-              }
+            if (is_space(begin[1])) {
+              parse_face(c, begin + 2, end);
             }
           } break;
-          default: {
-            fwrite(begin, 1, end-begin, stdout);
-            printf("unknown\n");
-            return false;
+          case 'o': {
+            if (is_space(begin[1])) {
+              state_change sc = { c.corners.size() / 9, 0, get_name(begin + 2, end) };
+              c.changes.push_back(sc);
+            }
           } break;
           case 'u': {
-            fwrite(begin, 1, end-begin, stdout);
-            if (begin+7 < end && !memcmp(begin, "usemtl ", 7)) {
-              size_t len = end - (begin+7);
-              size_t i = 0;
-              for (; i != materials.size(); ++i) {
-                if (
-                  materials[i].size() == len &&
-                  !memcmp(materials[i].c_str(), begin+7, len)
-                ) {
-                  break;
-                }
-              }
-
-              if (i == materials.size()) {
-                materials.push_back(string((const char*)begin+7, (unsigned)len));
-              }
-
-              material_index = (uint32_t)i;
+            if (end - begin > 7 && !memcmp(begin, "usemtl", 6) && is_space(begin[6])) {
+              state_change sc = { c.corners.size() / 9, 1, get_name(begin + 7, end) };
+              c.changes.push_back(sc);
+            }
+          } break;
+          case 'm': {
+            if (end - begin > 7 && !memcmp(begin, "mtllib", 6) && is_space(begin[6])) {
+              c.libraries.push_back(get_name(begin + 7, end));
             }
           } break;
+          default: {
+            // comments, groups, smoothing groups, lines and points are ignored.
+          } break;
         }
       }
-      flush();
+    }
 
-      return true;
+    // add the vertex counts of earlier chunks to relative and absolute indices and check them.
+    static void resolve_chunk(chunk &c, unsigned num_positions, unsigned num_uvs, unsigned num_normals) {
+      int32_t *corners = c.corners.data();
+      unsigned bases[3] = { c.pos_base, c.uv_base, c.normal_base };
+      for (unsigned i = 0; i != c.relative.size(); ++i) {
+        unsigned idx = c.relative[i];
+        corners[idx] += bases[idx % 3];
+      }
+      unsigned limits[3] = { num_positions, num_uvs, num_normals };
+      for (unsigned i = 0; i != c.corners.size(); i += 3) {
+        for (unsigned k = 0; k != 3; ++k) {
+          if ((uint32_t)corners[i + k] >= limits[k]) {
+            if (k == 0) c.error = true;
+            corners[i + k] = none;
+          }
+        }
+      }
     }
-  private:
-    dynarray<vec3p> src_vertices;
-    dynarray<vec3p> src_normals;
-    dynarray<vec2p> src_uvs;
-    dynarray<uint32_t> src_material;
-    dynarray<string> materials;
 
-    string obj_name;
-    string group_name;
-    resource_dict *dict;
-    scene_node *node;
+    static uint32_t hash_corner(const int32_t *c) {
+      uint64_t h = (uint32_t)c[0] * 0x9e3779b97f4a7c15ull;
+      h ^= (uint32_t)c[1] * 0xc2b2ae3d27d4eb4full;
+      h ^= (uint32_t)c[2] * 0x165667b19e3779f9ull;
+      h ^= h >> 29;
+      return (uint32_t)(h >> 32);
+    }
 
-    struct face {
-      mesh::vertex vtx[3];
-      int material_index;
+    // give each distinct corner a vertex index, numbered in order of first use.
+    // returns the number of vertices. rep gets the first corner of each vertex.
+    static unsigned weld(dynarray<uint32_t> &vertex_index, dynarray<uint32_t> &rep, const int32_t *corners, unsigned num_corners) {
+      platform::thread_pool &pool = platform::thread_pool::get();
+      unsigned num_blocks = (num_corners + block_size - 1) / block_size;
+
+      // sort the corners into buckets by hash, keeping them in order.
+      dynarray<uint8_t> bucket(num_corners);
+      dynarray<uint32_t> counts(num_blocks * num_buckets);
+      pool.parallel_for(0, num_blocks, [&](unsigned b) {
+        uint32_t *count = counts.data() + b * num_buckets;
+        memset(count, 0, num_buckets * sizeof(uint32_t));
+        unsigned end = std::min(num_corners, (b + 1) * block_size);
+        for (unsigned i = b * block_size; i != end; ++i) {
+          uint8_t k = (uint8_t)(hash_corner(corners + i * 3) >> (32 - bucket_bits));
+          bucket[i] = k;
+          count[k]++;
+        }
+      });
 
-      bool operator <(const face &rhs) {
-        return material_index < rhs.material_index;
+      dynarray<uint32_t> bucket_start(num_buckets + 1);
+      unsigned total = 0;
+      for (unsigned k = 0; k != num_buckets; ++k) {
+        bucket_start[k] = total;
+        for (unsigned b = 0; b != num_blocks; ++b) {
+          unsigned n = counts[b * num_buckets + k];
+          counts[b * num_buckets + k] = total;
+          total += n;
+        }
       }
-    };
+      bucket_start[num_buckets] = total;
+
+      dynarray<uint32_t> order(num_corners);
+      pool.parallel_for(0, num_blocks, [&](unsigned b) {
+        uint32_t *pos = counts.data() + b * num_buckets;
+        unsigned end = std::min(num_corners, (b + 1) * block_size);
+        for (unsigned i = b * block_size; i != end; ++i) {
+          order[pos[bucket[i]]++] = i;
+        }
+      });
+
+      // find the distinct corners in each bucket.
+      dynarray<uint32_t> local(num_corners);
+      pool.parallel_for(0, num_buckets, [&](unsigned k) {
+        unsigned begin = bucket_start[k], end = bucket_start[k + 1];
+        unsigned size = 16;
+        while (size < (end - begin) * 2) size *= 2;
+        dynarray<uint32_t> table(size);
+        memset(table.data(), 0xff, size * sizeof(uint32_t));
+        unsigned num_local = 0;
+        for (unsigned i = begin; i != end; ++i) {
+          unsigned c = order[i];
+          const int32_t *key = corners + c * 3;
+          unsigned slot = (hash_corner(key) * 0x9e3779b1u) & (size - 1);
+          for (;;) {
+            uint32_t other = table[slot];
+            if (other == ~0u) {
+              table[slot] = c;
+              local[c] = num_local++;
+              break;
+            }
+            const int32_t *okey = corners + other * 3;
+            if (okey[0] == key[0] && okey[1] == key[1] && okey[2] == key[2]) {
+              local[c] = local[other];
+              break;
+            }
+            slot = (slot + 1) & (size - 1);
+          }
+        }
+      });
+
+      // number the vertices in the order that they are first used.
+      dynarray<uint32_t> numbering(num_corners);
+      memset(numbering.data(), 0xff, num_corners * sizeof(uint32_t));
+      vertex_index.resize(num_corners);
+      rep.resize(0);
+      for (unsigned c = 0; c != num_corners; ++c) {
+        uint32_t &n = numbering[bucket_start[bucket[c]] + local[c]];
+        if (n == ~0u) {
+          n = rep.size();
+          rep.push_back(c);
+        }
+        vertex_index[c] = n;
+      }
+      return rep.size();
+    }
+
+    // read the materials from a .mtl file.
+    static void load_materials(const char *url, resource_dict &dict) {
+      dynarray<uint8_t> file;
+      app_utils::get_url(file, url);
 
-    dynarray<face> faces;
-    dynarray<uint32_t> indices;
-    dynarray<float> values;
-    dynarray<int> ivalues;
-    uint32_t material_index;
+      string dir(url);
+      dir.truncate(dir.filename_pos());
 
-    // convert an ascii sequence of integers like "1 3 9 12 34" to an array of integers
-    void atoiv(dynarray<int> &values, unsigned &slashes, const uint8_t *src, const uint8_t *end) {
-      values.resize(0);
-      slashes = 0;
+      string name;
+      string texture;
+      vec4 color(0.5f, 0.5f, 0.5f, 1);
+      const uint8_t *eof = file.data() + file.size();
+      for (const uint8_t *src = file.data(); ; ) {
+        const uint8_t *end = src < eof ? find_line_end(src, eof) : eof;
+        const uint8_t *begin = skip_space(src, end);
+        bool new_material = end - begin > 7 && !memcmp(begin, "newmtl", 6) && is_space(begin[6]);
+        if ((new_material || src >= eof) && name.size() && !dict.has_resource(name)) {
+          material *mat = texture.size() ? new material(new image(texture)) : new material(color);
+          dict.set_resource(name, mat);
+        }
+        if (src >= eof) break;
+        src = end + 1;
 
-      while (src != end && *src > 0 && *src <= ' ') ++src;
-      while(src != end) {
-        int whole = 0, msign = 1;
-        if (src != end && *src == '-') { msign = -1; src++; }
-        while (src != end && *src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
-        values.push_back(whole * msign);
-        while (src != end && *src > 0 && *src <= ' ') ++src;
-        if (src != end && *src == '/') { slashes++; src++; }
+        if (new_material) {
+          name_ref n = get_name(begin + 7, end);
+          name.set((const char*)n.str, n.len);
+          texture = "";
+          color = vec4(0.5f, 0.5f, 0.5f, 1);
+        } else if (end - begin > 3 && begin[0] == 'K' && begin[1] == 'd' && is_space(begin[2])) {
+          float values[3];
+          parse_floats(values, 3, begin + 3, end);
+          color = vec4(values[0], values[1], values[2], color.w());
+        } else if (end - begin > 2 && begin[0] == 'd' && is_space(begin[1])) {
+          float value;
+          parse_floats(&value, 1, begin + 2, end);
+          color = vec4(color.xyz(), value);
+        } else if (end - begin > 7 && !memcmp(begin, "map_Kd", 6) && is_space(begin[6])) {
+          name_ref n = get_name(begin + 7, end);
+          texture.format("%s%.*s", dir.c_str(), n.len, (const char*)n.str);
+        }
       }
     }
 
-    void atofv(dynarray<float> &values, const uint8_t *src, const uint8_t *end) {
-      values.resize(0);
+  public:
+    obj_loader() {
+    }
+
+    /// Load an OBJ file
+    /// http://en.wikipedia.org/wiki/Wavefront_.obj_file
+    /// Adds the materials, meshes and a node for each object to the dictionary.
+    /// If there is a scene, adds the nodes and mesh instances to it.
+    bool load(const char *url, resource_dict &dict, visual_scene *scene) {
+      platform::thread_pool &pool = platform::thread_pool::get();
+
+      // map the file if we can, otherwise read it.
+      dynarray<uint8_t> buffer;
+      file_map *map = 0;
+      const uint8_t *data = 0;
+      size_t size = 0;
+      if (strncmp(url, "zip://", 6) && strncmp(url, "http://", 7)) {
+        map = new file_map(app_utils::get_path(url));
+        data = map->get_data();
+        size = (size_t)map->get_size();
+      }
+      if (!data) {
+        app_utils::get_url(buffer, url);
+        data = buffer.data();
+        size = buffer.size();
+      }
+      if (size == 0) {
+        delete map;
+        return false;
+      }
+
+      // split the file at line ends.
+      dynarray<chunk*> chunks;
+      const uint8_t *eof = data + size;
+      for (const uint8_t *src = data; src != eof; ) {
+        const uint8_t *end = eof - src > chunk_size ? find_line_end(src + chunk_size, eof) : eof;
+        end += end != eof;
+        chunk *c = new chunk();
+        c->begin = src;
+        c->end = end;
+        chunks.push_back(c);
+        src = end;
+      }
+      unsigned num_chunks = chunks.size();
+
+      pool.parallel_for(0, num_chunks, [&](unsigned i) {
+        parse_chunk(*chunks[i]);
+      });
+
+      // count everything
+      unsigned num_positions = 0, num_uvs = 0, num_normals = 0, num_tris = 0;
+      for (unsigned i = 0; i != num_chunks; ++i) {
+        chunk &c = *chunks[i];
+        c.pos_base = num_positions;
+        c.uv_base = num_uvs;
+        c.normal_base = num_normals;
+        c.tri_base = num_tris;
+        num_positions += c.positions.size();
+        num_uvs += c.uvs.size();
+        num_normals += c.normals.size();
+        num_tris += c.corners.size() / 9;
+      }
+
+      // gather the vertex data and the corners into single arrays.
+      dynarray<vec3p> positions(num_positions);
+      dynarray<vec2p> uvs(num_uvs);
+      dynarray<vec3p> normals(num_normals);
+      dynarray<int32_t> corners(num_tris * 9);
+      bool error = false;
+      pool.parallel_for(0, num_chunks, [&](unsigned i) {
+        chunk &c = *chunks[i];
+        resolve_chunk(c, num_positions, num_uvs, num_normals);
+        memcpy(positions.data() + c.pos_base, c.positions.data(), c.positions.size() * sizeof(vec3p));
+        memcpy(uvs.data() + c.uv_base, c.uvs.data(), c.uvs.size() * sizeof(vec2p));
+        memcpy(normals.data() + c.normal_base, c.normals.data(), c.normals.size() * sizeof(vec3p));
+        memcpy(corners.data() + c.tri_base * 9, c.corners.data(), c.corners.size() * sizeof(int32_t));
+        c.positions.reset();
+        c.uvs.reset();
+        c.normals.reset();
+        c.corners.reset();
+      });
+
+      // name the objects and materials and find the object, material pair for each run of triangles.
+      dictionary<unsigned> object_ids;
+      dictionary<unsigned> material_ids;
+      dynarray<string> object_names;
+      dynarray<string> material_names;
+      hash_map<uint64_t, unsigned> group_ids;
+      dynarray<group> groups;
+      string default_object(url + string(url).filename_pos());
+      object_names.push_back(default_object);
+      material_names.push_back("default_material");
+      object_ids[default_object] = 1;
+
+      unsigned cur_object = 0, cur_material = 0;
+      string tmp;
+      for (unsigned i = 0; i != num_chunks; ++i) {
+        chunk &c = *chunks[i];
+        error |= c.error;
+        for (unsigned j = 0; j != c.libraries.size(); ++j) {
+          tmp.set((const char*)c.libraries[j].str, c.libraries[j].len);
+          string lib_url(url);
+          lib_url.truncate(lib_url.filename_pos());
+          lib_url += tmp;
+          load_materials(lib_url, dict);
+        }
+        unsigned num_chunk_tris = (i + 1 == num_chunks ? num_tris : chunks[i + 1]->tri_base) - c.tri_base;
+        for (unsigned j = 0; j <= c.changes.size(); ++j) {
+          unsigned tri = j == 0 ? 0 : c.changes[j - 1].tri;
+          if (j != 0) {
+            const state_change &sc = c.changes[j - 1];
+            tmp.set((const char*)sc.name.str, sc.name.len);
+            dictionary<unsigned> &ids = sc.is_material ? material_ids : object_ids;
+            dynarray<string> &names = sc.is_material ? material_names : object_names;
+            unsigned &id = ids[tmp];
+            if (id == 0) {
+              names.push_back(tmp);
+              id = names.size();
+            }
+            (sc.is_material ? cur_material : cur_object) = id - 1;
+          }
+          unsigned next = j == c.changes.size() ? num_chunk_tris : c.changes[j].tri;
+          if (next == tri) continue;
+
+          unsigned &g = group_ids[((uint64_t)(cur_object + 1) << 32) | cur_material];
+          if (g == 0) {
+            group grp = { cur_object, cur_material, 0, 0 };
+            groups.push_back(grp);
+            g = groups.size();
+          }
+          run r = { tri, next - tri, g - 1, groups[g - 1].num_tris };
+          groups[g - 1].num_tris += next - tri;
+          c.runs.push_back(r);
+        }
+      }
+
+      if (error || num_tris == 0) {
+        for (unsigned i = 0; i != num_chunks; ++i) delete chunks[i];
+        delete map;
+        return false;
+      }
+
+      // weld the corners into vertices.
+      dynarray<uint32_t> vertex_index;
+      dynarray<uint32_t> rep;
+      unsigned num_vertices = weld(vertex_index, rep, corners.data(), num_tris * 3);
+
+      dynarray<mesh::vertex> vtx(num_vertices);
+      pool.parallel_for(0, num_vertices, [&](unsigned i) {
+        const int32_t *c = corners.data() + rep[i] * 3;
+        mesh::vertex &v = vtx[i];
+        v.pos = positions[c[0]];
+        v.uv = c[1] == none ? vec2p(0, 0) : uvs[c[1]];
+        v.normal = c[2] == none ? vec3p(0, 0, 0) : normals[c[2]];
+      }, 4096);
+
+      // gather the triangles of each mesh
+      unsigned offset = 0;
+      for (unsigned i = 0; i != groups.size(); ++i) {
+        groups[i].offset = offset;
+        offset += groups[i].num_tris * 3;
+      }
+
+      dynarray<uint32_t> indices(num_tris * 3);
+      pool.parallel_for(0, num_chunks, [&](unsigned i) {
+        chunk &c = *chunks[i];
+        for (unsigned j = 0; j != c.runs.size(); ++j) {
+          const run &r = c.runs[j];
+          uint32_t *dest = indices.data() + groups[r.group].offset + r.offset * 3;
+          memcpy(dest, vertex_index.data() + (c.tri_base + r.tri) * 3, r.num_tris * 3 * sizeof(uint32_t));
+        }
+      });
+
+      for (unsigned i = 0; i != num_chunks; ++i) {
+        delete chunks[i];
+      }
+      delete map;
 
-      while (*src > 0 && *src <= ' ') ++src;
-      while(src != end) {
-        double whole = 0, msign = 1;
-        if (*src == '-') { msign = -1; src++; }
-        if( !(*src >= '0' && *src <= '9') && *src != '.' ) break;
-        while (*src >= '0' && *src <= '9') whole = whole * 10 + (*src++ - '0');
-        if (*src == '.') {
-          src++;
-          double frac = 0, v = 1;
-          while (*src >= '0' && *src <= '9') { frac = frac * 10 + (*src++ - '0'); v *= 10; }
-          whole += frac / v;
+      // bounding boxes for each mesh
+      dynarray<aabb> bounds(groups.size());
+      pool.parallel_for(0, groups.size(), [&](unsigned i) {
+        const uint32_t *ip = indices.data() + groups[i].offset;
+        vec3 vmin = vtx[ip[0]].pos, vmax = vmin;
+        for (unsigned j = 1; j != groups[i].num_tris * 3; ++j) {
+          vec3 pos = vtx[ip[j]].pos;
+          vmin = min(pos, vmin);
+          vmax = max(pos, vmax);
         }
-        if (*src == 'e' || *src == 'E') {
-          int esign = 1;
-          src++;
-          if (*src == '-') { esign = -1; src++; }
-          else if (*src == '+') src++;
-          int exp = 0;
-          while (*src >= '0' && *src <= '9') { exp = exp * 10 + (*src++ - '0'); }
-          whole = whole * pow(10.0, exp * esign);
+        bounds[i] = aabb((vmax + vmin) * 0.5f, (vmax - vmin) * 0.5f);
+      });
+
+      gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, num_vertices * sizeof(mesh::vertex));
+      vertices->assign(vtx.data(), 0, num_vertices * sizeof(mesh::vertex));
+
+      // make the nodes, meshes and instances
+      dynarray<scene_node*> nodes(object_names.size());
+      for (unsigned i = 0; i != object_names.size(); ++i) {
+        nodes[i] = 0;
+      }
+
+      for (unsigned i = 0; i != groups.size(); ++i) {
+        const group &g = groups[i];
+        scene_node *&node = nodes[g.object];
+        if (!node) {
+          node = new scene_node(mat4t(), app_utils::get_atom(object_names[g.object]));
+          dict.set_resource(object_names[g.object], node);
+          if (scene) scene->add_scene_node(node);
+        }
+
+        const char *mat_name = material_names[g.material];
+        material *mat = dict.get_material(mat_name);
+        if (!mat) {
+          mat = new material(vec4(0.5f, 0.5f, 0.5f, 1));
+          dict.set_resource(mat_name, mat);
+        }
+
+        mesh *msh = new mesh();
+        msh->set_default_attributes();
+        msh->set_vertices(vertices);
+        msh->set_num_vertices(num_vertices);
+        gl_resource *ib = new gl_resource(GL_ELEMENT_ARRAY_BUFFER, g.num_tris * 3 * sizeof(uint32_t));
+        ib->assign(indices.data() + g.offset, 0, g.num_tris * 3 * sizeof(uint32_t));
+        msh->set_indices(ib);
+        msh->set_num_indices(g.num_tris * 3);
+        msh->set_aabb(bounds[i]);
+
+        tmp.format("%s/%s", object_names[g.object].c_str(), mat_name);
+        dict.set_resource(tmp, msh);
+
+        if (scene) {
+          scene->add_mesh_instance(new mesh_instance(node, msh, mat));
         }
-        values.push_back((float)(whole * msign));
-        while (*src > 0 && *src <= ' ') ++src;
       }
+
+      return true;
     }
 
-    void flush() {
-      std::sort(faces.begin(), faces.end());
-      face *f = 0;
-      gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, faces.size() * sizeof(f->vtx));
+    /// Load an OBJ file as above, but use the cooked_cache if it is up to date.
+    bool load_cooked(const char *url, resource_dict &dict, visual_scene *scene) {
+      ref<resource_dict> cooked = cooked_cache::get().load(url);
+      if (!cooked) {
+        // the cache holds a scene with the nodes and mesh instances for this file.
+        cooked = new resource_dict();
+        cooked->set_active_scene(new visual_scene());
+        if (!load(url, *cooked, cooked->get_active_scene())) {
+          return false;
+        }
+        cooked_cache::get().save(*cooked, url);
+      }
+
+      dict.add_resources(*cooked);
 
-      {
-        gl_resource::wolock vl(vertices);
-        for (size_t i = 0; i != faces.size(); ++i) {
-          memcpy(vl.u8() + i * sizeof(f->vtx), faces[i].vtx, sizeof(f->vtx));
+      visual_scene *objects = cooked->get_active_scene();
+      if (scene && objects) {
+        for (int i = 0; i != objects->get_num_children(); ++i) {
+          scene->add_scene_node(objects->get_child(i));
+        }
+        for (int i = 0; i != objects->get_num_mesh_instances(); ++i) {
+          scene->add_mesh_instance(objects->get_mesh_instance(i));
         }
       }
+      return true;
+    }
 
-      int prev_mi = -1;
-      for (size_t i = 0; i != faces.size(); ++i) {
-        if (faces[i].material_index != prev_mi) {
-          mesh *msh = new mesh();
-          msh->set_default_attributes();
-          msh->set_vertices(vertices);
-          material *mat = new material(vec4(0.5f, 0.5f, 0.5f, 1));
-          mesh_instance *mi = new mesh_instance(node, msh, mat);
+    /// Write a grid of about size_mb megabytes to path if there is no file there, then time loading it.
+    static void benchmark(const char *path, unsigned size_mb = 1024) {
+      FILE *test = fopen(path, "rb");
+      if (test) {
+        fclose(test);
+      } else {
+        // about 240 bytes per grid point.
+        unsigned n = (unsigned)sqrtf(size_mb * (1024.0f * 1024.0f / 240));
+        FILE *file = fopen(path, "wb");
+        if (!file) return;
+        fprintf(file, "# %dx%d grid\no grid\n", n, n);
+        for (unsigned z = 0; z != n; ++z) {
+          for (unsigned x = 0; x != n; ++x) {
+            float h = sinf(x * 0.01f) * cosf(z * 0.013f) * 10;
+            fprintf(file, "v %.6f %.6f %.6f\nvt %.6f %.6f\nvn 0.000000 1.000000 0.000000\n", (float)x, h, (float)z, x / (float)n, z / (float)n);
+          }
+        }
+        fprintf(file, "usemtl grid\n");
+        for (unsigned z = 0; z + 1 < n; ++z) {
+          for (unsigned x = 0; x + 1 < n; ++x) {
+            unsigned i = z * n + x + 1;
+            fprintf(file, "f %d/%d/%d %d/%d/%d %d/%d/%d\n", i, i, i, i + n, i + n, i + n, i + 1, i + 1, i + 1);
+            fprintf(file, "f %d/%d/%d %d/%d/%d %d/%d/%d\n", i + 1, i + 1, i + 1, i + n, i + n, i + n, i + n + 1, i + n + 1, i + n + 1);
+          }
         }
+        fclose(file);
       }
 
-      faces.resize(0);
-      src_vertices.resize(0);
-      src_uvs.resize(0);
-      src_normals.resize(0);
+      ref<resource_dict> dict = new resource_dict();
+      obj_loader loader;
+      auto start = std::chrono::high_resolution_clock::now();
+      bool ok = loader.load(path, *dict, 0);
+      double secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+      file_map map(path);
+      log("obj_loader: %s %.1f MB in %.3fs, %.1f MB/s\n", ok ? "loaded" : "failed", map.get_size() / 1048576.0, secs, map.get_size() / 1048576.0 / secs);
     }
   };
 }}
@@ -0,0 +1,367 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// XML pull parser
+//
+// Reads XML from memory one token at a time without building a DOM.
+// This lets the reader decide what to keep and parse large text blocks in place.
+//
+
+namespace octet { namespace loaders {
+  /// Streaming XML reader for memory buffers such as a file_map.
+  ///
+  /// Example
+  ///
+  ///     xml_pull_parser parser(data, size);
+  ///     for (;;) {
+  ///       xml_pull_parser::token_type tok = parser.next();
+  ///       if (tok == xml_pull_parser::token_begin) {
+  ///         printf("<%.*s>\n", parser.get_name().size(), parser.get_name().begin);
+  ///       } else if (tok == xml_pull_parser::token_eof || tok == xml_pull_parser::token_error) {
+  ///         break;
+  ///       }
+  ///     }
+  ///
+  /// Names and text are ranges in the buffer. Use decode() to expand entities.
+  /// Comments, processing instructions and DOCTYPE are skipped.
+  class xml_pull_parser {
+  public:
+    enum token_type {
+      token_eof,    /// end of the document
+      token_error,  /// malformed document, see get_error()
+      token_begin,  /// start tag, see get_name() and get_attribute()
+      token_end,    /// end tag or the end of an empty element <x/>
+      token_text,   /// text or CDATA, see get_text()
+    };
+
+    /// A range of characters in the source.
+    struct range {
+      const char *begin;
+      const char *end;
+
+      unsigned size() const { return (unsigned)(end - begin); }
+      bool operator==(const char *rhs) const { return !strncmp(begin, rhs, size()) && rhs[size()] == 0; }
+    };
+
+  private:
+    const char *src;
+    const char *src_max;
+    const char *error;
+    const char *error_pos;
+    int depth;
+    bool pending_end;
+    bool cdata;
+
+    range name;
+    range text;
+
+    // name and value ranges for each attribute of the current start tag.
+    dynarray<range> attributes;
+
+    static bool is_space(char c) {
+      return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    static bool is_name_end(char c) {
+      return is_space(c) || c == '/' || c == '>' || c == '=';
+    }
+
+    bool starts_with(const char *str, unsigned len) const {
+      return (unsigned)(src_max - src) >= len && !memcmp(src, str, len);
+    }
+
+    // find str after src, returning the end of the buffer if not found
+    const char *find(const char *str, unsigned len) const {
+      for (const char *p = src; (unsigned)(src_max - p) >= len; ++p) {
+        p = (const char *)memchr(p, str[0], src_max - p);
+        if (!p || (unsigned)(src_max - p) < len) break;
+        if (!memcmp(p, str, len)) return p;
+      }
+      return src_max;
+    }
+
+    void skip_space() {
+      while (src != src_max && is_space(*src)) ++src;
+    }
+
+    range get_name_at() {
+      range r = { src, src };
+      while (src != src_max && !is_name_end(*src)) ++src;
+      r.end = src;
+      return r;
+    }
+
+    // stop parsing, remembering where the error was.
+    token_type fail(const char *msg) {
+      error = msg;
+      error_pos = src;
+      src = src_max;
+      return token_error;
+    }
+
+    // <!DOCTYPE ...> can have an internal subset in brackets.
+    bool skip_declaration() {
+      int brackets = 0;
+      for (; src != src_max; ++src) {
+        if (*src == '[') {
+          brackets++;
+        } else if (*src == ']') {
+          brackets--;
+        } else if (*src == '>' && brackets <= 0) {
+          ++src;
+          return true;
+        }
+      }
+      fail("unterminated declaration");
+      return false;
+    }
+
+    token_type parse_start_tag() {
+      ++src;
+      name = get_name_at();
+      if (name.size() == 0) return fail("bad element name");
+
+      attributes.resize(0);
+      for (;;) {
+        skip_space();
+        if (src == src_max) return fail("unterminated start tag");
+        if (*src == '>') {
+          ++src;
+          break;
+        }
+        if (*src == '/') {
+          if (src + 1 == src_max || src[1] != '>') return fail("bad empty element");
+          src += 2;
+          pending_end = true;
+          break;
+        }
+
+        range attr_name = get_name_at();
+        skip_space();
+        if (attr_name.size() == 0 || src == src_max || *src != '=') return fail("bad attribute");
+        ++src;
+        skip_space();
+        if (src == src_max || (*src != '"' && *src != '\'')) return fail("bad attribute value");
+        char quote = *src++;
+        const char *value_end = (const char *)memchr(src, quote, src_max - src);
+        if (!value_end) return fail("unterminated attribute value");
+        range attr_value = { src, value_end };
+        src = value_end + 1;
+        attributes.push_back(attr_name);
+        attributes.push_back(attr_value);
+      }
+
+      depth++;
+      return token_begin;
+    }
+
+    token_type parse_end_tag() {
+      src += 2;
+      name = get_name_at();
+      skip_space();
+      if (src == src_max || *src != '>') return fail("bad end tag");
+      ++src;
+      if (--depth < 0) return fail("unexpected end tag");
+      return token_end;
+    }
+
+  public:
+    /// Start parsing a buffer. The buffer must outlive the parser.
+    xml_pull_parser(const void *data, size_t size) {
+      src = (const char *)data;
+      src_max = src + size;
+      error = 0;
+      error_pos = 0;
+      depth = 0;
+      pending_end = false;
+      cdata = false;
+      name.begin = name.end = src;
+      text.begin = text.end = src;
+
+      // skip a UTF-8 byte order mark
+      if (starts_with("\xef\xbb\xbf", 3)) src += 3;
+    }
+
+    /// Get the next token.
+    token_type next() {
+      if (pending_end) {
+        pending_end = false;
+        depth--;
+        return token_end;
+      }
+
+      for (;;) {
+        if (src == src_max) {
+          return error ? token_error : depth ? fail("unexpected end of file") : token_eof;
+        }
+
+        if (*src != '<') {
+          const char *lt = (const char *)memchr(src, '<', src_max - src);
+          text.begin = src;
+          text.end = src = lt ? lt : src_max;
+          cdata = false;
+          return token_text;
+        }
+
+        if (starts_with("<!--", 4)) {
+          src = find("-->", 3);
+          if (src == src_max) return fail("unterminated comment");
+          src += 3;
+        } else if (starts_with("<![CDATA[", 9)) {
+          src += 9;
+          text.begin = src;
+          text.end = src = find("]]>", 3);
+          if (src == src_max) return fail("unterminated CDATA");
+          src += 3;
+          cdata = true;
+          return token_text;
+        } else if (starts_with("<?", 2)) {
+          src = find("?>", 2);
+          if (src == src_max) return fail("unterminated processing instruction");
+          src += 2;
+        } else if (starts_with("<!", 2)) {
+          if (!skip_declaration()) return token_error;
+        } else if (starts_with("</", 2)) {
+          return parse_end_tag();
+        } else {
+          return parse_start_tag();
+        }
+      }
+    }
+
+    /// Get the element name after token_begin or token_end.
+    range get_name() const {
+      return name;
+    }
+
+    /// Get the number of attributes after token_begin.
+    unsigned get_num_attributes() const {
+      return attributes.size() / 2;
+    }
+
+    /// Get the name of an attribute after token_begin.
+    range get_attribute_name(unsigned i) const {
+      return attributes[i*2];
+    }
+
+    /// Get the raw value of an attribute after token_begin.
+    range get_attribute_value(unsigned i) const {
+      return attributes[i*2+1];
+    }
+
+    /// Get the raw value of a named attribute after token_begin or an empty range.
+    range get_attribute(const char *attr_name) const {
+      for (unsigned i = 0; i != attributes.size(); i += 2) {
+        if (attributes[i] == attr_name) return attributes[i+1];
+      }
+      range empty = { src, src };
+      return empty;
+    }
+
+    /// Get the text after token_text.
+    /// Large texts, such as number arrays, can be parsed from here directly.
+    range get_text() const {
+      return text;
+    }
+
+    /// True if the text is CDATA, which has no entities.
+    bool is_cdata() const {
+      return cdata;
+    }
+
+    /// True if the text is all white space.
+    bool is_space_text() const {
+      for (const char *p = text.begin; p != text.end; ++p) {
+        if (!is_space(*p)) return false;
+      }
+      return true;
+    }
+
+    /// Get the current element depth.
+    int get_depth() const {
+      return depth;
+    }
+
+    /// Get the error message after token_error.
+    const char *get_error() const {
+      return error ? error : "";
+    }
+
+    /// Get the offset of the parser in the buffer, for error messages.
+    /// After token_error, this is where the error was found.
+    size_t get_offset(const void *data) const {
+      return (size_t)((error ? error_pos : src) - (const char *)data);
+    }
+
+    /// Decode entities in text or an attribute value.
+    /// If condense is true, runs of white space become a single space and the ends are trimmed.
+    static void decode(string &result, range r, bool entities = true, bool condense = false) {
+      dynarray<char> tmp;
+      tmp.reserve(r.size() + 1);
+      bool space = false;
+      for (const char *p = r.begin; p != r.end; ) {
+        char c = *p;
+        if (condense && is_space(c)) {
+          space = tmp.size() != 0;
+          ++p;
+          continue;
+        }
+        if (space) {
+          tmp.push_back(' ');
+          space = false;
+        }
+        if (entities && c == '&') {
+          const char *semi = (const char *)memchr(p, ';', r.end - p);
+          range ent = { p + 1, semi ? semi : p + 1 };
+          unsigned code = 0;
+          if (!semi) {
+            code = '&';
+          } else if (ent == "lt") {
+            code = '<';
+          } else if (ent == "gt") {
+            code = '>';
+          } else if (ent == "amp") {
+            code = '&';
+          } else if (ent == "quot") {
+            code = '"';
+          } else if (ent == "apos") {
+            code = '\'';
+          } else if (ent.size() >= 2 && ent.begin[0] == '#') {
+            bool hex = ent.begin[1] == 'x';
+            code = (unsigned)strtoul(ent.begin + 1 + hex, 0, hex ? 16 : 10);
+          }
+          if (code && semi) {
+            p = semi + 1;
+          } else {
+            code = '&';
+            ++p;
+          }
+
+          // utf-8 encode
+          if (code < 0x80) {
+            tmp.push_back((char)code);
+          } else if (code < 0x800) {
+            tmp.push_back((char)(0xc0 | code >> 6));
+            tmp.push_back((char)(0x80 | (code & 0x3f)));
+          } else if (code < 0x10000) {
+            tmp.push_back((char)(0xe0 | code >> 12));
+            tmp.push_back((char)(0x80 | (code >> 6 & 0x3f)));
+            tmp.push_back((char)(0x80 | (code & 0x3f)));
+          } else {
+            tmp.push_back((char)(0xf0 | code >> 18));
+            tmp.push_back((char)(0x80 | (code >> 12 & 0x3f)));
+            tmp.push_back((char)(0x80 | (code >> 6 & 0x3f)));
+            tmp.push_back((char)(0x80 | (code & 0x3f)));
+          }
+        } else {
+          tmp.push_back(c);
+          ++p;
+        }
+      }
+      result.set(tmp.data(), tmp.size());
+    }
+  };
+} }
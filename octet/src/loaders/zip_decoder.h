@@ -6,352 +6,752 @@
 //
 //
 // zip deflate format decoder
-// 
+//
 namespace octet { namespace loaders {
+  /// Inflate decoder for the deflate format used in zip files.
+  ///
+  /// Huffman codes are decoded with a lookup table indexed by the next few bits of input.
+  /// Codes longer than the first level of the table use a small second level table.
+  /// Input is read into a 64 bit bit buffer a word at a time, so one refill
+  /// is enough for a whole length/distance pair.
   class zip_decoder {
-    enum { debug = 1 };
+    enum {
+      debug = 0,
+
+      // bits in the first level of the lookup tables
+      lit_root_bits = 10,
+      dist_root_bits = 8,
+      length_root_bits = 7,
+
+      // first level plus the worst case second level tables for a complete code.
+      lit_table_size = (1 << lit_root_bits) + 48 * 32,
+      dist_table_size = (1 << dist_root_bits) + 4 * 128,
+      length_table_size = 1 << length_root_bits,
+
+      // table entries are (symbol or sub table offset) << 16 | flags | bits to consume
+      entry_sub = 0x100,
+      entry_invalid = 0x200,
+    };
 
     struct huffman_table {
-      uint8_t min_lit_length;
-      uint8_t max_lit_length;
-      uint8_t min_dist_length;
-      uint8_t max_dist_length;
-
-      //uint8_t lit_lengths[288];
-      uint16_t lit_codes[288];
-      uint16_t lit_limits[18];
-      uint16_t lit_base[18];
-
-      //uint8_t dist_lengths[32];
-      uint16_t dist_codes[32];
-      uint16_t dist_limits[18];
-      uint16_t dist_base[18];
+      uint32_t lit[lit_table_size];
+      uint32_t dist[dist_table_size];
+    };
+
+    // the fixed code tables are shared by all decoders.
+    struct fixed_table : huffman_table {
+      fixed_table() {
+        uint8_t lit_lengths[288];
+        uint8_t dist_lengths[32];
+        memset(lit_lengths +   0, 8, 144 - 0);
+        memset(lit_lengths + 144, 9, 256-144);
+        memset(lit_lengths + 256, 7, 280-256);
+        memset(lit_lengths + 280, 8, 288-280);
+        memset(dist_lengths, 5, 32);
+        build_huffman(lit, lit_table_size, lit_root_bits, lit_lengths, 288);
+        build_huffman(dist, dist_table_size, dist_root_bits, dist_lengths, 32);
+      }
     };
 
-    huffman_table fixed_;
+    static const huffman_table &get_fixed() {
+      static const fixed_table fixed;
+      return fixed;
+    }
+
+    // tables for the current dynamic block. A decoder can only be used by one thread at a time.
     huffman_table var_;
 
-    // on ARM we can do this faster with the "rev" instruction
-    inline static uint16_t rev16(uint16_t value) {
-      // small table version.
-      //static const uint8_t r16[] = { 0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe, 0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf };
-      //return r16[value&0x0f] * 0x1000 | r16[(value>>4)&0x0f] * 0x100 | r16[(value>>8)&0x0f] * 0x10 | r16[value>>12];
-
-      // this table is probably too big to be efficient. L1 cache misses are very expensive.
-      static const uint8_t r256[] = {
-        0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0, 
-        0x00+0x10, 0x80+0x10, 0x40+0x10, 0xc0+0x10, 0x20+0x10, 0xa0+0x10, 0x60+0x10, 0xe0+0x10, 
-        0x00+8, 0x80+8, 0x40+8, 0xc0+8, 0x20+8, 0xa0+8, 0x60+8, 0xe0+8, 
-        0x00+0x10+8, 0x80+0x10+8, 0x40+0x10+8, 0xc0+0x10+8, 0x20+0x10+8, 0xa0+0x10+8, 0x60+0x10+8, 0xe0+0x10+8, 
-        0x00+ 4, 0x80+ 4, 0x40+ 4, 0xc0+ 4, 0x20+ 4, 0xa0+ 4, 0x60+ 4, 0xe0+ 4, 
-        0x00+0x10+ 4, 0x80+0x10+ 4, 0x40+0x10+ 4, 0xc0+0x10+ 4, 0x20+0x10+ 4, 0xa0+0x10+ 4, 0x60+0x10+ 4, 0xe0+0x10+ 4, 
-        0x00+8+ 4, 0x80+8+ 4, 0x40+8+ 4, 0xc0+8+ 4, 0x20+8+ 4, 0xa0+8+ 4, 0x60+8+ 4, 0xe0+8+ 4, 
-        0x00+0x10+8+ 4, 0x80+0x10+8+ 4, 0x40+0x10+8+ 4, 0xc0+0x10+8+ 4, 0x20+0x10+8+ 4, 0xa0+0x10+8+ 4, 0x60+0x10+8+ 4, 0xe0+0x10+8+ 4, 
-        0x00+ 2, 0x80+ 2, 0x40+ 2, 0xc0+ 2, 0x20+ 2, 0xa0+ 2, 0x60+ 2, 0xe0+ 2, 
-        0x00+0x10+ 2, 0x80+0x10+ 2, 0x40+0x10+ 2, 0xc0+0x10+ 2, 0x20+0x10+ 2, 0xa0+0x10+ 2, 0x60+0x10+ 2, 0xe0+0x10+ 2, 
-        0x00+8+ 2, 0x80+8+ 2, 0x40+8+ 2, 0xc0+8+ 2, 0x20+8+ 2, 0xa0+8+ 2, 0x60+8+ 2, 0xe0+8+ 2, 
-        0x00+0x10+8+ 2, 0x80+0x10+8+ 2, 0x40+0x10+8+ 2, 0xc0+0x10+8+ 2, 0x20+0x10+8+ 2, 0xa0+0x10+8+ 2, 0x60+0x10+8+ 2, 0xe0+0x10+8+ 2, 
-        0x00+ 4+ 2, 0x80+ 4+ 2, 0x40+ 4+ 2, 0xc0+ 4+ 2, 0x20+ 4+ 2, 0xa0+ 4+ 2, 0x60+ 4+ 2, 0xe0+ 4+ 2, 
-        0x00+0x10+ 4+ 2, 0x80+0x10+ 4+ 2, 0x40+0x10+ 4+ 2, 0xc0+0x10+ 4+ 2, 0x20+0x10+ 4+ 2, 0xa0+0x10+ 4+ 2, 0x60+0x10+ 4+ 2, 0xe0+0x10+ 4+ 2, 
-        0x00+8+ 4+ 2, 0x80+8+ 4+ 2, 0x40+8+ 4+ 2, 0xc0+8+ 4+ 2, 0x20+8+ 4+ 2, 0xa0+8+ 4+ 2, 0x60+8+ 4+ 2, 0xe0+8+ 4+ 2, 
-        0x00+0x10+8+ 4+ 2, 0x80+0x10+8+ 4+ 2, 0x40+0x10+8+ 4+ 2, 0xc0+0x10+8+ 4+ 2, 0x20+0x10+8+ 4+ 2, 0xa0+0x10+8+ 4+ 2, 0x60+0x10+8+ 4+ 2, 0xe0+0x10+8+ 4+ 2, 
-        0x00+ 1, 0x80+ 1, 0x40+ 1, 0xc0+ 1, 0x20+ 1, 0xa0+ 1, 0x60+ 1, 0xe0+ 1, 
-        0x00+0x10+ 1, 0x80+0x10+ 1, 0x40+0x10+ 1, 0xc0+0x10+ 1, 0x20+0x10+ 1, 0xa0+0x10+ 1, 0x60+0x10+ 1, 0xe0+0x10+ 1, 
-        0x00+8+ 1, 0x80+8+ 1, 0x40+8+ 1, 0xc0+8+ 1, 0x20+8+ 1, 0xa0+8+ 1, 0x60+8+ 1, 0xe0+8+ 1, 
-        0x00+0x10+8+ 1, 0x80+0x10+8+ 1, 0x40+0x10+8+ 1, 0xc0+0x10+8+ 1, 0x20+0x10+8+ 1, 0xa0+0x10+8+ 1, 0x60+0x10+8+ 1, 0xe0+0x10+8+ 1, 
-        0x00+ 4+ 1, 0x80+ 4+ 1, 0x40+ 4+ 1, 0xc0+ 4+ 1, 0x20+ 4+ 1, 0xa0+ 4+ 1, 0x60+ 4+ 1, 0xe0+ 4+ 1, 
-        0x00+0x10+ 4+ 1, 0x80+0x10+ 4+ 1, 0x40+0x10+ 4+ 1, 0xc0+0x10+ 4+ 1, 0x20+0x10+ 4+ 1, 0xa0+0x10+ 4+ 1, 0x60+0x10+ 4+ 1, 0xe0+0x10+ 4+ 1, 
-        0x00+8+ 4+ 1, 0x80+8+ 4+ 1, 0x40+8+ 4+ 1, 0xc0+8+ 4+ 1, 0x20+8+ 4+ 1, 0xa0+8+ 4+ 1, 0x60+8+ 4+ 1, 0xe0+8+ 4+ 1, 
-        0x00+0x10+8+ 4+ 1, 0x80+0x10+8+ 4+ 1, 0x40+0x10+8+ 4+ 1, 0xc0+0x10+8+ 4+ 1, 0x20+0x10+8+ 4+ 1, 0xa0+0x10+8+ 4+ 1, 0x60+0x10+8+ 4+ 1, 0xe0+0x10+8+ 4+ 1, 
-        0x00+ 2+ 1, 0x80+ 2+ 1, 0x40+ 2+ 1, 0xc0+ 2+ 1, 0x20+ 2+ 1, 0xa0+ 2+ 1, 0x60+ 2+ 1, 0xe0+ 2+ 1, 
-        0x00+0x10+ 2+ 1, 0x80+0x10+ 2+ 1, 0x40+0x10+ 2+ 1, 0xc0+0x10+ 2+ 1, 0x20+0x10+ 2+ 1, 0xa0+0x10+ 2+ 1, 0x60+0x10+ 2+ 1, 0xe0+0x10+ 2+ 1, 
-        0x00+8+ 2+ 1, 0x80+8+ 2+ 1, 0x40+8+ 2+ 1, 0xc0+8+ 2+ 1, 0x20+8+ 2+ 1, 0xa0+8+ 2+ 1, 0x60+8+ 2+ 1, 0xe0+8+ 2+ 1, 
-        0x00+0x10+8+ 2+ 1, 0x80+0x10+8+ 2+ 1, 0x40+0x10+8+ 2+ 1, 0xc0+0x10+8+ 2+ 1, 0x20+0x10+8+ 2+ 1, 0xa0+0x10+8+ 2+ 1, 0x60+0x10+8+ 2+ 1, 0xe0+0x10+8+ 2+ 1, 
-        0x00+ 4+ 2+ 1, 0x80+ 4+ 2+ 1, 0x40+ 4+ 2+ 1, 0xc0+ 4+ 2+ 1, 0x20+ 4+ 2+ 1, 0xa0+ 4+ 2+ 1, 0x60+ 4+ 2+ 1, 0xe0+ 4+ 2+ 1, 
-        0x00+0x10+ 4+ 2+ 1, 0x80+0x10+ 4+ 2+ 1, 0x40+0x10+ 4+ 2+ 1, 0xc0+0x10+ 4+ 2+ 1, 0x20+0x10+ 4+ 2+ 1, 0xa0+0x10+ 4+ 2+ 1, 0x60+0x10+ 4+ 2+ 1, 0xe0+0x10+ 4+ 2+ 1, 
-        0x00+8+ 4+ 2+ 1, 0x80+8+ 4+ 2+ 1, 0x40+8+ 4+ 2+ 1, 0xc0+8+ 4+ 2+ 1, 0x20+8+ 4+ 2+ 1, 0xa0+8+ 4+ 2+ 1, 0x60+8+ 4+ 2+ 1, 0xe0+8+ 4+ 2+ 1, 
-        0x00+0x10+8+ 4+ 2+ 1, 0x80+0x10+8+ 4+ 2+ 1, 0x40+0x10+8+ 4+ 2+ 1, 0xc0+0x10+8+ 4+ 2+ 1, 0x20+0x10+8+ 4+ 2+ 1, 0xa0+0x10+8+ 4+ 2+ 1, 0x60+0x10+8+ 4+ 2+ 1, 0xe0+0x10+8+ 4+ 2+ 1, 
-      };
-      return r256[value&0xff] << 8 | r256[(value>>8)&0xff];
+    /// little-endian bit stream with a 64 bit buffer.
+    /// note: this will have to be fixed on PPC and other big-endian devices
+    struct bit_reader {
+      const uint8_t *src;
+      size_t size;
+      size_t pos;
+      uint64_t bits;
+      unsigned num_bits;
+
+      /// make sure there are at least 56 bits in the buffer.
+      /// Past the end of the input we read zeros, see overrun().
+      void refill() {
+        if (pos + 8 <= size) {
+          // read a whole word and keep as many whole bytes as will fit.
+          uint64_t word;
+          memcpy(&word, src + pos, 8);
+          bits |= word << num_bits;
+          pos += (63 - num_bits) >> 3;
+          num_bits |= 56;
+        } else {
+          while (num_bits <= 56) {
+            bits |= (uint64_t)(pos < size ? src[pos] : 0) << num_bits;
+            pos++;
+            num_bits += 8;
+          }
+        }
+      }
+
+      /// consume up to 32 bits from the buffer
+      unsigned get(unsigned n) {
+        unsigned value = (unsigned)bits & ((1u << n) - 1);
+        bits >>= n;
+        num_bits -= n;
+        return value;
+      }
+
+      /// go to a byte boundary and give back the whole bytes in the buffer.
+      void align() {
+        get(num_bits & 7);
+        pos -= num_bits >> 3;
+        bits = 0;
+        num_bits = 0;
+      }
+
+      /// true if we have used bits beyond the end of the input.
+      bool overrun() const {
+        return pos * 8 - num_bits > size * 8;
+      }
+    };
 
-      //value = ( ( value >> 1 ) & 0x5555 ) | ( ( value & 0x5555 ) << 1 );
-      //value = ( ( value >> 2 ) & 0x3333 ) | ( ( value & 0x3333 ) << 2 );
-      //value = ( ( value >> 4 ) & 0x0f0f ) | ( ( value & 0x0f0f ) << 4 );
-      //value = ( ( value >> 8 ) & 0x00ff ) | ( ( value & 0x00ff ) << 8 );
-      //return value;
+    static unsigned reverse_bits(unsigned code, unsigned length) {
+      unsigned result = 0;
+      for (unsigned i = 0; i != length; ++i) {
+        result = result * 2 + (code & 1);
+        code >>= 1;
+      }
+      return result;
     }
 
-    bool build_huffman(uint8_t *lengths, unsigned num_lengths, uint8_t &min_length, uint8_t &max_length, uint16_t *codes, uint16_t *limits, uint16_t *base) {
-      min_length = 16;
-      max_length = 0;
+    /// Build a lookup table from canonical huffman code lengths.
+    /// Codes up to root_bits long take one lookup, longer codes have a second level table.
+    static bool build_huffman(uint32_t *table, unsigned table_size, unsigned root_bits, const uint8_t *lengths, unsigned num_lengths) {
+      unsigned counts[16] = { 0 };
       for (unsigned i = 0; i != num_lengths; ++i) {
-        if (debug) printf("%d,", lengths[i]);
-        if (lengths[i]) {
-          if (min_length > lengths[i]) min_length = lengths[i];
-          if (max_length < lengths[i]) max_length = lengths[i];
+        if (lengths[i] > 15) return false;
+        counts[lengths[i]]++;
+      }
+      counts[0] = 0;
+
+      // first code of each length. Reject over-subscribed codes.
+      unsigned next_code[16];
+      unsigned code = 0;
+      int left = 1;
+      for (unsigned length = 1; length != 16; ++length) {
+        code = (code + counts[length-1]) << 1;
+        next_code[length] = code;
+        left = left * 2 - (int)counts[length];
+        if (left < 0) {
+          if (debug) printf("over-subscribed huffman table\n");
+          return false;
         }
       }
-      if (debug) printf("\n");
 
-      if (debug) printf("min_length=%d\n", min_length);
-      if (debug) printf("max_length=%d\n", max_length);
+      unsigned root_size = 1u << root_bits;
+      for (unsigned i = 0; i != root_size; ++i) {
+        table[i] = entry_invalid;
+      }
 
-      if ( min_length <= 0 || min_length > max_length || max_length > 16 ) {
-        return false;
+      // size the second level tables from the longest code with each prefix.
+      uint8_t sub_bits[1 << lit_root_bits];
+      memset(sub_bits, 0, root_size);
+      unsigned first_code[16];
+      memcpy(first_code, next_code, sizeof(first_code));
+      for (unsigned i = 0; i != num_lengths; ++i) {
+        unsigned length = lengths[i];
+        if (length > root_bits) {
+          unsigned prefix = reverse_bits(next_code[length]++, length) & (root_size - 1);
+          if (sub_bits[prefix] < length - root_bits) sub_bits[prefix] = (uint8_t)(length - root_bits);
+        }
       }
 
-      unsigned code = 0;
-      unsigned huffcode = 0;
-      for (unsigned length = min_length; length <= max_length; ++length) {
-        base[length-min_length] = huffcode - code;
-        for (unsigned i = 0; i != num_lengths; ++i) {
-          if (lengths[i] == length) {
-            codes[code++] = i;
-            //dump_bits(huffcode << (16-length), 16, "huffcode");
-            huffcode++;
+      unsigned table_end = root_size;
+      for (unsigned prefix = 0; prefix != root_size; ++prefix) {
+        if (sub_bits[prefix]) {
+          unsigned sub_size = 1u << sub_bits[prefix];
+          if (table_end + sub_size > table_size) {
+            if (debug) printf("huffman table too big\n");
+            return false;
           }
+          table[prefix] = table_end << 16 | entry_sub | sub_bits[prefix];
+          for (unsigned i = 0; i != sub_size; ++i) {
+            table[table_end + i] = entry_invalid;
+          }
+          table_end += sub_size;
         }
-        limits[length-min_length] = (uint16_t)( ( huffcode << (16-length) ) - 1 );
-        if (debug) printf("length %d: lim=%04x base=%04x\n", length, ( huffcode << (16-length) ) - 1, base[length-min_length]);
-        if (( huffcode << (16-length) ) - 1 > 0xffff) {
-          if (debug) printf("invalid huffman table\n");
-          return false;
-        }
-        huffcode *= 2;
       }
 
-      // prevent escape from bitstream decoding loop.
-      limits[max_length+1-min_length] = 0xffff;
+      // fill every slot whose low bits match the (bit reversed) code.
+      memcpy(next_code, first_code, sizeof(next_code));
+      for (unsigned i = 0; i != num_lengths; ++i) {
+        unsigned length = lengths[i];
+        if (!length) continue;
+        unsigned rev = reverse_bits(next_code[length]++, length);
+        if (length <= root_bits) {
+          for (unsigned j = rev; j < root_size; j += 1u << length) {
+            table[j] = i << 16 | length;
+          }
+        } else {
+          uint32_t sub = table[rev & (root_size - 1)];
+          uint32_t *sub_table = table + (sub >> 16);
+          unsigned sub_length = length - root_bits;
+          for (unsigned j = rev >> root_bits; j < (1u << (sub & 0xff)); j += 1u << sub_length) {
+            sub_table[j] = i << 16 | sub_length;
+          }
+        }
+      }
       return true;
     }
 
-    /// debug function for dumping bit fields
-    void dump_bits(unsigned value, unsigned bits, const char *name) {
-      char tmp[64];
-      assert(bits<63);
-      for (unsigned i = 0; i != bits; ++i) tmp[i] = ( ( value >> (bits-1-i) ) & 1 ) + '0';
-      tmp[bits] = 0;
-      printf("[%s] %s\n", tmp, name);
+    /// decode one symbol, there must be at least 15 bits in the buffer.
+    /// Returns ~0 for codes not in the table.
+    static unsigned decode_symbol(const uint32_t *table, unsigned root_bits, bit_reader &in) {
+      uint32_t entry = table[in.bits & ((1u << root_bits) - 1)];
+      if (entry & entry_sub) {
+        in.get(root_bits);
+        entry = table[(entry >> 16) + (in.bits & ((1u << (entry & 0xff)) - 1))];
+      }
+      in.get(entry & 0xff);
+      return entry & entry_invalid ? ~0u : entry >> 16;
     }
 
-    /// peek a fixed number of little-endian bits from the bitstream
-    /// note: this will have to be fixed on PPC and other big-endian devices
-    unsigned peek(const uint8_t *src, unsigned bitptr, unsigned bits, const char *name) {
-      unsigned i = bitptr >> 3, j = bitptr & 7;
-      unsigned value = ( (unsigned&)src[i] >> j ) & ( (1u << bits) - 1 );
-      if (name) dump_bits(value, bits, name);
-      return value;
+    /// copy a match which may overlap the bytes it is copying.
+    static void copy_match(uint8_t *dest, unsigned distance, unsigned length, const uint8_t *dest_max) {
+      const uint8_t *src = dest - distance;
+      uint8_t *end = dest + length;
+      if (distance >= 8 && end + 8 <= dest_max) {
+        // eight bytes at a time, each word has already been written.
+        // This can write up to seven bytes past the end which later output will replace.
+        do {
+          memcpy(dest, src, 8);
+          dest += 8;
+          src += 8;
+        } while (dest < end);
+      } else if (distance == 1) {
+        memset(dest, *src, length);
+      } else {
+        while (dest != end) {
+          *dest++ = *src++;
+        }
+      }
     }
 
-    unsigned decode_uncompressed(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) {
-      bitptr = ( bitptr + 7 ) & ~7;
-      unsigned bytes_to_copy = peek(src, bitptr, 16, "bytes_to_copy");
-      unsigned clength = peek(src, bitptr + 16, 16, "store length check");
-      bitptr += 32;
+    bool decode_uncompressed(uint8_t *&dest, uint8_t *dest_max, bit_reader &in) {
+      in.align();
+      if (in.pos + 4 > in.size) return false;
+      const uint8_t *src = in.src + in.pos;
+      unsigned bytes_to_copy = src[0] | src[1] << 8;
+      unsigned clength = src[2] | src[3] << 8;
+      in.pos += 4;
 
-      if (bytes_to_copy != (clength^0xffff)) return ~0;
-      if (dest + bytes_to_copy > dest_max) return ~0;
-      if ((src + bitptr/8) + bytes_to_copy > src_max) return ~0;
+      if (bytes_to_copy != (clength^0xffff)) return false;
+      if (bytes_to_copy > (size_t)(dest_max - dest)) return false;
+      if (bytes_to_copy > in.size - in.pos) return false;
 
-      memcpy(dest, src + bitptr/8, bytes_to_copy);
+      memcpy(dest, in.src + in.pos, bytes_to_copy);
       dest += bytes_to_copy;
-      bitptr += bytes_to_copy * 8;
-      return bitptr;
+      in.pos += bytes_to_copy;
+      return true;
     }
 
-    unsigned decode_lz77(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr, huffman_table *table_) {
+    bool decode_lz77(uint8_t *&dest_, uint8_t *dest_begin, uint8_t *dest_max, bit_reader &in_, const huffman_table &table) {
+      static const uint16_t length_base[] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+      };
+      static const uint8_t length_extra[] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+      };
+      static const uint16_t dist_base[] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+      };
+      static const uint8_t dist_extra[] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+      };
+
+      // local copies stay in registers; stores to dest could alias members.
+      bit_reader in = in_;
+      uint8_t *dest = dest_;
+      bool ok = false;
+
       for(;;) {
-        if (src + bitptr/8 > src_max) return ~0;
-        unsigned peek16 = peek(src, bitptr, 16, NULL);
-        unsigned value = rev16(peek16);
-        unsigned index = 0;
-        while (value > table_->lit_limits[index]) {
-          index++;
-        }
-        unsigned length = table_->min_lit_length + index;
-        unsigned offset = ( value >> ( 16 - length ) );
-        unsigned code = table_->lit_codes[offset - table_->lit_base[index]];
-        bitptr += length;
-        if (debug) dump_bits(peek16, length, "code");
+        // 15 + 5 bits of length and 15 + 13 bits of distance fit in one refill.
+        in.refill();
+        unsigned code = decode_symbol(table.lit, lit_root_bits, in);
 
         if (code < 256) {
-          if (dest+1 > dest_max) return ~0;
-          *dest++ = code;
-          if (debug) printf("%02x\n", code);
+          if (dest == dest_max) break;
+          *dest++ = (uint8_t)code;
         } else if (code == 256) {
-          return bitptr;
+          ok = true;
+          break;
         } else {
-          unsigned block_length;
-          unsigned distance;
-          {
-            if (debug) printf("[%d]\n", code);
-            static const uint8_t extra[] = {
-              0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
-            };
-            static const uint8_t base[] = {
-              3-3, 4-3, 5-3, 6-3, 7-3, 8-3, 9-3, 10-3,
-              11-3, 13-3, 15-3, 17-3, 19-3, 23-3, 27-3, 31-3,
-              35-3, 43-3, 51-3, 59-3, 67-3, 83-3, 99-3, 115-3,
-              131-3, 163-3, 195-3, 227-3, 258-3,
-            };
-            if (code-257 > sizeof(extra)) return ~0;
-            unsigned extra_length = extra[ code-257 ];
-            block_length = base[ code-257 ] + 3 + peek(src, bitptr, extra_length, "extra");
-            bitptr += extra_length;
-          }
-          {
-            //if (src + (bitptr + table_->max_dist_length)/8 > src_max ) return ~0;
-            unsigned peek16 = peek(src, bitptr, 16, NULL);
-            unsigned value = rev16(peek16);
-            unsigned index = 0;
-            while (value > table_->dist_limits[index]) {
-              index++;
-            }
-            unsigned length = table_->min_dist_length + index;
-            unsigned offset = ( value >> ( 16 - length ) );
-            unsigned code = table_->dist_codes[offset - table_->dist_base[index]];
-            bitptr += length;
-
-            if (debug) printf("{%d}\n", code);
-            static const uint8_t extra[] = {
-              0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13, 0, 0, 0,
-            };
-            static const uint16_t base[] = {
-              1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
-            };
-            if (code > sizeof(extra)) return ~0;
-            unsigned extra_length = extra[ code ];
-            distance = base[ code ] + peek(src, bitptr, extra_length, "extra");
-            bitptr += extra_length;
-          }
+          code -= 257;
+          if (code >= sizeof(length_extra)) break;
+          unsigned length = length_base[code] + in.get(length_extra[code]);
 
-          if (debug) printf("length=%d distance=%d\n", block_length, distance);
+          code = decode_symbol(table.dist, dist_root_bits, in);
+          if (code >= sizeof(dist_extra)) break;
+          unsigned distance = dist_base[code] + in.get(dist_extra[code]);
 
-          if (dest+block_length > dest_max) return ~0;
+          if (debug) printf("length=%d distance=%d\n", length, distance);
 
-          for(unsigned i = 0; i != block_length; ++i) {
-            dest[0] = dest[-(int)distance];
-            dest++;
-          }
+          if (distance > (size_t)(dest - dest_begin) || length > (size_t)(dest_max - dest)) break;
+          copy_match(dest, distance, length, dest_max);
+          dest += length;
         }
       }
-    }
 
-    unsigned decode_fixed(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) {
-      return decode_lz77(dest, dest_max, src, src_max, bitptr, &fixed_);
+      if (in.overrun()) ok = false;
+      in_ = in;
+      dest_ = dest;
+      return ok;
     }
 
-    unsigned decode_variable(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) {
-      unsigned num_lit_codes = peek(src, bitptr, 5, "num_lit_codes") + 257;
-      unsigned num_dist_codes = peek(src, bitptr+5, 5, "num_dist_codes") + 1;
-      unsigned num_length_codes = peek(src, bitptr+10, 4, "num_length_codes") + 4;
-      
-      bitptr += 14;
+    bool decode_variable(uint8_t *&dest, uint8_t *dest_begin, uint8_t *dest_max, bit_reader &in) {
+      in.refill();
+      unsigned num_lit_codes = in.get(5) + 257;
+      unsigned num_dist_codes = in.get(5) + 1;
+      unsigned num_length_codes = in.get(4) + 4;
+      if (num_lit_codes > 286 || num_dist_codes > 30) return false;
 
       uint8_t lengths[288 + 32];
-      memset(lengths, 0, 20);
-      if (src + bitptr/8 + num_length_codes > src_max ) return ~0;
+      memset(lengths, 0, 19);
       for (unsigned i = 0; i != num_length_codes; ++i) {
         static const uint8_t order[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
-        lengths[order[i]] = peek(src, bitptr, 3, "length code lenghs");
-        bitptr += 3;
+        in.refill();
+        lengths[order[i]] = (uint8_t)in.get(3);
       }
-      
-      uint16_t codes[19];
-      uint16_t limits[18];
-      uint16_t base[18];
-      uint8_t min_length;
-      uint8_t max_length;
-      if (!build_huffman(lengths, 19, min_length, max_length, codes, limits, base)) return ~0;
-      
+
+      uint32_t length_table[length_table_size];
+      if (!build_huffman(length_table, length_table_size, length_root_bits, lengths, 19)) return false;
+
       unsigned todo = num_lit_codes + num_dist_codes;
       for(unsigned done = 0; done < todo;) {
-        if (src + bitptr/8 + max_length > src_max ) return ~0;
-        unsigned peek16 = peek(src, bitptr, 16, NULL);
-        unsigned value = rev16(peek16);
-        unsigned index = 0;
-        while (value > limits[index]) {
-          index++;
-        }
-        unsigned length = min_length + index;
-        unsigned offset = ( value >> ( 16 - length ) );
-        unsigned code = codes[offset - base[index]];
-        bitptr += length;
-        if (debug) dump_bits(peek16, length, "length");
-        //fprintf(source_.debug(), "code=%03x\n", code);
+        in.refill();
+        unsigned code = decode_symbol(length_table, length_root_bits, in);
         unsigned copy = 1;
         if (code < 16) {
         } else if(code == 16) {
-          if (src + (bitptr+2)/8 > src_max ) return ~0;
-          copy = peek(src, bitptr, 2, NULL) + 3;
-          bitptr += 2;
-          if (done == 0) return ~0;
+          copy = in.get(2) + 3;
+          if (done == 0) return false;
           code = lengths[ done-1 ];
         } else if(code == 17) {
-          if (src + (bitptr+3)/8 > src_max ) return ~0;
-          copy = peek(src, bitptr, 3, NULL) + 3;
-          bitptr += 3;
+          copy = in.get(3) + 3;
           code = 0;
         } else if(code == 18) {
-          if (src + (bitptr+7)/8 > src_max ) return ~0;
-          copy = peek(src, bitptr, 7, NULL) + 11;
-          bitptr += 7;
+          copy = in.get(7) + 11;
           code = 0;
         } else {
-          return ~0;
+          return false;
         }
-        if (done + copy > todo) return ~0;
-        do {
-          lengths[done++] = code;
-        } while( --copy );
+        if (done + copy > todo) return false;
+        memset(lengths + done, code, copy);
+        done += copy;
       }
 
+      if (in.overrun()) return false;
+
       if (debug) printf("lengths done\n");
 
       if(
-        !build_huffman(lengths, num_lit_codes, var_.min_lit_length, var_.max_lit_length, var_.lit_codes, var_.lit_limits, var_.lit_base) ||
-        !build_huffman(lengths+num_lit_codes, num_dist_codes, var_.min_dist_length, var_.max_dist_length, var_.dist_codes, var_.dist_limits, var_.dist_base)
+        !build_huffman(var_.lit, lit_table_size, lit_root_bits, lengths, num_lit_codes) ||
+        !build_huffman(var_.dist, dist_table_size, dist_root_bits, lengths+num_lit_codes, num_dist_codes)
       ) {
-        return ~0;
+        return false;
       }
-      return decode_lz77(dest, dest_max, src, src_max, bitptr, &var_);
+      return decode_lz77(dest, dest_begin, dest_max, in, var_);
     }
-  public:
-    zip_decoder() {
-      uint8_t lit_lengths[288];
-      uint8_t dist_lengths[32];
-      memset(lit_lengths +   0, 8, 144 - 0);
-      memset(lit_lengths + 144, 9, 256-144);
-      memset(lit_lengths + 256, 7, 280-256);
-      memset(lit_lengths + 280, 8, 288-280);
-      memset(dist_lengths, 5, 32);
-      build_huffman(lit_lengths, 288, fixed_.min_lit_length, fixed_.max_lit_length, fixed_.lit_codes, fixed_.lit_limits, fixed_.lit_base);
-      build_huffman(dist_lengths, 32, fixed_.min_dist_length, fixed_.max_dist_length, fixed_.dist_codes, fixed_.dist_limits, fixed_.dist_base);
+    // little-endian fields of zip headers, for benchmark().
+    static unsigned le2(const uint8_t *p) {
+      return p[0] | p[1] << 8;
     }
 
-    void decode(uint8_t *dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max) {
-      unsigned bitptr = 0;
-      unsigned is_last_block;
+    static unsigned le4(const uint8_t *p) {
+      return le2(p) | le2(p + 2) << 16;
+    }
 
-      // for each "deflate" block:
-      do {
-        // prevent (bitptr / 8) from overflowing (>512Mib)
-        src += bitptr / 8;
-        bitptr %= 8;
+    // The decoder that the lookup tables replaced, kept so that benchmark() can compare them.
+    // It finds each code by scanning the limits of each code length in turn.
+    // It reads up to four bytes past src_max, so its input must be padded.
+    class linear_decoder {
+      struct huffman_table {
+        uint8_t min_lit_length;
+        uint8_t max_lit_length;
+        uint8_t min_dist_length;
+        uint8_t max_dist_length;
+        uint16_t lit_codes[288];
+        uint16_t lit_limits[18];
+        uint16_t lit_base[18];
+        uint16_t dist_codes[32];
+        uint16_t dist_limits[18];
+        uint16_t dist_base[18];
+      };
+
+      huffman_table fixed_;
+      huffman_table var_;
+
+      static uint16_t rev16(uint16_t value) {
+        static const uint8_t r256[] = {
+          0x00, 0x80, 0x40, 0xc0, 0x20, 0xa0, 0x60, 0xe0,
+          0x00+0x10, 0x80+0x10, 0x40+0x10, 0xc0+0x10, 0x20+0x10, 0xa0+0x10, 0x60+0x10, 0xe0+0x10,
+          0x00+8, 0x80+8, 0x40+8, 0xc0+8, 0x20+8, 0xa0+8, 0x60+8, 0xe0+8,
+          0x00+0x10+8, 0x80+0x10+8, 0x40+0x10+8, 0xc0+0x10+8, 0x20+0x10+8, 0xa0+0x10+8, 0x60+0x10+8, 0xe0+0x10+8,
+          0x00+ 4, 0x80+ 4, 0x40+ 4, 0xc0+ 4, 0x20+ 4, 0xa0+ 4, 0x60+ 4, 0xe0+ 4,
+          0x00+0x10+ 4, 0x80+0x10+ 4, 0x40+0x10+ 4, 0xc0+0x10+ 4, 0x20+0x10+ 4, 0xa0+0x10+ 4, 0x60+0x10+ 4, 0xe0+0x10+ 4,
+          0x00+8+ 4, 0x80+8+ 4, 0x40+8+ 4, 0xc0+8+ 4, 0x20+8+ 4, 0xa0+8+ 4, 0x60+8+ 4, 0xe0+8+ 4,
+          0x00+0x10+8+ 4, 0x80+0x10+8+ 4, 0x40+0x10+8+ 4, 0xc0+0x10+8+ 4, 0x20+0x10+8+ 4, 0xa0+0x10+8+ 4, 0x60+0x10+8+ 4, 0xe0+0x10+8+ 4,
+          0x00+ 2, 0x80+ 2, 0x40+ 2, 0xc0+ 2, 0x20+ 2, 0xa0+ 2, 0x60+ 2, 0xe0+ 2,
+          0x00+0x10+ 2, 0x80+0x10+ 2, 0x40+0x10+ 2, 0xc0+0x10+ 2, 0x20+0x10+ 2, 0xa0+0x10+ 2, 0x60+0x10+ 2, 0xe0+0x10+ 2,
+          0x00+8+ 2, 0x80+8+ 2, 0x40+8+ 2, 0xc0+8+ 2, 0x20+8+ 2, 0xa0+8+ 2, 0x60+8+ 2, 0xe0+8+ 2,
+          0x00+0x10+8+ 2, 0x80+0x10+8+ 2, 0x40+0x10+8+ 2, 0xc0+0x10+8+ 2, 0x20+0x10+8+ 2, 0xa0+0x10+8+ 2, 0x60+0x10+8+ 2, 0xe0+0x10+8+ 2,
+          0x00+ 4+ 2, 0x80+ 4+ 2, 0x40+ 4+ 2, 0xc0+ 4+ 2, 0x20+ 4+ 2, 0xa0+ 4+ 2, 0x60+ 4+ 2, 0xe0+ 4+ 2,
+          0x00+0x10+ 4+ 2, 0x80+0x10+ 4+ 2, 0x40+0x10+ 4+ 2, 0xc0+0x10+ 4+ 2, 0x20+0x10+ 4+ 2, 0xa0+0x10+ 4+ 2, 0x60+0x10+ 4+ 2, 0xe0+0x10+ 4+ 2,
+          0x00+8+ 4+ 2, 0x80+8+ 4+ 2, 0x40+8+ 4+ 2, 0xc0+8+ 4+ 2, 0x20+8+ 4+ 2, 0xa0+8+ 4+ 2, 0x60+8+ 4+ 2, 0xe0+8+ 4+ 2,
+          0x00+0x10+8+ 4+ 2, 0x80+0x10+8+ 4+ 2, 0x40+0x10+8+ 4+ 2, 0xc0+0x10+8+ 4+ 2, 0x20+0x10+8+ 4+ 2, 0xa0+0x10+8+ 4+ 2, 0x60+0x10+8+ 4+ 2, 0xe0+0x10+8+ 4+ 2,
+          0x00+ 1, 0x80+ 1, 0x40+ 1, 0xc0+ 1, 0x20+ 1, 0xa0+ 1, 0x60+ 1, 0xe0+ 1,
+          0x00+0x10+ 1, 0x80+0x10+ 1, 0x40+0x10+ 1, 0xc0+0x10+ 1, 0x20+0x10+ 1, 0xa0+0x10+ 1, 0x60+0x10+ 1, 0xe0+0x10+ 1,
+          0x00+8+ 1, 0x80+8+ 1, 0x40+8+ 1, 0xc0+8+ 1, 0x20+8+ 1, 0xa0+8+ 1, 0x60+8+ 1, 0xe0+8+ 1,
+          0x00+0x10+8+ 1, 0x80+0x10+8+ 1, 0x40+0x10+8+ 1, 0xc0+0x10+8+ 1, 0x20+0x10+8+ 1, 0xa0+0x10+8+ 1, 0x60+0x10+8+ 1, 0xe0+0x10+8+ 1,
+          0x00+ 4+ 1, 0x80+ 4+ 1, 0x40+ 4+ 1, 0xc0+ 4+ 1, 0x20+ 4+ 1, 0xa0+ 4+ 1, 0x60+ 4+ 1, 0xe0+ 4+ 1,
+          0x00+0x10+ 4+ 1, 0x80+0x10+ 4+ 1, 0x40+0x10+ 4+ 1, 0xc0+0x10+ 4+ 1, 0x20+0x10+ 4+ 1, 0xa0+0x10+ 4+ 1, 0x60+0x10+ 4+ 1, 0xe0+0x10+ 4+ 1,
+          0x00+8+ 4+ 1, 0x80+8+ 4+ 1, 0x40+8+ 4+ 1, 0xc0+8+ 4+ 1, 0x20+8+ 4+ 1, 0xa0+8+ 4+ 1, 0x60+8+ 4+ 1, 0xe0+8+ 4+ 1,
+          0x00+0x10+8+ 4+ 1, 0x80+0x10+8+ 4+ 1, 0x40+0x10+8+ 4+ 1, 0xc0+0x10+8+ 4+ 1, 0x20+0x10+8+ 4+ 1, 0xa0+0x10+8+ 4+ 1, 0x60+0x10+8+ 4+ 1, 0xe0+0x10+8+ 4+ 1,
+          0x00+ 2+ 1, 0x80+ 2+ 1, 0x40+ 2+ 1, 0xc0+ 2+ 1, 0x20+ 2+ 1, 0xa0+ 2+ 1, 0x60+ 2+ 1, 0xe0+ 2+ 1,
+          0x00+0x10+ 2+ 1, 0x80+0x10+ 2+ 1, 0x40+0x10+ 2+ 1, 0xc0+0x10+ 2+ 1, 0x20+0x10+ 2+ 1, 0xa0+0x10+ 2+ 1, 0x60+0x10+ 2+ 1, 0xe0+0x10+ 2+ 1,
+          0x00+8+ 2+ 1, 0x80+8+ 2+ 1, 0x40+8+ 2+ 1, 0xc0+8+ 2+ 1, 0x20+8+ 2+ 1, 0xa0+8+ 2+ 1, 0x60+8+ 2+ 1, 0xe0+8+ 2+ 1,
+          0x00+0x10+8+ 2+ 1, 0x80+0x10+8+ 2+ 1, 0x40+0x10+8+ 2+ 1, 0xc0+0x10+8+ 2+ 1, 0x20+0x10+8+ 2+ 1, 0xa0+0x10+8+ 2+ 1, 0x60+0x10+8+ 2+ 1, 0xe0+0x10+8+ 2+ 1,
+          0x00+ 4+ 2+ 1, 0x80+ 4+ 2+ 1, 0x40+ 4+ 2+ 1, 0xc0+ 4+ 2+ 1, 0x20+ 4+ 2+ 1, 0xa0+ 4+ 2+ 1, 0x60+ 4+ 2+ 1, 0xe0+ 4+ 2+ 1,
+          0x00+0x10+ 4+ 2+ 1, 0x80+0x10+ 4+ 2+ 1, 0x40+0x10+ 4+ 2+ 1, 0xc0+0x10+ 4+ 2+ 1, 0x20+0x10+ 4+ 2+ 1, 0xa0+0x10+ 4+ 2+ 1, 0x60+0x10+ 4+ 2+ 1, 0xe0+0x10+ 4+ 2+ 1,
+          0x00+8+ 4+ 2+ 1, 0x80+8+ 4+ 2+ 1, 0x40+8+ 4+ 2+ 1, 0xc0+8+ 4+ 2+ 1, 0x20+8+ 4+ 2+ 1, 0xa0+8+ 4+ 2+ 1, 0x60+8+ 4+ 2+ 1, 0xe0+8+ 4+ 2+ 1,
+          0x00+0x10+8+ 4+ 2+ 1, 0x80+0x10+8+ 4+ 2+ 1, 0x40+0x10+8+ 4+ 2+ 1, 0xc0+0x10+8+ 4+ 2+ 1, 0x20+0x10+8+ 4+ 2+ 1, 0xa0+0x10+8+ 4+ 2+ 1, 0x60+0x10+8+ 4+ 2+ 1, 0xe0+0x10+8+ 4+ 2+ 1,
+        };
+        return r256[value&0xff] << 8 | r256[(value>>8)&0xff];
+      }
+
+      static bool build_huffman(uint8_t *lengths, unsigned num_lengths, uint8_t &min_length, uint8_t &max_length, uint16_t *codes, uint16_t *limits, uint16_t *base) {
+        min_length = 16;
+        max_length = 0;
+        for (unsigned i = 0; i != num_lengths; ++i) {
+          if (lengths[i]) {
+            if (min_length > lengths[i]) min_length = lengths[i];
+            if (max_length < lengths[i]) max_length = lengths[i];
+          }
+        }
+        if (min_length <= 0 || min_length > max_length || max_length > 16) {
+          return false;
+        }
+
+        unsigned code = 0;
+        unsigned huffcode = 0;
+        for (unsigned length = min_length; length <= max_length; ++length) {
+          base[length-min_length] = huffcode - code;
+          for (unsigned i = 0; i != num_lengths; ++i) {
+            if (lengths[i] == length) {
+              codes[code++] = i;
+              huffcode++;
+            }
+          }
+          limits[length-min_length] = (uint16_t)((huffcode << (16-length)) - 1);
+          if ((huffcode << (16-length)) - 1 > 0xffff) {
+            return false;
+          }
+          huffcode *= 2;
+        }
+
+        // prevent escape from bitstream decoding loop.
+        limits[max_length+1-min_length] = 0xffff;
+        return true;
+      }
+
+      // peek a fixed number of little-endian bits from the bitstream
+      static unsigned peek(const uint8_t *src, unsigned bitptr, unsigned bits) {
+        unsigned i = bitptr >> 3, j = bitptr & 7;
+        unsigned word;
+        memcpy(&word, src + i, 4);
+        return (word >> j) & ((1u << bits) - 1);
+      }
+
+      static unsigned decode_uncompressed(uint8_t *&dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) {
+        bitptr = (bitptr + 7) & ~7;
+        unsigned bytes_to_copy = peek(src, bitptr, 16);
+        unsigned clength = peek(src, bitptr + 16, 16);
+        bitptr += 32;
+
+        if (bytes_to_copy != (clength^0xffff)) return ~0;
+        if (dest + bytes_to_copy > dest_max) return ~0;
+        if ((src + bitptr/8) + bytes_to_copy > src_max) return ~0;
+
+        memcpy(dest, src + bitptr/8, bytes_to_copy);
+        dest += bytes_to_copy;
+        bitptr += bytes_to_copy * 8;
+        return bitptr;
+      }
+
+      static unsigned decode_lz77(uint8_t *&dest, const uint8_t *dest_begin, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr, const huffman_table *table_) {
+        static const uint8_t length_extra[] = {
+          0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+        };
+        static const uint8_t length_base[] = {
+          3-3, 4-3, 5-3, 6-3, 7-3, 8-3, 9-3, 10-3,
+          11-3, 13-3, 15-3, 17-3, 19-3, 23-3, 27-3, 31-3,
+          35-3, 43-3, 51-3, 59-3, 67-3, 83-3, 99-3, 115-3,
+          131-3, 163-3, 195-3, 227-3, 258-3,
+        };
+        static const uint8_t dist_extra[] = {
+          0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+        };
+        static const uint16_t dist_base[] = {
+          1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+        };
+        for (;;) {
+          if (src + bitptr/8 > src_max) return ~0;
+          unsigned value = rev16(peek(src, bitptr, 16));
+          unsigned index = 0;
+          while (value > table_->lit_limits[index]) {
+            index++;
+          }
+          unsigned length = table_->min_lit_length + index;
+          unsigned code = table_->lit_codes[(value >> (16 - length)) - table_->lit_base[index]];
+          bitptr += length;
+
+          if (code < 256) {
+            if (dest+1 > dest_max) return ~0;
+            *dest++ = code;
+          } else if (code == 256) {
+            return bitptr;
+          } else {
+            if (code - 257 >= sizeof(length_extra)) return ~0;
+            unsigned extra_length = length_extra[code-257];
+            unsigned block_length = length_base[code-257] + 3 + peek(src, bitptr, extra_length);
+            bitptr += extra_length;
+
+            value = rev16(peek(src, bitptr, 16));
+            index = 0;
+            while (value > table_->dist_limits[index]) {
+              index++;
+            }
+            length = table_->min_dist_length + index;
+            code = table_->dist_codes[(value >> (16 - length)) - table_->dist_base[index]];
+            bitptr += length;
+            if (code >= sizeof(dist_extra)) return ~0;
+            extra_length = dist_extra[code];
+            unsigned distance = dist_base[code] + peek(src, bitptr, extra_length);
+            bitptr += extra_length;
+
+            if (dest+block_length > dest_max || distance > (unsigned)(dest - dest_begin)) return ~0;
+            for (unsigned i = 0; i != block_length; ++i) {
+              dest[0] = dest[-(int)distance];
+              dest++;
+            }
+          }
+        }
+      }
+
+      unsigned decode_variable(uint8_t *&dest, const uint8_t *dest_begin, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max, unsigned bitptr) {
+        unsigned num_lit_codes = peek(src, bitptr, 5) + 257;
+        unsigned num_dist_codes = peek(src, bitptr+5, 5) + 1;
+        unsigned num_length_codes = peek(src, bitptr+10, 4) + 4;
+        bitptr += 14;
+
+        uint8_t lengths[288 + 32];
+        memset(lengths, 0, 20);
+        if (src + bitptr/8 + num_length_codes > src_max) return ~0;
+        for (unsigned i = 0; i != num_length_codes; ++i) {
+          static const uint8_t order[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+          lengths[order[i]] = peek(src, bitptr, 3);
+          bitptr += 3;
+        }
+
+        uint16_t codes[19];
+        uint16_t limits[18];
+        uint16_t base[18];
+        uint8_t min_length;
+        uint8_t max_length;
+        if (!build_huffman(lengths, 19, min_length, max_length, codes, limits, base)) return ~0;
+
+        unsigned todo = num_lit_codes + num_dist_codes;
+        for (unsigned done = 0; done < todo;) {
+          if (src + bitptr/8 + max_length > src_max) return ~0;
+          unsigned value = rev16(peek(src, bitptr, 16));
+          unsigned index = 0;
+          while (value > limits[index]) {
+            index++;
+          }
+          unsigned length = min_length + index;
+          unsigned code = codes[(value >> (16 - length)) - base[index]];
+          bitptr += length;
+          unsigned copy = 1;
+          if (code < 16) {
+          } else if (code == 16) {
+            copy = peek(src, bitptr, 2) + 3;
+            bitptr += 2;
+            if (done == 0) return ~0;
+            code = lengths[done-1];
+          } else if (code == 17) {
+            copy = peek(src, bitptr, 3) + 3;
+            bitptr += 3;
+            code = 0;
+          } else if (code == 18) {
+            copy = peek(src, bitptr, 7) + 11;
+            bitptr += 7;
+            code = 0;
+          } else {
+            return ~0;
+          }
+          if (done + copy > todo) return ~0;
+          do {
+            lengths[done++] = code;
+          } while (--copy);
+        }
+
+        if (
+          !build_huffman(lengths, num_lit_codes, var_.min_lit_length, var_.max_lit_length, var_.lit_codes, var_.lit_limits, var_.lit_base) ||
+          !build_huffman(lengths+num_lit_codes, num_dist_codes, var_.min_dist_length, var_.max_dist_length, var_.dist_codes, var_.dist_limits, var_.dist_base)
+        ) {
+          return ~0;
+        }
+        return decode_lz77(dest, dest_begin, dest_max, src, src_max, bitptr, &var_);
+      }
+
+    public:
+      linear_decoder() {
+        uint8_t lit_lengths[288];
+        uint8_t dist_lengths[32];
+        memset(lit_lengths +   0, 8, 144 - 0);
+        memset(lit_lengths + 144, 9, 256-144);
+        memset(lit_lengths + 256, 7, 280-256);
+        memset(lit_lengths + 280, 8, 288-280);
+        memset(dist_lengths, 5, 32);
+        build_huffman(lit_lengths, 288, fixed_.min_lit_length, fixed_.max_lit_length, fixed_.lit_codes, fixed_.lit_limits, fixed_.lit_base);
+        build_huffman(dist_lengths, 32, fixed_.min_dist_length, fixed_.max_dist_length, fixed_.dist_codes, fixed_.dist_limits, fixed_.dist_base);
+      }
+
+      bool decode(uint8_t *dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max) {
+        const uint8_t *dest_begin = dest;
+        unsigned bitptr = 0;
+        unsigned is_last_block;
+        do {
+          src += bitptr / 8;
+          bitptr %= 8;
+          is_last_block = peek(src, bitptr, 1);
+          unsigned kind = peek(src, bitptr + 1, 2);
+          bitptr += 3;
+          switch (kind) {
+            case 0: bitptr = decode_uncompressed(dest, dest_max, src, src_max, bitptr); break;
+            case 1: bitptr = decode_lz77(dest, dest_begin, dest_max, src, src_max, bitptr, &fixed_); break;
+            case 2: bitptr = decode_variable(dest, dest_begin, dest_max, src, src_max, bitptr); break;
+            default: return false;
+          }
+        } while (!is_last_block && bitptr != ~0u);
+        return bitptr != ~0u;
+      }
+    };
+
+  public:
+    /// Inflate a deflate stream from src into dest.
+    /// Returns false if the stream is corrupt or does not fit in dest.
+    /// Input is never read beyond src_max.
+    bool decode(uint8_t *dest, uint8_t *dest_max, const uint8_t *src, const uint8_t *src_max) {
+      uint8_t *dest_begin = dest;
+      bit_reader in;
+      in.src = src;
+      in.size = (size_t)(src_max - src);
+      in.pos = 0;
+      in.bits = 0;
+      in.num_bits = 0;
 
+      // for each "deflate" block:
+      for (;;) {
         // three bits determine kind and exit condition
-        is_last_block = peek(src, bitptr, 1, "deflate last") != 0;
-        unsigned kind = peek(src, bitptr + 1, 2, "deflate kind");
+        in.refill();
+        unsigned is_last_block = in.get(1);
+        unsigned kind = in.get(2);
 
-        bitptr += 3;
+        bool ok = false;
         switch (kind) {
-        case 0: bitptr = decode_uncompressed(dest, dest_max, src, src_max, bitptr); break;
-        case 1: bitptr = decode_fixed(dest, dest_max, src, src_max, bitptr); break;
-        case 2: bitptr = decode_variable(dest, dest_max, src, src_max, bitptr); break;
-        default: return;
+        case 0: ok = decode_uncompressed(dest, dest_max, in); break;
+        case 1: ok = decode_lz77(dest, dest_begin, dest_max, in, get_fixed()); break;
+        case 2: ok = decode_variable(dest, dest_begin, dest_max, in); break;
+        }
+
+        if (!ok) {
+          if (debug) printf("zip_decoder: bad deflate block at %d\n", (int)in.pos);
+          return false;
+        }
+
+        if (is_last_block) {
+          return true;
         }
-      } while( !is_last_block && bitptr != ~0);
+      }
+    }
+
+    /// Time inflating every deflated file in a zip archive with this decoder and with the linear scan decoder it replaced.
+    static void benchmark(const char *path, unsigned repeats = 5) {
+      FILE *file = fopen(path, "rb");
+      if (!file) {
+        log("zip_decoder: could not open %s\n", path);
+        return;
+      }
+      fseek(file, 0, SEEK_END);
+      size_t size = (size_t)ftell(file);
+      fseek(file, 0, SEEK_SET);
+      dynarray<uint8_t> zip((unsigned)size);
+      size_t read = size ? fread(zip.data(), 1, size, file) : 0;
+      fclose(file);
+      if (read != size || size < 22) return;
+
+      // find the deflated files from the central directory at the end of the archive.
+      const uint8_t *z = zip.data();
+      size_t end = size - 22;
+      while (end != 0 && le4(z + end) != 0x06054b50) --end;
+      struct stream { size_t offset, csize, usize; };
+      dynarray<stream> streams;
+      size_t max_usize = 0, total = 0;
+      size_t pos = le4(z + end + 16);
+      for (unsigned i = 0, n = le2(z + end + 10); i != n && pos + 46 <= end && le4(z + pos) == 0x02014b50; ++i) {
+        const uint8_t *d = z + pos;
+        size_t local = le4(d + 42);
+        pos += 46 + le2(d + 28) + le2(d + 30) + le2(d + 32);
+        if (le2(d + 10) != 8 || local + 30 > size) continue;
+        stream s = { local + 30 + le2(z + local + 26) + le2(z + local + 28), le4(d + 20), le4(d + 24) };
+        if (s.offset > size || s.csize > size - s.offset) continue;
+        streams.push_back(s);
+        if (s.usize > max_usize) max_usize = s.usize;
+        total += s.usize;
+      }
+
+      // the linear scan decoder reads past the end of its input, so give it padded copies.
+      dynarray<uint8_t> out((unsigned)max_usize), check((unsigned)max_usize), padded;
+      zip_decoder tables;
+      linear_decoder linear;
+      unsigned mismatches = 0;
+      for (unsigned i = 0; i != streams.size(); ++i) {
+        const stream &s = streams[i];
+        padded.resize((unsigned)s.csize + 4);
+        memcpy(padded.data(), z + s.offset, s.csize);
+        bool ok_tables = tables.decode(out.data(), out.data() + s.usize, z + s.offset, z + s.offset + s.csize);
+        bool ok_linear = linear.decode(check.data(), check.data() + s.usize, padded.data(), padded.data() + s.csize);
+        if (ok_tables != ok_linear || memcmp(out.data(), check.data(), s.usize)) mismatches++;
+      }
+
+      const char *names[2] = { "tables", "linear scan" };
+      for (unsigned k = 0; k != 2; ++k) {
+        auto start = std::chrono::high_resolution_clock::now();
+        for (unsigned r = 0; r != repeats; ++r) {
+          for (unsigned i = 0; i != streams.size(); ++i) {
+            const stream &s = streams[i];
+            if (k == 0) {
+              tables.decode(out.data(), out.data() + s.usize, z + s.offset, z + s.offset + s.csize);
+            } else {
+              padded.resize((unsigned)s.csize + 4);
+              memcpy(padded.data(), z + s.offset, s.csize);
+              linear.decode(out.data(), out.data() + s.usize, padded.data(), padded.data() + s.csize);
+            }
+          }
+        }
+        double secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        double mb = (double)total * repeats / 1048576.0;
+        log("zip_decoder %s: %d files, %.1f MB in %.3fs, %.1f MB/s\n", names[k], streams.size(), mb, secs, mb / secs);
+      }
+      if (mismatches) log("zip_decoder: %d files decoded differently\n", mismatches);
     }
   };
 }}
-
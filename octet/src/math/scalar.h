@@ -178,6 +178,11 @@ namespace octet { namespace math {
     return res;
   }
 
+  /// count trailing zeros. Examples: 0x00000001 -> 0, 0x00000100 -> 8, 0x00000000 -> 32
+  inline static int ctz(uint32_t v) {
+    return v ? 31 - clz(v & (0 - v)) : 32;
+  }
+
   /// floor(log(2, v))
   inline static int ilog2(uint32_t v) {
     return 31 - (int)clz(v);
@@ -216,6 +221,10 @@ namespace octet { namespace math {
         assert(clz(0x00ffffff) == 8);
         assert(clz(0x00000040) == 25);
         assert(clz(0x00000000) == 32);
+        assert(ctz(0x00000001) == 0);
+        assert(ctz(0x00000100) == 8);
+        assert(ctz(0x80000000) == 31);
+        assert(ctz(0x00000000) == 32);
         assert(ilog2(1<<7) == 7);
         assert(ilog2((1<<7)+1) == 7);
         assert(ilog2((1<<7)-1) == 6);
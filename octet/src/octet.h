@@ -102,6 +102,7 @@
   // target specific support: Windows, Mac, Linux, PS Vita
   #include "platform/machine_specific.h"
   #include "platform/args_parser.h"
+  #include "platform/thread_pool.h"
 
   // math library
   #include "math/math.h"
@@ -148,6 +149,7 @@
   #include "helpers/helper_fps_controller.h"
 
   // asset loaders
+  #include "loaders/obj_loader.h"
   #include "loaders/collada_builder.h"
 
   // forward references
@@ -55,6 +55,12 @@
 #include <iostream>
 #include <fstream>
 #include <cmath>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <chrono>
 
 #if defined(WIN32)
   #include <direct.h>
@@ -42,6 +42,13 @@ static char *get_sprintf_buffer() {
   #include <sys/socket.h>
   #include <sys/ioctl.h>
   #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <dirent.h>
+  #include <utime.h>
+  #if OCTET_SSE
+    #include <emmintrin.h>
+  #endif
   #include <netinet/in.h>
   #define OCTET_HOT __attribute__( ( always_inline ) )
   #define ioctlsocket ioctl
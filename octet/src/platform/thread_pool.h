@@ -0,0 +1,159 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Pool of worker threads for data parallel loops
+//
+
+namespace octet { namespace platform {
+  /// A pool of worker threads that share the iterations of a loop.
+  ///
+  /// The calling thread also does work, so on a single core machine the loop simply runs serially.
+  /// Only one loop runs on the pool at a time. If a loop is started from inside another loop,
+  /// or from a second thread, it runs serially on the calling thread.
+  ///
+  /// Example
+  ///
+  ///     thread_pool::get().parallel_for(0, num_rows, [&](unsigned row) {
+  ///       process_row(row);
+  ///     });
+  ///
+  class thread_pool {
+    dynarray<std::thread*> threads;
+
+    // set while a loop owns the pool. A second loop, nested or from another thread, runs serially.
+    std::atomic<bool> busy;
+
+    // protects the state below
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+
+    // the current loop
+    std::function<void (unsigned)> kernel;
+    std::atomic<unsigned> next;
+    unsigned end;
+    unsigned grain;
+    unsigned generation;
+    unsigned num_running;
+    bool quit;
+
+    // share out the iterations of the current loop in blocks of grain.
+    void run_loop() {
+      for (;;) {
+        unsigned i = next.fetch_add(grain);
+        if (i >= end) break;
+        unsigned block_end = end - i < grain ? end : i + grain;
+        for (; i != block_end; ++i) {
+          kernel(i);
+        }
+      }
+    }
+
+    void worker() {
+      unsigned seen = 0;
+      for (;;) {
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          while (!quit && generation == seen) {
+            work_ready.wait(lock);
+          }
+          if (quit) return;
+          seen = generation;
+        }
+
+        run_loop();
+
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          if (--num_running == 0) {
+            work_done.notify_one();
+          }
+        }
+      }
+    }
+
+  public:
+    /// Make a pool with num_threads workers. By default, use one worker per extra core.
+    thread_pool(unsigned num_threads = ~0u) {
+      next = 0;
+      end = 0;
+      grain = 1;
+      generation = 0;
+      num_running = 0;
+      quit = false;
+      busy = false;
+      if (num_threads == ~0u) {
+        unsigned num_cores = std::thread::hardware_concurrency();
+        num_threads = num_cores ? num_cores - 1 : 0;
+      }
+      for (unsigned i = 0; i != num_threads; ++i) {
+        threads.push_back(new std::thread(&thread_pool::worker, this));
+      }
+    }
+
+    /// Stop and join the workers.
+    ~thread_pool() {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        quit = true;
+        work_ready.notify_all();
+      }
+      for (unsigned i = 0; i != threads.size(); ++i) {
+        threads[i]->join();
+        delete threads[i];
+      }
+    }
+
+    /// The pool shared by the framework.
+    static thread_pool &get() {
+      static thread_pool instance;
+      return instance;
+    }
+
+    /// Number of threads that take part in a loop, including the caller.
+    unsigned get_num_threads() const {
+      return threads.size() + 1;
+    }
+
+    /// Call fn(i) for i in [begin, end) using all the threads in the pool.
+    /// The iterations may run in any order. Returns when they are all done.
+    /// grain is the number of iterations that a thread takes at a time.
+    template <class fn_t> void parallel_for(unsigned begin, unsigned end_, fn_t fn, unsigned grain_ = 1) {
+      if (end_ <= begin) return;
+
+      bool was_busy = false;
+      if (threads.empty() || end_ - begin <= grain_ || !busy.compare_exchange_strong(was_busy, true)) {
+        for (unsigned i = begin; i != end_; ++i) {
+          fn(i);
+        }
+        return;
+      }
+
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        kernel = fn;
+        next = begin;
+        end = end_;
+        grain = grain_ ? grain_ : 1;
+        num_running = threads.size();
+        generation++;
+        work_ready.notify_all();
+      }
+
+      run_loop();
+
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (num_running != 0) {
+          work_done.wait(lock);
+        }
+        kernel = std::function<void (unsigned)>();
+      }
+
+      busy = false;
+    }
+  };
+} }
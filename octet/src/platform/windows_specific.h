@@ -60,6 +60,8 @@
 // some standard c++ definitions
 #include <map>
 #include <malloc.h>
+#include <sys/stat.h>
+#include <sys/utime.h>
 
 // windows only supports OpenGL 1.2 natively
 // so we need to extend this by getting the addresses of the extra functions
@@ -79,6 +81,7 @@
 #define OCTET_HOT __forceinline
 
 #include <xmmintrin.h>
+#include <emmintrin.h>
 #define snprintf sprintf_s
 
 namespace octet {
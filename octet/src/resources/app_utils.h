@@ -50,8 +50,11 @@ namespace octet { namespace resources {
     }
 
     /// open a zip file for a given URL
+    /// Loader threads can call this at the same time.
     static zip_file *get_zip_file(const char *url) {
+      static std::mutex zip_files_mutex;
       static dictionary<ref<zip_file> > zip_files;
+      std::lock_guard<std::mutex> lock(zip_files_mutex);
       int index = zip_files.get_index(url);
       if (index == -1) {
         return zip_files[url] = new zip_file(get_path(url));
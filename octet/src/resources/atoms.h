@@ -144,3 +144,13 @@ OCTET_ATOM(npos)
 OCTET_ATOM(diffuse_light)
 OCTET_ATOM(specular_light)
 OCTET_ATOM(first_index)
+OCTET_ATOM(sub_target)
+OCTET_ATOM(component)
+OCTET_ATOM(weld_epsilon)
+OCTET_ATOM(view_dir)
+OCTET_ATOM(shader)
+OCTET_ATOM(vertex_shader)
+OCTET_ATOM(fragment_shader)
+OCTET_ATOM(overdraw_threshold)
+OCTET_ATOM(ratio)
+OCTET_ATOM(max_error)
@@ -0,0 +1,292 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// load resources on background threads
+//
+
+namespace octet { namespace resources {
+  /// Loads resources on background threads and finishes them on the render thread.
+  ///
+  /// A job has two parts. The load part runs on a worker thread and returns the number of
+  /// bytes that the finish part will send to the GPU. The finish part runs in update(), which
+  /// the render thread calls once a frame (visual_scene::begin_render does this).
+  ///
+  /// Loads start in order of priority, highest first, and in the order they were added within a priority.
+  /// update() finishes loaded jobs in the order that they were loaded until the frame's byte budget is spent,
+  /// so a burst of new textures is spread over several frames instead of making one long frame.
+  /// At least one job is finished per frame, however big.
+  ///
+  /// Example
+  ///
+  ///     background_loader::get().add(
+  ///       [=]() { decode(); return size; },
+  ///       [=]() { upload(); }
+  ///     );
+  ///     ...
+  ///     // every frame
+  ///     background_loader::get().update();
+  ///
+  class background_loader {
+    struct job {
+      std::function<size_t ()> load;
+      std::function<void ()> finish;
+      int priority;
+      unsigned sequence;
+      size_t bytes;
+    };
+
+    dynarray<std::thread*> threads;
+    unsigned num_threads;
+
+    // protects the state below
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+
+    // waiting to load, loading and waiting to finish
+    dynarray<job*> queued;
+    unsigned num_loading;
+    dynarray<job*> loaded;
+
+    unsigned next_sequence;
+    size_t frame_budget;
+    bool quit;
+
+    // counters
+    unsigned num_finished;
+    uint64_t bytes_finished;
+
+    // take the best queued job. Call with the mutex held.
+    job *pop_queued() {
+      unsigned best = 0;
+      for (unsigned i = 1; i != queued.size(); ++i) {
+        const job *a = queued[i], *b = queued[best];
+        if (a->priority > b->priority || (a->priority == b->priority && a->sequence < b->sequence)) {
+          best = i;
+        }
+      }
+      job *result = queued[best];
+      queued.erase(best);
+      return result;
+    }
+
+    void worker() {
+      for (;;) {
+        job *j = 0;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          while (!quit && queued.empty()) {
+            work_ready.wait(lock);
+          }
+          if (quit) return;
+          j = pop_queued();
+          num_loading++;
+        }
+
+        j->bytes = j->load();
+
+        // jobs with nothing to finish are done now; do not leave them waiting for update().
+        bool done = !j->finish;
+        if (done) delete j;
+
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          if (!done) loaded.push_back(j);
+          num_loading--;
+          work_done.notify_all();
+        }
+      }
+    }
+
+  public:
+    /// Make a loader with num_threads workers. By default, use one worker per extra core, and at least one.
+    /// The threads start when the first job is added.
+    background_loader(unsigned num_threads_ = ~0u) {
+      if (num_threads_ == ~0u) {
+        unsigned num_cores = std::thread::hardware_concurrency();
+        num_threads_ = num_cores > 1 ? num_cores - 1 : 1;
+      }
+      num_threads = num_threads_ ? num_threads_ : 1;
+      num_loading = 0;
+      next_sequence = 0;
+      frame_budget = 8 * 1024 * 1024;
+      quit = false;
+      num_finished = 0;
+      bytes_finished = 0;
+    }
+
+    /// Stop and join the workers. Jobs that have not finished are dropped.
+    ~background_loader() {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        quit = true;
+        work_ready.notify_all();
+      }
+      for (unsigned i = 0; i != threads.size(); ++i) {
+        threads[i]->join();
+        delete threads[i];
+      }
+      for (unsigned i = 0; i != queued.size(); ++i) {
+        delete queued[i];
+      }
+      for (unsigned i = 0; i != loaded.size(); ++i) {
+        delete loaded[i];
+      }
+    }
+
+    /// The loader shared by the framework.
+    static background_loader &get() {
+      static background_loader instance;
+      return instance;
+    }
+
+    /// Bytes to finish per call to update(). The default is 8MB.
+    void set_frame_budget(size_t bytes) {
+      frame_budget = bytes;
+    }
+
+    /// Add a job. load() runs on a worker thread and returns the size of the upload.
+    /// finish() runs on the thread that calls update(). If finish is empty, the job is freed as soon
+    /// as it has loaded, so background work that needs no render thread step works without update().
+    void add(std::function<size_t ()> load, std::function<void ()> finish, int priority = 0) {
+      job *j = new job();
+      j->load = load;
+      j->finish = finish;
+      j->priority = priority;
+      j->bytes = 0;
+
+      std::unique_lock<std::mutex> lock(mutex);
+      j->sequence = next_sequence++;
+      queued.push_back(j);
+      if (threads.empty()) {
+        for (unsigned i = 0; i != num_threads; ++i) {
+          threads.push_back(new std::thread(&background_loader::worker, this));
+        }
+      }
+      work_ready.notify_one();
+    }
+
+    /// Finish loaded jobs until the frame budget is spent. Call this once a frame on the render thread.
+    /// Returns the number of jobs finished.
+    unsigned update() {
+      unsigned count = 0;
+      size_t spent = 0;
+      while (spent < frame_budget) {
+        job *j = 0;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          if (loaded.empty()) break;
+          j = loaded[0];
+          loaded.erase(0u);
+        }
+        j->finish();
+        spent += j->bytes;
+        num_finished++;
+        bytes_finished += j->bytes;
+        delete j;
+        count++;
+      }
+      return count;
+    }
+
+    /// Wait until every job added so far has loaded. They still need update() to finish.
+    void wait() {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (!queued.empty() || num_loading != 0) {
+        work_done.wait(lock);
+      }
+    }
+
+    /// Load and finish every job, ignoring the budget. Useful behind a loading screen.
+    void flush() {
+      size_t budget = frame_budget;
+      frame_budget = ~(size_t)0;
+      do {
+        wait();
+      } while (update() != 0);
+      frame_budget = budget;
+    }
+
+    /// True if there are no jobs waiting to load, loading or waiting to finish.
+    bool is_idle() {
+      std::unique_lock<std::mutex> lock(mutex);
+      return queued.empty() && num_loading == 0 && loaded.empty();
+    }
+
+    /// Number of jobs finished so far.
+    unsigned get_num_finished() const {
+      return num_finished;
+    }
+
+    /// Number of bytes uploaded by finished jobs.
+    uint64_t get_bytes_finished() const {
+      return bytes_finished;
+    }
+  };
+
+  #if OCTET_UNIT_TEST
+    class background_loader_unit_test {
+    public:
+      background_loader_unit_test() {
+        background_loader loader(1);
+        loader.set_frame_budget(250);
+
+        // hold the worker in a first, most urgent job until the others are queued, so that they load in priority order.
+        std::atomic<bool> go(false);
+        dynarray<int> load_order;
+        dynarray<int> finish_order;
+        loader.add([&]() { while (!go) std::this_thread::yield(); load_order.push_back(0); return (size_t)100; }, [&]() { finish_order.push_back(0); }, 10);
+
+        static const int priorities[] = { 0, 2, 1, 2, 0 };
+        for (int i = 1; i != 6; ++i) {
+          loader.add([&, i]() { load_order.push_back(i); return (size_t)100; }, [&, i]() { finish_order.push_back(i); }, priorities[i-1]);
+        }
+        go = true;
+
+        // nothing finishes until update() is called.
+        loader.wait();
+        assert(finish_order.size() == 0);
+
+        // 100 bytes each with a budget of 250: three jobs a frame.
+        unsigned frame0 = loader.update();
+        unsigned frame1 = loader.update();
+        unsigned frame2 = loader.update();
+        assert(frame0 == 3 && frame1 == 3 && frame2 == 0);
+        assert(loader.is_idle());
+
+        static const int expected[] = { 0, 2, 4, 3, 1, 5 };
+        assert(load_order.size() == 6 && finish_order.size() == 6);
+        for (unsigned i = 0; i != 6; ++i) {
+          assert(load_order[i] == expected[i]);
+          assert(finish_order[i] == expected[i]);
+        }
+
+        // a job bigger than the budget still finishes.
+        loader.add([]() { return (size_t)1000; }, [&]() { finish_order.push_back(6); });
+        loader.wait();
+        unsigned frame3 = loader.update();
+        assert(frame3 == 1);
+        assert(loader.get_num_finished() == 7 && loader.get_bytes_finished() == 1600);
+
+        // flush loads and finishes everything.
+        for (int i = 0; i != 20; ++i) {
+          loader.add([]() { return (size_t)100; }, [&]() { finish_order.push_back(7); }, i & 3);
+        }
+        loader.flush();
+        assert(loader.is_idle() && finish_order.size() == 27);
+
+        // jobs without a finish step do not wait for update().
+        std::atomic<int> loads(0);
+        for (int i = 0; i != 4; ++i) {
+          loader.add([&]() { loads++; return (size_t)0; }, std::function<void ()>());
+        }
+        loader.wait();
+        assert(loads == 4 && loader.is_idle());
+      }
+    };
+    static background_loader_unit_test background_loader_unit_test;
+  #endif
+} }
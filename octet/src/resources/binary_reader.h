@@ -10,16 +10,39 @@
 namespace octet { namespace resources {
   /// The binary reader is a visitor that is used to load a binary file.
   /// The binary reader will use a factory to create new classes, providied the class is in classes.h
+  /// Files can be read with stdio or from memory, for example a file_map.
   class binary_reader : public visitor {
-    enum { debug = true };
+    enum { debug = false };
     hash_map<void *, int> refs;
     dynarray<void *> id_to_ref;
     FILE *file;
+    const uint8_t *src;
+    const uint8_t *src_max;
     char tmp[256];
 
-    void read(uint8_t *src, size_t bytes) {
+    void read(uint8_t *dest, size_t bytes) {
       //if (debug) log("read %08x bytes\n", bytes);
-      fread(src, 1, bytes, file);
+      if (file) {
+        if (fread(dest, 1, bytes, file) != bytes) {
+          memset(dest, 0, bytes);
+          set_error(true);
+        }
+      } else if ((size_t)(src_max - src) >= bytes) {
+        memcpy(dest, src, bytes);
+        src += bytes;
+      } else {
+        memset(dest, 0, bytes);
+        src = src_max;
+        set_error(true);
+      }
+    }
+
+    int read_char() {
+      if (file) {
+        return fgetc(file);
+      } else {
+        return src != src_max ? *src++ : EOF;
+      }
     }
 
     int read_int() {
@@ -41,7 +64,11 @@ namespace octet { namespace resources {
     const char *read_string() {
       int nchars = 0;
       for(;;) {
-        int c = fgetc(file);
+        int c = read_char();
+        if (c == EOF) {
+          set_error(true);
+          c = 0;
+        }
         tmp[nchars] = c;
         if (c == 0) break;
         nchars += nchars != sizeof(tmp)-1;
@@ -50,10 +77,22 @@ namespace octet { namespace resources {
       return tmp;
     }
 
+    void init() {
+      if (debug) log("binary_reader\n");
+      id_to_ref.reserve(256);
+      id_to_ref.push_back(NULL);
+
+      char header[8];
+      read((uint8_t*)header, sizeof(header));
+      if (memcmp(header, "octet", 5)) {
+        set_error(true);
+      }
+    }
+
     bool check_atom(atom_t sid) {
       if (!get_error()) {
         atom_t test = read_atom();
-        log("%*scheck_atom %s\n", get_depth()*2, "", app_utils::get_atom_name(sid));
+        if (debug) log("%*scheck_atom %s\n", get_depth()*2, "", app_utils::get_atom_name(sid));
         if (test != sid) {
           log("error: expected %s\n", app_utils::get_atom_name(sid));
           set_error(true);
@@ -65,7 +104,7 @@ namespace octet { namespace resources {
     bool check_size(size_t size) {
       if (!get_error()) {
         int test = read_int();
-        log("%*scheck_size %d\n", get_depth()*2, "", size);
+        if (debug) log("%*scheck_size %d\n", get_depth()*2, "", size);
         if (test != (int)size) {
           log("error: expected %d bytes\n", size);
           set_error(true);
@@ -75,7 +114,7 @@ namespace octet { namespace resources {
     }
 
     void *get_ref(int id) {
-      log("%*sget_ref %d/%d\n", get_depth()*2, "", id, id_to_ref.size());
+      if (debug) log("%*sget_ref %d/%d\n", get_depth()*2, "", id, id_to_ref.size());
       if (id == (int)id_to_ref.size()) {
         return NULL;
       } else if (id > (int)id_to_ref.size()) {
@@ -90,16 +129,17 @@ namespace octet { namespace resources {
   public:
     /// Construct a binary reader for a file.
     binary_reader(FILE *file) {
-      if (debug) log("binary_reader\n");
-      id_to_ref.reserve(256);
-      id_to_ref.push_back(NULL);
-
       this->file = file;
-      char tmp[8];
-      fread(tmp, 1, sizeof(tmp), file);
-      if (memcmp(tmp, "octet", 5)) {
-        set_error(true);
-      }
+      src = src_max = 0;
+      init();
+    }
+
+    /// Construct a binary reader for a block of memory.
+    binary_reader(const uint8_t *src, size_t size) {
+      file = 0;
+      this->src = src;
+      src_max = src + size;
+      init();
     }
 
     /// Destroy the reader
@@ -176,7 +216,13 @@ namespace octet { namespace resources {
     /// Begin reading a dynarray
     unsigned begin_read_dynarray(unsigned elem_size, atom_t &sid) {
       if (!check_atom(atom_dynarray) && !check_atom(sid)) {
-        return (unsigned)read_int() / elem_size;
+        unsigned bytes = (unsigned)read_int();
+        if (!file && bytes > (size_t)(src_max - src)) {
+          log("error: dynarray overflow\n");
+          set_error(true);
+          return 0;
+        }
+        return bytes / elem_size;
       }
       return 0;
     }
@@ -211,7 +257,20 @@ namespace octet { namespace resources {
     /// Read a binary object. The contents are opaque.
     void visit_bin(void *value, size_t size, atom_t sid, atom_t type) {
       if (debug) log("%*svisit_bin %s %d\n", get_depth()*2, "", app_utils::get_atom_name(sid), size);
-      if (!check_atom(type) && !check_atom(sid) && !check_size(size)) {
+      if (type == atom_atom && size == sizeof(atom_t)) {
+        // user defined atoms are stored by name
+        if (!check_atom(type) && !check_atom(sid)) {
+          int stored_size = read_int();
+          if (stored_size == 0) {
+            *(atom_t*)value = app_utils::get_atom(read_string());
+          } else if (stored_size == (int)size) {
+            read((uint8_t*)value, size);
+          } else {
+            log("error: expected %d bytes\n", size);
+            set_error(true);
+          }
+        }
+      } else if (!check_atom(type) && !check_atom(sid) && !check_size(size)) {
         read((uint8_t*)value, size);
       }
     }
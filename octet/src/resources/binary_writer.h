@@ -11,11 +11,14 @@ namespace octet { namespace resources {
   /// The binary writer is a visitor that writes binary files.
   /// Use this to save game worlds or to do game saves.
   class binary_writer : public visitor {
-    enum { debug = true };
+    enum { debug = false };
     hash_map<void *, int> refs;
     int next_id;
     FILE *file;
 
+    // names of atoms, indexed by atom. Built on demand.
+    dynarray<const char *> atom_names;
+
     void write(const uint8_t *src, size_t bytes) {
       //if (debug) log("%*swrite %08x bytes\n", get_depth()*2, "", bytes);
       fwrite(src, 1, bytes, file);
@@ -38,6 +41,22 @@ namespace octet { namespace resources {
       write((const uint8_t*)value, (int)strlen(value)+1);
     }
 
+    // app_utils::get_atom_name is a linear search for user defined atoms.
+    const char *get_atom_name(atom_t atom) {
+      if ((unsigned)atom >= atom_names.size() || !atom_names[atom]) {
+        dictionary<atom_t> *dict = app_utils::get_atom_dict();
+        for (unsigned i = 0, n = dict->get_num_indices(); i != n; ++i) {
+          const char *key = dict->get_key(i);
+          if (key) {
+            unsigned value = (unsigned)dict->get_value(i);
+            while (value >= atom_names.size()) atom_names.push_back(NULL);
+            atom_names[value] = key;
+          }
+        }
+      }
+      return (unsigned)atom < atom_names.size() && atom_names[atom] ? atom_names[atom] : "";
+    }
+
   public:
     /// Construct a binary writer from a file
     binary_writer(FILE *file) {
@@ -154,11 +173,17 @@ namespace octet { namespace resources {
     }
 
     /// Write an opaque binary object
+    /// User defined atoms are numbered as they are created, so we write them by name.
     void visit_bin(void *value, size_t size, atom_t sid, atom_t type) {
       write_atom(type);
       write_atom(sid);
-      write_int((int)size);
-      write((const uint8_t*)value, size);
+      if (type == atom_atom && size == sizeof(atom_t) && !app_utils::predefined_atom(*(unsigned*)value)) {
+        write_int(0);
+        write_string(get_atom_name(*(atom_t*)value));
+      } else {
+        write_int((int)size);
+        write((const uint8_t*)value, size);
+      }
     }
 
     /// Write a string
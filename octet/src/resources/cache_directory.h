@@ -0,0 +1,91 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// directory of cache files
+//
+
+namespace octet { namespace resources {
+  /// A directory of cache files, used by texture_cache and cooked_cache.
+  ///
+  /// The directory can be changed while other threads load and save; each call sees either the old
+  /// or the new directory. Files are written under a temporary name and renamed when they are complete,
+  /// so that readers never see a partial file.
+  class cache_directory {
+    // guards directory
+    mutable std::mutex mutex;
+    string directory;
+
+  public:
+    /// The fixed start of every cache file. The cache checks all of it before using a file.
+    struct file_header {
+      char magic[8];
+      uint32_t version;
+      uint32_t tag;     /// for the cache's own use
+
+      void init(const char *magic_, uint32_t version_, uint32_t tag_ = 0) {
+        memcpy(magic, magic_, 8);
+        version = version_;
+        tag = tag_;
+      }
+
+      bool matches(const file_header &rhs) const {
+        return !memcmp(magic, rhs.magic, 8) && version == rhs.version && tag == rhs.tag;
+      }
+    };
+
+    /// Use a directory, making it if necessary. An empty string or NULL turns the cache off.
+    void set(const char *dir) {
+      std::lock_guard<std::mutex> lock(mutex);
+      directory = dir ? dir : "";
+      if (!directory.c_str()[0]) return;
+      #ifdef WIN32
+        _mkdir(directory.c_str());
+      #else
+        mkdir(directory.c_str(), 0755);
+      #endif
+    }
+
+    /// A copy of the directory, empty if the cache is off.
+    string get() const {
+      std::lock_guard<std::mutex> lock(mutex);
+      return directory;
+    }
+
+    /// True if there is a directory.
+    bool is_enabled() const {
+      std::lock_guard<std::mutex> lock(mutex);
+      return directory.c_str()[0] != 0;
+    }
+
+    /// Path of the file for a key, "<directory>/<key in hex>.<extension>". Returns false if the cache is off.
+    bool get_path(string &path, uint64_t key, const char *extension) const {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!directory.c_str()[0]) return false;
+      path.format("%s/%08x%08x.%s", directory.c_str(), (unsigned)(key >> 32), (unsigned)key, extension);
+      return true;
+    }
+
+    /// Write a cache file. write() fills the open file and returns false if it fails.
+    /// The temporary name is unique to the calling thread, so threads can save the same file at once.
+    static bool write_file(const char *path, const std::function<bool (FILE *)> &write) {
+      string tmp_path;
+      tmp_path.format("%s.%p.tmp", path, (void*)&tmp_path);
+      FILE *file = fopen(tmp_path.c_str(), "wb");
+      if (!file) return false;
+
+      bool ok = write(file) && !ferror(file);
+      ok = fclose(file) == 0 && ok;
+      if (ok) {
+        remove(path);
+        ok = rename(tmp_path.c_str(), path) == 0;
+      }
+      if (!ok) {
+        remove(tmp_path.c_str());
+      }
+      return ok;
+    }
+  };
+} }
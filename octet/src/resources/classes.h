@@ -36,4 +36,6 @@ OCTET_CLASS(scene, mesh_voxel_grid)
 #endif
 OCTET_CLASS(scene, mesh_points)
 OCTET_CLASS(scene, mesh_cylinder)
+OCTET_CLASS(scene, mesh_optimizer)
+OCTET_CLASS(scene, mesh_simplify)
 //OCTET_CLASS(scene, value)
@@ -0,0 +1,176 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// cache of imported assets in binary form
+//
+
+namespace octet { namespace resources {
+  /// Cooked asset cache.
+  ///
+  /// Importing text formats such as Collada and OBJ is slow, so we save the resulting
+  /// resource_dict in a cache directory as "<hash of source path>.cooked" using the binary_writer.
+  ///
+  /// The cache file is keyed by the source path, size and modification time.
+  /// It is rebuilt if any of these change or if the version or the predefined atoms change.
+  ///
+  /// The cache is off until it has a directory, which can be set at any time (see cache_directory).
+  ///
+  /// Example
+  ///
+  ///     cooked_cache::get().set_directory(app_utils::get_path("assets/cooked_cache"));
+  ///     ...
+  ///     ref<resource_dict> cooked = cooked_cache::get().load(url);
+  ///     if (!cooked) {
+  ///       cooked = new resource_dict();
+  ///       ... import url into cooked ...
+  ///       cooked_cache::get().save(*cooked, url);
+  ///     }
+  ///     dict.add_resources(*cooked);
+  ///
+  class cooked_cache {
+    enum { debug = false, version = 2 };
+
+    // the fixed part of the file, followed by the source url and the binary_writer data.
+    // The tag of the file header is the atom signature.
+    struct header {
+      cache_directory::file_header file;
+      uint64_t src_size;
+      uint64_t src_mtime;
+      uint64_t url_size;
+      uint64_t data_size;
+    };
+
+    // changes to atoms.h or classes.h renumber the atoms in the file.
+    static uint32_t get_atom_signature() {
+      unsigned num_atoms = 1;
+      while (app_utils::predefined_atom(num_atoms)) num_atoms++;
+      unsigned num_classes = (unsigned)atom_class_base + 1;
+      while (app_utils::predefined_atom(num_classes)) num_classes++;
+      return (uint32_t)(num_atoms | (num_classes - (unsigned)atom_class_base) << 16);
+    }
+
+    cache_directory directory;
+
+    cooked_cache() {
+    }
+
+    // find the source and cache files. Only local files are cached.
+    bool get_paths(const char *url, string &src_path, string &cache_path, header &hdr) const {
+      if (!url || !strncmp(url, "zip://", 6) || !strncmp(url, "http://", 7)) {
+        return false;
+      }
+
+      src_path = app_utils::get_path(url);
+
+      // the url in the file tells apart sources whose paths have the same hash.
+      uint64_t key = 0xcbf29ce484222325ull;
+      for (const char *p = src_path.c_str(); *p; ++p) {
+        key = (key ^ (uint8_t)*p) * 0x100000001b3ull;
+      }
+      if (!directory.get_path(cache_path, key, "cooked")) {
+        return false;
+      }
+
+      struct stat src_stat;
+      if (stat(src_path.c_str(), &src_stat) != 0) {
+        return false;
+      }
+
+      memset(&hdr, 0, sizeof(hdr));
+      hdr.file.init("octetck\x1a", version, get_atom_signature());
+      hdr.src_size = (uint64_t)src_stat.st_size;
+      hdr.src_mtime = (uint64_t)src_stat.st_mtime;
+      hdr.url_size = strlen(url);
+      return true;
+    }
+
+  public:
+    /// The cache shared by all loaders.
+    static cooked_cache &get() {
+      static cooked_cache cache;
+      return cache;
+    }
+
+    /// Use a directory for the cache, making it if necessary. An empty string or NULL turns the cache off.
+    void set_directory(const char *dir) {
+      directory.set(dir);
+    }
+
+    /// True if the cache has a directory.
+    bool is_enabled() const {
+      return directory.is_enabled();
+    }
+
+    /// Load the cached resources for url.
+    /// Returns NULL if there is no cache file, it is out of date or it does not read correctly.
+    resource_dict *load(const char *url) {
+      string src_path, cache_path;
+      header expected;
+      if (!get_paths(url, src_path, cache_path, expected)) {
+        return NULL;
+      }
+
+      file_map map(cache_path.c_str());
+      const uint8_t *data = map.get_data();
+      uint64_t size = map.get_size();
+      if (!data || size < sizeof(header) + expected.url_size) {
+        return NULL;
+      }
+
+      // data_size also catches files that were truncated.
+      header hdr;
+      memcpy(&hdr, data, sizeof(hdr));
+      uint64_t data_size = size - sizeof(header) - expected.url_size;
+      expected.data_size = data_size;
+      if (
+        memcmp(&hdr, &expected, sizeof(hdr)) ||
+        memcmp(data + sizeof(header), url, (size_t)expected.url_size)
+      ) {
+        log("cooked_cache: %s is out of date\n", cache_path.c_str());
+        return NULL;
+      }
+
+      resource_dict *result = new resource_dict();
+      binary_reader reader(data + sizeof(header) + expected.url_size, (size_t)data_size);
+      result->visit(reader);
+      if (reader.get_error()) {
+        log("cooked_cache: error reading %s\n", cache_path.c_str());
+        // free the partially read objects
+        result->add_ref();
+        result->release();
+        return NULL;
+      }
+
+      if (debug) log("cooked_cache: loaded %s\n", cache_path.c_str());
+      return result;
+    }
+
+    /// Save the resources imported from url.
+    bool save(resource_dict &dict, const char *url) {
+      string src_path, cache_path;
+      header hdr;
+      if (!get_paths(url, src_path, cache_path, hdr)) {
+        return false;
+      }
+
+      bool ok = cache_directory::write_file(cache_path.c_str(), [&](FILE *file) {
+        fwrite(&hdr, 1, sizeof(hdr), file);
+        fwrite(url, 1, (size_t)hdr.url_size, file);
+        long start = ftell(file);
+        {
+          binary_writer writer(file);
+          dict.visit(writer);
+        }
+        // now that we know the size, write the header again.
+        hdr.data_size = (uint64_t)(ftell(file) - start);
+        return fseek(file, 0, SEEK_SET) == 0 && fwrite(&hdr, 1, sizeof(hdr), file) == sizeof(hdr);
+      });
+
+      if (debug) log("cooked_cache: saved %s ok=%d\n", cache_path.c_str(), ok);
+      return ok;
+    }
+  };
+} }
@@ -21,6 +21,9 @@ public:
     error = 0;
     data = 0;
     size = 0;
+    #ifndef WIN32
+      file_handle = -1;
+    #endif
 
     if (file_name == NULL) {
       error = "no file name";
@@ -51,8 +54,28 @@ public:
 
       data = (const uint8_t *)MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
     #else
-      //file_handle = open(file_name, O_RDONLY);
-      //mmap
+      file_handle = open(file_name, O_RDONLY);
+      if (file_handle < 0) {
+        error = "could not open file";
+        return;
+      }
+
+      struct stat file_stat;
+      if (fstat(file_handle, &file_stat) != 0) {
+        error = "could not get file size";
+        return;
+      }
+
+      size = (uint64_t)file_stat.st_size;
+      if (size == 0) return;
+
+      void *ptr = mmap(0, (size_t)size, PROT_READ, MAP_PRIVATE, file_handle, 0);
+      if (ptr == MAP_FAILED) {
+        error = "could not map file";
+        size = 0;
+        return;
+      }
+      data = (const uint8_t *)ptr;
     #endif
   }
 
@@ -62,6 +85,8 @@ public:
       CloseHandle(file_handle);
       CloseHandle(mapping_handle);
     #else
+      if (data) munmap((void*)data, (size_t)size);
+      if (file_handle >= 0) close(file_handle);
     #endif
   }
 
@@ -23,6 +23,15 @@ namespace octet { namespace resources {
     // GL_ARRAY_BUFFER etc.
     GLuint target;
 
+    // changes whenever the buffer is allocated, freed or written through a lock.
+    // unique across all resources, so a cache keyed on it cannot match a new buffer at the same address.
+    mutable uint64_t generation;
+
+    static uint64_t new_generation() {
+      static std::atomic<uint64_t> next(0);
+      return ++next;
+    }
+
   public:
     /// Helper class to make a write-only lock
     class wolock {
@@ -70,6 +79,7 @@ namespace octet { namespace resources {
     /// Make a new OpenGL Resource
     gl_resource(unsigned target=0, unsigned size=0) {
       buffer = 0;
+      generation = new_generation();
       this->target = target;
       if (size) {
         allocate(target, size);
@@ -77,11 +87,30 @@ namespace octet { namespace resources {
     }
 
     /// serialize this object.
+    /// Readers make a new OpenGL object from the bytes.
     void visit(visitor &v) {
-      #ifdef OCTET_GLES2
-        v.visit(bytes, atom_bytes);
-      #endif
-      v.visit(target, atom_target);
+      if (v.is_reader()) {
+        dynarray<uint8_t> data;
+        v.visit(data, atom_bytes);
+        v.visit(target, atom_target);
+        if (!v.get_error()) {
+          allocate(target, data.size());
+          if (data.size()) assign(data.data(), 0, data.size());
+        }
+      } else {
+        #ifdef OCTET_GLES2
+          v.visit(bytes, atom_bytes);
+        #else
+          // desktop GL only has the data in the GPU
+          dynarray<uint8_t> data(buffer ? (unsigned)size : 0);
+          if (data.size()) {
+            memcpy(data.data(), lock_read_only(), data.size());
+            unlock_read_only();
+          }
+          v.visit(data, atom_bytes);
+        #endif
+        v.visit(target, atom_target);
+      }
     }
 
     /// Allocate a new OpenGL object.
@@ -96,6 +125,7 @@ namespace octet { namespace resources {
         this->size = size;
       #endif
       this->target = target;
+      generation = new_generation();
       glBindBuffer(target, 0);
     }
 
@@ -108,6 +138,7 @@ namespace octet { namespace resources {
         bytes.reset();
       #endif
       buffer = 0;
+      generation = new_generation();
     }
 
     /// Destructor
@@ -134,6 +165,12 @@ namespace octet { namespace resources {
       return buffer;
     }
 
+    /// get a number that changes whenever the contents may have changed.
+    /// No two buffers share a generation, so it can be used as a cache key.
+    uint64_t get_generation() const {
+      return generation;
+    }
+
     /// get a read-only lock on this buffer
     /// deprecated
     const void *lock_read_only() const {
@@ -179,6 +216,7 @@ namespace octet { namespace resources {
     /// release a read-write lock
     /// deprecated
     void unlock() const {
+      generation = new_generation();
       #ifdef OCTET_GLES2
         glBindBuffer(target, buffer);
         glBufferSubData(target, 0, bytes.size(), &bytes[0]);
@@ -206,6 +244,7 @@ namespace octet { namespace resources {
     /// release a read-write lock
     /// deprecated
     void unlock_write_only() const {
+      generation = new_generation();
       #ifdef OCTET_GLES2
         glBindBuffer(target, buffer);
         glBufferSubData(target, 0, bytes.size(), &bytes[0]);
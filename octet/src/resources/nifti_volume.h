@@ -0,0 +1,480 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// stream large 4D volumes a brick at a time
+//
+
+namespace octet { namespace resources {
+  /// Out of core reader for NIFTI (.nii) volumes that are too big to load, such as 4D scans of several GB.
+  ///
+  /// The file is mapped, not read. Each frame is split into bricks of brick_size^3 voxels which are
+  /// converted to 8 bit values with nifti_decoder::convert() when they are first used.
+  /// Converted bricks are kept in a cache of fixed size and the least recently used are reused first.
+  ///
+  /// read_frame() also asks a background_loader to convert the next frame, so that playing
+  /// through the frames in order finds them ready. Bricks can be read from several threads.
+  ///
+  /// Example
+  ///
+  ///     nifti_volume volume;
+  ///     if (volume.open("assets/scan.nii")) {
+  ///       dynarray<uint8_t> voxels(volume.get_width() * volume.get_height() * volume.get_depth());
+  ///       volume.read_frame(voxels.data(), frame);
+  ///     }
+  ///
+  class nifti_volume {
+    enum { none = ~0u };
+
+    // a brick in the cache, in a list from most to least recently used.
+    struct slot {
+      unsigned brick;
+      unsigned prev;
+      unsigned next;
+      bool loading;
+    };
+
+    file_map *map;
+    const uint8_t *file_data;
+    nifti_decoder::layout info;
+    unsigned brick_size;
+    unsigned bricks_x, bricks_y, bricks_z;
+    float scale, offset;
+    size_t max_bytes;
+
+    // protects the state below
+    mutable std::mutex mutex;
+    std::condition_variable brick_ready;
+    std::condition_variable prefetch_done;
+
+    // slot of each brick in the cache, or none
+    dynarray<unsigned> resident;
+    dynarray<slot> slots;
+    dynarray<uint8_t> pool;
+    unsigned head, tail;
+    unsigned max_slots;
+
+    unsigned hits, misses, evictions;
+
+    // frames being prefetched
+    bool auto_prefetch;
+    unsigned num_prefetching;
+    unsigned last_prefetch;
+
+    unsigned get_brick_bytes() const {
+      return brick_size * brick_size * brick_size;
+    }
+
+    unsigned get_bricks_per_frame() const {
+      return bricks_x * bricks_y * bricks_z;
+    }
+
+    void unlink(unsigned s) {
+      slot &sl = slots[s];
+      if (sl.prev != none) slots[sl.prev].next = sl.next; else head = sl.next;
+      if (sl.next != none) slots[sl.next].prev = sl.prev; else tail = sl.prev;
+    }
+
+    void push_front(unsigned s) {
+      slots[s].prev = none;
+      slots[s].next = head;
+      if (head != none) slots[head].prev = s; else tail = s;
+      head = s;
+    }
+
+    // a slot for a new brick: a new one or the least recently used one that is not loading.
+    // Call with the mutex held. Returns none if every slot is loading.
+    unsigned take_slot() {
+      if (slots.size() < max_slots) {
+        slot sl = { none, none, none, false };
+        slots.push_back(sl);
+        return slots.size() - 1;
+      }
+      for (unsigned s = tail; s != none; s = slots[s].prev) {
+        if (!slots[s].loading) {
+          unlink(s);
+          resident[slots[s].brick] = none;
+          evictions++;
+          return s;
+        }
+      }
+      return none;
+    }
+
+    // convert a brick from the file with a snapshot of the window. Voxels outside the volume repeat the edge.
+    void convert_brick(uint8_t *dest, unsigned brick, float scale, float offset) const {
+      unsigned frame = brick / get_bricks_per_frame();
+      unsigned b = brick % get_bricks_per_frame();
+      unsigned x0 = b % bricks_x * brick_size;
+      unsigned y0 = b / bricks_x % bricks_y * brick_size;
+      unsigned z0 = b / (bricks_x * bricks_y) * brick_size;
+      unsigned nx = info.width - x0 < brick_size ? info.width - x0 : brick_size;
+
+      const uint8_t *frame_data = file_data + info.vox_offset + (size_t)frame * info.width * info.height * info.depth * info.bytes_per_voxel;
+      for (unsigned k = 0; k != brick_size; ++k) {
+        unsigned z = z0 + k < info.depth ? z0 + k : info.depth - 1;
+        for (unsigned j = 0; j != brick_size; ++j) {
+          unsigned y = y0 + j < info.height ? y0 + j : info.height - 1;
+          uint8_t *row = dest + (k * brick_size + j) * brick_size;
+          const uint8_t *src = frame_data + (((size_t)z * info.height + y) * info.width + x0) * info.bytes_per_voxel;
+          nifti_decoder::convert(row, src, nx, info.datatype, scale, offset);
+          if (nx != brick_size) memset(row + nx, row[nx-1], brick_size - nx);
+        }
+      }
+    }
+
+    // wait for the prefetch jobs to finish. Call with the mutex held.
+    void wait_for_prefetches(std::unique_lock<std::mutex> &lock) {
+      while (num_prefetching != 0) {
+        prefetch_done.wait(lock);
+      }
+    }
+
+    // make a brick resident and optionally copy it out.
+    void fetch(uint8_t *dest, unsigned brick) {
+      std::unique_lock<std::mutex> lock(mutex);
+      for (;;) {
+        unsigned s = resident[brick];
+        if (s == none) break;
+        if (!slots[s].loading) {
+          unlink(s);
+          push_front(s);
+          hits++;
+          if (dest) memcpy(dest, pool.data() + (size_t)s * get_brick_bytes(), get_brick_bytes());
+          return;
+        }
+        // another thread is converting it.
+        brick_ready.wait(lock);
+      }
+
+      // set_window() may change these while we convert. Read them after waiting, as waiting lets
+      // set_window() run and drop the cache; a brick we cache now must use the new window.
+      float brick_scale = scale, brick_offset = offset;
+      misses++;
+      unsigned s = take_slot();
+      if (s == none) {
+        // everything is in flight; do not cache this one.
+        lock.unlock();
+        if (dest) convert_brick(dest, brick, brick_scale, brick_offset);
+        return;
+      }
+
+      slots[s].brick = brick;
+      slots[s].loading = true;
+      resident[brick] = s;
+      push_front(s);
+      uint8_t *data = pool.data() + (size_t)s * get_brick_bytes();
+
+      lock.unlock();
+      convert_brick(data, brick, brick_scale, brick_offset);
+      lock.lock();
+
+      slots[s].loading = false;
+      if (dest) memcpy(dest, data, get_brick_bytes());
+      brick_ready.notify_all();
+    }
+
+    bool is_scalar() const {
+      return info.datatype != nifti_decoder::dt_rgb24 && info.datatype != nifti_decoder::dt_rgba32;
+    }
+
+    // set up the bricks for a file in memory.
+    bool init(const uint8_t *data, size_t size) {
+      if (!data || !nifti_decoder::get_layout(info, data, data + size) || !is_scalar()) {
+        return false;
+      }
+      file_data = data;
+
+      float lo, hi;
+      nifti_decoder::get_window(lo, hi, info, data);
+      nifti_decoder::get_conversion(scale, offset, info, lo, hi);
+
+      bricks_x = (info.width + brick_size - 1) / brick_size;
+      bricks_y = (info.height + brick_size - 1) / brick_size;
+      bricks_z = (info.depth + brick_size - 1) / brick_size;
+      unsigned num_bricks = get_bricks_per_frame() * info.frames;
+
+      resident.resize(num_bricks);
+      for (unsigned i = 0; i != num_bricks; ++i) {
+        resident[i] = none;
+      }
+
+      size_t slot_limit = max_bytes / get_brick_bytes();
+      max_slots = (unsigned)(slot_limit < num_bricks ? slot_limit : num_bricks);
+      if (max_slots == 0) max_slots = 1;
+      slots.reserve(max_slots);
+      pool.resize((unsigned)(max_slots * get_brick_bytes()));
+      return true;
+    }
+
+  public:
+    /// Make a reader that keeps up to max_bytes of converted bricks. brick_size should be a power of two.
+    nifti_volume(size_t max_bytes = 64 * 1024 * 1024, unsigned brick_size = 32) :
+      map(0), file_data(0), brick_size(brick_size), bricks_x(0), bricks_y(0), bricks_z(0), scale(1), offset(0),
+      max_bytes(max_bytes), head(none), tail(none), max_slots(0),
+      hits(0), misses(0), evictions(0), auto_prefetch(true), num_prefetching(0), last_prefetch(none)
+    {
+      memset(&info, 0, sizeof(info));
+    }
+
+    /// Waits for prefetches and unmaps the file.
+    ~nifti_volume() {
+      close();
+    }
+
+    /// Map a .nii file. Volumes of RGB or RGBA voxels are not supported.
+    bool open(const char *url) {
+      close();
+      file_map *file = new file_map(app_utils::get_path(url));
+      if (!init(file->get_data(), file->get_size())) {
+        log("warning: could not open %s as a NIFTI volume\n", url);
+        delete file;
+        close();
+        return false;
+      }
+      map = file;
+      return true;
+    }
+
+    /// Use a .nii file that is already in memory, such as one read from a zip archive.
+    /// The memory must stay valid until the volume is closed.
+    bool open(const uint8_t *data, size_t size) {
+      close();
+      if (!init(data, size)) {
+        log("warning: could not open a NIFTI volume from memory\n");
+        close();
+        return false;
+      }
+      return true;
+    }
+
+    /// Forget the file and the cache.
+    void close() {
+      std::unique_lock<std::mutex> lock(mutex);
+      wait_for_prefetches(lock);
+      delete map;
+      map = 0;
+      file_data = 0;
+      memset(&info, 0, sizeof(info));
+      bricks_x = bricks_y = bricks_z = 0;
+      resident.reset();
+      slots.reset();
+      pool.reset();
+      head = tail = none;
+      max_slots = 0;
+      last_prefetch = none;
+    }
+
+    /// Show the real values lo..hi as 0..255. The default is the file's display range or the range of the first frame.
+    void set_window(float lo, float hi) {
+      std::unique_lock<std::mutex> lock(mutex);
+      wait_for_prefetches(lock);
+      nifti_decoder::get_conversion(scale, offset, info, lo, hi);
+
+      // cached bricks are out of date; wait for any in flight and drop them all.
+      // Other readers can start loading slots while we wait, so check every slot again after each wait.
+      for (;;) {
+        bool busy = false;
+        for (unsigned s = 0; s != slots.size(); ++s) {
+          busy = busy || slots[s].loading;
+        }
+        if (!busy) break;
+        brick_ready.wait(lock);
+      }
+      for (unsigned s = 0; s != slots.size(); ++s) {
+        resident[slots[s].brick] = none;
+      }
+      slots.resize(0);
+      head = tail = none;
+    }
+
+    /// Convert the next frame in the background when read_frame is called. On by default.
+    void set_auto_prefetch(bool value) {
+      std::unique_lock<std::mutex> lock(mutex);
+      auto_prefetch = value;
+    }
+
+    unsigned get_width() const { return info.width; }
+    unsigned get_height() const { return info.height; }
+    unsigned get_depth() const { return info.depth; }
+    unsigned get_frames() const { return info.frames; }
+    unsigned get_brick_size() const { return brick_size; }
+    unsigned get_bricks_x() const { return bricks_x; }
+    unsigned get_bricks_y() const { return bricks_y; }
+    unsigned get_bricks_z() const { return bricks_z; }
+
+    /// Copy the brick_size^3 voxels of a brick to dest, x fastest.
+    bool read_brick(uint8_t *dest, unsigned frame, unsigned bx, unsigned by, unsigned bz) {
+      if (!file_data || frame >= info.frames || bx >= bricks_x || by >= bricks_y || bz >= bricks_z) return false;
+      fetch(dest, frame * get_bricks_per_frame() + (bz * bricks_y + by) * bricks_x + bx);
+      return true;
+    }
+
+    /// Copy a whole frame of width * height * depth voxels to dest, x fastest, then prefetch the next frame.
+    bool read_frame(uint8_t *dest, unsigned frame) {
+      if (!file_data || frame >= info.frames) return false;
+
+      dynarray<uint8_t> brick(get_brick_bytes());
+      for (unsigned bz = 0; bz != bricks_z; ++bz) {
+        for (unsigned by = 0; by != bricks_y; ++by) {
+          for (unsigned bx = 0; bx != bricks_x; ++bx) {
+            read_brick(brick.data(), frame, bx, by, bz);
+            unsigned x0 = bx * brick_size, y0 = by * brick_size, z0 = bz * brick_size;
+            unsigned nx = info.width - x0 < brick_size ? info.width - x0 : brick_size;
+            unsigned ny = info.height - y0 < brick_size ? info.height - y0 : brick_size;
+            unsigned nz = info.depth - z0 < brick_size ? info.depth - z0 : brick_size;
+            for (unsigned k = 0; k != nz; ++k) {
+              for (unsigned j = 0; j != ny; ++j) {
+                uint8_t *out = dest + ((size_t)(z0 + k) * info.height + y0 + j) * info.width + x0;
+                memcpy(out, brick.data() + (k * brick_size + j) * brick_size, nx);
+              }
+            }
+          }
+        }
+      }
+
+      if (info.frames > 1) {
+        bool prefetch_next;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          prefetch_next = auto_prefetch;
+        }
+        if (prefetch_next) prefetch(frame + 1 == info.frames ? 0 : frame + 1);
+      }
+      return true;
+    }
+
+    /// Convert the bricks of a frame on a background thread.
+    /// At most half of the cache is used so that the frame being shown stays resident.
+    void prefetch(unsigned frame) {
+      if (!file_data || frame >= info.frames) return;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (frame == last_prefetch) return;
+        last_prefetch = frame;
+        num_prefetching++;
+      }
+      nifti_volume *self = this;
+      background_loader::get().add(
+        [self, frame]() {
+          unsigned count = self->get_bricks_per_frame();
+          if (count > self->max_slots / 2) count = self->max_slots / 2;
+          for (unsigned i = 0; i != count; ++i) {
+            self->fetch(0, frame * self->get_bricks_per_frame() + i);
+          }
+          // notify with the mutex held, so that close() cannot return and free the volume first.
+          std::unique_lock<std::mutex> lock(self->mutex);
+          self->num_prefetching--;
+          self->prefetch_done.notify_all();
+          return (size_t)0;
+        },
+        // nothing to finish, so the loader frees the job on its worker.
+        std::function<void ()>(),
+        -1
+      );
+    }
+
+    /// Number of bricks found in the cache.
+    unsigned get_hits() const {
+      std::unique_lock<std::mutex> lock(mutex);
+      return hits;
+    }
+
+    /// Number of bricks converted from the file.
+    unsigned get_misses() const {
+      std::unique_lock<std::mutex> lock(mutex);
+      return misses;
+    }
+
+    /// Number of bricks dropped to make room.
+    unsigned get_evictions() const {
+      std::unique_lock<std::mutex> lock(mutex);
+      return evictions;
+    }
+
+    /// Number of bricks in the cache.
+    unsigned get_resident_bricks() const {
+      std::unique_lock<std::mutex> lock(mutex);
+      return slots.size();
+    }
+  };
+
+  #if OCTET_UNIT_TEST
+    class nifti_volume_unit_test {
+      enum { width = 10, height = 7, depth = 5, frames = 3, brick = 4, voxels = width * height * depth };
+
+      // the frame as nifti_decoder::convert() makes it, for a window of lo..hi.
+      static void get_expected(dynarray<uint8_t> &result, const dynarray<uint8_t> &file, unsigned frame, float lo, float hi) {
+        nifti_decoder::layout info;
+        nifti_decoder::get_layout(info, file.data(), file.data() + file.size());
+        float scale, offset;
+        nifti_decoder::get_conversion(scale, offset, info, lo, hi);
+        result.resize(voxels);
+        nifti_decoder::convert(result.data(), file.data() + info.vox_offset + frame * voxels * 2, voxels, info.datatype, scale, offset);
+      }
+
+    public:
+      nifti_volume_unit_test() {
+        // a 4D volume of 16 bit voxels whose sides are not multiples of the brick size.
+        dynarray<uint8_t> file(352 + voxels * frames * 2);
+        memset(file.data(), 0, file.size());
+        int32_t header_size = 348;
+        int16_t dim[8] = { 4, width, height, depth, frames, 1, 1, 1 };
+        int16_t datatype = nifti_decoder::dt_int16, bitpix = 16;
+        float vox_offset = 352;
+        memcpy(file.data(), &header_size, 4);
+        memcpy(file.data() + 40, dim, sizeof(dim));
+        memcpy(file.data() + 70, &datatype, 2);
+        memcpy(file.data() + 72, &bitpix, 2);
+        memcpy(file.data() + 108, &vox_offset, 4);
+        memcpy(file.data() + 344, "n+1", 4);
+        for (unsigned i = 0; i != voxels * frames; ++i) {
+          int16_t value = (int16_t)((i * 37) % 3000 - 500);
+          memcpy(file.data() + 352 + i * 2, &value, 2);
+        }
+
+        // room for four of the twelve bricks in a frame.
+        nifti_volume volume(4 * brick * brick * brick, brick);
+        volume.set_auto_prefetch(false);
+        bool opened = volume.open(file.data(), file.size());
+        assert(opened);
+        assert(volume.get_bricks_x() == 3 && volume.get_bricks_y() == 2 && volume.get_bricks_z() == 2);
+
+        // whole frames are put together from the bricks.
+        dynarray<uint8_t> result(voxels), expected;
+        volume.set_window(-200, 2000);
+        for (unsigned frame = 0; frame != frames; ++frame) {
+          bool read = volume.read_frame(result.data(), frame);
+          assert(read);
+          get_expected(expected, file, frame, -200, 2000);
+          assert(!memcmp(result.data(), expected.data(), voxels));
+        }
+
+        // only four bricks fit, so the rest were dropped.
+        assert(volume.get_resident_bricks() == 4);
+        assert(volume.get_evictions() == frames * 12 - 4);
+
+        // the last brick hangs over every side; the voxels outside the volume repeat the edge.
+        get_expected(expected, file, 0, -200, 2000);
+        uint8_t voxels_out[brick * brick * brick];
+        unsigned misses = volume.get_misses(), hits = volume.get_hits();
+        volume.read_brick(voxels_out, 0, 2, 1, 1);
+        volume.read_brick(voxels_out, 0, 2, 1, 1);
+        assert(volume.get_misses() == misses + 1 && volume.get_hits() == hits + 1);
+        for (unsigned k = 0; k != brick; ++k) {
+          for (unsigned j = 0; j != brick; ++j) {
+            for (unsigned i = 0; i != brick; ++i) {
+              unsigned x = 8 + i < width ? 8 + i : width - 1;
+              unsigned y = 4 + j < height ? 4 + j : height - 1;
+              unsigned z = 4 + k < depth ? 4 + k : depth - 1;
+              assert(voxels_out[(k * brick + j) * brick + i] == expected[(z * height + y) * width + x]);
+            }
+          }
+        }
+      }
+    };
+    static nifti_volume_unit_test nifti_volume_unit_test;
+  #endif
+} }
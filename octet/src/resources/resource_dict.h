@@ -115,6 +115,17 @@ namespace octet { namespace resources {
       }
     }
 
+    /// Add all the named resources from another dictionary, replacing any with the same name.
+    void add_resources(resource_dict &rhs) {
+      unsigned num_indices = rhs.dict.get_num_indices();
+      for (unsigned i = 0; i != num_indices; ++i) {
+        const char *key = rhs.dict.get_key(i);
+        if (key) {
+          dict[key] = rhs.dict.get_value(i);
+        }
+      }
+    }
+
     /// factory for textures: Deprecated will use Image object in future
     static GLuint get_texture_handle(unsigned gl_kind, const char *name) {
       GLuint &result = textures()[name];
@@ -30,5 +30,10 @@
   #include "../resources/gl_resource.h"
   #include "../resources/bitmap_font.h"
   #include "../resources/mesh_builder.h"
+  #include "../resources/cache_directory.h"
+  #include "../resources/cooked_cache.h"
+  #include "../resources/texture_cache.h"
+  #include "../resources/background_loader.h"
+  #include "../resources/nifti_volume.h"
 
 #endif
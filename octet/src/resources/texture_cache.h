@@ -0,0 +1,301 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// cache of finished textures
+//
+
+namespace octet { namespace resources {
+  /// On-disk cache of finished textures.
+  ///
+  /// Decoding JPEG or GIF files, making mipmaps and compressing them is slow, so images
+  /// save the finished mip chain in a directory of "<key>.tex" files and map them on later runs.
+  ///
+  /// The key is a hash of the source file contents and the settings used to make the texture,
+  /// so edited files and changed settings miss and are rebuilt. Old entries are never read again and are
+  /// removed, least recently used first, when the directory grows past the size limit.
+  ///
+  /// The cache is off until it has a directory, which can be set at any time (see cache_directory).
+  /// Loads and saves can come from several threads.
+  ///
+  /// Example
+  ///
+  ///     texture_cache::get().set_directory("texture_cache");
+  ///     ...
+  ///     texture_cache::get().log_stats();
+  ///
+  class texture_cache {
+  public:
+    /// Size, format and levels of a texture.
+    struct info {
+      uint32_t width;
+      uint32_t height;
+      uint32_t format;
+      uint32_t mip_levels;
+    };
+
+  private:
+    enum { debug = false, version = 1 };
+
+    // the fixed part of the file, followed by the texture data.
+    struct header {
+      cache_directory::file_header file;
+      uint64_t key;
+      info texture;
+      uint64_t data_size;
+    };
+
+    cache_directory directory;
+
+    // size limit and bytes in the directory, guarded by mutex
+    std::mutex mutex;
+    uint64_t max_bytes;
+    uint64_t total_bytes;
+
+    std::atomic<unsigned> hits;
+    std::atomic<unsigned> misses;
+    std::atomic<unsigned> writes;
+    std::atomic<unsigned> evictions;
+
+    struct entry {
+      string path;
+      uint64_t size;
+      uint64_t mtime;
+    };
+
+    // find the .tex files in the directory
+    void list_entries(dynarray<entry> &entries) const {
+      string dir_path = directory.get();
+      if (!dir_path.c_str()[0]) return;
+      #ifdef WIN32
+        string pattern;
+        pattern.format("%s/*.tex", dir_path.c_str());
+        WIN32_FIND_DATAA find_data;
+        HANDLE handle = FindFirstFileA(pattern.c_str(), &find_data);
+        if (handle == INVALID_HANDLE_VALUE) return;
+        do {
+          entry e;
+          e.path.format("%s/%s", dir_path.c_str(), find_data.cFileName);
+          e.size = (uint64_t)find_data.nFileSizeHigh << 32 | find_data.nFileSizeLow;
+          e.mtime = (uint64_t)find_data.ftLastWriteTime.dwHighDateTime << 32 | find_data.ftLastWriteTime.dwLowDateTime;
+          entries.push_back(e);
+        } while (FindNextFileA(handle, &find_data));
+        FindClose(handle);
+      #else
+        DIR *dir = opendir(dir_path.c_str());
+        if (!dir) return;
+        while (struct dirent *d = readdir(dir)) {
+          size_t len = strlen(d->d_name);
+          if (len < 4 || strcmp(d->d_name + len - 4, ".tex")) continue;
+          entry e;
+          e.path.format("%s/%s", dir_path.c_str(), d->d_name);
+          struct stat file_stat;
+          if (stat(e.path.c_str(), &file_stat) != 0) continue;
+          e.size = (uint64_t)file_stat.st_size;
+          e.mtime = (uint64_t)file_stat.st_mtime;
+          entries.push_back(e);
+        }
+        closedir(dir);
+      #endif
+    }
+
+    // remove least recently used entries until the directory fits. Call with the mutex held.
+    void trim() {
+      dynarray<entry> entries;
+      list_entries(entries);
+      total_bytes = 0;
+      for (unsigned i = 0; i != entries.size(); ++i) {
+        total_bytes += entries[i].size;
+      }
+      if (total_bytes <= max_bytes) return;
+
+      // oldest first
+      dynarray<unsigned> order(entries.size());
+      for (unsigned i = 0; i != entries.size(); ++i) {
+        order[i] = i;
+      }
+      std::sort(order.data(), order.data() + order.size(), [&](unsigned a, unsigned b) {
+        return entries[a].mtime < entries[b].mtime;
+      });
+
+      // leave some room so that we do not scan the directory on every save.
+      uint64_t target = max_bytes / 4 * 3;
+      for (unsigned i = 0; i != order.size() && total_bytes > target; ++i) {
+        const entry &e = entries[order[i]];
+        if (remove(e.path.c_str()) == 0) {
+          total_bytes -= e.size;
+          evictions++;
+          if (debug) log("texture_cache: evicted %s\n", e.path.c_str());
+        }
+      }
+    }
+
+    // mark an entry as recently used
+    static void touch(const char *path) {
+      #ifdef WIN32
+        _utime(path, NULL);
+      #else
+        utime(path, NULL);
+      #endif
+    }
+
+    texture_cache() : max_bytes(256 * 1024 * 1024), total_bytes(0), hits(0), misses(0), writes(0), evictions(0) {
+    }
+
+  public:
+    /// The cache shared by all images.
+    static texture_cache &get() {
+      static texture_cache cache;
+      return cache;
+    }
+
+    /// Use a directory for the cache, making it if necessary. An empty string or NULL turns the cache off.
+    void set_directory(const char *dir) {
+      std::lock_guard<std::mutex> lock(mutex);
+      directory.set(dir);
+      if (directory.is_enabled()) trim();
+    }
+
+    /// Limit the size of the cache directory. The default is 256MB.
+    void set_max_bytes(uint64_t value) {
+      std::lock_guard<std::mutex> lock(mutex);
+      max_bytes = value;
+      if (directory.is_enabled()) trim();
+    }
+
+    /// True if the cache has a directory.
+    bool is_enabled() const {
+      return directory.is_enabled();
+    }
+
+    /// Remove every entry.
+    void clear() {
+      std::lock_guard<std::mutex> lock(mutex);
+      dynarray<entry> entries;
+      list_entries(entries);
+      for (unsigned i = 0; i != entries.size(); ++i) {
+        remove(entries[i].path.c_str());
+      }
+      total_bytes = 0;
+    }
+
+    /// Hash some bytes, for example a source file, to make a key.
+    /// Use the seed for the settings that change the texture.
+    static uint64_t hash(const uint8_t *data, size_t size, uint64_t seed = 0) {
+      const uint64_t m = 0x9e3779b97f4a7c15ull;
+      uint64_t h = seed ^ (size * m);
+      size_t i = 0;
+      for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        word *= m;
+        word ^= word >> 29;
+        h = (h ^ word) * m;
+        h ^= h >> 32;
+      }
+      uint64_t tail = 0;
+      for (; i != size; ++i) {
+        tail = tail << 8 | data[i];
+      }
+      h = (h ^ tail) * m;
+      h ^= h >> 29;
+      h *= m;
+      return h ^ (h >> 32);
+    }
+
+    /// Get the texture for a key. Returns false on a miss.
+    bool load(uint64_t key, dynarray<uint8_t> &bytes, info &texture) {
+      string path;
+      if (!directory.get_path(path, key, "tex")) return false;
+
+      cache_directory::file_header expected;
+      expected.init("octettx\x1a", version);
+      bool ok = false;
+      {
+        file_map map(path.c_str());
+        const uint8_t *data = map.get_data();
+        if (data && map.get_size() >= sizeof(header)) {
+          header hdr;
+          memcpy(&hdr, data, sizeof(hdr));
+          ok =
+            hdr.file.matches(expected) && hdr.key == key &&
+            hdr.data_size == map.get_size() - sizeof(header)
+          ;
+          if (ok) {
+            texture = hdr.texture;
+            bytes.resize((size_t)hdr.data_size);
+            memcpy(bytes.data(), data + sizeof(header), (size_t)hdr.data_size);
+          } else {
+            log("texture_cache: %s is damaged\n", path.c_str());
+          }
+        }
+      }
+
+      if (ok) {
+        touch(path.c_str());
+        hits++;
+      } else {
+        misses++;
+      }
+      if (debug) log("texture_cache: %s %s\n", ok ? "hit" : "miss", path.c_str());
+      return ok;
+    }
+
+    /// Save the texture for a key.
+    bool save(uint64_t key, const uint8_t *bytes, size_t size, const info &texture) {
+      string path;
+      if (!directory.get_path(path, key, "tex")) return false;
+
+      header hdr;
+      memset(&hdr, 0, sizeof(hdr));
+      hdr.file.init("octettx\x1a", version);
+      hdr.key = key;
+      hdr.texture = texture;
+      hdr.data_size = size;
+
+      bool ok = cache_directory::write_file(path.c_str(), [&](FILE *file) {
+        return fwrite(&hdr, 1, sizeof(hdr), file) == sizeof(hdr) && fwrite(bytes, 1, size, file) == size;
+      });
+      if (!ok) return false;
+
+      writes++;
+      std::lock_guard<std::mutex> lock(mutex);
+      total_bytes += sizeof(hdr) + size;
+      if (total_bytes > max_bytes) {
+        trim();
+      }
+      return true;
+    }
+
+    /// Number of loads that found their texture.
+    unsigned get_hits() const {
+      return hits;
+    }
+
+    /// Number of loads that did not.
+    unsigned get_misses() const {
+      return misses;
+    }
+
+    /// Number of textures saved.
+    unsigned get_writes() const {
+      return writes;
+    }
+
+    /// Number of entries removed to keep under the size limit.
+    unsigned get_evictions() const {
+      return evictions;
+    }
+
+    /// Write the counters to the log.
+    void log_stats() {
+      std::lock_guard<std::mutex> lock(mutex);
+      log(
+        "texture_cache: %d hits %d misses %d writes %d evictions %dMB\n",
+        (unsigned)hits, (unsigned)misses, (unsigned)writes, (unsigned)evictions, (unsigned)(total_bytes >> 20)
+      );
+    }
+  };
+} }
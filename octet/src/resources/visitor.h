@@ -20,7 +20,7 @@ namespace octet { namespace resources {
   /// A visitor pattern can be used to solve a number of problems and provides
   /// "Metadata" for the classes.
   class visitor {
-    enum { debug = true };
+    enum { debug = false };
     unsigned depth;
     bool error;
 
@@ -315,6 +315,22 @@ namespace octet { namespace resources {
       }
     }
 
+    /// Call this in your "visit" method for dynarrays of atoms.
+    /// Atoms are visited one by one so that readers and writers can translate user defined atoms.
+    void visit(dynarray<atom_t> &value, atom_t sid) {
+      if (error) return;
+      int size = value.size();
+      if (begin_refs(sid, size, false)) {
+        if (is_reader()) {
+          value.resize(size);
+        }
+        for (int i = 0; i != size && !error; ++i) {
+          visit(value[i], atom_);
+        }
+        end_refs(false);
+      }
+    }
+
     /// Call this in your "visit" method for dynarrays of POD types (except references)
     template <class type> void visit(dynarray<type> &value, atom_t sid) {
       if (error) return;
@@ -9,20 +9,84 @@ namespace octet { namespace resources {
   /// Zip file reader, uses zip_decoder to inflate compressed files.
   /// Zip files are smaller and faster than regular files.
   /// They make updates easier and work will over the internet.
+  ///
+  /// The archive is memory mapped and the directory is read when it is opened,
+  /// so loader threads can call get_file() and get_view() at the same time.
+  /// Recently inflated files are kept in a small cache for assets that are loaded more than once.
   class zip_file {
-    int ref_cnt;
-    FILE *the_file;
+  public:
+    /// Inflated contents of a file, shared by the cache and views.
+    class inflated_data {
+      std::atomic<int> ref_cnt;
+    public:
+      dynarray<uint8_t> bytes;
+
+      inflated_data() : ref_cnt(0) {
+      }
+
+      void add_ref() {
+        ref_cnt++;
+      }
+
+      void release() {
+        if (--ref_cnt == 0) {
+          delete this;
+        }
+      }
+    };
+
+    /// Read-only contents of a file in the archive.
+    /// Stored files point into the memory map without copying.
+    /// A view keeps the archive alive if it is held by a ref<>, otherwise the view must not outlive it.
+    class view {
+      ref<zip_file> archive;
+      ref<inflated_data> inflated;
+      const uint8_t *data;
+      size_t size;
+      friend class zip_file;
+    public:
+      view() : data(0), size(0) {
+      }
+
+      const uint8_t *get_data() const {
+        return data;
+      }
+
+      size_t get_size() const {
+        return size;
+      }
+    };
+
+  private:
+    enum {
+      // recently inflated files, a file bigger than a quarter of the cache is not kept.
+      cache_entries = 8,
+      cache_max_bytes = 16 * 1024 * 1024,
+    };
+
+    std::atomic<int> ref_cnt;
+    file_map map;
 
     struct dir_entry {
-      uint32_t offset;
+      uint32_t offset;    // start of the file data in the archive
       uint32_t csize;
       uint32_t usize;
       uint32_t compression;
     };
 
+    // written only by the constructor
     dictionary<dir_entry> directory;
 
-    zip_decoder decoder;
+    struct cache_entry {
+      int index;
+      uint64_t last_use;
+      ref<inflated_data> data;
+    };
+
+    std::mutex cache_mutex;
+    cache_entry cache[cache_entries];
+    uint64_t cache_clock;
+    size_t cache_bytes;
 
     // read little endian bytes on any machine
     static unsigned u4(const uint8_t *src) {
@@ -41,56 +105,142 @@ namespace octet { namespace resources {
       return (int16_t)(src[0] + src[1] * 256);
     }
 
-  public:
-    /// Open a zip file for reading
-    zip_file(const char *filename) {
-      ref_cnt = 0;
-      the_file = fopen(filename, "rb");
-      if (!the_file) {
-        printf("file %s not found\n", filename);
-      } else {
-        uint8_t tmp[256];
-        unsigned tmp_size = (unsigned)sizeof(tmp);
-        fseek(the_file, 0, SEEK_END);
-        long file_size = ftell(the_file);
-        long search_offset = file_size - (long)tmp_size;
-        search_offset = search_offset < 0 ? 0 : search_offset;
-        fseek(the_file, search_offset, SEEK_SET);
-        fread(&tmp, 1, tmp_size, the_file);
-        for( unsigned i = 0; i != tmp_size; ++i) {
-          if (u4(tmp + i) == 0x06054b50) {
-            dynarray<uint8_t> dir;
-            dir.resize(u4(tmp + i + 12));
-            fseek(the_file, (long)u4(tmp + i + 16), SEEK_SET);
-            fread(&dir[0], 1, dir.size(), the_file);
-            for (unsigned i = 0; i + 4 < dir.size();) {
-              uint8_t *p = &dir[i];
-              if (u4(p) != 0x02014b50) break;
-              struct dir_entry d;
-              d.compression = u2(p + 10);
-              d.csize = u4(p + 20);
-              d.usize = u4(p + 24);
-              unsigned file_name_len = u2(p + 28);
-              unsigned extra_len = u2(p + 30);
-              string file;
-              file.set((const char*)(p + 46), file_name_len);
-              i += 46 + file_name_len + extra_len;
-              d.offset = u4(p + 42);// + (46 + file_name_len + extra_len);
-              for (unsigned i = 0; file[i]; ++i) {
-                if (file[i] == '\\') file[i] = '/';
-              }
-              //printf("%s\n", file.c_str());
-              directory[file] = d;
-            }
-            break;
+    void read_directory(const uint8_t *data, size_t size) {
+      // the end of central directory record is in the last 64k (+ 22 bytes) because of the comment.
+      if (size < 22) return;
+      size_t search_min = size > 0xffff + 22 ? size - 0xffff - 22 : 0;
+      const uint8_t *end_record = 0;
+      for (size_t i = size - 22 + 1; i-- > search_min; ) {
+        if (u4(data + i) == 0x06054b50) {
+          end_record = data + i;
+          break;
+        }
+      }
+      if (!end_record) return;
+
+      size_t dir_size = u4(end_record + 12);
+      size_t dir_offset = u4(end_record + 16);
+      if (dir_offset > size || dir_size > size - dir_offset) return;
+
+      const uint8_t *p = data + dir_offset;
+      const uint8_t *dir_end = p + dir_size;
+      while (dir_end - p >= 46 && u4(p) == 0x02014b50) {
+        dir_entry d;
+        d.compression = u2(p + 10);
+        d.csize = u4(p + 20);
+        d.usize = u4(p + 24);
+        unsigned file_name_len = u2(p + 28);
+        unsigned extra_len = u2(p + 30);
+        unsigned comment_len = u2(p + 32);
+        size_t local_offset = u4(p + 42);
+        if ((size_t)(dir_end - p) < 46 + file_name_len) break;
+
+        string file;
+        file.set((const char*)(p + 46), file_name_len);
+        p += 46 + file_name_len + extra_len + comment_len;
+
+        /*local file header signature     4 bytes  (0x04034b50) 0
+        version needed to extract       2 bytes 4
+        general purpose bit flag        2 bytes 6
+        compression method              2 bytes 8
+        last mod file time              2 bytes 10
+        last mod file date              2 bytes 12
+        crc-32                          4 bytes 14
+        compressed size                 4 bytes 18
+        uncompressed size               4 bytes 22
+        file name length                2 bytes 26
+        extra field length              2 bytes 28 / 30*/
+        if (local_offset > size || size - local_offset < 30) continue;
+        const uint8_t *local = data + local_offset;
+        if (u4(local) != 0x04034b50) continue;
+        size_t offset = local_offset + 30 + u2(local + 26) + u2(local + 28);
+        if (offset > size || size - offset < d.csize) continue;
+
+        // stored files are read as usize bytes from the map.
+        if (d.compression == 0 && (d.usize != d.csize || size - offset < d.usize)) continue;
+        d.offset = (uint32_t)offset;
+
+        for (unsigned i = 0; file[i]; ++i) {
+          if (file[i] == '\\') file[i] = '/';
+        }
+        //printf("%s\n", file.c_str());
+        directory[file] = d;
+      }
+    }
+
+    // find a recently inflated file
+    bool cache_find(int index, ref<inflated_data> &result) {
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      for (unsigned i = 0; i != cache_entries; ++i) {
+        if (cache[i].index == index) {
+          cache[i].last_use = ++cache_clock;
+          result = cache[i].data;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // keep a recently inflated file, dropping the least recently used ones to make room.
+    void cache_add(int index, inflated_data *data) {
+      size_t bytes = data->bytes.size();
+      if (bytes > cache_max_bytes / 4) return;
+
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      for (unsigned i = 0; i != cache_entries; ++i) {
+        // another thread got there first
+        if (cache[i].index == index) return;
+      }
+
+      for (;;) {
+        int empty = -1, oldest = -1;
+        for (unsigned i = 0; i != cache_entries; ++i) {
+          if (cache[i].index == -1) {
+            empty = (int)i;
+          } else if (oldest == -1 || cache[i].last_use < cache[oldest].last_use) {
+            oldest = (int)i;
           }
         }
+
+        if (empty != -1 && cache_bytes + bytes <= cache_max_bytes) {
+          cache_entry &entry = cache[empty];
+          entry.index = index;
+          entry.last_use = ++cache_clock;
+          entry.data = data;
+          cache_bytes += bytes;
+          return;
+        }
+
+        // the cache is full, so there is an oldest entry.
+        cache_entry &entry = cache[oldest];
+        cache_bytes -= entry.data->bytes.size();
+        entry.index = -1;
+        entry.data = 0;
       }
     }
 
-    /// close the zip file
-    ~zip_file() {
-      if (the_file) fclose(the_file);
+    bool inflate(uint8_t *dest, const dir_entry &d) {
+      // a decoder is about 14k of tables, one per call keeps threads apart.
+      zip_decoder decoder;
+      const uint8_t *src = map.get_data() + d.offset;
+      return decoder.decode(dest, dest + d.usize, src, src + d.csize);
+    }
+
+  public:
+    /// Open a zip file for reading
+    zip_file(const char *filename) : ref_cnt(0), map(filename) {
+      cache_clock = 0;
+      cache_bytes = 0;
+      for (unsigned i = 0; i != cache_entries; ++i) {
+        cache[i].index = -1;
+        cache[i].last_use = 0;
+      }
+
+      if (!map.get_data()) {
+        printf("file %s not found\n", filename);
+      } else {
+        read_directory(map.get_data(), (size_t)map.get_size());
+      }
     }
 
     /// allow ref<zip_file>
@@ -100,43 +250,72 @@ namespace octet { namespace resources {
 
     /// allow ref<zip_file>
     void release() {
-      if (--ref_cnt) {
+      if (--ref_cnt == 0) {
         delete this;
       }
     }
 
     /// get a file from a zip file, this is called from get_url with a zip:// prefix.
+    /// Compressed files are inflated straight into the buffer.
+    /// The buffer is left empty if the file is corrupt or uses an unknown compression method.
     void get_file(dynarray<uint8_t> &buffer, const char *file) {
       int index = directory.get_index(file);
       if (index < 0) return;
-      if (!the_file) return;
       const dir_entry &d = directory.get_value(index);
       buffer.resize(d.usize);
-      fseek(the_file, d.offset, SEEK_SET);
-      /*local file header signature     4 bytes  (0x04034b50) 0
-      version needed to extract       2 bytes 4
-      general purpose bit flag        2 bytes 6
-      compression method              2 bytes 8
-      last mod file time              2 bytes 10
-      last mod file date              2 bytes 12
-      crc-32                          4 bytes 14
-      compressed size                 4 bytes 18
-      uncompressed size               4 bytes 22
-      file name length                2 bytes 26
-      extra field length              2 bytes 28 / 30*/
-
-      uint8_t tmp[30];
-      fread(tmp, 1, sizeof(tmp), the_file);
-      if (u4(tmp) != 0x04034b50) return;
-      unsigned extra = u2(tmp + 26) + u2(tmp + 28);
-      fseek(the_file, d.offset + 30 + extra, SEEK_SET);
       if (d.compression == 0) {
-        fread(buffer.data(), 1, d.usize, the_file);
+        memcpy(buffer.data(), map.get_data() + d.offset, d.usize);
       } else if (d.compression == 8) {
-        dynarray<uint8_t> uncomp(d.csize + 4); // note: + 4 bytes prevents decode() overflowing
-        fread(uncomp.data(), 1, d.csize, the_file);
-        decoder.decode(buffer.data(), buffer.data() + d.usize, uncomp.data(), uncomp.data() + d.csize);
+        ref<inflated_data> cached;
+        if (cache_find(index, cached)) {
+          memcpy(buffer.data(), cached->bytes.data(), d.usize);
+        } else if (inflate(buffer.data(), d)) {
+          if (d.usize <= cache_max_bytes / 4) {
+            ref<inflated_data> copy = new inflated_data();
+            copy->bytes.resize(d.usize);
+            memcpy(copy->bytes.data(), buffer.data(), d.usize);
+            cache_add(index, copy);
+          }
+        } else {
+          printf("zip file: %s is corrupt\n", file);
+          buffer.resize(0);
+        }
+      } else {
+        printf("zip file: %s uses unknown compression %u\n", file, d.compression);
+        buffer.resize(0);
+      }
+    }
+
+    /// get a view of a file without copying it if possible.
+    /// Returns false if the file is missing or corrupt.
+    bool get_view(view &result, const char *file) {
+      int index = directory.get_index(file);
+      if (index < 0) return false;
+      const dir_entry &d = directory.get_value(index);
+      // only share an archive that is already owned by a ref<>, or dropping the view would delete it.
+      result.archive = ref_cnt > 0 ? this : 0;
+      result.inflated = 0;
+      result.size = d.usize;
+      if (d.compression == 0) {
+        result.data = map.get_data() + d.offset;
+        return true;
+      } else if (d.compression == 8) {
+        if (!cache_find(index, result.inflated)) {
+          result.inflated = new inflated_data();
+          result.inflated->bytes.resize(d.usize);
+          if (!inflate(result.inflated->bytes.data(), d)) {
+            printf("zip file: %s is corrupt\n", file);
+            result.inflated = 0;
+            result.data = 0;
+            return false;
+          }
+          cache_add(index, result.inflated);
+        }
+        result.data = result.inflated->bytes.data();
+        return true;
       }
+      result.data = 0;
+      return false;
     }
   };
 } }
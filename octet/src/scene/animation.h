@@ -43,6 +43,13 @@ namespace octet { namespace scene {
     void visit(visitor &v) {
       v.visit(data, atom_data);
       v.visit(channels, atom_channels);
+
+      // channels are plain data, but their atoms may be user defined and need translating.
+      for (unsigned i = 0; i != channels.size(); ++i) {
+        v.visit(channels[i].sid, atom_sid);
+        v.visit(channels[i].sub_target, atom_sub_target);
+        v.visit(channels[i].component, atom_component);
+      }
       v.visit(targets, atom_targets);
       v.visit(end_time, atom_end_time);
     }
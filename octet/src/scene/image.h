@@ -19,7 +19,7 @@ namespace octet { namespace scene {
     // source of image for reloads
     string url;
 
-    // image data
+    // image data, followed by the smaller mip levels if mip_levels > 1
     dynarray<uint8_t> bytes;
 
     // dimensions
@@ -31,12 +31,37 @@ namespace octet { namespace scene {
     uint8_t mip_levels;
     uint8_t cube_faces;
 
+    // dxt_encoder format to compress to when loading, or zero
+    uint16_t compression;
+
+    // load in the background when the texture is first used
+    bool async;
+
+    // true while a background load is in flight. Only touched by the render thread.
+    bool loading;
+
+    // rows run from the top down (DDS files). They are flipped on upload unless shaders flip the texture coordinates.
+    bool flipped;
+
+    // every sampler of the image so far flips texture coordinates, so upload flipped images as they are.
+    bool flip_in_shader;
+
+    // something samples the image without flipping, so always flip on upload.
+    bool upright;
+
+    // DDS files are mapped and uploaded straight from the map instead of bytes.
+    file_map *mapped_file;
+    const uint8_t *mapped_data;
+    size_t mapped_size;
+
     // derived attributes (not for saving)
     // todo: use gl_resource
     GLuint gl_texture;
 
     GLuint gl_target;
 
+    mipmap_filter mip_filter;
+
     void init(const char *name) {
       bool is_cubemap = strstr(name, "%s") != 0;
       this->url = name;
@@ -47,6 +72,15 @@ namespace octet { namespace scene {
       mip_levels = 1;
       cube_faces = is_cubemap ? 6 : 1;
       format = 0;
+      compression = 0;
+      async = false;
+      loading = false;
+      flipped = false;
+      flip_in_shader = false;
+      upright = false;
+      mapped_file = 0;
+      mapped_data = 0;
+      mapped_size = 0;
     }
 
     // these are here to avoid including glext.h which may be platform dependent.
@@ -62,173 +96,185 @@ namespace octet { namespace scene {
       COMPRESSED_RGBA_S3TC_DXT1_EXT = 0x83F1,
       COMPRESSED_RGBA_S3TC_DXT3_EXT = 0x83F2,
       COMPRESSED_RGBA_S3TC_DXT5_EXT = 0x83F3,
+      COMPRESSED_RED_RGTC1 = 0x8DBB,
+      COMPRESSED_RG_RGTC2 = 0x8DBD,
     };
 
-    /// Make mipmaps for this image.
+    /// Make mipmaps for this image with the mipmap filter.
+    /// Cube maps and 3D textures use glGenerateMipmap instead.
     void make_mipmaps() {
       if (format != RGB && format != RGBA) return;
-
-      bytes.resize(bytes.size() * 4 / 3);
+      if (gl_target != GL_TEXTURE_2D || cube_faces != 1) return;
 
       unsigned num_comps = format == RGB ? 3 : 4;
-      uint8_t *src = &bytes[0];
-      uint8_t *dest = &bytes[width * height * num_comps];
-      unsigned w = width;
-      unsigned h = height;
-      unsigned stride = w * num_comps;
-      mip_levels = 0;
-      while (w > 1 && h > 1) {
-        for (unsigned y = 0; y < h/2; ++y) {
-          for (unsigned x = 0; x < w/2; ++x) {
-            // this is a rather dreadful box filter, it is simple to make, but introduces
-            // artifacts. We can do better than this.
-            for (unsigned i = 0; i != num_comps; ++i) {
-              *dest++ = ( src[0] + src[num_comps] + src[stride] + src[stride+num_comps] + 3 ) >> 2;
-              src++;
-            }
-            src += num_comps;
-          }
-          src += stride;
-        }
-        w >>= 1;
-        h >>= 1;
-        stride >>= 1;
-        mip_levels++;
-      }
-      assert(dest - &bytes[0] < (int)bytes.size());
-      //printf("%d %d\n", dest - &bytes[0], bytes.size());
+      bytes.resize((unsigned)mipmap_filter::get_chain_size(width, height, num_comps));
+      mip_levels = (uint8_t)mip_filter.make_chain(bytes.data(), width, height, num_comps);
     }
 
-    /// DXT encode the image, making it smaller and grainier.
-    /// Todo: do standard error-diffusion and other improvements.
-    void dxt_encode() {
+    /// Compress the image and its mip levels to 4x4 blocks with dxt_encoder.
+    /// RGB images become BC1 and RGBA images BC3 unless another dxt_encoder format is given.
+    void dxt_encode(unsigned dxt_format = 0) {
       if (format != RGB && format != RGBA) return;
+      if (gl_target != GL_TEXTURE_2D || cube_faces != 1) return;
 
       unsigned num_comps = format == RGB ? 3 : 4;
+      if (!dxt_format) dxt_format = format == RGB ? dxt_encoder::bc1 : dxt_encoder::bc3;
+      dxt_encoder encoder((dxt_encoder::format_type)dxt_format);
       dynarray<uint8_t> result;
-      result.resize(bytes.size() / num_comps);
-      uint8_t *src = &bytes[0];
-      uint8_t *dest = &result[0];
-      unsigned w = width;
-      unsigned h = height;
-      unsigned stride = w * num_comps;
-      unsigned new_mip_levels = 0;
-      while (w > 4 && h > 4 && new_mip_levels < mip_levels) {
-        for (unsigned y = 0; y < h/4; ++y) {
-          log("w=%d y=%d src=%08x\n", w, y, src - &bytes[0]);
-          for (unsigned x = 0; x < w/4; ++x) {
-            // ye olde covariance method http://en.wikipedia.org/wiki/Linear_discriminant_analysis
-            vec4 tot(0, 0, 0, 0);
-            vec4 colours[16];
-            for (unsigned j = 0; j != 4; ++j) {
-              for (unsigned i = 0; i != 4; ++i) {
-                //vec4 colour(src[0] * (1.0f/255), src[1] * (1.0f/255), src[2] * (1.0f/255), (num_comps == 4 ? src[3] * (1.0f/255) : 1.0f));
-                vec4 colour(src[0] * (1.0f/255), src[1] * (1.0f/255), src[2] * (1.0f/255), 1.0f);
-                colours[i+j*4] = colour;
-                tot += colour;
-                src += num_comps;
-              }
-              src += ( w - 4 ) * num_comps;
-            }
-            src -= ( w - 1 ) * 4 * num_comps;
-
-            // calculate the covariance matrix
-            vec4 mean = tot * 0.0625f;
-            mat4t covariance(0);
-            for (unsigned i = 0; i != 16; ++i) {
-              vec4 colour = colours[i] -= mean;
-              covariance += outer(colour, colour);
-            }
-
-            // power method to find largest eigenvector (axis)
-            vec4 axis = covariance.trace();
-            for (unsigned i = 0; i != 4; ++i) {
-              axis = axis * covariance;
-            }
-            float len = axis.length();
-            if (abs(len) >= 0.001f) axis = axis / len;
-            //if (y == 27) log("%s %s %s\n", mean.toString(), axis.toString(), covariance.toString(tmp, sizeof(tmp)));
-
-            // our colours all have to live on the axis.
-            // in practice, we can ignore "odd man out" colours
-            // for better compression. But for now, do all the colours.
-            float pmin = dot(colours[0], axis);
-            float pmax = pmin;
-            float projs[16];
-            projs[0] = pmin;
-            for (unsigned i = 1; i != 16; ++i) {
-              float proj = dot(colours[i], axis);
-              projs[i] = proj;
-              pmin = pmin < proj ? pmin : proj;
-              pmax = pmax > proj ? pmax : proj;
-            }
-            vec4 cmin = mean + axis * pmin;
-            vec4 cmax = mean + axis * pmax;
-            //if (y == 27) log("%s -> %s\n", cmin.toString(), cmax.toString(tmp, sizeof(tmp)));
-            cmin = min(max(cmin, vec4(0, 0, 0, 0)), vec4(1, 1, 1, 1));
-            cmax = min(max(cmax, vec4(0, 0, 0, 0)), vec4(1, 1, 1, 1));
-
-            unsigned c0 =
-              ( (unsigned)(cmin.x() * 31.999f) << 11 ) |
-              ( (unsigned)(cmin.y() * 63.999f) << 5 ) |
-              ( (unsigned)(cmin.z() * 31.999f) << 0 )
-            ;
-            unsigned c1 =
-              ( (unsigned)(cmax.x() * 31.999f) << 11 ) |
-              ( (unsigned)(cmax.y() * 63.999f) << 5 ) |
-              ( (unsigned)(cmax.z() * 31.999f) << 0 )
-            ;
-
-            if (c0 < c1) {
-              unsigned t = c0; c0 = c1; c1 = t;
-              float p = pmin; pmin = pmax; pmax = p;
-            }
-
-            float pscale = abs(pmax - pmin) > 0.001f ? 3.999f / (pmax - pmin) : 0;
-            uint8_t pal[16];
-            for (unsigned i = 0; i != 16; ++i) {
-              pal[i] = (unsigned)( ( projs[i] - pmin ) * pscale );
-            }
-
-            dest[0] = ( c0 >> 0 ) & 0xff;
-            dest[1] = ( c0 >> 8 ) & 0xff;
-            dest[2] = ( c1 >> 0 ) & 0xff;
-            dest[3] = ( c1 >> 8 ) & 0xff;
-            for (int i = 0; i != 4; ++i) {
-              dest[i+4] = pal[i*4+0] + pal[i*4+1] * 4 + pal[i*4+2] * 16 + pal[i*4+3] * 64;
-            }
-            dest += 8;
+      encoder.encode_chain(result, bytes.data(), width, height, num_comps, mip_levels);
+      bytes.resize(result.size());
+      memcpy(bytes.data(), result.data(), result.size());
+      format = (uint16_t)dxt_format;
+    }
+
+    static bool is_compressed(unsigned format) {
+      return
+        format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT ||
+        format == COMPRESSED_RGBA_S3TC_DXT3_EXT || format == COMPRESSED_RGBA_S3TC_DXT5_EXT ||
+        format == COMPRESSED_RED_RGTC1 || format == COMPRESSED_RG_RGTC2
+      ;
+    }
+
+    // true if GL can use a compressed format. Call from the render thread.
+    static bool can_use_format(unsigned format) {
+      static int s3tc = -1, rgtc = -1;
+      if (s3tc == -1) {
+        // core profiles do not list extensions here, but desktop GL has both.
+        const char *ext = (const char*)glGetString(GL_EXTENSIONS);
+        s3tc = !ext || strstr(ext, "texture_compression_s3tc") || strstr(ext, "texture_compression_dxt");
+        rgtc = !ext || strstr(ext, "texture_compression_rgtc");
+      }
+      return format == COMPRESSED_RED_RGTC1 || format == COMPRESSED_RG_RGTC2 ? rgtc != 0 : s3tc != 0;
+    }
+
+    // number of whole compressed levels in the image data
+    unsigned count_compressed_levels() const {
+      unsigned w = width, h = height, levels = 0;
+      size_t offset = 0;
+      for (;;) {
+        offset += dds_decoder::get_level_size(w, h, format);
+        if (offset > bytes.size()) return levels;
+        levels++;
+        if (w == 1 && h == 1) return levels;
+        w = w > 1 ? w >> 1 : 1;
+        h = h > 1 ? h >> 1 : 1;
+      }
+    }
+
+    // the image data: the mapped file or bytes.
+    const uint8_t *get_data() const {
+      return mapped_data ? mapped_data : bytes.data();
+    }
+
+    size_t get_data_size() const {
+      return mapped_data ? mapped_size : bytes.size();
+    }
+
+    void release_map() {
+      delete mapped_file;
+      mapped_file = 0;
+      mapped_data = 0;
+      mapped_size = 0;
+    }
+
+    // Map a local DDS file so that its levels can be uploaded without copying them.
+    bool map_dds(const char *_url) {
+      if (!strncmp(_url, "zip://", 6) || !strncmp(_url, "http://", 7)) return false;
+
+      file_map *map = new file_map(app_utils::get_path(_url));
+      const uint8_t *data = map->get_data();
+      dds_decoder::layout layout;
+      if (!data || map->get_size() < 4 || memcmp(data, "DDS ", 4) || !dds_decoder::get_layout(layout, data, data + map->get_size())) {
+        delete map;
+        return false;
+      }
+
+      release_map();
+      bytes.reset();
+      mapped_file = map;
+      mapped_data = data + layout.offset;
+      mapped_size = layout.size;
+      width = (uint16_t)layout.width;
+      height = (uint16_t)layout.height;
+      format = (uint16_t)layout.format;
+      mip_levels = (uint8_t)layout.mip_levels;
+      flipped = true;
+      return true;
+    }
+
+    // Start sending the image data to GL. Returns the address to give to glTexImage2D.
+    // Background loads of 2D textures on desktop GL copy the data to a pixel unpack buffer, so that the driver
+    // can copy it to the texture without stalling; the address is then an offset into the buffer.
+    const uint8_t *begin_upload(GLuint &pbo) {
+      pbo = 0;
+      #ifndef OCTET_GLES2
+        if (async && gl_target == GL_TEXTURE_2D && get_data_size()) {
+          glGenBuffers(1, &pbo);
+          glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+          glBufferData(GL_PIXEL_UNPACK_BUFFER, get_data_size(), NULL, GL_STREAM_DRAW);
+          #ifdef __APPLE__
+            void *dest = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+          #else
+            void *dest = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, get_data_size(), GL_MAP_WRITE_BIT|GL_MAP_INVALIDATE_BUFFER_BIT);
+          #endif
+          if (dest) {
+            memcpy(dest, get_data(), get_data_size());
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            return (const uint8_t*)0;
           }
-          src += stride * 3;
+          glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+          glDeleteBuffers(1, &pbo);
+          pbo = 0;
         }
-        w >>= 1;
-        h >>= 1;
-        stride >>= 1;
-        new_mip_levels++;
+      #endif
+      return get_data();
+    }
+
+    // GL keeps the buffer until the copy is done, so we can let go of it straight away.
+    void end_upload(GLuint pbo) {
+      if (pbo) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glDeleteBuffers(1, &pbo);
+      }
+    }
+
+    // true if every level can be flipped a block at a time.
+    bool can_flip_levels() const {
+      unsigned h = height;
+      for (unsigned level = 0; level != mip_levels; ++level) {
+        if (!dds_decoder::can_flip_level(h)) return false;
+        h = h > 1 ? h >> 1 : 1;
       }
-      assert(dest - &result[0] < (int)result.size());
-      bytes.resize((int)(dest - &result[0]));
-      memcpy(&bytes[0], &result[0], dest - &result[0]);
-      format = COMPRESSED_RGB_S3TC_DXT1_EXT;
-      mip_levels = new_mip_levels;
+      return true;
     }
 
-    void add_texture() {
+    // swap rows of pixels top to bottom in place.
+    static void flip_rows(uint8_t *pixels, unsigned stride, unsigned rows) {
+      for (unsigned j = 0; j < rows / 2; ++j) {
+        std::swap_ranges(pixels + j * stride, pixels + (j + 1) * stride, pixels + (rows - 1 - j) * stride);
+      }
+    }
+
+    void add_texture(const uint8_t *base) {
       glBindTexture(gl_target, gl_texture);
 
       if (mip_levels == 1 || gl_target != GL_TEXTURE_2D) {
         if (gl_target == GL_TEXTURE_2D) {
-          glTexImage2D(gl_target, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, (void*)&bytes[0]);
+          glTexImage2D(gl_target, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, (void*)base);
           // this may not work on very old systems, comment it out.
           glGenerateMipmap(gl_target);
         } else if (gl_target == GL_TEXTURE_3D) {
-          glTexImage3D(gl_target, 0, format, width, height, 1, 0, format, GL_UNSIGNED_BYTE, (void*)&bytes[0]);
+          // NIFTI volumes are one byte per voxel.
+          glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+          glTexImage3D(gl_target, 0, format, width, height, depth, 0, format, GL_UNSIGNED_BYTE, (void*)base);
+          glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+          glGenerateMipmap(gl_target);
           printf("err=%08x\n", glGetError());
         } else if (gl_target == GL_TEXTURE_CUBE_MAP) {
           unsigned num_comps = format == RGBA ? 4 : 3;
           for (int i = 0; i != 6; ++i) {
             size_t offset = width * height * num_comps * i;
-            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, (void*)&bytes[offset]);
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, (void*)(base + offset));
             //static const unsigned cols[6] = { 0xff0000ff, 0xffff00ff, 0xffffffff, 0xff00ffff, 0x0000ffff, 0x00ffffff };
             //glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, format, 1, 1, 0, format, GL_UNSIGNED_BYTE, (void*)&cols[i]);
           }
@@ -238,14 +284,16 @@ namespace octet { namespace scene {
         unsigned num_comps = format == RGBA ? 4 : 3;
         unsigned w = width;
         unsigned h = height;
-        uint8_t *src = &bytes[0];
-        unsigned level = 0;
-        while (w != 0 && h != 0) {
-          glTexImage2D(gl_target, level++, format, w, h, 0, format, GL_UNSIGNED_BYTE, (void*)src);
+        const uint8_t *src = base;
+        // rows of RGB levels are not multiples of four bytes.
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (unsigned level = 0; level != mip_levels; ++level) {
+          glTexImage2D(gl_target, level, format, w, h, 0, format, GL_UNSIGNED_BYTE, (void*)src);
           src += w * h * num_comps;
-          w >>= 1;
-          h >>= 1;
+          w = w > 1 ? w >> 1 : 1;
+          h = h > 1 ? h >> 1 : 1;
         }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
       }
     }
 
@@ -269,10 +317,19 @@ namespace octet { namespace scene {
       width = _width;
       height = _height;
       depth = _depth; // for 3D textures
+      async = false;
+      loading = false;
+      flipped = false;
+      flip_in_shader = false;
+      upright = false;
+      mapped_file = 0;
+      mapped_data = 0;
+      mapped_size = 0;
     }
 
     /// release resources.
     ~image() {
+      release_map();
     }
 
     /// width in pixels
@@ -300,6 +357,22 @@ namespace octet { namespace scene {
       return frames;
     }
 
+    /// number of mip levels in the image data, including the top level.
+    unsigned get_mip_levels() const {
+      return mip_levels;
+    }
+
+    /// set the filter used to make mipmaps when the image is loaded.
+    void set_mipmap_filter(const mipmap_filter &filter) {
+      mip_filter = filter;
+    }
+
+    /// compress to a dxt_encoder format such as dxt_encoder::bc1 when the image is loaded.
+    /// Zero leaves the image uncompressed. Use bc5 for normal maps.
+    void set_compression(unsigned dxt_format) {
+      compression = (uint16_t)dxt_format;
+    }
+
     /// access attributes by name
     void visit(visitor &v) {
       v.visit(url, atom_url);
@@ -313,6 +386,8 @@ namespace octet { namespace scene {
 
     /// load the image from a url
     void load() {
+      release_map();
+      flipped = false;
       string x;
       if (cube_faces == 6) {
         bytes.resize(0);
@@ -335,10 +410,31 @@ namespace octet { namespace scene {
     }
 
     void load_part(const char *_url) {
+      // DDS files are finished textures, so map them and upload the levels from the map.
+      if (cube_faces == 1 && map_dds(_url)) return;
+
       dynarray<uint8_t> buffer;
       app_utils::get_url(buffer, _url);
       const unsigned char *src = &buffer[0];
       const unsigned char *src_max = src + buffer.size();
+
+      // finished 2D textures are kept in the texture cache, keyed by the file contents and the settings.
+      // DDS files are already finished.
+      bool is_dds = buffer.size() >= 4 && !memcmp(&buffer[0], "DDS ", 4);
+      bool cacheable = texture_cache::get().is_enabled() && gl_target == GL_TEXTURE_2D && cube_faces == 1 && buffer.size() && !is_dds;
+      uint64_t key = 0;
+      if (cacheable) {
+        key = texture_cache::hash(src, buffer.size(), mip_filter.get_signature() * 31 + compression);
+        texture_cache::info info;
+        if (texture_cache::get().load(key, bytes, info)) {
+          width = (uint16_t)info.width;
+          height = (uint16_t)info.height;
+          format = (uint16_t)info.format;
+          mip_levels = (uint8_t)info.mip_levels;
+          return;
+        }
+      }
+
       if (buffer.size() >= 6 && !memcmp(&buffer[0], "GIF89a", 6)) {
         gif_decoder dec;
         dec.get_image(bytes, format, width, height, src, src_max);
@@ -348,9 +444,11 @@ namespace octet { namespace scene {
       } else if (buffer.size() >= 6 && buffer[0] == 0 && buffer[1] == 0 && buffer[2] == 2) {
         tga_decoder dec;
         dec.get_image(bytes, format, width, height, src, src_max);
-      } else if (buffer.size() >= 4 && buffer[0] == 'D' && buffer[1] == 'D' && buffer[2] == 'S' && buffer[3] == ' ') {
+      } else if (is_dds) {
         dds_decoder dec;
         dec.get_image(bytes, format, width, height, src, src_max);
+        mip_levels = is_compressed(format) ? count_compressed_levels() : 1;
+        flipped = true;
       } else if (buffer.size() >= 348 && (!memcmp(&buffer[344], "ni1", 4) || !memcmp(&buffer[344], "n+1", 4))) {
         nifti_decoder dec;
         gl_target = GL_TEXTURE_3D;
@@ -361,47 +459,164 @@ namespace octet { namespace scene {
       }
 
       make_mipmaps();
-      //dxt_encode();
+      if (compression) {
+        dxt_encode(compression);
+      }
+
+      if (cacheable && gl_target == GL_TEXTURE_2D && bytes.size()) {
+        texture_cache::info info = { width, height, format, mip_levels };
+        texture_cache::get().save(key, bytes.data(), bytes.size(), info);
+      }
+    }
+
+    /// load the image on a background thread and upload it when background_loader::update() allows.
+    /// Until then, get_gl_texture() returns a placeholder. Higher priorities load first.
+    void load_async(int priority = 0) {
+      if (loading || gl_texture) return;
+      loading = true;
+      ref<image> self = this;
+      background_loader::get().add(
+        [self]() { self->load(); return self->get_data_size(); },
+        [self]() { self->loading = false; self->upload(); },
+        priority
+      );
+    }
+
+    /// load in the background when the texture is first used instead of stalling the frame.
+    void set_async(bool value) {
+      async = value;
+    }
+
+    /// true while a background load is in flight. Do not use the size or data of the image until it is done.
+    bool is_loading() const {
+      return loading;
+    }
+
+    /// true if the GL texture is upside down, so shaders must flip the v texture coordinate; see param_sampler.
+    /// Only DDS images that allow_flip_in_shader() has been called for are uploaded upside down.
+    bool is_flipped() const {
+      // the loader writes flipped, so only read it once the load has finished.
+      return !loading && flipped && flip_in_shader;
+    }
+
+    /// Upload DDS images upside down, straight from the file, and leave shaders to flip the v coordinate.
+    /// param_sampler calls this for shaders with a "<sampler>_flip" uniform. Ignored after require_upright().
+    void allow_flip_in_shader() {
+      if (!upright) flip_in_shader = true;
+    }
+
+    /// Flip DDS images on upload, for shaders that do not flip the v coordinate.
+    /// param_sampler calls this for shaders without a "<sampler>_flip" uniform. It wins over allow_flip_in_shader().
+    /// Code that draws with get_gl_texture() and its own shader does not need to call it unless the image
+    /// is also used by a material with a flipping shader.
+    void require_upright() {
+      upright = true;
+      if (flip_in_shader) {
+        flip_in_shader = false;
+        // an upside down texture must be loaded again.
+        if (gl_texture && flipped) {
+          glDeleteTextures(1, &gl_texture);
+          gl_texture = 0;
+        }
+      }
+    }
+
+    /// a 1x1 grey texture to draw with until background loads are done.
+    static GLuint get_placeholder(GLuint target) {
+      static GLuint textures[2];
+      static const uint8_t grey[4] = { 0x80, 0x80, 0x80, 0xff };
+      bool is_cubemap = target == GL_TEXTURE_CUBE_MAP;
+      GLuint &texture = textures[is_cubemap];
+      if (!texture) {
+        glGenTextures(1, &texture);
+        glBindTexture(target, texture);
+        if (is_cubemap) {
+          for (int i = 0; i != 6; ++i) {
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, (void*)grey);
+          }
+        } else {
+          glTexImage2D(target, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, (void*)grey);
+        }
+        glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+      }
+      return texture;
     }
 
     /// get the OpenGL texture handle for this image.
+    /// Async images return a placeholder until they have loaded.
     GLuint get_gl_texture() {
       if (!gl_texture) {
-        if (bytes.size() == 0 || width == 0 || height == 0) {
+        // the loader thread owns the image until its finish job runs in background_loader::update().
+        // the load sets gl_target for 3D textures, so go by the face count.
+        GLuint placeholder_target = cube_faces == 6 ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+        if (loading) {
+          return get_placeholder(placeholder_target);
+        }
+        if (get_data_size() == 0 || width == 0 || height == 0) {
+          if (async) {
+            load_async();
+            return get_placeholder(placeholder_target);
+          }
           load();
         }
+        upload();
+      }
+      return gl_texture;
+    }
+
+    /// make the GL texture from the loaded image. Does nothing if there is already a texture.
+    void upload() {
+      if (gl_texture) return;
+
+      // make a new texture handle
+      glGenTextures(1, &gl_texture);
+      glActiveTexture(GL_TEXTURE0);
 
-        // make a new texture handle
-        glGenTextures(1, &gl_texture);
-        glActiveTexture(GL_TEXTURE0);
-
-        // todo: handle compressed textures
-        if (format == GL_RGB || format == GL_RGBA) {
-          add_texture();
-        } else if (format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT3_EXT || format == COMPRESSED_RGBA_S3TC_DXT5_EXT) {
-          glBindTexture(gl_target, gl_texture);
-          unsigned w = width;
-          unsigned h = height;
-          uint8_t *src = &bytes[0];
-          unsigned level = 0;
-          unsigned shift = ( format == COMPRESSED_RGB_S3TC_DXT1_EXT || format == COMPRESSED_RGBA_S3TC_DXT1_EXT ) ? 1 : 0;
-          while (w != 0 && h != 0) {
-            unsigned wmin = w < 4 ? 4 : w;
-            unsigned hmin = h < 4 ? 4 : h;
-            unsigned size = ( wmin * hmin ) >> shift;
-            glCompressedTexImage2D(gl_target, level++, format, w, h, 0, size, (void*)src);
-            //printf("%d\n", glGetError());
-            src += size;
-            w >>= 1;
-            h >>= 1;
+      // DDS levels are turned the right way up here unless shaders do it.
+      bool flip = flipped && !flip_in_shader;
+
+      // formats that GL cannot use are decoded to RGBA a level at a time.
+      // So are levels whose blocks cannot be flipped, which needs all the levels to be RGBA.
+      bool decode = is_compressed(format) && (!can_use_format(format) || (flip && !can_flip_levels()));
+
+      GLuint pbo = 0;
+      const uint8_t *base = decode || flip ? get_data() : begin_upload(pbo);
+      if (format == GL_RGB || format == GL_RGBA || (format == LUMINANCE && gl_target == GL_TEXTURE_3D)) {
+        add_texture(base);
+      } else if (is_compressed(format)) {
+        glBindTexture(gl_target, gl_texture);
+        unsigned w = width;
+        unsigned h = height;
+        const uint8_t *src = base;
+        dynarray<uint8_t> rgba(decode ? width * height * 4 : 0);
+        dynarray<uint8_t> blocks(flip && !decode ? (unsigned)dds_decoder::get_level_size(width, height, format) : 0);
+        for (unsigned level = 0; level != mip_levels; ++level) {
+          unsigned size = (unsigned)dds_decoder::get_level_size(w, h, format);
+          if (decode) {
+            dds_decoder::decode_level(rgba.data(), src, w, h, format);
+            if (flip) flip_rows(rgba.data(), w * 4, h);
+            glTexImage2D(gl_target, level, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, (void*)rgba.data());
+          } else if (flip) {
+            dds_decoder::flip_level(blocks.data(), src, w, h, format);
+            glCompressedTexImage2D(gl_target, level, format, w, h, 0, size, (void*)blocks.data());
+          } else {
+            glCompressedTexImage2D(gl_target, level, format, w, h, 0, size, (void*)src);
           }
-          //printf("%d %d\n", src - image_, size);
+          src += size;
+          w = w > 1 ? w >> 1 : 1;
+          h = h > 1 ? h >> 1 : 1;
         }
-
-        glTexParameteri(gl_target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(gl_target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
       }
-      return gl_texture;
+      end_upload(pbo);
+
+      // the GL texture has the data now.
+      release_map();
+
+      // a single compressed level cannot be mipmapped by GL
+      bool single_level = is_compressed(format) && mip_levels == 1;
+      glTexParameteri(gl_target, GL_TEXTURE_MIN_FILTER, single_level ? GL_LINEAR : GL_LINEAR_MIPMAP_LINEAR);
+      glTexParameteri(gl_target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     }
 
     /// todo: merge gl_resource with textures.
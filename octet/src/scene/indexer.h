@@ -8,47 +8,60 @@
 namespace octet { namespace scene {
   /// Mesh modifier to index a mesh. The meshes from Collada may not be correctly indexed
   /// and vertices may be duplicated. This modifier de-duplicates vertices.
+  ///
+  /// Vertices are hashed in parallel and then split into buckets by hash so that
+  /// each bucket can be de-duplicated on its own thread.
+  /// With a weld epsilon, positions are snapped to a grid of that size before comparing,
+  /// so that vertices that differ only by rounding are merged.
   class indexer : public mesh {
-    struct vertex {
-      const uint8_t *bytes;
-      unsigned size;
+    enum { num_buckets = 256 };
 
-      bool is_empty() const { return bytes == 0; }
+    // source mesh. Provides underlying geometry.
+    ref<mesh> src;
 
-      bool operator ==(const vertex &rhs) const {
-        //printf("%p %p %d\n", this, &rhs, size == rhs.size && memcmp(bytes, rhs.bytes, size) == 0);
-        return size == rhs.size && memcmp(bytes, rhs.bytes, size) == 0;
-      }
+    // grid size for welding positions. zero for exact matches.
+    float weld_epsilon;
 
-      unsigned get_hash() const {
-        unsigned hash = 0;
-        for (unsigned i = 0; i != size; ++i) {
-          hash = ( hash * 7 ) + ( hash >> 13 ) + bytes[i];
-          //printf("%02x ", bytes[i]);
-        }
-        //printf("%d hash=%08x\n", size, hash_map_cmp::fuzz_hash(hash));
-        return hash;
-      }
-    };
-
-    class vertex_cmp : public hash_map_cmp {
-    public:
-      static unsigned get_hash(const vertex &key) { return fuzz_hash(key.get_hash()); }
-      static bool is_empty(const vertex &key) { return key.is_empty(); }
-    };
+    static uint64_t mix(uint64_t h) {
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdULL;
+      h ^= h >> 33;
+      h *= 0xc4ceb9fe1a85ec53ULL;
+      h ^= h >> 33;
+      return h;
+    }
 
-    // source mesh. Provides underlying geometry.
-    ref<mesh> src;
+    // 64 bit hash of a vertex, a word at a time.
+    static uint64_t hash_bytes(const uint8_t *bytes, unsigned size) {
+      uint64_t h = size;
+      unsigned i = 0;
+      for (; i + 4 <= size; i += 4) {
+        uint32_t w;
+        memcpy(&w, bytes + i, 4);
+        h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+      }
+      for (; i != size; ++i) {
+        h = (h ^ bytes[i]) * 0x9e3779b97f4a7c15ULL;
+      }
+      return mix(h);
+    }
 
   public:
     RESOURCE_META(indexer)
 
     /// Construct a mesh indexer from a mesh.
-    indexer(mesh *src=0) {
+    indexer(mesh *src=0, float weld_epsilon=0) {
       this->src = src;
+      this->weld_epsilon = weld_epsilon;
       update();
     }
 
+    /// Set the grid size for welding positions. Zero (the default) only merges identical vertices.
+    void set_weld_epsilon(float value) {
+      weld_epsilon = value;
+    }
+
     /// standard update function, called if input changes.
     void update() {
       if (!src) return;
@@ -57,34 +70,110 @@ namespace octet { namespace scene {
 
       if (get_index_type() != GL_UNSIGNED_INT) return;
 
-      hash_map<vertex, unsigned, vertex_cmp> vertex_to_index;
+      platform::thread_pool &pool = platform::thread_pool::get();
+      unsigned stride = get_stride();
+      unsigned num_indices = get_num_indices();
+      if (!stride || !num_indices) return;
 
       dynarray<uint8_t> dest_vertices;
-      dynarray<uint32_t> dest_indices;
-      dest_indices.reserve(get_num_indices());
+      dynarray<uint32_t> dest_indices(num_indices);
+      unsigned num_vertices = 0;
 
-      gl_resource::rolock idx_lock(get_indices());
-      gl_resource::rolock vtx_lock(get_vertices());
-      const uint32_t *ip = idx_lock.u32();
-      const uint8_t *vp = vtx_lock.u8();
+      {
+        gl_resource::rolock idx_lock(get_indices());
+        gl_resource::rolock vtx_lock(get_vertices());
+        const uint32_t *ip = idx_lock.u32();
+        const uint8_t *vp = vtx_lock.u8();
+        unsigned num_src = get_vertices()->get_size() / stride;
+
+        // with welding, compare copies of the vertices with the positions snapped to the grid.
+        dynarray<uint8_t> keys;
+        const uint8_t *kp = vp;
+        unsigned pos_slot = get_slot(attribute_pos);
+        if (weld_epsilon > 0 && pos_slot != ~0 && get_kind(pos_slot) == GL_FLOAT) {
+          unsigned pos_offset = get_offset(pos_slot);
+          unsigned pos_size = get_size(pos_slot);
+          float scale = 1.0f / weld_epsilon;
+          keys.resize(num_src * stride);
+          pool.parallel_for(0, num_src, [&](unsigned i) {
+            uint8_t *key = keys.data() + i * stride;
+            memcpy(key, vp + i * stride, stride);
+            for (unsigned j = 0; j != pos_size; ++j) {
+              float f;
+              memcpy(&f, key + pos_offset + j * 4, 4);
+              int32_t q = (int32_t)std::floor(f * scale + 0.5f);
+              memcpy(key + pos_offset + j * 4, &q, 4);
+            }
+          }, 1024);
+          kp = keys.data();
+        }
 
-      unsigned stride = get_stride();
-      unsigned num_vertices = 0;
-      for (unsigned i = 0; i != get_num_indices(); ++i) {
-        uint32_t idx = ip[i];
-        vertex v = { vp + idx * stride, stride };
-        unsigned &e = vertex_to_index[v];
-        //printf("i=%d idx=%d e=%d\n", i, idx, e);
-        if (e == 0) { // hash_map inits to zero
-          e = ++num_vertices;
-          unsigned old_size = dest_vertices.size();
-          dest_vertices.resize(old_size + stride);
-          memcpy(&dest_vertices[old_size], vp + idx * stride, stride);
+        dynarray<uint64_t> hashes(num_src);
+        pool.parallel_for(0, num_src, [&](unsigned i) {
+          hashes[i] = hash_bytes(kp + i * stride, stride);
+        }, 1024);
+
+        // partition the vertices into buckets by the top bits of the hash, keeping them in order.
+        unsigned bucket_start[num_buckets + 1] = { 0 };
+        for (unsigned i = 0; i != num_src; ++i) {
+          bucket_start[(hashes[i] >> 56) + 1]++;
+        }
+        for (unsigned b = 0; b != num_buckets; ++b) {
+          bucket_start[b + 1] += bucket_start[b];
+        }
+        dynarray<uint32_t> order(num_src);
+        {
+          unsigned pos[num_buckets];
+          memcpy(pos, bucket_start, sizeof(pos));
+          for (unsigned i = 0; i != num_src; ++i) {
+            order[pos[hashes[i] >> 56]++] = i;
+          }
         }
-        dest_indices.push_back(e - 1);
-        //printf("di=%d\n", e-1);
+
+        // map each vertex to the first vertex equal to it, one bucket per job.
+        dynarray<uint32_t> first(num_src);
+        pool.parallel_for(0, num_buckets, [&](unsigned b) {
+          unsigned begin = bucket_start[b], end = bucket_start[b + 1];
+          if (begin == end) return;
+          unsigned size = 1;
+          while (size < (end - begin) * 2) size *= 2;
+          dynarray<uint32_t> table(size);
+          memset(table.data(), 0xff, size * sizeof(uint32_t));
+          for (unsigned i = begin; i != end; ++i) {
+            uint32_t v = order[i];
+            unsigned slot = (unsigned)hashes[v] & (size - 1);
+            for (;;) {
+              uint32_t e = table[slot];
+              if (e == ~0u) {
+                table[slot] = first[v] = v;
+                break;
+              } else if (hashes[e] == hashes[v] && !memcmp(kp + e * stride, kp + v * stride, stride)) {
+                first[v] = e;
+                break;
+              }
+              slot = (slot + 1) & (size - 1);
+            }
+          }
+        });
+
+        // number the vertices in the order they are first used.
+        dynarray<uint32_t> new_index(num_src);
+        dynarray<uint32_t> used(num_src);
+        memset(new_index.data(), 0xff, num_src * sizeof(uint32_t));
+        for (unsigned i = 0; i != num_indices; ++i) {
+          uint32_t v = first[ip[i]];
+          if (new_index[v] == ~0u) {
+            used[num_vertices] = v;
+            new_index[v] = num_vertices++;
+          }
+          dest_indices[i] = new_index[v];
+        }
+
+        dest_vertices.resize(num_vertices * stride);
+        pool.parallel_for(0, num_vertices, [&](unsigned i) {
+          memcpy(dest_vertices.data() + i * stride, vp + used[i] * stride, stride);
+        }, 1024);
       }
-      //printf("%d/%d\n", get_num_vertices(), num_vertices);
 
       unsigned isize = dest_indices.size() * sizeof(dest_indices[0]);
       unsigned vsize = dest_vertices.size() * sizeof(dest_vertices[0]);
@@ -104,6 +193,7 @@ namespace octet { namespace scene {
     void visit(visitor &v) {
       mesh::visit(v);
       v.visit(src, atom_src);
+      v.visit(weld_epsilon, atom_weld_epsilon);
     }
   };
 }}
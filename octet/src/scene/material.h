@@ -42,21 +42,8 @@ namespace octet { namespace scene {
       params.push_back(new param_attribute(atom_normal, GL_FLOAT_VEC3));
     }
 
-  public:
-    RESOURCE_META(material)
-
-    enum {
-      ambient_size = 1,
-      max_lights = 4,
-      light_size = 4,
-    };
-
-    /// Default constructor makes a blank material.
-    material() {
-    }
-
-    /// Alternative constructor.
-    material(const vec4 &color, param_shader *shader = NULL) {
+    // solid color material
+    void init_color(const vec4 &color, param_shader *shader) {
       // materials are constructed from parameters which build the final shader.
       // this allows us to use OpenGLES2 (uniforms) and 3 (buffers) as well as new shader features.
       params.reserve(16);
@@ -74,8 +61,8 @@ namespace octet { namespace scene {
       custom_shader = shader;
     }
 
-    /// create a material from an existing image
-    material(image *img, sampler *smpl = NULL, param_shader *shader = NULL) {
+    // textured material
+    void init_image(image *img, sampler *smpl, param_shader *shader) {
       if (!smpl) smpl = new sampler();
 
       params.reserve(16);
@@ -93,11 +80,70 @@ namespace octet { namespace scene {
       custom_shader = shader;
     }
 
+  public:
+    RESOURCE_META(material)
+
+    enum {
+      ambient_size = 1,
+      max_lights = 4,
+      light_size = 4,
+    };
+
+    /// Default constructor makes a blank material.
+    material() {
+    }
+
+    /// Alternative constructor.
+    material(const vec4 &color, param_shader *shader = NULL) {
+      init_color(color, shader);
+    }
+
+    /// create a material from an existing image
+    material(image *img, sampler *smpl = NULL, param_shader *shader = NULL) {
+      init_image(img, smpl, shader);
+    }
+
     material(param *diffuse, param *ambient, param *emission, param *specular, param *bump, param *shininess) {
     }
 
     /// Serialize.
+    /// We save the diffuse color or texture and the shader, and rebuild the material from them.
+    /// Parameters added with add_uniform or add_sampler are not saved.
     void visit(visitor &v) {
+      atom_t kind = atom_;
+      vec4 color(0, 0, 0, 0);
+      ref<image> img;
+      ref<sampler> smpl;
+      ref<param_shader> shader;
+      if (!v.is_reader()) {
+        shader = custom_shader;
+        param *diffuse = get_param(atom_diffuse);
+        param *diffuse_sampler = get_param(atom_diffuse_sampler);
+        if (diffuse && diffuse->get_type() == atom_param_color) {
+          kind = atom_color;
+          color = ((param_color*)diffuse)->get_value(buffer.data());
+        } else if (diffuse_sampler && diffuse_sampler->get_type() == atom_param_sampler) {
+          kind = atom_image;
+          img = ((param_sampler*)diffuse_sampler)->get_image();
+          smpl = ((param_sampler*)diffuse_sampler)->get_sampler();
+        }
+      }
+
+      v.visit(kind, atom_kind);
+      v.visit(color, atom_color);
+      v.visit(img, atom_image);
+      v.visit(smpl, atom_sampler);
+      v.visit(shader, atom_shader);
+
+      if (v.is_reader() && !v.get_error() && params.size() == 0) {
+        if (kind == atom_color) {
+          init_color(color, shader);
+        } else if (kind == atom_image && img) {
+          // init_image leaves custom shaders for the caller to bind.
+          init_image(img, smpl, shader);
+          if (shader) shader->init(params);
+        }
+      }
     }
 
     /// Set the uniforms for this material.
@@ -177,10 +223,10 @@ namespace octet { namespace scene {
       param_buffer_info pbi(buffer);
       param_uniform *result = new param_uniform(pbi, data, name, _type, _repeat, _stage);
       params.push_back(result);
-
-      param_bind_info pbind;
-      pbind.program = custom_shader->get_program();
-      result->bind(pbind);
+
+      param_bind_info pbind;
+      pbind.program = custom_shader->get_program();
+      result->bind(pbind);
       return result;
     }
 
@@ -189,10 +235,10 @@ namespace octet { namespace scene {
       pbi.texture_slot = texture_slot;
       param_sampler *result = new param_sampler(pbi, name, _image, _sampler, _stage);
       params.push_back(result);
-
-      param_bind_info pbind;
-      pbind.program = custom_shader->get_program();
-      result->bind(pbind);
+
+      param_bind_info pbind;
+      pbind.program = custom_shader->get_program();
+      result->bind(pbind);
       return result;
     }
   };
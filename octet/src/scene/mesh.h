@@ -33,6 +33,32 @@ namespace octet { namespace scene {
       int32_t tri1;
       bool operator<(const edge &rhs) const { return idx0 == rhs.idx0 ? idx1 < rhs.idx1 : idx0 < rhs.idx0; }
     };
+
+    /// Edges of the triangles with the triangle on each side. idx0 -> idx1 follows the winding of tri0.
+    /// tri0 and tri1 are offsets from the first index; tri1 is -1 for border edges.
+    /// Built once for a set of indices and shared between copies of the mesh.
+    class edge_cache : public resource {
+    public:
+      dynarray<edge> edges;
+
+      // what the cache was built from
+      uint64_t indices_generation;
+      unsigned first_index;
+      unsigned num_indices;
+    };
+
+    /// Triangle planes in groups of four: four nx, four ny, four nz then four d.
+    /// Built once for a set of vertices and shared between copies of the mesh.
+    class plane_cache : public resource {
+    public:
+      dynarray<float> planes;
+
+      // what the cache was built from
+      uint64_t vertices_generation;
+      uint64_t indices_generation;
+      unsigned first_index;
+      unsigned num_indices;
+    };
   private:
     ref<gl_resource> vertices;
     ref<gl_resource> indices;
@@ -57,6 +83,10 @@ namespace octet { namespace scene {
     // bounding box
     aabb mesh_aabb;
 
+    // adjacency and triangle planes for silhouettes
+    ref<edge_cache> edges_cache;
+    ref<plane_cache> planes_cache;
+
     struct general_vertex {
       const uint8_t *bytes;
       unsigned size;
@@ -86,11 +116,6 @@ namespace octet { namespace scene {
     };
 
     // add a new edge to a hash map. (index, index) -> (triangle+1, triangle+1)
-    static void add_edge(dynarray<edge> &edges, unsigned tri_idx, unsigned i0, unsigned i1) {
-      edge e = { (int32_t)std::min(i0, i1), (int32_t)std::max(i0, i1), (int32_t)tri_idx, (int32_t)~0 };
-      edges.push_back(e);
-    }
-
     // return true if the triangle tri is visible from the viewpoint (in model space)
     // the exact definition of "is visible" depends on winding order.
     static bool tri_is_visible(
@@ -102,7 +127,7 @@ namespace octet { namespace scene {
       const vec3p &pb = *(const vec3p*)(vp + ip[tri+1] * stride + pos_offset);
       const vec3p &pc = *(const vec3p*)(vp + ip[tri+2] * stride + pos_offset);
       vec3 normal = cross(((vec3)pb - pa), ((vec3)pc - pa));
-      vec3 dir = is_directional ? viewpoint - pa : viewpoint;
+      vec3 dir = is_directional ? viewpoint : viewpoint - pa;
       return dot(normal, dir) <= 0;
     }
 
@@ -431,12 +456,14 @@ namespace octet { namespace scene {
     void allocate(size_t vsize, size_t isize) {
       vertices->allocate(GL_ARRAY_BUFFER, vsize);
       indices->allocate(GL_ELEMENT_ARRAY_BUFFER, isize);
+      invalidate_edge_cache();
     }
 
     /// allocate and assign data to IBO and VBO
     void assign(size_t vsize, size_t isize, uint8_t *vsrc, uint8_t *isrc) {
       vertices->assign(vsrc, 0, vsize);
       indices->assign(isrc, 0, isize);
+      invalidate_edge_cache();
     }
 
     /// set standard parameters of the mesh together.
@@ -634,6 +661,7 @@ namespace octet { namespace scene {
     /// set a new VBO object
     void set_vertices(gl_resource *value) {
       vertices = value;
+      planes_cache = 0;
     }
 
     /// assign a vector to the vertex buffer and set params
@@ -644,12 +672,14 @@ namespace octet { namespace scene {
       }
       vertices->assign(rhs.data(), 0, rhs.size() * sizeof(elem_t));
       stride = sizeof(elem_t);
+      planes_cache = 0;
       set_num_vertices(rhs.size());
     }
 
     /// set a new IBO object
     void set_indices(gl_resource *value) {
       indices = value;
+      invalidate_edge_cache();
     }
 
     /// assign a vector to the index buffer and set params
@@ -659,48 +689,194 @@ namespace octet { namespace scene {
         indices->allocate(GL_ELEMENT_ARRAY_BUFFER, rhs.size() * sizeof(elem_t));
       }
       indices->assign(rhs.data(), 0, rhs.size() * sizeof(elem_t));
+      invalidate_edge_cache();
       set_index_type(sizeof(elem_t) == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT);
       set_num_indices(rhs.size());
       set_first_index(0);
     }
 
-    /// Get all the edges in a hash map to avoid duplicates.
-    /// record the triangle indices that they came from.
-    void get_edges(dynarray<edge> &edges) {
-      if (get_index_type() != GL_UNSIGNED_INT) return;
+    /// Get the edges of the triangles, building them if the indices have changed.
+    /// Returns null if this is not a GL_TRIANGLES mesh with GL_UNSIGNED_INT indices.
+    edge_cache *get_edge_cache() {
+      if (mode != GL_TRIANGLES || index_type != GL_UNSIGNED_INT || !indices) return 0;
 
-      gl_resource::rolock idx_lock(get_indices());
-      const uint32_t *ip = idx_lock.u32();
+      edge_cache *cache = edges_cache;
+      if (cache && cache->indices_generation == indices->get_generation() && cache->first_index == first_index && cache->num_indices == num_indices) {
+        return cache;
+      }
 
-      edges.resize(0);
-      for (unsigned i = 0; i < get_num_indices(); i += 3) {
-        add_edge(edges, i, ip[i+0], ip[i+1]);
-        add_edge(edges, i, ip[i+1], ip[i+2]);
-        add_edge(edges, i, ip[i+2], ip[i+0]);
-      }
-
-      std::sort(edges.data(), edges.data() + edges.size());
-
-      size_t dest = 0, src = 0;
-      for (; src < edges.size()-1; ) {
-        edge &e0 = edges[src];
-        edge &e1 = edges[src+1];
-        if (dest != src && e0.idx0 == e1.idx0 && e0.idx1 == e1.idx1) {
-          // combine two similar edges.
-          edge &ed = edges[dest++];
-          ed = e0;
-          ed.tri1 = e1.tri0;
-          src += 2;
-        } else {
-          edges[dest++] = e0;
-          src++;
+      // one half edge per triangle side, keyed by the vertex pair
+      struct half_edge {
+        uint64_t key;
+        uint32_t tri;
+        uint32_t reversed;
+        bool operator<(const half_edge &rhs) const { return key == rhs.key ? tri < rhs.tri : key < rhs.key; }
+      };
+
+      unsigned num_tris = num_indices / 3;
+      dynarray<half_edge> half_edges(num_tris * 3);
+      {
+        gl_resource::rolock idx_lock(get_indices());
+        const uint32_t *ip = idx_lock.u32() + first_index;
+        platform::thread_pool::get().parallel_for(0, num_tris, [&](unsigned t) {
+          for (unsigned j = 0; j != 3; ++j) {
+            uint32_t i0 = ip[t*3 + j], i1 = ip[t*3 + (j == 2 ? 0 : j + 1)];
+            half_edge &h = half_edges[t*3 + j];
+            h.key = i0 < i1 ? ((uint64_t)i0 << 32) | i1 : ((uint64_t)i1 << 32) | i0;
+            h.tri = t * 3;
+            h.reversed = i0 > i1;
+          }
+        }, 1024);
+      }
+
+      std::sort(half_edges.data(), half_edges.data() + half_edges.size());
+
+      cache = new edge_cache();
+      cache->indices_generation = indices->get_generation();
+      cache->first_index = first_index;
+      cache->num_indices = num_indices;
+      dynarray<edge> &edges = cache->edges;
+      edges.reserve(half_edges.size() / 2 + 16);
+
+      // pair up opposite half edges. Extra half edges on non-manifold meshes become borders.
+      for (unsigned i = 0; i != half_edges.size(); ) {
+        unsigned end = i + 1;
+        while (end != half_edges.size() && half_edges[end].key == half_edges[i].key) ++end;
+        int32_t lo = (int32_t)(half_edges[i].key >> 32), hi = (int32_t)half_edges[i].key;
+        unsigned f = i, r = i;
+        for (;;) {
+          while (f != end && half_edges[f].reversed) ++f;
+          while (r != end && !half_edges[r].reversed) ++r;
+          if (f == end || r == end) break;
+          edge e = { lo, hi, (int32_t)half_edges[f++].tri, (int32_t)half_edges[r++].tri };
+          edges.push_back(e);
+        }
+        for (; f != end; ++f) {
+          if (half_edges[f].reversed) continue;
+          edge e = { lo, hi, (int32_t)half_edges[f].tri, -1 };
+          edges.push_back(e);
         }
+        for (; r != end; ++r) {
+          if (!half_edges[r].reversed) continue;
+          edge e = { hi, lo, (int32_t)half_edges[r].tri, -1 };
+          edges.push_back(e);
+        }
+        i = end;
       }
 
-      if (src < edges.size()-1) {
-        edges[dest++] = edges[src++];
+      edges_cache = cache;
+      return cache;
+    }
+
+    /// Get the triangle planes, building them if the vertices or indices have changed.
+    /// Returns null if the positions are not three or more floats.
+    plane_cache *get_plane_cache() {
+      if (mode != GL_TRIANGLES || index_type != GL_UNSIGNED_INT || !indices || !vertices) return 0;
+
+      plane_cache *cache = planes_cache;
+      bool same_buffers = cache && cache->vertices_generation == vertices->get_generation() && cache->indices_generation == indices->get_generation();
+      if (same_buffers && cache->first_index == first_index && cache->num_indices == num_indices) {
+        return cache;
       }
-      edges.resize(dest);
+
+      unsigned pos_slot = get_slot(attribute_pos);
+      if (pos_slot == ~0 || get_size(pos_slot) < 3 || get_kind(pos_slot) != GL_FLOAT) return 0;
+      unsigned pos_offset = get_offset(pos_slot);
+      unsigned stride = get_stride();
+
+      cache = new plane_cache();
+      cache->vertices_generation = vertices->get_generation();
+      cache->indices_generation = indices->get_generation();
+      cache->first_index = first_index;
+      cache->num_indices = num_indices;
+
+      unsigned num_tris = num_indices / 3;
+      unsigned num_groups = (num_tris + 3) / 4;
+      cache->planes.resize(num_groups * 16);
+      float *planes = cache->planes.data();
+
+      gl_resource::rolock idx_lock(get_indices());
+      gl_resource::rolock vtx_lock(get_vertices());
+      const uint32_t *ip = idx_lock.u32() + first_index;
+      const uint8_t *vp = vtx_lock.u8();
+
+      platform::thread_pool::get().parallel_for(0, num_groups, [&](unsigned g) {
+        float *p = planes + g * 16;
+        for (unsigned j = 0; j != 4; ++j) {
+          unsigned t = g * 4 + j;
+          vec3 normal(0, 0, 0);
+          float d = 0;
+          if (t < num_tris) {
+            vec3 pa = *(const vec3p*)(vp + ip[t*3+0] * stride + pos_offset);
+            vec3 pb = *(const vec3p*)(vp + ip[t*3+1] * stride + pos_offset);
+            vec3 pc = *(const vec3p*)(vp + ip[t*3+2] * stride + pos_offset);
+            normal = cross(pb - pa, pc - pa);
+            d = dot(normal, pa);
+          }
+          p[j] = normal.x();
+          p[j+4] = normal.y();
+          p[j+8] = normal.z();
+          p[j+12] = d;
+        }
+      }, 256);
+
+      planes_cache = cache;
+      return cache;
+    }
+
+    /// Drop the cached edges and planes.
+    /// Writes through gl_resource locks are noticed anyway; call this after writing to the buffers through GL directly.
+    void invalidate_edge_cache() {
+      edges_cache = 0;
+      planes_cache = 0;
+    }
+
+    /// Get all the edges with the triangles that they came from.
+    /// idx0 -> idx1 follows the winding of tri0. tri1 is -1 for border edges.
+    void get_edges(dynarray<edge> &edges) {
+      edges.resize(0);
+      edge_cache *cache = get_edge_cache();
+      if (!cache) return;
+
+      edges.resize(cache->edges.size());
+      memcpy(edges.data(), cache->edges.data(), cache->edges.size() * sizeof(edge));
+    }
+
+    /// For each triangle, set one byte to 1 if it is visible from the viewpoint (see tri_is_visible).
+    /// The result is padded to a multiple of four triangles.
+    bool get_visible_triangles(dynarray<uint8_t> &visible, const vec3 &viewpoint, bool is_directional) {
+      plane_cache *cache = get_plane_cache();
+      if (!cache) return false;
+
+      unsigned num_groups = cache->planes.size() / 16;
+      visible.resize(num_groups * 4);
+      const float *planes = cache->planes.data();
+      uint8_t *vis = visible.data();
+      float vx = viewpoint.x(), vy = viewpoint.y(), vz = viewpoint.z();
+      float w = is_directional ? 0.0f : 1.0f;
+
+      // visible if dot(normal, viewpoint) - d * w <= 0
+      platform::thread_pool::get().parallel_for(0, num_groups, [&](unsigned g) {
+        const float *p = planes + g * 16;
+        uint8_t *v = vis + g * 4;
+        #if OCTET_SSE
+          __m128 s = _mm_mul_ps(_mm_loadu_ps(p), _mm_set1_ps(vx));
+          s = _mm_add_ps(s, _mm_mul_ps(_mm_loadu_ps(p + 4), _mm_set1_ps(vy)));
+          s = _mm_add_ps(s, _mm_mul_ps(_mm_loadu_ps(p + 8), _mm_set1_ps(vz)));
+          s = _mm_sub_ps(s, _mm_mul_ps(_mm_loadu_ps(p + 12), _mm_set1_ps(w)));
+          int mask = _mm_movemask_ps(_mm_cmple_ps(s, _mm_setzero_ps()));
+          v[0] = mask & 1;
+          v[1] = (mask >> 1) & 1;
+          v[2] = (mask >> 2) & 1;
+          v[3] = (mask >> 3) & 1;
+        #else
+          for (unsigned j = 0; j != 4; ++j) {
+            float s = p[j] * vx + p[j+4] * vy + p[j+8] * vz - p[j+12] * w;
+            v[j] = s <= 0;
+          }
+        #endif
+      }, 1024);
+      return true;
     }
 
     /// Generate silhouette edges.
@@ -712,35 +888,76 @@ namespace octet { namespace scene {
     ///   There is only one triangle that uses the edge.
     ///   One triangle can be seen from the viewpoint, the other can't.
     void get_silhouette_edges(const vec3 &viewpoint, bool is_directional, dynarray<edge> &edges) {
-      unsigned pos_slot = get_slot(attribute_pos);
-      if (get_index_type() != GL_UNSIGNED_INT) return;
-      if (get_size(pos_slot) < 3) return;
-      if (get_kind(pos_slot) != GL_FLOAT) return;
+      edges.resize(0);
+      dynarray<uint8_t> visible;
+      edge_cache *cache = get_edge_cache();
+      if (!cache || !get_visible_triangles(visible, viewpoint, is_directional)) return;
+
+      const uint8_t *vis = visible.data();
+      for (unsigned i = 0; i != cache->edges.size(); ++i) {
+        const edge &e = cache->edges[i];
+        if (e.tri1 < 0 || vis[e.tri0 / 3] != vis[e.tri1 / 3]) {
+          edges.push_back(e);
+        }
+      }
+    }
 
-      unsigned pos_offset = get_offset(pos_slot);
+    /// Write the silhouette edges as GL_LINES indices into dest, growing it if needed.
+    /// Each line follows the winding of the triangle that is visible from the viewpoint,
+    /// so that shadow volumes can be extruded with a consistent winding.
+    /// Returns the number of indices written.
+    unsigned get_silhouette_indices(gl_resource *dest, const vec3 &viewpoint, bool is_directional) {
+      dynarray<uint8_t> visible;
+      edge_cache *cache = get_edge_cache();
+      if (!cache || !get_visible_triangles(visible, viewpoint, is_directional)) return 0;
+
+      enum { block_size = 4096 };
+      const edge *edges = cache->edges.data();
+      const uint8_t *vis = visible.data();
+      unsigned num_edges = cache->edges.size();
+      unsigned num_blocks = (num_edges + block_size - 1) / block_size;
+      platform::thread_pool &pool = platform::thread_pool::get();
+
+      // count the silhouette edges in each block, then write each block at its offset.
+      dynarray<unsigned> block_start(num_blocks + 1);
+      pool.parallel_for(0, num_blocks, [&](unsigned b) {
+        unsigned end = std::min(num_edges, (b + 1) * block_size), count = 0;
+        for (unsigned i = b * block_size; i != end; ++i) {
+          const edge &e = edges[i];
+          count += e.tri1 < 0 || vis[e.tri0 / 3] != vis[e.tri1 / 3];
+        }
+        block_start[b + 1] = count;
+      });
 
-      get_edges(edges);
+      block_start[0] = 0;
+      for (unsigned b = 0; b != num_blocks; ++b) {
+        block_start[b + 1] += block_start[b];
+      }
 
-      gl_resource::rolock idx_lock(get_indices());
-      gl_resource::rolock vtx_lock(get_vertices());
-      const uint32_t *ip = idx_lock.u32() + first_index;
-      const uint8_t *vp = vtx_lock.u8();
-      unsigned stride = get_stride();
-      
-      size_t dest = 0;
-      for (size_t i = 0; i != edges.size(); ++i) {
-        const edge &edge = edges[i];
-        if (
-          tri_is_visible(
-            edge.tri0, pos_offset, stride, ip, vp, viewpoint, is_directional
-          ) != tri_is_visible(
-            edge.tri1, pos_offset, stride, ip, vp, viewpoint, is_directional
-          )
-        ) {
-          edges[dest++] = edge;
-        }
+      unsigned num_lines = block_start[num_blocks];
+      if (num_lines == 0) return 0;
+
+      if (dest->get_size() < num_lines * 2 * sizeof(uint32_t)) {
+        dest->allocate(GL_ELEMENT_ARRAY_BUFFER, num_lines * 2 * sizeof(uint32_t), GL_DYNAMIC_DRAW);
       }
-      edges.resize(dest);
+
+      gl_resource::wolock dest_lock(dest);
+      uint32_t *dp = dest_lock.u32();
+      pool.parallel_for(0, num_blocks, [&](unsigned b) {
+        unsigned end = std::min(num_edges, (b + 1) * block_size);
+        uint32_t *d = dp + block_start[b] * 2;
+        for (unsigned i = b * block_size; i != end; ++i) {
+          const edge &e = edges[i];
+          uint8_t v0 = vis[e.tri0 / 3];
+          if (e.tri1 < 0 || v0 != vis[e.tri1 / 3]) {
+            d[0] = v0 ? e.idx0 : e.idx1;
+            d[1] = v0 ? e.idx1 : e.idx0;
+            d += 2;
+          }
+        }
+      });
+
+      return num_lines * 2;
     }
 
     /// Debugging: show the effect of the vertex shader on the vertices
@@ -0,0 +1,423 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Mesh optimizer modifier. Reorder triangles and vertices for the GPU.
+//
+
+namespace octet { namespace scene {
+  /// Mesh modifier to reorder the triangles and vertices of an indexed triangle mesh.
+  ///
+  /// Three passes are applied:
+  ///
+  /// * Forsyth's linear speed vertex cache optimisation orders the triangles to reuse
+  ///   recently transformed vertices.
+  /// * The result is split into clusters that start with a cold cache and the clusters are
+  ///   sorted so that outward facing ones draw first, reducing overdraw (Sander et al.).
+  /// * Vertices are renumbered and stored in the order they are first used.
+  ///   Unused vertices are dropped.
+  ///
+  /// Example
+  ///
+  ///     mesh_optimizer *opt = new mesh_optimizer(new indexer(msh));
+  ///     log("acmr %f -> %f\n", opt->get_before().acmr, opt->get_after().acmr);
+  ///
+  class mesh_optimizer : public mesh {
+  public:
+    /// Post transform cache statistics for a FIFO cache.
+    struct stats {
+      /// average cache miss ratio: transformed vertices per triangle (0.5 - 3.0)
+      float acmr;
+
+      /// average transform to vertex ratio: transformed vertices per unique vertex (1.0 - 6.0)
+      float atvr;
+
+      unsigned num_triangles;
+      unsigned num_vertices;
+    };
+
+  private:
+    enum { max_cache_size = 32 };
+
+    // source mesh. Provides underlying geometry.
+    ref<mesh> src;
+
+    // split overdraw clusters while they are no worse than this ratio of cache misses
+    float overdraw_threshold;
+
+    stats before;
+    stats after;
+
+    // Forsyth's vertex score
+    static float vertex_score(int cache_pos, unsigned num_live) {
+      if (num_live == 0) return -1.0f;
+
+      float score = 0;
+      if (cache_pos < 0) {
+      } else if (cache_pos < 3) {
+        score = 0.75f;
+      } else {
+        float scale = 1.0f / (max_cache_size - 3);
+        score = std::pow(1.0f - (cache_pos - 3) * scale, 1.5f);
+      }
+      return score + 2.0f * std::pow((float)num_live, -0.5f);
+    }
+
+    // build triangle lists for each vertex. returns offsets into tris.
+    static void get_adjacency(dynarray<uint32_t> &offsets, dynarray<uint32_t> &tris, const uint32_t *indices, unsigned num_indices, unsigned num_vertices) {
+      offsets.resize(num_vertices + 1);
+      memset(offsets.data(), 0, offsets.size() * sizeof(uint32_t));
+      for (unsigned i = 0; i != num_indices; ++i) {
+        offsets[indices[i] + 1]++;
+      }
+      for (unsigned v = 0; v != num_vertices; ++v) {
+        offsets[v + 1] += offsets[v];
+      }
+      tris.resize(num_indices);
+      dynarray<uint32_t> pos(num_vertices);
+      memcpy(pos.data(), offsets.data(), num_vertices * sizeof(uint32_t));
+      for (unsigned i = 0; i != num_indices; ++i) {
+        tris[pos[indices[i]]++] = i / 3;
+      }
+    }
+
+  public:
+    RESOURCE_META(mesh_optimizer)
+
+    /// Construct an optimized mesh from a mesh with GL_UNSIGNED_INT indices.
+    mesh_optimizer(mesh *src=0, float overdraw_threshold=1.05f) {
+      this->src = src;
+      this->overdraw_threshold = overdraw_threshold;
+      memset(&before, 0, sizeof(before));
+      memset(&after, 0, sizeof(after));
+      update();
+    }
+
+    /// Measure the cache performance of triangles drawn with a FIFO cache of cache_size vertices.
+    static void get_stats(stats &result, const uint32_t *indices, unsigned num_indices, unsigned num_vertices, unsigned cache_size=16) {
+      dynarray<uint32_t> time(num_vertices);
+      memset(time.data(), 0, num_vertices * sizeof(uint32_t));
+
+      // time[v] is the value of clock after v was last loaded
+      unsigned clock = cache_size + 1;
+      unsigned misses = 0, unique = 0;
+      for (unsigned i = 0; i != num_indices; ++i) {
+        uint32_t v = indices[i];
+        if (time[v] == 0) unique++;
+        if (clock - time[v] > cache_size) {
+          time[v] = ++clock;
+          misses++;
+        }
+      }
+
+      result.num_triangles = num_indices / 3;
+      result.num_vertices = unique;
+      result.acmr = num_indices ? (float)misses / (num_indices / 3) : 0;
+      result.atvr = unique ? (float)misses / unique : 0;
+    }
+
+    /// Reorder triangles to make good use of the post transform vertex cache.
+    static void optimize_vertex_cache(uint32_t *dest, const uint32_t *indices, unsigned num_indices, unsigned num_vertices) {
+      unsigned num_tris = num_indices / 3;
+      if (num_tris == 0) return;
+
+      dynarray<uint32_t> offsets;
+      dynarray<uint32_t> tris;
+      get_adjacency(offsets, tris, indices, num_indices, num_vertices);
+
+      // live triangle count and position in the cache for each vertex.
+      dynarray<uint32_t> num_live(num_vertices);
+      dynarray<int32_t> cache_pos(num_vertices);
+      dynarray<float> score(num_vertices);
+      for (unsigned v = 0; v != num_vertices; ++v) {
+        num_live[v] = offsets[v + 1] - offsets[v];
+        cache_pos[v] = -1;
+        score[v] = vertex_score(-1, num_live[v]);
+      }
+
+      dynarray<float> tri_score(num_tris);
+      dynarray<uint8_t> emitted(num_tris);
+      for (unsigned t = 0; t != num_tris; ++t) {
+        const uint32_t *tp = indices + t * 3;
+        tri_score[t] = score[tp[0]] + score[tp[1]] + score[tp[2]];
+        emitted[t] = 0;
+      }
+
+      uint32_t cache[max_cache_size + 3];
+      unsigned cache_count = 0;
+      unsigned cursor = 0;
+      unsigned best = 0;
+      float best_score = -1;
+      for (unsigned t = 0; t != num_tris; ++t) {
+        if (tri_score[t] > best_score) {
+          best_score = tri_score[t];
+          best = t;
+        }
+      }
+
+      for (unsigned out = 0; out != num_tris; ++out) {
+        if (best == ~0u) {
+          // no triangle touches the cache; take the next one in the input.
+          while (emitted[cursor]) ++cursor;
+          best = cursor;
+        }
+
+        const uint32_t *tp = indices + best * 3;
+        dest[out * 3 + 0] = tp[0];
+        dest[out * 3 + 1] = tp[1];
+        dest[out * 3 + 2] = tp[2];
+        emitted[best] = 1;
+
+        // remove the triangle from its vertices' lists of live triangles.
+        for (int j = 0; j != 3; ++j) {
+          uint32_t v = tp[j];
+          uint32_t *list = tris.data() + offsets[v];
+          unsigned n = num_live[v];
+          for (unsigned k = 0; k != n; ++k) {
+            if (list[k] == best) {
+              list[k] = list[n - 1];
+              break;
+            }
+          }
+          num_live[v] = n - 1;
+        }
+
+        // move the triangle's vertices to the front of the cache.
+        uint32_t new_cache[max_cache_size + 3];
+        unsigned new_count = 0;
+        for (int j = 0; j != 3; ++j) {
+          if (j == 0 || (tp[j] != tp[0] && (j == 1 || tp[j] != tp[1]))) {
+            new_cache[new_count++] = tp[j];
+          }
+        }
+        for (unsigned k = 0; k != cache_count; ++k) {
+          uint32_t v = cache[k];
+          if (v != tp[0] && v != tp[1] && v != tp[2]) {
+            new_cache[new_count++] = v;
+          }
+        }
+
+        // vertices beyond the end of the cache drop out.
+        for (unsigned k = max_cache_size; k < new_count; ++k) {
+          cache_pos[new_cache[k]] = -1;
+          score[new_cache[k]] = vertex_score(-1, num_live[new_cache[k]]);
+        }
+        cache_count = std::min(new_count, (unsigned)max_cache_size);
+        for (unsigned k = 0; k != cache_count; ++k) {
+          uint32_t v = new_cache[k];
+          cache[k] = v;
+          cache_pos[v] = (int32_t)k;
+          score[v] = vertex_score((int)k, num_live[v]);
+        }
+
+        // rescore the triangles that use vertices in the cache and find the best.
+        best = ~0u;
+        best_score = -1;
+        for (unsigned k = 0; k != new_count; ++k) {
+          uint32_t v = new_cache[k];
+          const uint32_t *list = tris.data() + offsets[v];
+          for (unsigned l = 0; l != num_live[v]; ++l) {
+            uint32_t t = list[l];
+            const uint32_t *tq = indices + t * 3;
+            float s = score[tq[0]] + score[tq[1]] + score[tq[2]];
+            tri_score[t] = s;
+            if (s > best_score) {
+              best_score = s;
+              best = t;
+            }
+          }
+        }
+      }
+    }
+
+    /// Split triangles in vertex cache order into clusters and sort the clusters to reduce overdraw.
+    /// A cluster starts wherever the cache goes cold and is split further while its
+    /// cache miss ratio stays within threshold times that of the whole.
+    static void optimize_overdraw(
+      uint32_t *dest, const uint32_t *indices, unsigned num_indices,
+      const uint8_t *vertices, unsigned stride, unsigned pos_offset, unsigned num_vertices,
+      unsigned cache_size=16, float threshold=1.05f
+    ) {
+      unsigned num_tris = num_indices / 3;
+      if (num_tris == 0) return;
+
+      // find the triangles that miss on all three vertices.
+      dynarray<uint32_t> clusters;
+      dynarray<uint32_t> time(num_vertices);
+      memset(time.data(), 0, num_vertices * sizeof(uint32_t));
+      unsigned clock = cache_size + 1;
+      unsigned total_misses = 0;
+      for (unsigned t = 0; t != num_tris; ++t) {
+        unsigned misses = 0;
+        for (int j = 0; j != 3; ++j) {
+          uint32_t v = indices[t * 3 + j];
+          if (clock - time[v] > cache_size) {
+            time[v] = ++clock;
+            misses++;
+          }
+        }
+        if (t == 0 || misses == 3) clusters.push_back(t);
+        total_misses += misses;
+      }
+      clusters.push_back(num_tris);
+
+      // soft split the clusters, restarting the cache at each split.
+      float limit = (float)total_misses / num_tris * threshold;
+      dynarray<uint32_t> split;
+      for (unsigned c = 0; c + 1 < clusters.size(); ++c) {
+        unsigned begin = clusters[c], end = clusters[c + 1];
+        unsigned misses = 0, start = begin;
+        clock += cache_size + 1;
+        split.push_back(begin);
+        for (unsigned t = begin; t != end; ++t) {
+          for (int j = 0; j != 3; ++j) {
+            uint32_t v = indices[t * 3 + j];
+            if (clock - time[v] > cache_size) {
+              time[v] = ++clock;
+              misses++;
+            }
+          }
+          if (t + 1 != end && t + 1 - start >= 8 && misses <= limit * (t + 1 - start)) {
+            split.push_back(t + 1);
+            start = t + 1;
+            misses = 0;
+            clock += cache_size + 1;
+          }
+        }
+      }
+      split.push_back(num_tris);
+
+      // area weighted centroid and normal for the mesh and each cluster.
+      unsigned num_clusters = split.size() - 1;
+      dynarray<vec3> centroid(num_clusters);
+      dynarray<vec3> normal(num_clusters);
+      vec3 mesh_centroid(0, 0, 0);
+      float mesh_area = 0;
+      for (unsigned c = 0; c != num_clusters; ++c) {
+        vec3 sum_c(0, 0, 0), sum_n(0, 0, 0);
+        float area = 0;
+        for (unsigned t = split[c]; t != split[c + 1]; ++t) {
+          const uint32_t *tp = indices + t * 3;
+          vec3 a = *(const vec3p*)(vertices + tp[0] * stride + pos_offset);
+          vec3 b = *(const vec3p*)(vertices + tp[1] * stride + pos_offset);
+          vec3 d = *(const vec3p*)(vertices + tp[2] * stride + pos_offset);
+          vec3 n = cross(b - a, d - a);
+          float tri_area = length(n);
+          sum_c += (a + b + d) * (tri_area * (1.0f/3));
+          sum_n += n;
+          area += tri_area;
+        }
+        centroid[c] = area > 0 ? sum_c / area : vec3(0, 0, 0);
+        normal[c] = sum_n;
+        mesh_centroid += sum_c;
+        mesh_area += area;
+      }
+      if (mesh_area > 0) mesh_centroid = mesh_centroid / mesh_area;
+
+      // clusters that face away from the centre draw first.
+      dynarray<float> sort_key(num_clusters);
+      dynarray<uint32_t> order(num_clusters);
+      for (unsigned c = 0; c != num_clusters; ++c) {
+        float len = length(normal[c]);
+        sort_key[c] = len > 0 ? dot(centroid[c] - mesh_centroid, normal[c] / len) : 0;
+        order[c] = c;
+      }
+      std::stable_sort(order.data(), order.data() + num_clusters, [&](uint32_t a, uint32_t b) {
+        return sort_key[a] > sort_key[b];
+      });
+
+      uint32_t *dp = dest;
+      for (unsigned i = 0; i != num_clusters; ++i) {
+        unsigned c = order[i];
+        unsigned n = (split[c + 1] - split[c]) * 3;
+        memcpy(dp, indices + split[c] * 3, n * sizeof(uint32_t));
+        dp += n;
+      }
+    }
+
+    /// Renumber vertices in the order that they are first used and copy them to dest.
+    /// Rewrites indices in place and returns the number of vertices used.
+    static unsigned optimize_vertex_fetch(uint8_t *dest, uint32_t *indices, unsigned num_indices, const uint8_t *vertices, unsigned num_vertices, unsigned stride) {
+      dynarray<uint32_t> remap(num_vertices);
+      memset(remap.data(), 0xff, num_vertices * sizeof(uint32_t));
+      unsigned num_used = 0;
+      for (unsigned i = 0; i != num_indices; ++i) {
+        uint32_t v = indices[i];
+        if (remap[v] == ~0u) {
+          remap[v] = num_used;
+          memcpy(dest + num_used * stride, vertices + v * stride, stride);
+          num_used++;
+        }
+        indices[i] = remap[v];
+      }
+      return num_used;
+    }
+
+    /// standard update function, called if input changes.
+    void update() {
+      if (!src) return;
+
+      *(mesh*)this = *(mesh*)src;
+
+      if (get_mode() != GL_TRIANGLES || get_index_type() != GL_UNSIGNED_INT) return;
+
+      unsigned pos_slot = get_slot(attribute_pos);
+      if (pos_slot == ~0 || get_kind(pos_slot) != GL_FLOAT || get_size(pos_slot) != 3) return;
+
+      unsigned stride = get_stride();
+      unsigned num_indices = get_num_indices() - get_num_indices() % 3;
+      unsigned num_vertices = get_vertices()->get_size() / stride;
+      dynarray<uint32_t> dest_indices(num_indices);
+      dynarray<uint8_t> dest_vertices(num_vertices * stride);
+      unsigned num_used = 0;
+
+      {
+        gl_resource::rolock idx_lock(get_indices());
+        gl_resource::rolock vtx_lock(get_vertices());
+        const uint32_t *ip = idx_lock.u32() + get_first_index();
+        const uint8_t *vp = vtx_lock.u8();
+
+        get_stats(before, ip, num_indices, num_vertices);
+
+        dynarray<uint32_t> tmp(num_indices);
+        optimize_vertex_cache(tmp.data(), ip, num_indices, num_vertices);
+        optimize_overdraw(dest_indices.data(), tmp.data(), num_indices, vp, stride, get_offset(pos_slot), num_vertices, 16, overdraw_threshold);
+        num_used = optimize_vertex_fetch(dest_vertices.data(), dest_indices.data(), num_indices, vp, num_vertices, stride);
+
+        get_stats(after, dest_indices.data(), num_indices, num_used);
+      }
+
+      unsigned isize = num_indices * sizeof(uint32_t);
+      unsigned vsize = num_used * stride;
+      gl_resource *indices = new gl_resource(GL_ELEMENT_ARRAY_BUFFER, isize);
+      gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, vsize);
+      indices->assign(dest_indices.data(), 0, isize);
+      vertices->assign(dest_vertices.data(), 0, vsize);
+
+      set_indices(indices);
+      set_vertices(vertices);
+      set_num_indices(num_indices);
+      set_first_index(0);
+      set_num_vertices(num_used);
+    }
+
+    /// Cache statistics of the source mesh, measured by the last update.
+    const stats &get_before() const {
+      return before;
+    }
+
+    /// Cache statistics of the optimized mesh, measured by the last update.
+    const stats &get_after() const {
+      return after;
+    }
+
+    /// Serialization, scripts, web access
+    void visit(visitor &v) {
+      mesh::visit(v);
+      v.visit(src, atom_src);
+      v.visit(overdraw_threshold, atom_overdraw_threshold);
+    }
+  };
+}}
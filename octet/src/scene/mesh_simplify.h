@@ -0,0 +1,386 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Mesh simplify modifier. Reduce triangle counts for distant LODs.
+//
+
+namespace octet { namespace scene {
+  /// Mesh modifier to reduce the number of triangles in an indexed triangle mesh.
+  ///
+  /// Uses edge collapses ordered by quadric error (Garland and Heckbert).
+  /// Each collapse moves a vertex onto one of its neighbours, so no new vertices are made
+  /// and the simplified mesh shares the vertex buffer of the source.
+  ///
+  /// Vertices on attribute seams (the same position with different normals or uvs) do not move.
+  /// Vertices on open borders only move along the border. Vertices only merge with
+  /// vertices that have the same blend indices, so skins keep working.
+  /// Index the mesh first so that only real seams count as seams.
+  ///
+  /// Example
+  ///
+  ///     dynarray<ref<mesh> > lods;
+  ///     mesh_simplify::make_lod_chain(lods, new indexer(msh), 4);
+  ///     mesh_simplify::add_lod_instances(app_scene, node, lods, mat, 10.0f);
+  ///
+  class mesh_simplify : public mesh {
+    // source mesh. Provides underlying geometry.
+    ref<mesh> src;
+
+    // fraction of the triangles to keep
+    float ratio;
+
+    // largest error allowed, as a distance
+    float max_error;
+
+    // symmetric 4x4 matrix giving the sum of squared distances to a set of planes.
+    struct quadric {
+      double a[10];
+
+      void clear() {
+        memset(a, 0, sizeof(a));
+      }
+
+      void add_plane(vec3_in n, float d, float weight) {
+        double x = n.x(), y = n.y(), z = n.z(), w = d;
+        a[0] += weight*x*x; a[1] += weight*x*y; a[2] += weight*x*z; a[3] += weight*x*w;
+        a[4] += weight*y*y; a[5] += weight*y*z; a[6] += weight*y*w;
+        a[7] += weight*z*z; a[8] += weight*z*w;
+        a[9] += weight*w*w;
+      }
+
+      void operator+=(const quadric &rhs) {
+        for (int i = 0; i != 10; ++i) a[i] += rhs.a[i];
+      }
+
+      double error(vec3_in p) const {
+        double x = p.x(), y = p.y(), z = p.z();
+        return
+          a[0]*x*x + 2*a[1]*x*y + 2*a[2]*x*z + 2*a[3]*x +
+          a[4]*y*y + 2*a[5]*y*z + 2*a[6]*y +
+          a[7]*z*z + 2*a[8]*z +
+          a[9]
+        ;
+      }
+    };
+
+    struct collapse {
+      double cost;
+      uint32_t from;
+      uint32_t to;
+      bool operator<(const collapse &rhs) const { return cost < rhs.cost; }
+    };
+
+    static uint64_t edge_key(uint32_t a, uint32_t b) {
+      return a < b ? (uint64_t)a << 32 | b : (uint64_t)b << 32 | a;
+    }
+
+    static bool is_border(const dynarray<uint64_t> &border_edges, uint32_t a, uint32_t b) {
+      uint64_t key = edge_key(a, b);
+      return std::binary_search(border_edges.data(), border_edges.data() + border_edges.size(), key);
+    }
+
+  public:
+    RESOURCE_META(mesh_simplify)
+
+    /// Simplify a mesh with GL_UNSIGNED_INT indices, keeping about ratio of the triangles.
+    mesh_simplify(mesh *src=0, float ratio=0.5f, float max_error=1e30f) {
+      this->src = src;
+      this->ratio = ratio;
+      this->max_error = max_error;
+      update();
+    }
+
+    /// Simplify triangles until there are no more than target_indices indices or the error
+    /// would exceed max_error. Writes the new indices to dest and returns how many there are.
+    /// skin_offset is the offset of the blend indices in each vertex or -1 if there are none.
+    static unsigned simplify(
+      uint32_t *dest, const uint32_t *indices, unsigned num_indices,
+      const uint8_t *vertices, unsigned num_vertices, unsigned stride, unsigned pos_offset,
+      unsigned target_indices, float max_error = 1e30f, int skin_offset = -1, unsigned skin_size = 0
+    ) {
+      num_indices -= num_indices % 3;
+      memcpy(dest, indices, num_indices * sizeof(uint32_t));
+      if (num_indices <= target_indices) return num_indices;
+
+      // map each vertex to a position. Vertices with the same position are wedges of that position.
+      auto get_pos = [&](uint32_t v) { return (vec3)*(const vec3p*)(vertices + v * stride + pos_offset); };
+      dynarray<uint32_t> sorted(num_vertices);
+      for (unsigned v = 0; v != num_vertices; ++v) sorted[v] = v;
+      std::sort(sorted.data(), sorted.data() + num_vertices, [&](uint32_t a, uint32_t b) {
+        const float *pa = (const float*)(vertices + a * stride + pos_offset);
+        const float *pb = (const float*)(vertices + b * stride + pos_offset);
+        return memcmp(pa, pb, 12) < 0;
+      });
+
+      dynarray<uint32_t> pos_of(num_vertices);
+      dynarray<vec3> positions;
+      for (unsigned i = 0; i != num_vertices; ++i) {
+        uint32_t v = sorted[i];
+        if (i == 0 || memcmp(vertices + v * stride + pos_offset, vertices + sorted[i-1] * stride + pos_offset, 12)) {
+          positions.push_back(get_pos(v));
+        }
+        pos_of[v] = positions.size() - 1;
+      }
+      unsigned num_pos = positions.size();
+
+      // positions with more than one wedge in use are on seams.
+      dynarray<uint32_t> wedge(num_pos);
+      dynarray<uint8_t> locked(num_pos);
+      memset(wedge.data(), 0xff, num_pos * sizeof(uint32_t));
+      memset(locked.data(), 0, num_pos);
+      for (unsigned i = 0; i != num_indices; ++i) {
+        uint32_t v = dest[i], p = pos_of[v];
+        if (wedge[p] == ~0u) {
+          wedge[p] = v;
+        } else if (wedge[p] != v) {
+          locked[p] = 1;
+        }
+      }
+
+      // find the border edges: edges with only one triangle.
+      dynarray<uint64_t> edges;
+      dynarray<uint64_t> border_edges;
+      edges.reserve(num_indices);
+      for (unsigned i = 0; i != num_indices; i += 3) {
+        for (int j = 0; j != 3; ++j) {
+          edges.push_back(edge_key(pos_of[dest[i+j]], pos_of[dest[i+(j+1)%3]]));
+        }
+      }
+      std::sort(edges.data(), edges.data() + edges.size());
+      for (unsigned i = 0; i != edges.size(); ) {
+        unsigned j = i + 1;
+        while (j != edges.size() && edges[j] == edges[i]) ++j;
+        if (j - i == 1) border_edges.push_back(edges[i]);
+        i = j;
+      }
+      dynarray<uint8_t> border(num_pos);
+      memset(border.data(), 0, num_pos);
+      for (unsigned i = 0; i != border_edges.size(); ++i) {
+        border[(uint32_t)(border_edges[i] >> 32)] = 1;
+        border[(uint32_t)border_edges[i]] = 1;
+      }
+
+      // plane quadrics for each position. Border edges also get a perpendicular plane.
+      dynarray<quadric> quadrics(num_pos);
+      for (unsigned p = 0; p != num_pos; ++p) quadrics[p].clear();
+      for (unsigned i = 0; i != num_indices; i += 3) {
+        uint32_t p[3] = { pos_of[dest[i]], pos_of[dest[i+1]], pos_of[dest[i+2]] };
+        vec3 a = positions[p[0]], b = positions[p[1]], c = positions[p[2]];
+        vec3 n = cross(b - a, c - a);
+        float len = length(n);
+        if (len == 0) continue;
+        n = n / len;
+        for (int j = 0; j != 3; ++j) {
+          quadrics[p[j]].add_plane(n, -dot(n, a), 1.0f);
+        }
+        for (int j = 0; j != 3; ++j) {
+          uint32_t p0 = p[j], p1 = p[(j+1)%3];
+          if (border[p0] && border[p1] && is_border(border_edges, p0, p1)) {
+            vec3 e = positions[p1] - positions[p0];
+            vec3 m = cross(e, n);
+            float mlen = length(m);
+            if (mlen == 0) continue;
+            m = m / mlen;
+            quadrics[p0].add_plane(m, -dot(m, positions[p0]), 10.0f);
+            quadrics[p1].add_plane(m, -dot(m, positions[p0]), 10.0f);
+          }
+        }
+      }
+
+      unsigned num_live = num_indices;
+      double max_cost = (double)max_error * max_error;
+      dynarray<uint32_t> offsets;
+      dynarray<uint32_t> tris;
+      dynarray<collapse> collapses;
+      dynarray<uint8_t> touched(num_pos);
+
+      for (;;) {
+        // triangles around each position.
+        offsets.resize(num_pos + 1);
+        memset(offsets.data(), 0, offsets.size() * sizeof(uint32_t));
+        for (unsigned i = 0; i != num_live; ++i) offsets[pos_of[dest[i]] + 1]++;
+        for (unsigned p = 0; p != num_pos; ++p) offsets[p + 1] += offsets[p];
+        tris.resize(num_live);
+        {
+          dynarray<uint32_t> fill(num_pos);
+          memcpy(fill.data(), offsets.data(), num_pos * sizeof(uint32_t));
+          for (unsigned i = 0; i != num_live; ++i) tris[fill[pos_of[dest[i]]]++] = i / 3;
+        }
+
+        // cheapest allowed direction for each edge.
+        collapses.resize(0);
+        for (unsigned i = 0; i != num_live; i += 3) {
+          for (int j = 0; j != 3; ++j) {
+            uint32_t a = pos_of[dest[i+j]], b = pos_of[dest[i+(j+1)%3]];
+            if (a > b) continue; // consider each edge once (interior edges appear twice)
+            collapse best = { 1e300, ~0u, ~0u };
+            for (int k = 0; k != 2; ++k) {
+              uint32_t from = k ? b : a, to = k ? a : b;
+              if (locked[from]) continue;
+              if (border[from] && !(border[to] && is_border(border_edges, from, to))) continue;
+              quadric q = quadrics[from];
+              q += quadrics[to];
+              double cost = q.error(positions[to]);
+              if (cost < best.cost) {
+                best.cost = cost;
+                best.from = from;
+                best.to = to;
+              }
+            }
+            if (best.from != ~0u && best.cost <= max_cost) collapses.push_back(best);
+          }
+        }
+        if (collapses.empty()) break;
+        std::sort(collapses.data(), collapses.data() + collapses.size());
+
+        memset(touched.data(), 0, num_pos);
+        unsigned num_collapsed = 0;
+        unsigned live = num_live;
+        for (unsigned c = 0; c != collapses.size() && live > target_indices; ++c) {
+          uint32_t from = collapses[c].from, to = collapses[c].to;
+          if (touched[from] || touched[to]) continue;
+
+          // find the wedge of "to" next to "from" and check that the triangles do not flip.
+          uint32_t from_v = wedge[from], to_v = ~0u;
+          bool ok = true;
+          unsigned num_removed = 0;
+          for (unsigned t = offsets[from]; t != offsets[from + 1] && ok; ++t) {
+            const uint32_t *tp = dest + tris[t] * 3;
+            int k_from = -1, k_to = -1;
+            for (int k = 0; k != 3; ++k) {
+              if (pos_of[tp[k]] == from) k_from = k;
+              if (pos_of[tp[k]] == to) k_to = k;
+            }
+            if (k_to >= 0) {
+              to_v = tp[k_to];
+              num_removed += 3;
+              continue;
+            }
+            vec3 p0 = positions[pos_of[tp[0]]], p1 = positions[pos_of[tp[1]]], p2 = positions[pos_of[tp[2]]];
+            vec3 n_old = cross(p1 - p0, p2 - p0);
+            vec3 q[3] = { p0, p1, p2 };
+            q[k_from] = positions[to];
+            vec3 n_new = cross(q[1] - q[0], q[2] - q[0]);
+            if (dot(n_old, n_new) <= 0.25f * length(n_old) * length(n_new)) ok = false;
+          }
+          if (!ok || to_v == ~0u) continue;
+          if (skin_offset >= 0 && memcmp(vertices + from_v * stride + skin_offset, vertices + to_v * stride + skin_offset, skin_size)) continue;
+
+          // move the triangles to the new vertex. The degenerate ones are removed below.
+          for (unsigned t = offsets[from]; t != offsets[from + 1]; ++t) {
+            uint32_t *tp = dest + tris[t] * 3;
+            for (int k = 0; k != 3; ++k) {
+              uint32_t p = pos_of[tp[k]];
+              touched[p] = 1;
+              if (p == from) tp[k] = to_v;
+            }
+          }
+          quadrics[to] += quadrics[from];
+          wedge[from] = to_v;
+          live -= num_removed;
+          num_collapsed++;
+        }
+
+        // compact the triangles, dropping ones with two vertices at the same position.
+        unsigned num_out = 0;
+        for (unsigned i = 0; i != num_live; i += 3) {
+          uint32_t p0 = pos_of[dest[i]], p1 = pos_of[dest[i+1]], p2 = pos_of[dest[i+2]];
+          if (p0 == p1 || p1 == p2 || p2 == p0) continue;
+          dest[num_out++] = dest[i]; dest[num_out++] = dest[i+1]; dest[num_out++] = dest[i+2];
+        }
+        num_live = num_out;
+
+        if (num_collapsed == 0 || num_live <= target_indices) break;
+      }
+
+      return num_live;
+    }
+
+    /// standard update function, called if input changes.
+    void update() {
+      if (!src) return;
+
+      *(mesh*)this = *(mesh*)src;
+
+      if (get_mode() != GL_TRIANGLES || get_index_type() != GL_UNSIGNED_INT) return;
+
+      unsigned pos_slot = get_slot(attribute_pos);
+      if (pos_slot == ~0 || get_kind(pos_slot) != GL_FLOAT || get_size(pos_slot) != 3) return;
+
+      unsigned skin_slot = get_slot(attribute_blendindices);
+      int skin_offset = skin_slot == ~0 ? -1 : (int)get_offset(skin_slot);
+      unsigned skin_size = skin_slot == ~0 ? 0 : get_size(skin_slot) * kind_size(get_kind(skin_slot));
+
+      unsigned num_indices = get_num_indices();
+      unsigned target = (unsigned)(num_indices / 3 * ratio) * 3;
+      dynarray<uint32_t> dest(num_indices);
+      unsigned num_dest = 0;
+      {
+        gl_resource::rolock idx_lock(get_indices());
+        gl_resource::rolock vtx_lock(get_vertices());
+        const uint32_t *ip = idx_lock.u32() + get_first_index();
+        unsigned num_vertices = get_vertices()->get_size() / get_stride();
+        num_dest = simplify(
+          dest.data(), ip, num_indices, vtx_lock.u8(), num_vertices, get_stride(), get_offset(pos_slot),
+          target, max_error, skin_offset, skin_size
+        );
+      }
+
+      // keep the new triangles in vertex cache order. The vertices are shared with the source.
+      dynarray<uint32_t> ordered(num_dest);
+      mesh_optimizer::optimize_vertex_cache(ordered.data(), dest.data(), num_dest, get_vertices()->get_size() / get_stride());
+
+      unsigned isize = num_dest * sizeof(uint32_t);
+      gl_resource *indices = new gl_resource(GL_ELEMENT_ARRAY_BUFFER, isize);
+      indices->assign(ordered.data(), 0, isize);
+      set_indices(indices);
+      set_num_indices(num_dest);
+      set_first_index(0);
+    }
+
+    /// Make a chain of num_levels meshes starting with msh.
+    /// Each level keeps about ratio of the triangles of the one before.
+    static void make_lod_chain(dynarray<ref<mesh> > &lods, mesh *msh, unsigned num_levels, float ratio=0.5f) {
+      lods.resize(0);
+      lods.push_back(msh);
+      for (unsigned i = 1; i < num_levels; ++i) {
+        mesh *prev = lods[i-1];
+        ref<mesh> next = new mesh_simplify(prev, ratio);
+        // stop when simplification makes no more progress.
+        if (next->get_num_indices() >= prev->get_num_indices()) break;
+        lods.push_back(next);
+      }
+    }
+
+    /// Add one mesh instance per level to a scene, switching level at distances
+    /// first_distance, first_distance * distance_scale, ...
+    static void add_lod_instances(
+      visual_scene *scene, scene_node *node, const dynarray<ref<mesh> > &lods, material *mat,
+      float first_distance, float distance_scale=3.0f
+    ) {
+      float min_distance = -1e37f;
+      float max_distance = first_distance;
+      for (unsigned i = 0; i != lods.size(); ++i) {
+        if (i + 1 == lods.size()) max_distance = 1e37f;
+        mesh_instance *mi = new mesh_instance(node, lods[i], mat);
+        mi->set_min_draw_distance(min_distance);
+        mi->set_max_draw_distance(max_distance);
+        mi->set_flags(mesh_instance::flag_enabled|mesh_instance::flag_lod);
+        scene->add_mesh_instance(mi);
+        min_distance = max_distance;
+        max_distance *= distance_scale;
+      }
+    }
+
+    /// Serialization, scripts, web access
+    void visit(visitor &v) {
+      mesh::visit(v);
+      v.visit(src, atom_src);
+      v.visit(ratio, atom_ratio);
+      v.visit(max_error, atom_max_error);
+    }
+  };
+}}
@@ -8,38 +8,57 @@
 //
 
 namespace octet { namespace scene {
-  template <class interface_t, int dim> class mesh_iterate_faces : public interface_t {
-  public:
-    void iterate(const uint32_t *opaque) {
-      for (int z = 0; z != dim; ++z) {
-        for (int y = 0; y != dim; ++y) {
-          uint32_t p00 = opaque[z*dim+y];
-          interface_t::add_lefts( p00 & ~(p00 << 1), y, z );
-          interface_t::add_rights( p00 & ~(p00 >> 1), y, z );
-        }
+  /// Call the interface for every exposed face in a subcube of dim x dim x dim voxels.
+  /// opaque holds one row of x bits for each y and z.
+  /// neighbours are the opaque bits of the subcubes at -x, +x, -y, +y, -z and +z.
+  /// Faces that touch an opaque neighbour are culled. Missing neighbours may be zero.
+  ///
+  /// The interface gets add_lefts(bits, y, z) etc. where bits has one bit per exposed face.
+  /// Bottoms and backs are called with the row below the exposed voxel (-1 for the first row).
+  template <int dim, class interface_t> void iterate_faces(interface_t &ifc, const uint32_t *opaque, const uint32_t *const *neighbours = 0) {
+    static const uint32_t empty[dim*dim] = { 0 };
+    const uint32_t *nx0 = neighbours && neighbours[0] ? neighbours[0] : empty;
+    const uint32_t *nx1 = neighbours && neighbours[1] ? neighbours[1] : empty;
+    const uint32_t *ny0 = neighbours && neighbours[2] ? neighbours[2] : empty;
+    const uint32_t *ny1 = neighbours && neighbours[3] ? neighbours[3] : empty;
+    const uint32_t *nz0 = neighbours && neighbours[4] ? neighbours[4] : empty;
+    const uint32_t *nz1 = neighbours && neighbours[5] ? neighbours[5] : empty;
+
+    for (int z = 0; z != dim; ++z) {
+      for (int y = 0; y != dim; ++y) {
+        uint32_t p00 = opaque[z*dim+y];
+        ifc.add_lefts( p00 & ~(p00 << 1 | nx0[z*dim+y] >> (dim-1)), y, z );
+        ifc.add_rights( p00 & ~(p00 >> 1 | nx1[z*dim+y] << (dim-1)), y, z );
       }
+    }
 
-      for (int z = 0; z != dim; ++z) {
-        interface_t::add_bottoms( opaque[z*dim+0], 0, z );
-        for (int y = 0; y != dim-1; ++y) {
-          uint32_t p00 = opaque[z*dim+y];
-          uint32_t p01 = opaque[z*dim+(y+1)];
-          interface_t::add_bottoms( p01 & ~p00, y, z );
-          interface_t::add_tops( p00 & ~p01, y, z );
-        }
-        interface_t::add_tops( opaque[z*dim+(dim-1)], dim-1, z );
+    for (int z = 0; z != dim; ++z) {
+      ifc.add_bottoms( opaque[z*dim+0] & ~ny0[z*dim+(dim-1)], -1, z );
+      for (int y = 0; y != dim-1; ++y) {
+        uint32_t p00 = opaque[z*dim+y];
+        uint32_t p01 = opaque[z*dim+(y+1)];
+        ifc.add_bottoms( p01 & ~p00, y, z );
+        ifc.add_tops( p00 & ~p01, y, z );
       }
+      ifc.add_tops( opaque[z*dim+(dim-1)] & ~ny1[z*dim+0], dim-1, z );
+    }
 
-      for (int y = 0; y != dim; ++y) {
-        interface_t::add_backs( opaque[0*dim+y], y, 0 );
-        for (int z = 0; z != dim-1; ++z) {
-          uint32_t p00 = opaque[z*dim+y];
-          uint32_t p10 = opaque[(z+1)*dim+y];
-          interface_t::add_backs( p10 & ~p00, y, z );
-          interface_t::add_fronts( p00 & ~p10, y, z );
-        }
-        interface_t::add_fronts( opaque[(dim-1)*dim+y], y, dim-1 );
+    for (int y = 0; y != dim; ++y) {
+      ifc.add_backs( opaque[0*dim+y] & ~nz0[(dim-1)*dim+y], y, -1 );
+      for (int z = 0; z != dim-1; ++z) {
+        uint32_t p00 = opaque[z*dim+y];
+        uint32_t p10 = opaque[(z+1)*dim+y];
+        ifc.add_backs( p10 & ~p00, y, z );
+        ifc.add_fronts( p00 & ~p10, y, z );
       }
+      ifc.add_fronts( opaque[(dim-1)*dim+y] & ~nz1[0*dim+y], y, dim-1 );
+    }
+  }
+
+  template <class interface_t, int dim> class mesh_iterate_faces : public interface_t {
+  public:
+    void iterate(const uint32_t *opaque, const uint32_t *const *neighbours = 0) {
+      iterate_faces<dim>(*(interface_t*)this, opaque, neighbours);
     }
   };
 
@@ -134,6 +153,127 @@ namespace octet { namespace scene {
     }
   };
 
+  /// Greedy mesher for use with iterate_faces.
+  /// Collects the exposed faces of a subcube and merges rectangles of coplanar faces
+  /// into single quads using bit scans on the rows. Call finish() to generate the quads.
+  /// If vtx is zero, the quads are only counted.
+  class greedy_faces {
+    enum { max_dim = 32 };
+
+    // exposed faces for -x, +x, -y, +y, -z, +z. One row of x bits for each voxel y and z.
+    uint32_t exposed[6][max_dim*max_dim];
+
+    // position of a point on a plane perpendicular to axis.
+    static vec3 point(int axis, int plane, int u, int v) {
+      switch (axis) {
+        case 0: return vec3((float)plane, (float)u, (float)v);
+        case 1: return vec3((float)u, (float)plane, (float)v);
+        default: return vec3((float)u, (float)v, (float)plane);
+      }
+    }
+
+    // add a quad of w x h faces at (u0, v0) on slice s, matching the winding of face_adder.
+    void add_quad(int dir, int s, int u0, int v0, int w, int h) {
+      if (vtx) {
+        int axis = dir >> 1;
+        int plane = s + (dir & 1);
+        vec3 normal(0.0f);
+        normal[axis] = dir & 1 ? 1.0f : -1.0f;
+        vec3 c[4];
+        if (dir & 1) {
+          c[0] = point(axis, plane, u0+w, v0+h); c[1] = point(axis, plane, u0, v0+h);
+          c[2] = point(axis, plane, u0, v0); c[3] = point(axis, plane, u0+w, v0);
+        } else {
+          c[0] = point(axis, plane, u0, v0); c[1] = point(axis, plane, u0+w, v0);
+          c[2] = point(axis, plane, u0+w, v0+h); c[3] = point(axis, plane, u0, v0+h);
+        }
+        vtx->pos = origin + c[0] * voxel_size; vtx->normal = normal; vtx->uv = vec2p(0, 0); vtx++;
+        vtx->pos = origin + c[1] * voxel_size; vtx->normal = normal; vtx->uv = vec2p((float)w, 0); vtx++;
+        vtx->pos = origin + c[2] * voxel_size; vtx->normal = normal; vtx->uv = vec2p((float)w, (float)h); vtx++;
+        vtx->pos = origin + c[3] * voxel_size; vtx->normal = normal; vtx->uv = vec2p(0, (float)h); vtx++;
+        unsigned idx_val = num_faces * 4;
+        idx[0] = idx_val + 0;
+        idx[3] = idx[1] = idx_val + 1;
+        idx[5] = idx[2] = idx_val + 3;
+        idx[4] = idx_val + 2;
+        idx += 6;
+      }
+      num_faces++;
+    }
+
+    // merge one slice of rows of u bits into quads. rows is consumed.
+    void merge_slice(int dir, int s, uint32_t *rows, int dim) {
+      for (int v = 0; v != dim; ++v) {
+        while (rows[v]) {
+          int u0 = ctz(rows[v]);
+          int w = ctz(~(rows[v] >> u0));
+          uint32_t mask = (w == 32 ? ~0u : (1u << w) - 1) << u0;
+          int h = 1;
+          while (v + h != dim && (rows[v+h] & mask) == mask) {
+            rows[v+h] &= ~mask;
+            ++h;
+          }
+          rows[v] &= ~mask;
+          add_quad(dir, s, u0, v, w, h);
+        }
+      }
+    }
+
+  public:
+    vec3 origin;
+    float voxel_size;
+    mesh::vertex *vtx;
+    uint32_t *idx;
+    unsigned num_faces;
+
+    greedy_faces() {
+      memset(exposed, 0, sizeof(exposed));
+      origin = vec3(0.0f);
+      voxel_size = 1.0f;
+      vtx = 0;
+      idx = 0;
+      num_faces = 0;
+    }
+
+    void add_lefts(uint32_t v, int y, int z) { exposed[0][z*max_dim+y] = v; }
+    void add_rights(uint32_t v, int y, int z) { exposed[1][z*max_dim+y] = v; }
+    void add_bottoms(uint32_t v, int y, int z) { exposed[2][z*max_dim+y+1] = v; }
+    void add_tops(uint32_t v, int y, int z) { exposed[3][z*max_dim+y] = v; }
+    void add_backs(uint32_t v, int y, int z) { exposed[4][(z+1)*max_dim+y] = v; }
+    void add_fronts(uint32_t v, int y, int z) { exposed[5][z*max_dim+y] = v; }
+
+    /// Generate (or count) the merged quads for a subcube of dim x dim x dim voxels.
+    void finish(int dim) {
+      uint32_t rows[max_dim];
+      uint32_t transposed[max_dim*max_dim];
+      for (int dir = 0; dir != 6; ++dir) {
+        const uint32_t *src = exposed[dir];
+        int axis = dir >> 1;
+        if (axis == 0) {
+          // x faces lie in y-z planes: flip each z layer so that rows have one bit per y.
+          memset(transposed, 0, sizeof(transposed));
+          for (int z = 0; z != dim; ++z) {
+            for (int y = 0; y != dim; ++y) {
+              for (uint32_t bits = src[z*max_dim+y]; bits; bits &= bits - 1) {
+                transposed[z*max_dim+ctz(bits)] |= 1u << y;
+              }
+            }
+          }
+        }
+        for (int s = 0; s != dim; ++s) {
+          for (int v = 0; v != dim; ++v) {
+            switch (axis) {
+              case 0: rows[v] = transposed[v*max_dim+s]; break; // u = y, v = z
+              case 1: rows[v] = src[v*max_dim+s]; break;        // u = x, v = z
+              default: rows[v] = src[s*max_dim+v]; break;       // u = x, v = y
+            }
+          }
+          merge_slice(dir, s, rows, dim);
+        }
+      }
+    }
+  };
+
   /// experimental voxel world subcube class.
   class mesh_voxel_subcube : public resource {
     enum {
@@ -164,11 +304,11 @@ namespace octet { namespace scene {
     static unsigned shift4(unsigned x, unsigned y, unsigned z) { return x+y*4+(z&1)*16; }
     static unsigned shift2(unsigned x, unsigned y, unsigned z) { return x+y*2+z*4; }
 
-    unsigned get32(uint32_t *src, unsigned x, unsigned y, unsigned z) { return (opaque[z*32+y] >> x) & 1; }
-    static unsigned get16(uint32_t *src, unsigned x, unsigned y, unsigned z) { return (src[off16(x,y,z)] >> shift16(x,y,z)) & 1; }
-    static unsigned get8(uint32_t *src, unsigned x, unsigned y, unsigned z) { return (src[off8(x,y,z)] >> shift8(x,y,z)) & 1; }
-    static unsigned get4(uint32_t *src, unsigned x, unsigned y, unsigned z) { return (src[off4(x,y,z)] >> shift4(x,y,z)) & 1; }
-    static unsigned get2(uint32_t *src, unsigned x, unsigned y, unsigned z) { return (src[off2(x,y,z)] >> shift2(x,y,z)) & 1; }
+    unsigned get32(const uint32_t *src, unsigned x, unsigned y, unsigned z) const { return (opaque[z*32+y] >> x) & 1; }
+    static unsigned get16(const uint32_t *src, unsigned x, unsigned y, unsigned z) { return (src[off16(x,y,z)] >> shift16(x,y,z)) & 1; }
+    static unsigned get8(const uint32_t *src, unsigned x, unsigned y, unsigned z) { return (src[off8(x,y,z)] >> shift8(x,y,z)) & 1; }
+    static unsigned get4(const uint32_t *src, unsigned x, unsigned y, unsigned z) { return (src[off4(x,y,z)] >> shift4(x,y,z)) & 1; }
+    static unsigned get2(const uint32_t *src, unsigned x, unsigned y, unsigned z) { return (src[off2(x,y,z)] >> shift2(x,y,z)) & 1; }
 
     static unsigned rot(unsigned x, unsigned amount) { return (x << amount) | (x >> (32-amount)); }
 
@@ -263,23 +403,62 @@ namespace octet { namespace scene {
       assert(any - any_opaque == num_lod);
     }
 
-    void count_faces(mesh_iterate_faces<face_counter, dim> &count) {
-      count.iterate(opaque);
+    void count_faces(mesh_iterate_faces<face_counter, dim> &count, const uint32_t *const *neighbours = 0) {
+      count.iterate(opaque, neighbours);
     }
 
-    void add_faces(mesh_iterate_faces<face_adder, dim> &add) {
-      add.iterate(opaque);
+    void add_faces(mesh_iterate_faces<face_adder, dim> &add, const uint32_t *const *neighbours = 0) {
+      add.iterate(opaque, neighbours);
     }
 
-    template <class set> void add_voxels(mat4t_in voxelToWorld, const set &set_in) {
+    /// add voxels inside a set. returns true if any voxel changed.
+    template <class set> bool add_voxels(mat4t_in voxelToWorld, const set &set_in) {
+      uint32_t changed = 0;
       for (int z = 0; z != dim; ++z) {
         for (int y = 0; y != dim; ++y) {
+          uint32_t row = 0;
           for (int x = 0; x != dim; ++x) {
             vec3 txyz = vec3(x, y, z) * voxelToWorld;
             if (set_in.intersects(txyz)) {
-              opaque[z*dim+y] |= 1 << x;
+              row |= 1 << x;
             }
           }
+          changed |= row & ~opaque[z*dim+y];
+          opaque[z*dim+y] |= row;
+        }
+      }
+      return changed != 0;
+    }
+
+    /// set or clear a single voxel. returns true if the voxel changed.
+    bool set_voxel(unsigned x, unsigned y, unsigned z, bool value) {
+      uint32_t old_row = opaque[z*dim+y];
+      uint32_t new_row = value ? old_row | (1u << x) : old_row & ~(1u << x);
+      opaque[z*dim+y] = new_row;
+      return new_row != old_row;
+    }
+
+    /// get a single voxel.
+    unsigned get_voxel(unsigned x, unsigned y, unsigned z) const {
+      return (opaque[z*dim+y] >> x) & 1;
+    }
+
+    /// get the opaque bits, one 32 bit row per y and z.
+    const uint32_t *get_opaque() const {
+      return opaque;
+    }
+
+    /// get the any_opaque bits of a level of detail (0-4) with one row of (32>>level) bits per y and z.
+    /// Level 1 is 16x16x16, level 4 is 2x2x2. Call update_lod() first.
+    void get_lod_opaque(uint32_t *dest, int level) const {
+      int n = dim >> level;
+      for (int z = 0; z != n; ++z) {
+        for (int y = 0; y != n; ++y) {
+          uint32_t row = 0;
+          for (int x = 0; x != n; ++x) {
+            row |= is_any(ivec3(x, y, z), level) << x;
+          }
+          dest[z*n+y] = row;
         }
       }
     }
@@ -403,7 +582,7 @@ namespace octet { namespace scene {
       return true;
     }
 
-    unsigned is_any(ivec3_in pos, int level) {
+    unsigned is_any(ivec3_in pos, int level) const {
       switch(level) {
         case 0: return get32(opaque, pos.x(), pos.y(), pos.z());
         case 1: return get16(any_opaque, pos.x(), pos.y(), pos.z());
@@ -415,7 +594,7 @@ namespace octet { namespace scene {
       }
     }
 
-    unsigned is_all(ivec3_in pos, int level) {
+    unsigned is_all(ivec3_in pos, int level) const {
       switch(level) {
         case 0: return get32(opaque, pos.x(), pos.y(), pos.z());
         case 1: return get16(all_opaque, pos.x(), pos.y(), pos.z());
@@ -27,26 +27,56 @@ namespace octet { namespace scene {
 
   /// Experimental Voxel world mesh, uses subcubes to create a voxel world.
   class mesh_voxels : public mesh {
+  public:
+    /// Result of a ray march.
+    struct voxel_hit {
+      /// voxel coordinates of the opaque voxel that was hit.
+      ivec3 voxel;
+      /// fraction of the way along the ray of the hit.
+      float t;
+      /// normal of the face of the voxel that was hit. (zero if the ray starts inside)
+      vec3 normal;
+    };
+
+  private:
     ivec3 size;
     float voxel_size;
 
     enum { log_subcube_dim = 5, subcube_dim = 1 << log_subcube_dim };
 
+    // subcubes are only allocated when they contain voxels; empty ones are zero.
     dynarray<ref<mesh_voxel_subcube> > subcubes;
 
-    struct kd_node {
-      int axis;
-      int kids[2];
+    // sparse octree over the subcubes.
+    // A node is empty, full or mixed. Only mixed nodes above the subcubes have children.
+    struct octree_node {
+      enum { empty, full, mixed };
+      uint8_t state;
+      int kids;
     };
 
-    dynarray<kd_node> kd_tree;
+    // children of mixed nodes in groups of eight, indexed by delta(i).
+    dynarray<octree_node> octree;
+    octree_node octree_root;
+
+    // the root covers (1 << octree_levels) subcubes on each side.
+    int octree_levels;
+
+    // a ray in voxel coordinates: pos(t) = org + dir * t
+    struct voxel_ray {
+      vec3 org;
+      vec3 dir;
+      vec3 inv_dir;
+      float eps;
+      int dir_mask;
+    };
 
     unsigned is_all(ivec3_in pos, int level) const {
       if ((1<<level) <= subcube_dim) {
         return all(pos >= ivec3(0, 0, 0)) && all(pos < size) ? 1 : 0;
       } else {
         mesh_voxel_subcube *subcube = get_subcube(pos>>level);
-        return subcube->is_any(pos & ivec3(subcube_dim-1), level);
+        return subcube ? subcube->is_any(pos & ivec3(subcube_dim-1), level) : 0;
       }
     }
 
@@ -64,63 +94,269 @@ namespace octet { namespace scene {
       return d[i];
     }
 
-    void update_mesh() {
-      mesh_iterate_faces<face_counter, subcube_dim> count;
-      for (unsigned i = 0; i != subcubes.size(); ++i) {
-        mesh_voxel_subcube *p = subcubes[i];
-        if (p) {
-          p->count_faces(count);
+    // range of faces in the vertex and index buffers owned by one subcube.
+    // each face uses four vertices and six indices.
+    struct subcube_range {
+      unsigned first_face;
+      unsigned max_faces;
+      unsigned num_faces;
+    };
+
+    // one range per subcube, sub-allocated from a pool of faces.
+    dynarray<subcube_range> ranges;
+
+    // ranges abandoned by subcubes that outgrew them. These get degenerate indices.
+    dynarray<subcube_range> holes;
+
+    // one flag per subcube, set when the subcube needs to be remeshed.
+    dynarray<uint8_t> dirty;
+    unsigned num_dirty;
+
+    // level of detail of each subcube, 0 = 32x32x32 voxels, 4 = 2x2x2 voxels.
+    dynarray<uint8_t> levels;
+
+    // merge coplanar faces into larger quads.
+    bool greedy;
+
+    // faces allocated in the pool, faces the buffers can hold and faces lost to holes.
+    unsigned pool_faces;
+    unsigned pool_capacity;
+    unsigned pool_waste;
+
+    unsigned subcube_index(ivec3_in pos) const {
+      return pos.x() + size.x() * (pos.y() + size.y() * pos.z());
+    }
+
+    // leave a little room in each range so that small edits do not move the subcube.
+    static unsigned range_size(unsigned num_faces) {
+      return num_faces ? num_faces + num_faces / 4 + 4 : 0;
+    }
+
+    // get the opaque bits of a subcube at a level of detail or zero if there is no subcube.
+    const uint32_t *get_lod_bits(ivec3_in pos, int level, uint32_t *tmp) const {
+      mesh_voxel_subcube *p = subcubes[subcube_index(pos)];
+      if (!p) return 0;
+      if (level == 0) return p->get_opaque();
+      p->get_lod_opaque(tmp, level);
+      return tmp;
+    }
+
+    // Call the interface for the exposed faces of one subcube at its level of detail.
+    // Faces are only culled against neighbours at the same level so that there are no holes.
+    // returns the dimension of the subcube at that level.
+    template <class interface_t> int iterate_subcube(ivec3_in pos, interface_t &ifc) const {
+      int level = levels[subcube_index(pos)];
+      uint32_t tmp[7][subcube_dim*subcube_dim];
+      const uint32_t *bits = get_lod_bits(pos, level, tmp[6]);
+      if (!bits) return 0;
+
+      const uint32_t *neighbours[6];
+      for (int axis = 0; axis != 3; ++axis) {
+        ivec3 d(axis == 0, axis == 1, axis == 2);
+        ivec3 lo = pos - d;
+        ivec3 hi = pos + d;
+        bool use_lo = lo[axis] >= 0 && levels[subcube_index(lo)] == level;
+        bool use_hi = hi[axis] < size[axis] && levels[subcube_index(hi)] == level;
+        neighbours[axis*2+0] = use_lo ? get_lod_bits(lo, level, tmp[axis*2+0]) : 0;
+        neighbours[axis*2+1] = use_hi ? get_lod_bits(hi, level, tmp[axis*2+1]) : 0;
+      }
+
+      switch (level) {
+        case 0: iterate_faces<subcube_dim>(ifc, bits, neighbours); break;
+        case 1: iterate_faces<subcube_dim/2>(ifc, bits, neighbours); break;
+        case 2: iterate_faces<subcube_dim/4>(ifc, bits, neighbours); break;
+        case 3: iterate_faces<subcube_dim/8>(ifc, bits, neighbours); break;
+        default: iterate_faces<subcube_dim/16>(ifc, bits, neighbours); break;
+      }
+      return subcube_dim >> level;
+    }
+
+    unsigned count_faces(ivec3_in pos) const {
+      if (greedy) {
+        greedy_faces count;
+        count.finish(iterate_subcube(pos, count));
+        return count.num_faces;
+      } else {
+        face_counter count;
+        iterate_subcube(pos, count);
+        return count.num_faces;
+      }
+    }
+
+    void set_dirty(ivec3_in pos) {
+      if (all(pos >= ivec3(0, 0, 0)) && all(pos < size)) {
+        unsigned idx = subcube_index(pos);
+        if (!dirty[idx]) {
+          dirty[idx] = 1;
+          num_dirty++;
         }
       }
+    }
 
-      allocate(sizeof(vertex)*count.num_faces*4, sizeof(uint32_t)*count.num_faces*6);
-      set_num_indices(count.num_faces*6);
-      set_num_vertices(count.num_faces*4);
+    ivec3 subcube_pos(unsigned idx) const {
+      return ivec3(idx % size.x(), (idx / size.x()) % size.y(), idx / (size.x() * size.y()));
+    }
 
-      mesh_iterate_faces<face_adder, subcube_dim> add;
-      add.vtx = (vertex *)get_vertices()->lock();
-      add.idx = (uint32_t *)get_indices()->lock();
-      add.dx = vec3(voxel_size, 0.0f, 0.0f);
-      add.dy = vec3(0.0f, voxel_size, 0.0f);
-      add.dz = vec3(0.0f, 0.0f, voxel_size);
-      add.voxel_size = voxel_size;
+    // make a list of the dirty subcubes to share between threads.
+    void get_dirty_list(dynarray<unsigned> &list) const {
+      list.resize(0);
+      list.reserve(num_dirty);
+      for (unsigned idx = 0; idx != dirty.size(); ++idx) {
+        if (dirty[idx]) list.push_back(idx);
+      }
+    }
 
-      vec3 offset = vec3(size) * (-0.5f * subcube_dim * voxel_size);
-      vec3 scale(subcube_dim * voxel_size);
-      int idx = 0;
-      for (int z = 0; z != size.z(); ++z) {
-        for (int y = 0; y != size.y(); ++y) {
-          for (int x = 0; x != size.x(); ++x) {
-            mesh_voxel_subcube *p = subcubes[idx++];
-            add.origin = vec3(x, y, z) * scale + offset;
-            if (p) {
-              p->add_faces(add);
-            }
+    // Rebuild the pool from scratch with every subcube packed together.
+    // Called the first time and when the pool overflows or has too many holes.
+    // The faces are counted in parallel and the ranges come from a prefix sum of the counts.
+    void compact() {
+      thread_pool::get().parallel_for(0, ranges.size(), [&](unsigned idx) {
+        ranges[idx].max_faces = range_size(count_faces(subcube_pos(idx)));
+      });
+
+      unsigned total = 0;
+      for (unsigned idx = 0; idx != ranges.size(); ++idx) {
+        subcube_range &r = ranges[idx];
+        r.first_face = total;
+        r.num_faces = 0;
+        total += r.max_faces;
+        dirty[idx] = 1;
+      }
+      num_dirty = ranges.size();
+      holes.resize(0);
+      pool_faces = total;
+      pool_waste = 0;
+      pool_capacity = total + total / 2 + 64;
+      allocate(sizeof(vertex)*pool_capacity*4, sizeof(uint32_t)*pool_capacity*6);
+    }
+
+    // Count the faces of dirty subcubes and move any that have outgrown their range
+    // to the end of the pool. Returns false if the pool needs compacting.
+    bool place_dirty_subcubes(const dynarray<unsigned> &dirty_list) {
+      thread_pool::get().parallel_for(0, dirty_list.size(), [&](unsigned i) {
+        unsigned idx = dirty_list[i];
+        ranges[idx].num_faces = count_faces(subcube_pos(idx));
+      });
+
+      for (unsigned i = 0; i != dirty_list.size(); ++i) {
+        subcube_range &r = ranges[dirty_list[i]];
+        if (r.num_faces > r.max_faces) {
+          unsigned max_faces = range_size(r.num_faces);
+          if (pool_faces + max_faces > pool_capacity) {
+            return false;
           }
+          if (r.max_faces) {
+            holes.push_back(r);
+            pool_waste += r.max_faces;
+          }
+          r.first_face = pool_faces;
+          r.max_faces = max_faces;
+          pool_faces += max_faces;
         }
       }
+      return pool_waste <= pool_faces / 2;
+    }
 
-      assert(count.num_faces == add.num_faces);
+    // write the faces of one subcube into its range of the pool.
+    void add_subcube_faces(unsigned idx, vertex *vertices, uint32_t *indices) const {
+      const subcube_range &r = ranges[idx];
+      vertex *vtx = vertices + r.first_face * 4;
+      uint32_t *ip = indices + r.first_face * 6;
+      ivec3 pos = subcube_pos(idx);
+      vec3 offset = vec3(size) * (-0.5f * subcube_dim * voxel_size);
+      vec3 origin = vec3(pos) * (subcube_dim * voxel_size) + offset;
+      float lod_voxel_size = voxel_size * (1 << levels[idx]);
+      if (r.num_faces && greedy) {
+        greedy_faces add;
+        add.vtx = vtx;
+        add.idx = ip;
+        add.num_faces = r.first_face;
+        add.origin = origin;
+        add.voxel_size = lod_voxel_size;
+        add.finish(iterate_subcube(pos, add));
+        assert(add.num_faces == r.first_face + r.num_faces);
+      } else if (r.num_faces) {
+        face_adder add;
+        add.vtx = vtx;
+        add.idx = ip;
+        add.num_faces = r.first_face;
+        add.origin = origin;
+        add.dx = vec3(lod_voxel_size, 0.0f, 0.0f);
+        add.dy = vec3(0.0f, lod_voxel_size, 0.0f);
+        add.dz = vec3(0.0f, 0.0f, lod_voxel_size);
+        add.voxel_size = lod_voxel_size;
+        iterate_subcube(pos, add);
+        assert(add.num_faces == r.first_face + r.num_faces);
+      }
 
-      get_vertices()->unlock();
-      get_indices()->unlock();
+      // unused faces at the end of the range are degenerate.
+      memset(ip + r.num_faces * 6, 0, (r.max_faces - r.num_faces)*6*sizeof(uint32_t));
+    }
+
+    // Remesh only the dirty subcubes, writing their faces into their own ranges of the pool.
+    // The subcubes are counted and meshed in parallel as their ranges do not overlap.
+    void update_mesh() {
+      if (!num_dirty && pool_capacity) return;
+
+      dynarray<unsigned> dirty_list;
+      get_dirty_list(dirty_list);
+      if (!pool_capacity || !place_dirty_subcubes(dirty_list)) {
+        compact();
+        get_dirty_list(dirty_list);
+        bool fits = place_dirty_subcubes(dirty_list);
+        assert(fits);
+      }
+
+      gl_resource::wolock vlock(get_vertices());
+      gl_resource::wolock ilock(get_indices());
+
+      // holes are drawn as degenerate triangles until the next compaction.
+      for (unsigned i = 0; i != holes.size(); ++i) {
+        memset(ilock.u32() + holes[i].first_face*6, 0, holes[i].max_faces*6*sizeof(uint32_t));
+      }
+      holes.resize(0);
+
+      vertex *vertices = (vertex *)vlock.u8();
+      uint32_t *indices = ilock.u32();
+      thread_pool::get().parallel_for(0, dirty_list.size(), [&](unsigned i) {
+        add_subcube_faces(dirty_list[i], vertices, indices);
+      });
+
+      memset(dirty.data(), 0, dirty.size());
+      num_dirty = 0;
+
+      set_num_indices(pool_faces*6);
+      set_num_vertices(pool_faces*4);
       //dump(log("voxels\n"));
     }
 
+    // Rasterise a set into every subcube in parallel.
     template <class set> void add_voxels(mat4t_in voxelToWorld, const set &set_in) {
-      int idx = 0;
       vec3 offset = vec3(size) * (-0.5f * subcube_dim) + vec3(0.5f);
       vec3 scale = vec3(subcube_dim);
-      for (int z = 0; z != size.z(); ++z) {
-        for (int y = 0; y != size.y(); ++y) {
-          for (int x = 0; x != size.x(); ++x) {
-            mat4t localVoxelToWorld = voxelToWorld;
-            vec3 pos = vec3(x, y, z) * scale + offset;
-            localVoxelToWorld.translate(pos.x(), pos.y(), pos.z());
-            //localVoxelToWorld.w() += vec4(0.5f, 0.5f, 0.5f, 0.0f);
-            subcubes[idx++]->add_voxels(localVoxelToWorld, set_in);
+      dynarray<uint8_t> changed(subcubes.size());
+      thread_pool::get().parallel_for(0, subcubes.size(), [&](unsigned idx) {
+        mat4t localVoxelToWorld = voxelToWorld;
+        vec3 pos = vec3(subcube_pos(idx)) * scale + offset;
+        localVoxelToWorld.translate(pos.x(), pos.y(), pos.z());
+        //localVoxelToWorld.w() += vec4(0.5f, 0.5f, 0.5f, 0.0f);
+        mesh_voxel_subcube *p = subcubes[idx];
+        if (p) {
+          changed[idx] = p->add_voxels(localVoxelToWorld, set_in);
+        } else {
+          // only keep new subcubes that have something in them.
+          mesh_voxel_subcube tmp;
+          changed[idx] = tmp.add_voxels(localVoxelToWorld, set_in);
+          if (changed[idx]) {
+            subcubes[idx] = new mesh_voxel_subcube(tmp);
           }
         }
+      });
+
+      for (unsigned idx = 0; idx != subcubes.size(); ++idx) {
+        if (changed[idx]) {
+          mark_dirty(subcube_pos(idx));
+        }
       }
     }
 
@@ -158,9 +394,152 @@ namespace octet { namespace scene {
       return *this;
     }*/
 
+    octree_node build_octree(ivec3_in pos, int level) {
+      octree_node node = { octree_node::empty, -1 };
+      if (level == 0) {
+        if (all(pos < size)) {
+          mesh_voxel_subcube *p = subcubes[subcube_index(pos)];
+          if (p && p->is_all(ivec3(0, 0, 0), log_subcube_dim)) {
+            node.state = octree_node::full;
+          } else if (p && p->is_any(ivec3(0, 0, 0), log_subcube_dim)) {
+            node.state = octree_node::mixed;
+          }
+        }
+        return node;
+      }
+
+      octree_node kids[8];
+      unsigned num_empty = 0, num_full = 0;
+      for (int i = 0; i != 8; ++i) {
+        kids[i] = build_octree(pos * 2 + delta(i), level - 1);
+        num_empty += kids[i].state == octree_node::empty;
+        num_full += kids[i].state == octree_node::full;
+      }
+
+      // collapse nodes that are all empty or all full.
+      if (num_empty == 8 || num_full == 8) {
+        node.state = num_full == 8 ? octree_node::full : octree_node::empty;
+      } else {
+        node.state = octree_node::mixed;
+        node.kids = octree.size();
+        octree.resize(node.kids + 8);
+        for (int i = 0; i != 8; ++i) {
+          octree[node.kids + i] = kids[i];
+        }
+      }
+      return node;
+    }
+
+    // free subcubes that have become empty and rebuild the octree.
+    void update_octree() {
+      for (unsigned idx = 0; idx != subcubes.size(); ++idx) {
+        mesh_voxel_subcube *p = subcubes[idx];
+        if (p && !p->is_any(ivec3(0, 0, 0), log_subcube_dim)) {
+          subcubes[idx] = 0;
+        }
+      }
+
+      int max_size = std::max(size.x(), std::max(size.y(), size.z()));
+      octree_levels = 0;
+      while ((1 << octree_levels) < max_size) ++octree_levels;
+      octree.resize(0);
+      octree_root = build_octree(ivec3(0, 0, 0), octree_levels);
+    }
+
+    // clip a ray to a box in voxel coordinates.
+    // returns the entry and exit t and the axis we entered by.
+    static bool clip_ray(const voxel_ray &r, vec3_in lo, vec3_in hi, float &t0, float &t1, int &axis) {
+      vec3 ta = (lo - r.org) * r.inv_dir;
+      vec3 tb = (hi - r.org) * r.inv_dir;
+      vec3 tnear = min(ta, tb);
+      vec3 tfar = max(ta, tb);
+      axis = tnear.x() >= tnear.y() && tnear.x() >= tnear.z() ? 0 : tnear.y() >= tnear.z() ? 1 : 2;
+      t0 = tnear[axis];
+      t1 = std::min(tfar.x(), std::min(tfar.y(), tfar.z()));
+      return t0 <= t1;
+    }
+
+    void set_hit(const voxel_ray &r, ivec3_in voxel, float t, int axis, voxel_hit &hit) const {
+      hit.voxel = voxel;
+      hit.t = t;
+      hit.normal = vec3(0.0f);
+      if (axis >= 0) {
+        hit.normal[axis] = r.dir[axis] > 0 ? -1.0f : 1.0f;
+      }
+    }
+
+    // Hierarchical DDA through one subcube using its any/all pyramids.
+    // Empty cells are stepped over in one go at the coarsest level that is empty,
+    // mixed cells are descended into and full cells end the march.
+    bool march_subcube(const voxel_ray &r, ivec3_in cube_pos, float t, float t1, int axis, voxel_hit &hit) const {
+      mesh_voxel_subcube *p = subcubes[subcube_index(cube_pos)];
+      if (!p) return false;
+
+      ivec3 base = cube_pos * subcube_dim;
+      int top_level = log_subcube_dim - 1;
+      int level = top_level;
+      while (t <= t1) {
+        vec3 sample = r.org + r.dir * (t + r.eps) - vec3(base);
+        ivec3 vox = ivec3(sample).max(ivec3(0)).min(ivec3(subcube_dim-1));
+        ivec3 cell = vox >> ivec3(level);
+        if (p->is_any(cell, level)) {
+          if (level == 0 || p->is_all(cell, level)) {
+            set_hit(r, base + vox, t, axis, hit);
+            return true;
+          }
+          level--;
+        } else {
+          // step to the far side of this empty cell.
+          vec3 lo = vec3(base + (cell << ivec3(level)));
+          vec3 hi = lo + vec3((float)(1 << level));
+          vec3 tfar = max((lo - r.org) * r.inv_dir, (hi - r.org) * r.inv_dir);
+          axis = tfar.x() <= tfar.y() && tfar.x() <= tfar.z() ? 0 : tfar.y() <= tfar.z() ? 1 : 2;
+          // always make progress, even if rounding puts the sample in the wrong cell.
+          t = std::max(tfar[axis], t + r.eps);
+          if (level < top_level) level++;
+        }
+      }
+      return false;
+    }
+
+    // Visit the octree front to back. Children are visited in the order i ^ dir_mask
+    // so the first hit is the nearest one.
+    bool march_node(const voxel_ray &r, const octree_node &node, ivec3_in pos, int level, float tmin, float tmax, voxel_hit &hit) const {
+      if (node.state == octree_node::empty) return false;
+
+      float node_size = (float)(subcube_dim << level);
+      vec3 lo = vec3(pos) * node_size;
+      float t0, t1;
+      int axis;
+      if (!clip_ray(r, lo, lo + vec3(node_size), t0, t1, axis)) return false;
+      if (t0 < tmin) { t0 = tmin; axis = -1; }
+      if (t1 > tmax) t1 = tmax;
+      if (t0 > t1) return false;
+
+      if (node.state == octree_node::full) {
+        vec3 entry = r.org + r.dir * (t0 + r.eps);
+        ivec3 vox = ivec3(entry).max(ivec3(pos) * (subcube_dim << level)).min((ivec3(pos) + 1) * (subcube_dim << level) - 1);
+        set_hit(r, vox, t0, axis, hit);
+        return true;
+      }
+
+      if (level == 0) {
+        return march_subcube(r, pos, t0, t1, axis, hit);
+      }
+
+      for (int i = 0; i != 8; ++i) {
+        int k = i ^ r.dir_mask;
+        if (march_node(r, octree[node.kids + k], pos * 2 + delta(k), level - 1, tmin, tmax, hit)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
   public:
     RESOURCE_META(mesh_voxels)
 
+
     /// Make a new voxel mesh
     mesh_voxels(float voxel_size_in=1.0f/32, const ivec3 &size_in = ivec3(1, 1, 1)) {
       set_default_attributes();
@@ -169,37 +548,150 @@ namespace octet { namespace scene {
       //set_aabb(aabb(vec3(0, 0, 0), size));
 
       subcubes.resize(size.x() * size.y() * size.z());
+      ranges.resize(subcubes.size());
+      dirty.resize(subcubes.size());
+      memset(dirty.data(), 1, dirty.size());
+      num_dirty = dirty.size();
+      levels.resize(subcubes.size());
+      memset(levels.data(), 0, levels.size());
+      greedy = true;
+      pool_faces = pool_capacity = pool_waste = 0;
       set_aabb(aabb(vec3(0, 0, 0), vec3(size)*(voxel_size*subcube_dim*0.5f)));
-      int idx = 0;
-      for (int z = 0; z != size.z(); ++z) {
-        for (int y = 0; y != size.y(); ++y) {
-          for (int x = 0; x != size.x(); ++x) {
-            ivec3 pos(x, y, z);
-            subcubes[idx++] = new mesh_voxel_subcube();
-          }
-        }
-      }
 
       //box(aabb(vec3(8, 8, 8), vec3(8, 8, 8)));
+      octree_root.state = octree_node::empty;
+      octree_root.kids = -1;
+      octree_levels = 0;
       update_lod();
     }
 
     /// Update only the LODs used for collision detection.
     void update_lod() {
-      for (unsigned i = 0; i != subcubes.size(); ++i) {
+      thread_pool::get().parallel_for(0, subcubes.size(), [&](unsigned i) {
         mesh_voxel_subcube *p = subcubes[i];
         if (p) {
           p->update_lod();
         }
-      }
+      });
+      update_octree();
     }
 
     /// Update both the mesh and the LODs.
+    /// Only subcubes that have changed since the last update (and their neighbours) are remeshed.
     void update() {
-      update_lod();
+      thread_pool::get().parallel_for(0, subcubes.size(), [&](unsigned i) {
+        mesh_voxel_subcube *p = subcubes[i];
+        if (p && dirty[i]) {
+          p->update_lod();
+        }
+      });
+      if (num_dirty) {
+        update_octree();
+      }
       update_mesh();
     }
 
+    /// March a ray (in model space) through the voxels and find the first opaque voxel.
+    /// Uses the octree to skip empty and full regions and the subcube pyramids
+    /// to skip empty space inside subcubes. Call update() or update_lod() after edits.
+    bool ray_march(const ray &the_ray, voxel_hit &hit) const {
+      vec3 offset = vec3(size) * (-0.5f * subcube_dim * voxel_size);
+      voxel_ray r;
+      r.org = (the_ray.get_start() - offset) / voxel_size;
+      r.dir = (the_ray.get_end() - the_ray.get_start()) / voxel_size;
+      r.dir_mask = 0;
+      for (int i = 0; i != 3; ++i) {
+        r.inv_dir[i] = r.dir[i] != 0 ? 1.0f / r.dir[i] : (r.dir[i] < 0 ? -1e30f : 1e30f);
+        r.dir_mask |= r.dir[i] < 0 ? 1 << i : 0;
+      }
+      float max_dir = std::max(std::abs(r.dir.x()), std::max(std::abs(r.dir.y()), std::abs(r.dir.z())));
+      r.eps = max_dir ? 1.0e-3f / max_dir : 0.0f;
+      return march_node(r, octree_root, ivec3(0, 0, 0), octree_levels, 0.0f, 1.0f, hit);
+    }
+
+    /// Return true if there are no opaque voxels between two points in model space.
+    bool line_of_sight(vec3_in from, vec3_in to) const {
+      voxel_hit hit;
+      return !ray_march(ray(from, to), hit);
+    }
+
+    /// Choose the level of detail of each subcube from its distance to the viewer.
+    /// view_pos is in model space. Subcubes nearer than lod_distance get full detail,
+    /// each doubling of distance after that halves the resolution, down to 2x2x2.
+    /// The coarse levels come from the any_opaque pyramids, so objects never vanish.
+    void set_lod_view(vec3_in view_pos, float lod_distance) {
+      vec3 offset = vec3(size) * (-0.5f * subcube_dim * voxel_size);
+      vec3 scale(subcube_dim * voxel_size);
+      int idx = 0;
+      for (int z = 0; z != size.z(); ++z) {
+        for (int y = 0; y != size.y(); ++y) {
+          for (int x = 0; x != size.x(); ++x, ++idx) {
+            vec3 centre = (vec3(x, y, z) + vec3(0.5f)) * scale + offset;
+            float distance = length(centre - view_pos);
+            int level = 0;
+            if (distance >= lod_distance) {
+              level = std::min(ilog2((unsigned)(distance / lod_distance)) + 1, (int)log_subcube_dim - 1);
+            }
+            if (levels[idx] != level) {
+              levels[idx] = (uint8_t)level;
+              mark_dirty(ivec3(x, y, z));
+            }
+          }
+        }
+      }
+    }
+
+    /// Get the level of detail of a subcube. (0 = full detail)
+    int get_lod(ivec3_in pos) const {
+      return levels[subcube_index(pos)];
+    }
+
+    /// Merge coplanar faces into larger quads (default) or use one quad per voxel face.
+    void set_greedy(bool value) {
+      if (greedy != value) {
+        greedy = value;
+        memset(dirty.data(), 1, dirty.size());
+        num_dirty = dirty.size();
+      }
+    }
+
+    /// Mark a subcube and its six neighbours for remeshing on the next update.
+    void mark_dirty(ivec3_in pos) {
+      set_dirty(pos);
+      for (int axis = 0; axis != 3; ++axis) {
+        ivec3 d(axis == 0, axis == 1, axis == 2);
+        set_dirty(pos - d);
+        set_dirty(pos + d);
+      }
+    }
+
+    /// Set or clear a single voxel. Only the subcube containing the voxel
+    /// and any neighbour that shares a face with it get remeshed.
+    void set_voxel(ivec3_in pos, bool value) {
+      ivec3 cube_pos = pos >> ivec3(log_subcube_dim);
+      ivec3 vox_pos = pos & ivec3(subcube_dim-1);
+      mesh_voxel_subcube *subcube = get_subcube(cube_pos);
+      if (!subcube) {
+        if (!value) return;
+        subcube = subcubes[subcube_index(cube_pos)] = new mesh_voxel_subcube();
+      }
+      if (subcube->set_voxel(vox_pos.x(), vox_pos.y(), vox_pos.z(), value)) {
+        set_dirty(cube_pos);
+        for (int axis = 0; axis != 3; ++axis) {
+          ivec3 d(axis == 0, axis == 1, axis == 2);
+          if (vox_pos[axis] == 0) set_dirty(cube_pos - d);
+          if (vox_pos[axis] == subcube_dim-1) set_dirty(cube_pos + d);
+        }
+      }
+    }
+
+    /// Get a single voxel.
+    unsigned get_voxel(ivec3_in pos) const {
+      ivec3 vox_pos = pos & ivec3(subcube_dim-1);
+      mesh_voxel_subcube *subcube = get_subcube(pos >> ivec3(log_subcube_dim));
+      return subcube ? subcube->get_voxel(vox_pos.x(), vox_pos.y(), vox_pos.z()) : 0;
+    }
+
     /// Serialize.
     void visit(visitor &v) {
       mesh::visit(v);
@@ -229,7 +721,7 @@ namespace octet { namespace scene {
     mesh_voxel_subcube *get_subcube(ivec3_in pos) const {
       assert(all(pos < size));
       //assert(x < (unsigned)size.x() && y < (unsigned)size.y() && z < (unsigned)size.z());
-      return subcubes[pos.x()+ size.x() * (pos.y() + size.y()*pos.z())];
+      return subcubes[subcube_index(pos)];
     }
 
     /// Is any cube in this subcube collidable?
@@ -243,7 +735,7 @@ namespace octet { namespace scene {
         //char b[3][128];
         //log("%d %s->%s/%s\n", level, pos.toString(b[0], sizeof(b[0])), cube_addr.toString(b[1], sizeof(b[1])), vox_addr.toString(b[2], sizeof(b[2])));
         mesh_voxel_subcube *subcube = get_subcube(cube_addr);
-        return subcube->is_any(vox_addr, level);
+        return subcube ? subcube->is_any(vox_addr, level) : 0;
       }
     }
 
@@ -271,7 +763,7 @@ namespace octet { namespace scene {
         return false;
       }
 
-      while(!stack.is_empty()) {
+      while(!stack.empty()) {
         entry ta = stack.back().first;
         entry tb = stack.back().second;
         stack.pop_back();
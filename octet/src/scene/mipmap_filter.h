@@ -0,0 +1,386 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// (C) Andy Thomason 2012-2014
+//
+// Modular Framework for OpenGLES2 rendering on multiple platforms.
+//
+// Mipmap filter. Makes the chain of smaller images used for minification.
+//
+
+namespace octet { namespace scene {
+  /// Makes mip chains for 8 bit RGB and RGBA images.
+  ///
+  /// Each level is resampled from the one above it with a separable windowed sinc
+  /// (Kaiser or Lanczos) or a box filter. Filtering is done in linear light when
+  /// the image is sRGB and colours are weighted by alpha so that transparent pixels do not bleed.
+  /// Level sizes are max(1, size/2) so that non power of two images get a full chain.
+  ///
+  /// Alpha tested textures such as foliage get thinner in the smaller levels.
+  /// Set an alpha reference to scale the alpha of each level so that the fraction of pixels
+  /// that pass the alpha test stays the same as in the top level.
+  ///
+  /// Rows are processed four channels at a time with vec4 and each level is split
+  /// into strips of rows for the thread pool.
+  ///
+  /// Example
+  ///
+  ///     mipmap_filter filter(mipmap_filter::kernel_lanczos);
+  ///     filter.set_alpha_coverage(0.5f);
+  ///     img->set_mipmap_filter(filter);
+  ///
+  class mipmap_filter {
+  public:
+    enum kernel_type {
+      kernel_box,       /// average of the pixels under each destination pixel
+      kernel_kaiser,    /// Kaiser windowed sinc, sharp with little ringing
+      kernel_lanczos,   /// Lanczos 3, sharper with more ringing
+    };
+
+  private:
+    kernel_type kernel;
+
+    // treat the colour channels as sRGB
+    bool srgb;
+
+    // alpha test reference for coverage preservation, zero to disable
+    float alpha_ref;
+
+    // destination rows per strip
+    enum { strip_rows = 32 };
+
+    // size of the linear to sRGB table, enough for better than a quarter of an 8 bit step.
+    enum { linear_table_size = 16384 };
+
+    struct tables {
+      float to_linear[256];
+      uint8_t to_srgb[linear_table_size];
+
+      tables() {
+        for (unsigned i = 0; i != 256; ++i) {
+          float c = i * (1.0f/255);
+          to_linear[i] = c <= 0.04045f ? c * (1.0f/12.92f) : powf((c + 0.055f) * (1.0f/1.055f), 2.4f);
+        }
+        for (unsigned i = 0; i != linear_table_size; ++i) {
+          float c = i * (1.0f/(linear_table_size-1));
+          float s = c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f/2.4f) - 0.055f;
+          to_srgb[i] = (uint8_t)(s * 255 + 0.5f);
+        }
+      }
+    };
+
+    static const tables &get_tables() {
+      static const tables t;
+      return t;
+    }
+
+    // modified Bessel function of the first kind, order zero.
+    static float bessel_i0(float x) {
+      float sum = 1, term = 1, x2 = x * x * 0.25f;
+      for (int k = 1; k != 32 && term > sum * 1e-8f; ++k) {
+        term *= x2 / (float)(k * k);
+        sum += term;
+      }
+      return sum;
+    }
+
+    static float sinc(float x) {
+      if (x == 0) return 1;
+      x *= 3.14159265f;
+      return sinf(x) / x;
+    }
+
+    // support of the kernel in destination pixels
+    float get_radius() const {
+      return kernel == kernel_box ? 0.5f : kernel == kernel_kaiser ? 2.0f : 3.0f;
+    }
+
+    // kernel value at x destination pixels from the centre.
+    float weight(float x) const {
+      float r = get_radius();
+      if (x < 0) x = -x;
+      if (x > r) return 0;
+      switch (kernel) {
+        case kernel_box: return 1;
+        case kernel_kaiser: {
+          const float alpha = 4.0f;
+          float t = x / r;
+          return sinc(x) * bessel_i0(alpha * sqrtf(1 - t * t)) / bessel_i0(alpha);
+        }
+        default: return sinc(x) * sinc(x / r);
+      }
+    }
+
+    // Source pixels and weights for each destination pixel of one axis.
+    // Taps beyond the edge are clamped to the edge pixel.
+    struct taps {
+      unsigned num_taps;
+      dynarray<unsigned> index;
+      dynarray<float> weights;
+    };
+
+    void make_taps(taps &result, unsigned src_size, unsigned dest_size) const {
+      float scale = (float)src_size / dest_size;
+      float radius = get_radius() * scale;
+      // pixels strictly inside the support, the kernels are zero at the edge.
+      unsigned num_taps = (unsigned)ceilf(radius * 2);
+      result.num_taps = num_taps;
+      result.index.resize(dest_size * num_taps);
+      result.weights.resize(dest_size * num_taps);
+
+      for (unsigned d = 0; d != dest_size; ++d) {
+        // centre of the destination pixel in source pixels
+        float centre = (d + 0.5f) * scale;
+        int first = (int)floorf(centre - radius + 0.5f);
+        float total = 0;
+        for (unsigned k = 0; k != num_taps; ++k) {
+          int s = first + (int)k;
+          float w = weight((s + 0.5f - centre) / scale);
+          s = s < 0 ? 0 : s >= (int)src_size ? (int)src_size - 1 : s;
+          result.index[d * num_taps + k] = (unsigned)s;
+          result.weights[d * num_taps + k] = w;
+          total += w;
+        }
+        float rcp = 1.0f / total;
+        for (unsigned k = 0; k != num_taps; ++k) {
+          result.weights[d * num_taps + k] *= rcp;
+        }
+      }
+    }
+
+    // convert a row of bytes to linear premultiplied colour
+    void linearise_row(vec4 *dest, const uint8_t *src, unsigned width, unsigned num_comps) const {
+      const float *to_linear = get_tables().to_linear;
+      for (unsigned x = 0; x != width; ++x, src += num_comps) {
+        float a = num_comps == 4 ? src[3] * (1.0f/255) : 1.0f;
+        if (srgb) {
+          dest[x] = vec4(to_linear[src[0]] * a, to_linear[src[1]] * a, to_linear[src[2]] * a, a);
+        } else {
+          dest[x] = vec4(src[0] * a, src[1] * a, src[2] * a, a * 255) * (1.0f/255);
+        }
+      }
+    }
+
+    // convert a row of linear premultiplied colour back to bytes
+    void encode_row(uint8_t *dest, const vec4 *src, unsigned width, unsigned num_comps) const {
+      const uint8_t *to_srgb = get_tables().to_srgb;
+      const vec4 zero(0.0f), one(1.0f);
+      for (unsigned x = 0; x != width; ++x, dest += num_comps) {
+        vec4 c = src[x];
+        float a = c.w();
+        if (num_comps == 4 && a > 1.0f/1024) {
+          c = c * (1.0f / a);
+          c.w() = a;
+        }
+        c = min(max(c, zero), one);
+        if (srgb) {
+          vec4 i = c * (float)(linear_table_size-1) + 0.5f;
+          dest[0] = to_srgb[(int)i.x()];
+          dest[1] = to_srgb[(int)i.y()];
+          dest[2] = to_srgb[(int)i.z()];
+        } else {
+          vec4 i = c * 255.0f + 0.5f;
+          dest[0] = (uint8_t)i.x();
+          dest[1] = (uint8_t)i.y();
+          dest[2] = (uint8_t)i.z();
+        }
+        if (num_comps == 4) {
+          dest[3] = (uint8_t)(c.w() * 255.0f + 0.5f);
+        }
+      }
+    }
+
+    // resample one level into the next.
+    void make_level(uint8_t *dest, unsigned dest_w, unsigned dest_h, const uint8_t *src, unsigned src_w, unsigned src_h, unsigned num_comps) const {
+      taps htaps, vtaps;
+      make_taps(htaps, src_w, dest_w);
+      make_taps(vtaps, src_h, dest_h);
+
+      unsigned num_strips = (dest_h + strip_rows - 1) / strip_rows;
+      platform::thread_pool::get().parallel_for(0, num_strips, [&](unsigned strip) {
+        unsigned y0 = strip * strip_rows;
+        unsigned y1 = y0 + strip_rows < dest_h ? y0 + strip_rows : dest_h;
+        unsigned nv = vtaps.num_taps, nh = htaps.num_taps;
+
+        // the taps are in order, so the strip reads a contiguous range of source rows.
+        unsigned row_min = vtaps.index[y0 * nv];
+        unsigned row_max = vtaps.index[(y1 - 1) * nv + nv - 1] + 1;
+
+        // filter the source rows horizontally
+        dynarray<vec4> line(src_w);
+        dynarray<vec4> rows((row_max - row_min) * dest_w);
+        for (unsigned y = row_min; y != row_max; ++y) {
+          linearise_row(line.data(), src + y * src_w * num_comps, src_w, num_comps);
+          vec4 *row = rows.data() + (y - row_min) * dest_w;
+          const unsigned *index = htaps.index.data();
+          const float *weights = htaps.weights.data();
+          for (unsigned x = 0; x != dest_w; ++x, index += nh, weights += nh) {
+            vec4 sum(0.0f);
+            for (unsigned k = 0; k != nh; ++k) {
+              sum += line[index[k]] * weights[k];
+            }
+            row[x] = sum;
+          }
+        }
+
+        // then vertically, a whole row at a time
+        for (unsigned y = y0; y != y1; ++y) {
+          const unsigned *index = vtaps.index.data() + y * nv;
+          const float *weights = vtaps.weights.data() + y * nv;
+          for (unsigned x = 0; x != dest_w; ++x) {
+            line[x] = vec4(0.0f);
+          }
+          for (unsigned k = 0; k != nv; ++k) {
+            const vec4 *row = rows.data() + (index[k] - row_min) * dest_w;
+            float w = weights[k];
+            for (unsigned x = 0; x != dest_w; ++x) {
+              line[x] += row[x] * w;
+            }
+          }
+          encode_row(dest + y * dest_w * num_comps, line.data(), dest_w, num_comps);
+        }
+      });
+    }
+
+    // fraction of pixels that pass the alpha test after scaling alpha.
+    static float coverage(const unsigned *histogram, unsigned total, float scale, float ref) {
+      unsigned count = 0;
+      for (unsigned i = 0; i != 256; ++i) {
+        if (i * scale > ref * 255) count += histogram[i];
+      }
+      return (float)count / total;
+    }
+
+    static void alpha_histogram(unsigned *histogram, const uint8_t *src, unsigned num_pixels) {
+      memset(histogram, 0, sizeof(unsigned) * 256);
+      for (unsigned i = 0; i != num_pixels; ++i) {
+        histogram[src[i*4+3]]++;
+      }
+    }
+
+    // scale the alpha of a level to match the coverage of the top level.
+    void preserve_coverage(uint8_t *level, unsigned num_pixels, float target) const {
+      unsigned histogram[256];
+      alpha_histogram(histogram, level, num_pixels);
+
+      // coverage only goes up with the scale.
+      float lo = 0, hi = 255;
+      for (int i = 0; i != 24; ++i) {
+        float mid = (lo + hi) * 0.5f;
+        if (coverage(histogram, num_pixels, mid, alpha_ref) < target) {
+          lo = mid;
+        } else {
+          hi = mid;
+        }
+      }
+
+      // small levels cannot match exactly, so take the nearer side.
+      float scale = target - coverage(histogram, num_pixels, lo, alpha_ref) < coverage(histogram, num_pixels, hi, alpha_ref) - target ? lo : hi;
+
+      uint8_t table[256];
+      for (unsigned i = 0; i != 256; ++i) {
+        float a = i * scale + 0.5f;
+        table[i] = (uint8_t)(a > 255 ? 255 : a);
+      }
+      for (unsigned i = 0; i != num_pixels; ++i) {
+        level[i*4+3] = table[level[i*4+3]];
+      }
+    }
+
+  public:
+    /// Make a filter with a kernel, sRGB or linear colour and no alpha coverage preservation.
+    mipmap_filter(kernel_type kernel = kernel_kaiser, bool srgb = true) : kernel(kernel), srgb(srgb), alpha_ref(0) {
+    }
+
+    /// Keep the fraction of pixels with alpha greater than ref the same in every level.
+    /// Use the reference of the alpha test in the shader, or zero to disable.
+    void set_alpha_coverage(float ref) {
+      alpha_ref = ref;
+    }
+
+    /// Bits that identify the settings, for caches of filtered images.
+    uint64_t get_signature() const {
+      uint32_t ref_bits;
+      memcpy(&ref_bits, &alpha_ref, sizeof(ref_bits));
+      return (uint64_t)ref_bits << 32 | (uint32_t)kernel << 1 | (srgb ? 1 : 0);
+    }
+
+    /// Number of levels in a full chain, including the top level.
+    static unsigned get_num_levels(unsigned width, unsigned height) {
+      unsigned levels = 1;
+      while (width > 1 || height > 1) {
+        width = width > 1 ? width >> 1 : 1;
+        height = height > 1 ? height >> 1 : 1;
+        levels++;
+      }
+      return levels;
+    }
+
+    /// Bytes in a full chain, including the top level.
+    static size_t get_chain_size(unsigned width, unsigned height, unsigned num_comps) {
+      size_t size = 0;
+      for (;;) {
+        size += (size_t)width * height * num_comps;
+        if (width == 1 && height == 1) return size;
+        width = width > 1 ? width >> 1 : 1;
+        height = height > 1 ? height >> 1 : 1;
+      }
+    }
+
+    /// Fill in a chain after the top level, which is at the start of data.
+    /// data must have get_chain_size() bytes. num_comps is 3 for RGB or 4 for RGBA.
+    /// Returns the number of levels, including the top level.
+    unsigned make_chain(uint8_t *data, unsigned width, unsigned height, unsigned num_comps) const {
+      bool keep_coverage = num_comps == 4 && alpha_ref > 0;
+      float target = 0;
+      if (keep_coverage) {
+        unsigned histogram[256];
+        alpha_histogram(histogram, data, width * height);
+        target = coverage(histogram, width * height, 1.0f, alpha_ref);
+      }
+
+      // each level is made from the unscaled alpha of the one above
+      uint8_t *src = data;
+      unsigned levels = 1;
+      while (width > 1 || height > 1) {
+        unsigned dest_w = width > 1 ? width >> 1 : 1;
+        unsigned dest_h = height > 1 ? height >> 1 : 1;
+        uint8_t *dest = src + width * height * num_comps;
+        make_level(dest, dest_w, dest_h, src, width, height, num_comps);
+        if (keep_coverage && levels > 1) {
+          preserve_coverage(src, width * height, target);
+        }
+        src = dest;
+        width = dest_w;
+        height = dest_h;
+        levels++;
+      }
+      if (keep_coverage && levels > 1) {
+        preserve_coverage(src, width * height, target);
+      }
+      return levels;
+    }
+
+    /// Time mip chains for a size x size RGBA image with each kernel.
+    static void benchmark(unsigned size = 4096) {
+      dynarray<uint8_t> data(get_chain_size(size, size, 4));
+      for (unsigned y = 0; y != size; ++y) {
+        for (unsigned x = 0; x != size; ++x) {
+          uint8_t *p = data.data() + (y * size + x) * 4;
+          p[0] = (uint8_t)(x ^ y);
+          p[1] = (uint8_t)(x * 3 + y);
+          p[2] = (uint8_t)(y * 5);
+          p[3] = (uint8_t)(((x >> 4) + (y >> 4)) & 1 ? 0xff : x);
+        }
+      }
+
+      const char *names[3] = { "box", "kaiser", "lanczos" };
+      for (unsigned k = 0; k != 3; ++k) {
+        mipmap_filter filter((kernel_type)k);
+        auto start = std::chrono::high_resolution_clock::now();
+        unsigned levels = filter.make_chain(data.data(), size, size, 4);
+        double secs = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+        log("%s: %d levels from %dx%d in %.3fs\n", names[k], levels, size, size, secs);
+      }
+    }
+  };
+}}
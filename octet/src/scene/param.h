@@ -274,10 +274,15 @@ namespace octet { namespace scene {
     ref<image> image_;
     ref<sampler> sampler_;
     GLuint texture_slot;
+
+    // optional "<name>_flip" float uniform, set to one for images stored top down.
+    // Without it, the image is flipped when it is uploaded.
+    GLint flip_uniform;
   public:
     RESOURCE_META(param_sampler)
 
       param_sampler() {
+      flip_uniform = -1;
     }
 
     /// constuct a sampler parameter, allocating a texture slot and adding it to a prototype uniform buffer.
@@ -285,41 +290,96 @@ namespace octet { namespace scene {
       param_uniform(pbi, &pbi.texture_slot, name, _sampler->get_sampler_type(), 1, _stage), image_(_image), sampler_(_sampler)
     {
       texture_slot = pbi.texture_slot++;
+      flip_uniform = -1;
+    }
+
+    /// connect the sampler and its flip uniform, if the shader has one, to the shader.
+    /// Shaders flip the v coordinate with uv.y + flip * (1.0 - 2.0 * uv.y).
+    void bind(param_bind_info &pbi) {
+      param_uniform::bind(pbi);
+      string flip_name;
+      flip_name.format("%s_flip", get_atom_name());
+      flip_uniform = glGetUniformLocation(pbi.program, flip_name.c_str());
+    }
+
+    /// get the image
+    image *get_image() const {
+      return image_;
+    }
+
+    /// get the sampler
+    sampler *get_sampler() const {
+      return sampler_;
     }
 
     /// Set the OpenGL state for this sampler.
     void render(const uint8_t *buffer) {
       param_uniform::render(buffer);
+      // DDS images are only left upside down if every shader that samples them can flip them.
+      if (flip_uniform != -1) {
+        image_->allow_flip_in_shader();
+      } else {
+        image_->require_upright();
+      }
       glActiveTexture(GL_TEXTURE0 + texture_slot);
       glBindTexture(sampler_->get_gl_target(), sampler_->get_gl_texture(image_));
+      if (flip_uniform != -1) {
+        glUniform1f(flip_uniform, image_->is_flipped() ? 1.0f : 0.0f);
+      }
 
       //log("%s: u%d=ts%d targ=%04x tex=%d\n", get_atom_name(), get_uniform(), texture_slot, sampler_->get_gl_target(), sampler_->get_gl_texture(image_));
     }
   };
 
   /// Shader that uses parameters.
+  /// The shader is saved as the urls of its sources, which are loaded again when it is read.
   class param_shader : public shader {
+    string vertex_url;
+    string fragment_url;
     std::string vertex_shader;
     std::string fragment_shader;
+    bool compiled;
+
+    void load_sources() {
+      dynarray<uint8_t> vs;
+      dynarray<uint8_t> fs;
+      app_utils::get_url(vs, vertex_url.c_str());
+      app_utils::get_url(fs, fragment_url.c_str());
+
+      vertex_shader.assign((const char*)vs.data(), (const char*)(vs.data() + vs.size()));
+      fragment_shader.assign((const char*)fs.data(), (const char*)(fs.data() + fs.size()));
+    }
 
   public:
     RESOURCE_META(param_shader)
 
     param_shader() {
+      compiled = false;
     }
 
     param_shader(const char *vs_url, const char *fs_url) {
-      dynarray<uint8_t> vs;
-      dynarray<uint8_t> fs;
-      app_utils::get_url(vs, vs_url);
-      app_utils::get_url(fs, fs_url);
+      vertex_url = vs_url;
+      fragment_url = fs_url;
+      compiled = false;
+      load_sources();
+    }
 
-      vertex_shader.assign((const char*)vs.data(), (const char*)(vs.data() + vs.size()));
-      fragment_shader.assign((const char*)fs.data(), (const char*)(fs.data() + fs.size()));
+    /// Serialize the urls of the shader sources.
+    void visit(visitor &v) {
+      v.visit(vertex_url, atom_vertex_shader);
+      v.visit(fragment_url, atom_fragment_shader);
+      if (v.is_reader() && !v.get_error() && vertex_url.c_str()[0]) {
+        load_sources();
+      }
     }
 
+    /// Compile the shader the first time, then bind the parameters to the program.
+    /// Materials that share a shader can all call this.
     void init(dynarray<ref<param> > &params) {
-      shader::init(vertex_shader.data(), fragment_shader.data());
+      if (!compiled) {
+        shader::init(vertex_shader.data(), fragment_shader.data());
+        compiled = true;
+      }
 
       param_bind_info pbi;
       pbi.program = get_program();
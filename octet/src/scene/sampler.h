@@ -60,7 +60,13 @@ namespace octet { namespace scene {
 
     unsigned get_gl_texture(image *img) {
       if (!gl_texture) {
-        gl_texture = img->get_gl_texture();
+        unsigned texture = img->get_gl_texture();
+
+        // keep asking until a background load has replaced the placeholder.
+        if (img->is_loading()) return texture;
+        gl_texture = texture;
+
+        glBindTexture(gl_target, gl_texture);
 
         glTexParameteri(gl_target, GL_TEXTURE_MAG_FILTER, texture_mag_filter);
         glTexParameteri(gl_target, GL_TEXTURE_MIN_FILTER, texture_min_filter);
@@ -15,6 +15,7 @@
 #include "../scene/skeleton.h"
 #include "../scene/animation.h"
 #include "../scene/mesh.h"
+#include "../scene/mipmap_filter.h"
 #include "../scene/image.h"
 #include "../scene/sampler.h"
 #include "../scene/param.h"
@@ -27,6 +28,8 @@
 #include "../scene/visual_scene.h"
 #include "../scene/displacement_map.h"
 #include "../scene/indexer.h"
+#include "../scene/mesh_optimizer.h"
+#include "../scene/mesh_simplify.h"
 #include "../scene/smooth.h"
 #include "../scene/mesh_text.h"
 #include "../scene/mesh_box.h"
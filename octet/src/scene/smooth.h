@@ -4,11 +4,63 @@
 //
 // Modular Framework for OpenGLES2 rendering on multiple platforms.
 //
-// Mesh smooth modifier. Work in progress.
+// Mesh smooth modifier.
 //
 
 namespace octet { namespace scene {
+  /// Mesh smooth modifier. Splits edges that is_smooth_in_view() rejects and moves
+  /// the new vertices onto a curve through the ends. By default every edge is smooth,
+  /// so override is_smooth() or is_smooth_in_view() to choose the edges to split.
+  ///
+  /// Source triangles are refined in parallel. Neighbours agree on the new vertices
+  /// through an edge table split into locked shards.
+  /// After set_view(), update_view() refines again only the source triangles that used
+  /// an edge whose decision has changed, and recycles the vertices that are no longer used.
+  ///
+  /// Example
+  ///
+  ///     smooth *smo = new smooth(msh);
+  ///     ...
+  ///     smo->set_view(camera_pos, camera_dir);
+  ///     smo->update_view();
+  ///
   class smooth : public mesh {
+    enum {
+      num_shards = 64,
+      block_bits = 12,
+      block_size = 1 << block_bits,
+      max_blocks = 1024,
+      max_depth = 6,
+      chunk_size = 256,
+    };
+
+    // a split decision for an edge, made at the depth where the edge first appears.
+    struct edge_info {
+      uint32_t i0, i1;
+      uint32_t vertex; // new vertex, zero if the edge has never been split
+      uint8_t depth;
+      uint8_t split;
+      uint8_t changed;
+      uint8_t live;
+    };
+
+    // part of the edge table with its own lock and storage for new vertices.
+    struct shard {
+      std::mutex mutex;
+      hash_map<uint64_t, edge_info> edges;
+      uint8_t *blocks[max_blocks];
+      unsigned num_vertices;
+      dynarray<uint32_t> free_vertices;
+    };
+
+    // triangles and edges used by a run of source triangles.
+    struct chunk {
+      dynarray<uint32_t> indices;
+      dynarray<uint64_t> keys;
+      dynarray<uint32_t> num_indices;
+      dynarray<uint32_t> num_keys;
+    };
+
     // source mesh. Provides underlying geometry.
     ref<mesh> src;
 
@@ -17,35 +69,92 @@ namespace octet { namespace scene {
     vec3 view_dir;
 
     // working params
-    unsigned num_dest_vertices;
-
-    dynarray<uint32_t> dest_indices;
-    hash_map<uint64_t, unsigned> edges;
-    dynarray<uint8_t> dest_vertices;
     unsigned pos_offset;
     unsigned normal_offset;
     unsigned uv_offset;
-    int depth;
+    unsigned stride;
+    unsigned num_src_vertices;
+    unsigned num_src_tris;
+    bool valid;
+
+    dynarray<uint8_t> src_vertices;
+    dynarray<uint32_t> src_indices;
+    shard *shards;
+
+    // refined triangles and the edges they used for each source triangle
+    dynarray<uint32_t> index_start;
+    dynarray<uint32_t> refined;
+    dynarray<uint32_t> key_start;
+    dynarray<uint64_t> keys;
+
+    // new vertices are numbered from num_src_vertices, shard in the low bits.
+    uint8_t *get_vertex(uint32_t v) {
+      if (v < num_src_vertices) return src_vertices.data() + v * stride;
+      v -= num_src_vertices;
+      shard &s = shards[v % num_shards];
+      unsigned local = v / num_shards;
+      return s.blocks[local >> block_bits] + (local & (block_size - 1)) * stride;
+    }
+
+    // call with the shard locked.
+    uint32_t new_vertex(unsigned shard_index) {
+      shard &s = shards[shard_index];
+      if (!s.free_vertices.empty()) {
+        uint32_t v = s.free_vertices.back();
+        s.free_vertices.pop_back();
+        return v;
+      }
+      unsigned local = s.num_vertices++;
+      unsigned block = local >> block_bits;
+      assert(block < max_blocks);
+      if (!s.blocks[block]) {
+        s.blocks[block] = (uint8_t*)allocator::malloc(block_size * stride);
+      }
+      return num_src_vertices + local * num_shards + shard_index;
+    }
+
+    // scramble the vertex pair as hash_map only folds the two halves of the key together.
+    static uint64_t edge_key(uint32_t i0, uint32_t i1) {
+      return (((uint64_t)i1 << 32) | i0) * 0x9e3779b97f4a7c15ULL;
+    }
+
+    static unsigned shard_of(uint64_t key) {
+      return (unsigned)(key >> 58);
+    }
 
-    bool split_edge(uint8_t *dest, const uint8_t *src0, const uint8_t *src1, unsigned stride) {
+    bool should_split(uint32_t i0, uint32_t i1, int depth) {
+      const uint8_t *v0 = get_vertex(i0), *v1 = get_vertex(i1);
+      const vec3p &pos0 = (const vec3p&)v0[pos_offset];
+      const vec3p &pos1 = (const vec3p&)v1[pos_offset];
+      const vec3p &n0 = (const vec3p&)v0[normal_offset];
+      const vec3p &n1 = (const vec3p&)v1[normal_offset];
+      return depth < max_depth && !is_smooth_in_view(pos0, n0, pos1, n1, depth, view_pos, view_dir);
+    }
+
+    // average all the attributes, then put the position on a curve.
+    void split_edge(uint8_t *dest, const uint8_t *src0, const uint8_t *src1) {
       const vec3p &pos0 = (const vec3p&)src0[pos_offset];
       const vec3p &pos1 = (const vec3p&)src1[pos_offset];
       const vec3p &n0 = (const vec3p&)src0[normal_offset];
       const vec3p &n1 = (const vec3p&)src1[normal_offset];
-      //const vec3 &uv0 = (const vec3&)src0[uv_offset];
-      //const vec3 &uv1 = (const vec3&)src1[uv_offset];
-
-      if (is_smooth(n0, n1, depth)) {
-        return false;
-      }
 
       // Catmul-Rom spline
       vec3 diff = (vec3)pos1 - (vec3)pos0;
       vec3 t0 = cross(cross(n0, diff), n0); // bezier tangent * 3
       vec3 t1 = cross(cross(n1, diff), n1); // bezier tangent * 3
 
-      for (unsigned i = 0; i < stride/sizeof(float); ++i) {
-        ((float*)dest)[i] = (((float*)src0)[i] + ((float*)src1)[i]) * 0.5f;
+      const float *f0 = (const float*)src0;
+      const float *f1 = (const float*)src1;
+      float *fd = (float*)dest;
+      unsigned num_floats = stride / sizeof(float), i = 0;
+      #if OCTET_SSE
+        __m128 half = _mm_set1_ps(0.5f);
+        for (; i + 4 <= num_floats; i += 4) {
+          _mm_storeu_ps(fd + i, _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(f0 + i), _mm_loadu_ps(f1 + i)), half));
+        }
+      #endif
+      for (; i < num_floats; ++i) {
+        fd[i] = (f0[i] + f1[i]) * 0.5f;
       }
 
       vec3p &pos = (vec3p&)dest[pos_offset];
@@ -53,126 +162,346 @@ namespace octet { namespace scene {
 
       pos = ((vec3)pos0 + (vec3)pos1) * 0.5f + (t0 - t1) * 0.125; // (3/8)/3 = 1/8
       normal = normalize(normal);
-
-      return true;
     }
 
-    unsigned add_edge(int i0, int i1) {
+    // find or make the decision for an edge. returns the new vertex or zero.
+    uint32_t add_edge(chunk &c, uint32_t i0, uint32_t i1, int depth) {
       if (i0 > i1) { std::swap(i0, i1); }
-
-      unsigned &e = edges[((uint64_t)i1 << 32) | i0];
-
-      if (e == ~0) return 0;
-
-      if (e != 0) return e;
-
-      unsigned stride = get_stride();
-
-      dest_vertices.resize((num_dest_vertices + 1) * stride);
-
-      log("%*se%d %d %d\n", depth*2, "", num_dest_vertices, i0, i1);
-      bool split = split_edge(
-        &dest_vertices[num_dest_vertices * stride],
-        &dest_vertices[i0 * stride],
-        &dest_vertices[i1 * stride],
-        stride
-      );
-
-      if (split) {
-        e = num_dest_vertices++;
-        return e;
-      } else {
-        // unable to split. Don't test again.
-        e = ~0;
-        return 0;
+      uint64_t key = edge_key(i0, i1);
+      c.keys.push_back(key);
+
+      unsigned si = shard_of(key);
+      shard &s = shards[si];
+      std::lock_guard<std::mutex> lock(s.mutex);
+      edge_info &e = s.edges[key];
+      if (e.i0 == e.i1) {
+        // new entries are zero
+        e.i0 = i0;
+        e.i1 = i1;
+        e.depth = (uint8_t)depth;
+        e.split = should_split(i0, i1, depth);
+        e.changed = 0;
+        e.live = 0;
+        if (e.split) {
+          e.vertex = new_vertex(si);
+          split_edge(get_vertex(e.vertex), get_vertex(i0), get_vertex(i1));
+        }
       }
+      return e.split ? e.vertex : 0;
     }
 
-    void add_triangle(unsigned i0, unsigned i1, unsigned i2) {
-      unsigned i3 = add_edge(i0, i1);
-      unsigned i4 = add_edge(i1, i2);
-      unsigned i5 = add_edge(i2, i0);
+    void add_triangle(chunk &c, unsigned i0, unsigned i1, unsigned i2, int depth) {
+      unsigned i3 = add_edge(c, i0, i1, depth);
+      unsigned i4 = add_edge(c, i1, i2, depth);
+      unsigned i5 = add_edge(c, i2, i0, depth);
 
       depth++;
 
-      log("%*sat: %d %d %d %d %d %d\n", depth*2, "", i0, i1, i2, i3, i4, i5);
-
       switch( (i3 != 0) + (i4 != 0)*2 + (i5 != 0)*4 ) {
         case 0: {
-          unsigned disize = dest_indices.size();
-          dest_indices.resize(disize+3);
-          dest_indices[disize+0] = i0;
-          dest_indices[disize+1] = i1;
-          dest_indices[disize+2] = i2;
+          c.indices.push_back(i0);
+          c.indices.push_back(i1);
+          c.indices.push_back(i2);
         } break;
         case 1: {
           //    1
-          //   3 
+          //   3
           //  0   2
-          add_triangle(i3, i1, i2);
-          add_triangle(i3, i2, i0);
+          add_triangle(c, i3, i1, i2, depth);
+          add_triangle(c, i3, i2, i0, depth);
         } break;
         case 2: {
           //    1
-          //     4 
+          //     4
           //  0   2
-          add_triangle(i4, i0, i1);
-          add_triangle(i4, i2, i0);
+          add_triangle(c, i4, i0, i1, depth);
+          add_triangle(c, i4, i2, i0, depth);
         } break;
         case 3: {
           //    1
           //   3 4
           //  0   2
-          add_triangle(i3, i1, i4);
-          add_triangle(i3, i4, i0);
-          add_triangle(i4, i2, i0);
+          add_triangle(c, i3, i1, i4, depth);
+          add_triangle(c, i3, i4, i0, depth);
+          add_triangle(c, i4, i2, i0, depth);
         } break;
         case 4: {
           //    1
-          //      
+          //
           //  0 5 2
-          add_triangle(i5, i0, i1);
-          add_triangle(i5, i1, i2);
+          add_triangle(c, i5, i0, i1, depth);
+          add_triangle(c, i5, i1, i2, depth);
         } break;
         case 5: {
           //    1
-          //   3  
+          //   3
           //  0 5 2
-          add_triangle(i5, i0, i3);
-          add_triangle(i5, i3, i2);
-          add_triangle(i3, i1, i2);
+          add_triangle(c, i5, i0, i3, depth);
+          add_triangle(c, i5, i3, i2, depth);
+          add_triangle(c, i3, i1, i2, depth);
         } break;
         case 6: {
           //    1
           //     4
           //  0 5 2
-          add_triangle(i4, i2, i5);
-          add_triangle(i5, i0, i4);
-          add_triangle(i4, i0, i1);
+          add_triangle(c, i4, i2, i5, depth);
+          add_triangle(c, i5, i0, i4, depth);
+          add_triangle(c, i4, i0, i1, depth);
         } break;
         case 7: {
           //    1
           //   3 4
           //  0 5 2
-          add_triangle(i1, i4, i3);
-          add_triangle(i3, i4, i5);
-          add_triangle(i3, i5, i0);
-          add_triangle(i4, i2, i5);
+          add_triangle(c, i1, i4, i3, depth);
+          add_triangle(c, i3, i4, i5, depth);
+          add_triangle(c, i3, i5, i0, depth);
+          add_triangle(c, i4, i2, i5, depth);
         } break;
       }
-      depth--;
     }
-          
+
+    void free_shards() {
+      if (!shards) return;
+      for (unsigned i = 0; i != num_shards; ++i) {
+        for (unsigned b = 0; b != max_blocks && shards[i].blocks[b]; ++b) {
+          allocator::free(shards[i].blocks[b], block_size * stride);
+        }
+      }
+      delete [] shards;
+      shards = 0;
+    }
+
+    // make the decisions again for every edge in the table with the current view.
+    // returns true if any of them changed.
+    bool update_decisions() {
+      std::atomic<unsigned> num_changed(0);
+      platform::thread_pool::get().parallel_for(0, num_shards, [&](unsigned si) {
+        shard &s = shards[si];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        unsigned changed = 0;
+        for (unsigned i = 0; i != s.edges.size(); ++i) {
+          uint64_t key = s.edges.get_key(i);
+          if (!key) continue;
+          edge_info &e = s.edges[key];
+          uint8_t split = should_split(e.i0, e.i1, e.depth);
+          e.changed = split != e.split;
+          e.split = split;
+          changed += e.changed;
+          if (split && !e.vertex) {
+            e.vertex = new_vertex(si);
+            split_edge(get_vertex(e.vertex), get_vertex(e.i0), get_vertex(e.i1));
+          }
+        }
+        num_changed += changed;
+      });
+      return num_changed != 0;
+    }
+
+    bool edge_changed(uint64_t key) {
+      shard &s = shards[shard_of(key)];
+      int index = s.edges.get_index(key);
+      return s.edges.get_value(index).changed != 0;
+    }
+
+    // drop the edges that the refined triangles no longer use and recycle the vertices
+    // of those edges and of edges that are no longer split. No live triangle uses them.
+    void collect() {
+      // sort the live keys by shard
+      dynarray<uint32_t> shard_start(num_shards + 1);
+      memset(shard_start.data(), 0, shard_start.size() * sizeof(uint32_t));
+      for (unsigned i = 0; i != keys.size(); ++i) {
+        shard_start[shard_of(keys[i]) + 1]++;
+      }
+      for (unsigned i = 0; i != num_shards; ++i) {
+        shard_start[i + 1] += shard_start[i];
+      }
+      dynarray<uint64_t> shard_keys(keys.size());
+      dynarray<uint32_t> pos(num_shards);
+      memcpy(pos.data(), shard_start.data(), num_shards * sizeof(uint32_t));
+      for (unsigned i = 0; i != keys.size(); ++i) {
+        shard_keys[pos[shard_of(keys[i])]++] = keys[i];
+      }
+
+      platform::thread_pool::get().parallel_for(0, num_shards, [&](unsigned si) {
+        shard &s = shards[si];
+        std::lock_guard<std::mutex> lock(s.mutex);
+        for (unsigned k = shard_start[si]; k != shard_start[si + 1]; ++k) {
+          s.edges[shard_keys[k]].live = 1;
+        }
+
+        dynarray<edge_info> kept;
+        for (unsigned i = 0; i != s.edges.size(); ++i) {
+          uint64_t key = s.edges.get_key(i);
+          if (!key) continue;
+          edge_info e = s.edges.get_value(i);
+          if (e.vertex && (!e.live || !e.split)) {
+            s.free_vertices.push_back(e.vertex);
+            e.vertex = 0;
+          }
+          if (e.live) {
+            e.live = 0;
+            kept.push_back(e);
+          }
+        }
+
+        s.edges.clear();
+        for (unsigned i = 0; i != kept.size(); ++i) {
+          s.edges[edge_key(kept[i].i0, kept[i].i1)] = kept[i];
+        }
+      });
+    }
+
+    // refine the source triangles that need it and rebuild the mesh.
+    void refine(bool all) {
+      platform::thread_pool &pool = platform::thread_pool::get();
+      unsigned num_chunks = (num_src_tris + chunk_size - 1) / chunk_size;
+
+      // find the triangles that used an edge that changed.
+      dynarray<uint8_t> dirty(num_src_tris);
+      dynarray<uint8_t> chunk_dirty(num_chunks);
+      pool.parallel_for(0, num_chunks, [&](unsigned ci) {
+        unsigned end = std::min((ci + 1) * chunk_size, num_src_tris);
+        uint8_t any = 0;
+        for (unsigned t = ci * chunk_size; t != end; ++t) {
+          uint8_t d = all;
+          for (unsigned k = all ? 0 : key_start[t]; !d && k != key_start[t + 1]; ++k) {
+            d = edge_changed(keys[k]);
+          }
+          dirty[t] = d;
+          any |= d;
+        }
+        chunk_dirty[ci] = any;
+      });
+
+      // refine the dirty triangles. Edges are added in parallel.
+      dynarray<chunk*> chunks(num_chunks);
+      pool.parallel_for(0, num_chunks, [&](unsigned ci) {
+        chunks[ci] = 0;
+        if (!chunk_dirty[ci]) return;
+        chunk *c = chunks[ci] = new chunk();
+        unsigned end = std::min((ci + 1) * chunk_size, num_src_tris);
+        for (unsigned t = ci * chunk_size; t != end; ++t) {
+          if (!dirty[t]) continue;
+          unsigned ni = c->indices.size(), nk = c->keys.size();
+          const uint32_t *tp = src_indices.data() + t * 3;
+          add_triangle(*c, tp[0], tp[1], tp[2], 0);
+          c->num_indices.push_back(c->indices.size() - ni);
+          c->num_keys.push_back(c->keys.size() - nk);
+        }
+      });
+
+      // merge the new results with the ones that are still good.
+      dynarray<uint32_t> new_index_start(num_src_tris + 1);
+      dynarray<uint32_t> new_key_start(num_src_tris + 1);
+      dynarray<uint32_t> chunk_pos(num_chunks);
+      new_index_start[0] = new_key_start[0] = 0;
+      for (unsigned ci = 0; ci != num_chunks; ++ci) {
+        unsigned end = std::min((ci + 1) * chunk_size, num_src_tris), j = 0;
+        for (unsigned t = ci * chunk_size; t != end; ++t) {
+          unsigned ni, nk;
+          if (dirty[t]) {
+            ni = chunks[ci]->num_indices[j];
+            nk = chunks[ci]->num_keys[j];
+            j++;
+          } else {
+            ni = index_start[t + 1] - index_start[t];
+            nk = key_start[t + 1] - key_start[t];
+          }
+          new_index_start[t + 1] = new_index_start[t] + ni;
+          new_key_start[t + 1] = new_key_start[t] + nk;
+        }
+      }
+
+      dynarray<uint32_t> new_refined(new_index_start[num_src_tris]);
+      dynarray<uint64_t> new_keys(new_key_start[num_src_tris]);
+      pool.parallel_for(0, num_chunks, [&](unsigned ci) {
+        unsigned end = std::min((ci + 1) * chunk_size, num_src_tris);
+        unsigned ci_pos = 0, ck_pos = 0;
+        for (unsigned t = ci * chunk_size; t != end; ++t) {
+          unsigned ni = new_index_start[t + 1] - new_index_start[t];
+          unsigned nk = new_key_start[t + 1] - new_key_start[t];
+          if (dirty[t]) {
+            memcpy(new_refined.data() + new_index_start[t], chunks[ci]->indices.data() + ci_pos, ni * sizeof(uint32_t));
+            memcpy(new_keys.data() + new_key_start[t], chunks[ci]->keys.data() + ck_pos, nk * sizeof(uint64_t));
+            ci_pos += ni;
+            ck_pos += nk;
+          } else {
+            memcpy(new_refined.data() + new_index_start[t], refined.data() + index_start[t], ni * sizeof(uint32_t));
+            memcpy(new_keys.data() + new_key_start[t], keys.data() + key_start[t], nk * sizeof(uint64_t));
+          }
+        }
+        delete chunks[ci];
+      });
+
+      refined.resize(new_refined.size());
+      keys.resize(new_keys.size());
+      memcpy(index_start.data(), new_index_start.data(), new_index_start.size() * sizeof(uint32_t));
+      memcpy(key_start.data(), new_key_start.data(), new_key_start.size() * sizeof(uint32_t));
+      memcpy(refined.data(), new_refined.data(), new_refined.size() * sizeof(uint32_t));
+      memcpy(keys.data(), new_keys.data(), new_keys.size() * sizeof(uint64_t));
+
+      build_mesh();
+    }
+
+    // number the vertices in the order they are used and make new buffers.
+    void build_mesh() {
+      unsigned max_local = 0;
+      for (unsigned i = 0; i != num_shards; ++i) {
+        max_local = std::max(max_local, shards[i].num_vertices);
+      }
+
+      dynarray<uint32_t> dest_indices(refined.size());
+      dynarray<uint32_t> used;
+      dynarray<uint32_t> remap(num_src_vertices + max_local * num_shards);
+      memset(remap.data(), 0, remap.size() * sizeof(uint32_t));
+      for (unsigned i = 0; i != refined.size(); ++i) {
+        uint32_t v = refined[i];
+        uint32_t &e = remap[v];
+        if (e == 0) {
+          used.push_back(v);
+          e = used.size();
+        }
+        dest_indices[i] = e - 1;
+      }
+
+      dynarray<uint8_t> dest_vertices(used.size() * stride);
+      platform::thread_pool::get().parallel_for(0, used.size(), [&](unsigned i) {
+        memcpy(dest_vertices.data() + i * stride, get_vertex(used[i]), stride);
+      }, 1024);
+
+      unsigned isize = dest_indices.size() * sizeof(dest_indices[0]);
+      unsigned vsize = dest_vertices.size() * sizeof(dest_vertices[0]);
+      gl_resource *indices = new gl_resource(GL_ELEMENT_ARRAY_BUFFER, isize);
+      gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, vsize);
+      indices->assign(dest_indices.data(), 0, isize);
+      vertices->assign(dest_vertices.data(), 0, vsize);
+
+      set_indices(indices);
+      set_vertices(vertices);
+      set_num_vertices(used.size());
+      set_num_indices(dest_indices.size());
+      set_first_index(0);
+    }
+
   public:
     RESOURCE_META(smooth)
 
     smooth(mesh *src=0) {
       this->src = src;
       view_pos = vec3(0, 0, 0);
+      view_dir = vec3(0, 0, -1);
+      shards = 0;
+      valid = false;
       update();
     }
 
+    ~smooth() {
+      free_shards();
+    }
+
+    /// Rebuild everything from the source mesh, called if input changes.
     void update() {
+      valid = false;
       if (!src) return;
       if (src->get_mode() != GL_TRIANGLES) return;
       if (src->get_index_type() != GL_UNSIGNED_INT) return;
@@ -188,54 +517,82 @@ namespace octet { namespace scene {
         return;
       }
 
+      free_shards();
+
       pos_offset = get_offset(pos_slot);
       normal_offset = get_offset(normal_slot);
       uv_offset = get_offset(uv_slot);
+      stride = get_stride();
+      num_src_vertices = get_num_vertices();
+      num_src_tris = get_num_indices() / 3;
+
+      src_vertices.resize(num_src_vertices * stride);
+      src_indices.resize(num_src_tris * 3);
+      {
+        gl_resource::rolock vtx_lock(src->get_vertices());
+        gl_resource::rolock idx_lock(src->get_indices());
+        memcpy(src_vertices.data(), vtx_lock.u8(), num_src_vertices * stride);
+        memcpy(src_indices.data(), idx_lock.u32() + src->get_first_index(), num_src_tris * 3 * sizeof(uint32_t));
+      }
 
-      dest_indices.reserve(get_num_indices() * 4);
-      dest_vertices.reserve(get_num_vertices() * get_stride() * 4);
-      dest_vertices.resize(get_num_vertices() * get_stride());
+      shards = new shard[num_shards];
+      for (unsigned i = 0; i != num_shards; ++i) {
+        memset(shards[i].blocks, 0, sizeof(shards[i].blocks));
+        shards[i].num_vertices = 0;
+      }
 
-      // copy vertices for existing triangles
-      const void *sp = src->get_vertices()->lock_read_only();
-      memcpy(&dest_vertices[0], sp, get_num_vertices() * get_stride());
-      src->get_vertices()->unlock_read_only();
-      num_dest_vertices = get_num_vertices();
+      index_start.resize(num_src_tris + 1);
+      key_start.resize(num_src_tris + 1);
+      refine(true);
+      valid = true;
+    }
 
-      const void *sip = src->get_indices()->lock_read_only();
-      depth = 0;
-      for (unsigned i = 0; i+2 < get_num_indices(); i += 3) {
-        uint32_t *tp = ((uint32_t*)sip) + i;
-        add_triangle(tp[0], tp[1], tp[2]);
-      }
-      src->get_indices()->unlock_read_only();
+    /// Set the view for view dependent smoothing. Call update_view() to apply it.
+    void set_view(vec3_in pos, vec3_in dir) {
+      view_pos = pos;
+      view_dir = dir;
+    }
 
-      unsigned isize = dest_indices.size() * sizeof(dest_indices[0]);
-      unsigned vsize = dest_vertices.size() * sizeof(dest_vertices[0]);
-      gl_resource *indices = new gl_resource(GL_ELEMENT_ARRAY_BUFFER, isize);
-      gl_resource *vertices = new gl_resource(GL_ARRAY_BUFFER, vsize);
-      indices->assign(&dest_indices[0], 0, isize);
-      vertices->assign(&dest_vertices[0], 0, vsize);
+    /// Get the view position for is_smooth.
+    vec3 get_view_pos() const {
+      return view_pos;
+    }
 
-      set_indices(indices);
-      set_vertices(vertices);
-      set_num_vertices(num_dest_vertices);
-      set_num_indices(dest_indices.size());
+    /// Get the view direction for is_smooth.
+    vec3 get_view_dir() const {
+      return view_dir;
+    }
 
-      dump(log("dump"));
+    /// Refine again only the triangles affected by changes in is_smooth decisions.
+    void update_view() {
+      if (!valid) {
+        update();
+        return;
+      }
+      if (update_decisions()) {
+        refine(false);
+        collect();
+      }
     }
 
     void visit(visitor &v) {
       mesh::visit(v);
       v.visit(src, atom_src);
       v.visit(view_pos, atom_view_pos);
+      v.visit(view_dir, atom_view_dir);
     }
 
+    /// Return true if the edge between normals n0 and n1 does not need splitting.
+    /// This may be called from several threads at once.
     virtual bool is_smooth(const vec3 &n0, const vec3 &n1, int depth) {
       return true;
-      float dotp = dot(n0, n1);
-      log("%*s  dotp=%f\n", depth*2, "", dotp);
-      return (dotp >= 0.9f) || depth >= 4;
+    }
+
+    /// Return true if the edge from pos0 to pos1 does not need splitting when seen from view_pos
+    /// looking along view_dir. The default ignores the view and calls is_smooth().
+    /// This may be called from several threads at once.
+    virtual bool is_smooth_in_view(const vec3 &pos0, const vec3 &n0, const vec3 &pos1, const vec3 &n1, int depth, const vec3 &view_pos, const vec3 &view_dir) {
+      return is_smooth(n0, n1, depth);
     }
   };
 }}
@@ -353,6 +353,9 @@ namespace octet { namespace scene {
 
     /// set up OpenGL state
     void begin_render(int vx, int vy, vec4_in clear_color=vec4(0.5f, 0.5f, 0.5f, 1.0f)) {
+      /// upload images that have finished loading in the background
+      background_loader::get().update();
+
       /// set a viewport - includes whole window area
       glViewport(0, 0, vx, vy);
 